@@ -1,8 +1,9 @@
 import asyncio
 import json
 import logging
-from datetime import datetime
-from typing import Dict, Any, Optional
+from datetime import datetime, timedelta
+from typing import Dict, Any, List, Optional, Tuple
+import msgpack
 import paho.mqtt.client as mqtt
 from sqlalchemy.orm import Session
 from database import SessionLocal
@@ -11,6 +12,74 @@ import os
 
 logger = logging.getLogger(__name__)
 
+# Compact MessagePack keys published on homeautomation/devices/+/state/bin.
+# Must match ha::keys in firmware/lib/HomeAutomationCore/src/StateEncoding.h.
+BINARY_STATE_VERSION = 1
+BINARY_STATE_KEYS = {
+    "t": "timestamp",
+    "id": "device_id",
+    "p": "power",
+    "br": "brightness",
+    "cr": "color_r",
+    "cg": "color_g",
+    "cb": "color_b",
+    "tc": "temperature",
+    "rh": "humidity",
+    "pa": "pressure",
+    "lx": "light_level",
+    "mo": "motion_detected",
+    "av": "analog_value",
+    "w": "window",
+}
+
+# Per-field window statistics: {"min", "max", "mean", "samples"} in JSON,
+# a [min, max, mean, samples] array under the compact key in MessagePack.
+# Must match WindowStats::serialize() in the firmware library.
+WINDOW_FIELDS = ("min", "max", "mean", "samples")
+
+def decode_binary_state(data: bytes) -> Dict[str, Any]:
+    """Decode a compact MessagePack state payload into the JSON field names"""
+    packed = msgpack.unpackb(data, raw=False)
+    if not isinstance(packed, dict):
+        raise ValueError("binary state payload is not a map")
+    version = packed.pop("v", None)
+    if version != BINARY_STATE_VERSION:
+        raise ValueError(f"unsupported binary state version: {version}")
+    state = {BINARY_STATE_KEYS.get(key, key): value for key, value in packed.items()}
+    if isinstance(state.get("window"), dict):
+        state["window"] = {
+            BINARY_STATE_KEYS.get(key, key): dict(zip(WINDOW_FIELDS, row))
+            for key, row in state["window"].items()
+        }
+    return state
+
+# Row layout of batched samples on homeautomation/devices/+/samples[/bin]:
+# [t, tc*100, rh*10, pa*10, lx, mo]. Must match publishSampleBatch() in
+# firmware/esp32-sensor-node/src/main.cpp.
+SAMPLE_BATCH_VERSION = 1
+SAMPLE_COLUMNS = (
+    ("temperature", 100),
+    ("humidity", 10),
+    ("pressure", 10),
+    ("light_level", 1),
+    ("motion_detected", None),
+)
+
+def decode_sample_batch(payload: Dict[str, Any], received_at: datetime) -> List[Tuple[datetime, Dict[str, Any]]]:
+    """Expand a sample batch into (timestamp, readings) pairs, oldest first"""
+    if payload.get("v") != SAMPLE_BATCH_VERSION:
+        raise ValueError(f"unsupported sample batch version: {payload.get('v')}")
+    published_at = payload["t"]
+    samples = []
+    for row in payload.get("s", []):
+        # Row times are device uptime; date them relative to the publish
+        timestamp = received_at - timedelta(milliseconds=published_at - row[0])
+        readings = {}
+        for (key, scale), value in zip(SAMPLE_COLUMNS, row[1:]):
+            readings[key] = bool(value) if scale is None else value / scale
+        samples.append((timestamp, readings))
+    return samples
+
 class MQTTClient:
     def __init__(self):
         self.client = mqtt.Client()
@@ -18,6 +87,8 @@ class MQTTClient:
         self.mqtt_port = int(os.getenv("MQTT_PORT", "1884"))
         self.mqtt_user = os.getenv("MQTT_USER", "")
         self.mqtt_password = os.getenv("MQTT_PASSWORD", "")
+        # Opt devices that advertise it into MessagePack state publishing
+        self.binary_state = os.getenv("MQTT_BINARY_STATE", "false").lower() == "true"
         
         # Setup callbacks
         self.client.on_connect = self.on_connect
@@ -34,7 +105,12 @@ class MQTTClient:
             # Subscribe to device topics
             client.subscribe("homeautomation/devices/+/status")
             client.subscribe("homeautomation/devices/+/state")
+            client.subscribe("homeautomation/devices/+/state/bin")
+            client.subscribe("homeautomation/devices/+/samples")
+            client.subscribe("homeautomation/devices/+/samples/bin")
             client.subscribe("homeautomation/devices/+/online")
+            client.subscribe("homeautomation/devices/+/children")
+            client.subscribe("homeautomation/devices/+/event")
         else:
             logger.error(f"Failed to connect to MQTT broker: {rc}")
     
@@ -49,7 +125,12 @@ class MQTTClient:
             
             device_id = topic_parts[2]
             message_type = topic_parts[3]
-            payload = json.loads(msg.payload.decode())
+            if message_type == "state" and topic_parts[4:] == ["bin"]:
+                payload = decode_binary_state(msg.payload)
+            elif topic_parts[4:] == ["bin"]:
+                payload = msgpack.unpackb(msg.payload, raw=False)
+            else:
+                payload = json.loads(msg.payload.decode())
             
             logger.info(f"Received MQTT message: {msg.topic} - {payload}")
             
@@ -60,6 +141,12 @@ class MQTTClient:
                 self.handle_device_state(device_id, payload)
             elif message_type == "online":
                 self.handle_device_online(device_id, payload)
+            elif message_type == "samples":
+                self.handle_device_samples(device_id, payload)
+            elif message_type == "children":
+                self.handle_gateway_children(device_id, payload)
+            elif message_type == "event":
+                self.handle_device_event(device_id, payload)
                 
         except Exception as e:
             logger.error(f"Error processing MQTT message: {e}")
@@ -75,11 +162,22 @@ class MQTTClient:
                 if "firmware_version" in payload:
                     device.firmware_version = payload["firmware_version"]
                 db.commit()
+            self.negotiate_state_encoding(device_id, payload)
         except Exception as e:
             logger.error(f"Error updating device status: {e}")
         finally:
             db.close()
     
+    def negotiate_state_encoding(self, device_id: str, payload: Dict[str, Any]):
+        """Switch devices that support it to MessagePack state publishing"""
+        if not self.binary_state:
+            return
+        if "msgpack" not in payload.get("state_encodings", []):
+            return
+        if payload.get("state_encoding") == "msgpack":
+            return
+        self.publish_device_command(device_id, "set_encoding", {"encoding": "msgpack"})
+    
     def handle_device_state(self, device_id: str, payload: Dict[str, Any]):
         """Handle device state updates"""
         db = SessionLocal()
@@ -112,6 +210,44 @@ class MQTTClient:
         finally:
             db.close()
     
+    def handle_device_samples(self, device_id: str, payload: Dict[str, Any]):
+        """Handle a batch of buffered sensor samples"""
+        db = SessionLocal()
+        try:
+            device = db.query(Device).filter(Device.device_id == device_id).first()
+            if device:
+                for timestamp, readings in decode_sample_batch(payload, datetime.utcnow()):
+                    for state_key, state_value in readings.items():
+                        db.add(DeviceState(
+                            device_id=device.id,
+                            state_key=state_key,
+                            state_value=str(state_value),
+                            state_type="boolean" if isinstance(state_value, bool) else "number",
+                            timestamp=timestamp
+                        ))
+                
+                device.last_seen = datetime.utcnow()
+                db.commit()
+        except Exception as e:
+            logger.error(f"Error storing device samples: {e}")
+        finally:
+            db.close()
+    
+    def handle_device_event(self, device_id: str, payload: Dict[str, Any]):
+        """Handle an immediate device event, such as a motion edge"""
+        if payload.get("event") == "motion" and "motion" in payload:
+            self.handle_device_state(device_id, {"motion_detected": bool(payload["motion"])})
+    
+    def handle_gateway_children(self, gateway_id: str, payload: Dict[str, Any]):
+        """Handle a gateway's batch of sub-device readings, one entry per child"""
+        for child_id, readings in payload.get("children", {}).items():
+            readings = dict(readings)
+            online = readings.pop("online", None)
+            if online is not None:
+                self.handle_device_online(child_id, {"online": online})
+            if readings:
+                self.handle_device_state(child_id, readings)
+    
     def handle_device_online(self, device_id: str, payload: Dict[str, Any]):
         """Handle device online/offline status"""
         db = SessionLocal()
@@ -136,13 +272,35 @@ class MQTTClient:
                 "timestamp": datetime.utcnow().isoformat()
             }
             
-            self.client.publish(topic, json.dumps(payload))
+            # QoS1: the broker queues it in the device's persistent session
+            # if the device is offline right now
+            self.client.publish(topic, json.dumps(payload), qos=1)
             logger.info(f"Published command to {topic}: {payload}")
             return True
         except Exception as e:
             logger.error(f"Error publishing device command: {e}")
             return False
     
+    def publish_group_commands(self, group_id: str, commands: List[Tuple[str, Dict[str, Any]]],
+                               kind: str = "groups", transition: Optional[int] = None):
+        """Publish a batch of commands once to every member of a group or scene.
+        Devices join with the set_groups command and apply the batch as one change."""
+        try:
+            topic = f"homeautomation/{kind}/{group_id}/command"
+            payload = {
+                "commands": [{"command": command, "parameters": parameters or {}} for command, parameters in commands],
+                "timestamp": datetime.utcnow().isoformat()
+            }
+            if transition is not None:
+                payload["transition"] = transition
+            
+            self.client.publish(topic, json.dumps(payload), qos=1)
+            logger.info(f"Published {len(commands)} commands to {topic}")
+            return True
+        except Exception as e:
+            logger.error(f"Error publishing group commands: {e}")
+            return False
+    
     def connect(self):
         """Connect to MQTT broker"""
         try:
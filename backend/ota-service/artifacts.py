@@ -0,0 +1,164 @@
+"""OTA artifact encoders matching the firmware's ImageDecoder.
+
+Besides the plain image, a device may be sent a gzip image (ESP8266 only,
+unpacked by its bootloader) or a container: a 32-byte header followed by a
+heatshrink-compressed payload, a delta patch against the image the device
+is running, or a compressed patch.
+"""
+import gzip
+import hashlib
+import struct
+from typing import Dict
+
+CONTAINER_MAGIC = b"HAOT"
+FLAG_HEATSHRINK = 0x01
+FLAG_DELTA = 0x02
+
+# Must fit the device's window buffer (ImageDecoder::MAX_WINDOW_BITS)
+HEATSHRINK_WINDOW_BITS = 10
+HEATSHRINK_LOOKAHEAD_BITS = 5
+
+DELTA_OP_DATA = 0x00
+DELTA_OP_COPY = 0x01
+DELTA_BLOCK = 32
+
+MAX_MATCH_CANDIDATES = 32
+
+
+class _BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.buffer = 0
+        self.count = 0
+
+    def write(self, value: int, bits: int):
+        self.buffer = (self.buffer << bits) | value
+        self.count += bits
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.buffer >> self.count) & 0xFF)
+        self.buffer &= (1 << self.count) - 1
+
+    def finish(self) -> bytes:
+        if self.count:
+            self.out.append((self.buffer << (8 - self.count)) & 0xFF)
+            self.count = 0
+        return bytes(self.out)
+
+
+def heatshrink_compress(data: bytes, window_bits: int = HEATSHRINK_WINDOW_BITS,
+                        lookahead_bits: int = HEATSHRINK_LOOKAHEAD_BITS) -> bytes:
+    """Greedy LZSS in the heatshrink bit format (MSB first): 1 + literal byte,
+    or 0 + (distance - 1) + (length - 1)"""
+    window = 1 << window_bits
+    max_length = 1 << lookahead_bits
+    writer = _BitWriter()
+    chains: Dict[bytes, list] = {}
+    size = len(data)
+
+    def remember(position: int):
+        if position + 3 <= size:
+            chain = chains.setdefault(data[position:position + 3], [])
+            chain.append(position)
+            if len(chain) > MAX_MATCH_CANDIDATES:
+                del chain[0]
+
+    i = 0
+    while i < size:
+        best_length = 0
+        best_distance = 0
+        limit = min(max_length, size - i)
+        if limit >= 3:
+            for candidate in reversed(chains.get(data[i:i + 3], ())):
+                distance = i - candidate
+                if distance > window:
+                    break
+                length = 3
+                while length < limit and data[candidate + length] == data[i + length]:
+                    length += 1
+                if length > best_length:
+                    best_length, best_distance = length, distance
+                    if length == limit:
+                        break
+
+        if best_length >= 3:
+            writer.write(0, 1)
+            writer.write(best_distance - 1, window_bits)
+            writer.write(best_length - 1, lookahead_bits)
+            for position in range(i, i + best_length):
+                remember(position)
+            i += best_length
+        else:
+            writer.write(1, 1)
+            writer.write(data[i], 8)
+            remember(i)
+            i += 1
+    return writer.finish()
+
+
+def make_delta(base: bytes, target: bytes) -> bytes:
+    """Patch ops rebuilding target from base: DATA <u32 length> <bytes> and
+    COPY <u32 offset> <u32 length>. Base blocks are indexed at DELTA_BLOCK
+    alignment and matched at any target offset, then grown both ways."""
+    index: Dict[bytes, int] = {}
+    for offset in range(0, len(base) - DELTA_BLOCK + 1, DELTA_BLOCK):
+        index.setdefault(base[offset:offset + DELTA_BLOCK], offset)
+
+    ops = bytearray()
+
+    def emit_data(chunk: bytes):
+        if chunk:
+            ops.extend(struct.pack("<BI", DELTA_OP_DATA, len(chunk)))
+            ops.extend(chunk)
+
+    pending = 0
+    i = 0
+    while i + DELTA_BLOCK <= len(target):
+        offset = index.get(target[i:i + DELTA_BLOCK])
+        if offset is None:
+            i += 1
+            continue
+
+        start, base_start = i, offset
+        while start > pending and base_start > 0 and target[start - 1] == base[base_start - 1]:
+            start -= 1
+            base_start -= 1
+        end, base_end = i + DELTA_BLOCK, offset + DELTA_BLOCK
+        while end < len(target) and base_end < len(base) and target[end] == base[base_end]:
+            end += 1
+            base_end += 1
+
+        emit_data(target[pending:start])
+        ops.extend(struct.pack("<BII", DELTA_OP_COPY, base_start, end - start))
+        i = pending = end
+    emit_data(target[pending:])
+    return bytes(ops)
+
+
+def container(flags: int, image: bytes, payload: bytes, base: bytes = b"") -> bytes:
+    header = CONTAINER_MAGIC + struct.pack(
+        "<BBBxII16s",
+        flags,
+        HEATSHRINK_WINDOW_BITS if flags & FLAG_HEATSHRINK else 0,
+        HEATSHRINK_LOOKAHEAD_BITS if flags & FLAG_HEATSHRINK else 0,
+        len(image),
+        len(base),
+        hashlib.md5(base).digest() if flags & FLAG_DELTA else bytes(16),
+    )
+    return header + payload
+
+
+def build_full_artifacts(image: bytes) -> Dict[str, bytes]:
+    """Format name -> artifact for the formats needing no base image"""
+    return {
+        "gzip": gzip.compress(image, compresslevel=9, mtime=0),
+        "heatshrink": container(FLAG_HEATSHRINK, image, heatshrink_compress(image)),
+    }
+
+
+def build_delta_artifact(base: bytes, image: bytes) -> bytes:
+    """The smaller of the raw and the compressed patch"""
+    patch = make_delta(base, image)
+    raw = container(FLAG_DELTA, image, patch, base)
+    compressed = container(FLAG_DELTA | FLAG_HEATSHRINK, image, heatshrink_compress(patch), base)
+    return compressed if len(compressed) < len(raw) else raw
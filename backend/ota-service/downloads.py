@@ -0,0 +1,54 @@
+"""Firmware file responses for device downloads.
+
+Devices resume an interrupted download with a "Range: bytes=<offset>-"
+request. Starlette's FileResponse ignores Range, so single ranges are
+answered here with 206 and anything unsatisfiable with 416.
+"""
+import re
+from pathlib import Path
+from typing import Optional
+
+import aiofiles
+from fastapi import status
+from fastapi.responses import FileResponse, Response, StreamingResponse
+
+RANGE_PATTERN = re.compile(r"bytes=(\d+)-(\d*)$")
+DOWNLOAD_CHUNK_SIZE = 64 * 1024
+
+
+def ranged_file_response(file_path: Path, range_header: Optional[str],
+                         filename: Optional[str] = None) -> Response:
+    """Serve file_path whole, or the single byte range a device asked for"""
+    size = file_path.stat().st_size
+    match = RANGE_PATTERN.match((range_header or "").strip())
+    if not match:
+        return FileResponse(file_path, media_type="application/octet-stream", filename=filename,
+                            headers={"Accept-Ranges": "bytes"})
+
+    start = int(match.group(1))
+    end = min(int(match.group(2)), size - 1) if match.group(2) else size - 1
+    if start >= size or start > end:
+        return Response(status_code=status.HTTP_416_REQUESTED_RANGE_NOT_SATISFIABLE,
+                        headers={"Content-Range": f"bytes */{size}"})
+
+    async def body():
+        async with aiofiles.open(file_path, 'rb') as f:
+            await f.seek(start)
+            remaining = end - start + 1
+            while remaining > 0:
+                chunk = await f.read(min(DOWNLOAD_CHUNK_SIZE, remaining))
+                if not chunk:
+                    break
+                remaining -= len(chunk)
+                yield chunk
+
+    return StreamingResponse(
+        body(),
+        status_code=status.HTTP_206_PARTIAL_CONTENT,
+        media_type="application/octet-stream",
+        headers={
+            "Accept-Ranges": "bytes",
+            "Content-Range": f"bytes {start}-{end}/{size}",
+            "Content-Length": str(end - start + 1),
+        }
+    )
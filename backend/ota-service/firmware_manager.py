@@ -17,11 +17,24 @@ from schemas import (
     FirmwareUploadSchema, FirmwareRolloutCreateSchema, 
     DeviceCompatibilitySchema, BulkUpdateRequestSchema
 )
+from artifacts import build_delta_artifact, build_full_artifacts, HEATSHRINK_WINDOW_BITS
 import paho.mqtt.client as mqtt
+import random
+import time
 import uuid
 
 logger = logging.getLogger(__name__)
 
+# Rollout admission: devices sent an update start at a random point of the
+# start window, then ask for one of the rollout's max_concurrent_updates
+# download slots. A slot is freed by the device's result or when its lease
+# runs out; devices turned away are told when to ask again.
+OTA_START_WINDOW = 300  # seconds
+OTA_SLOT_LEASE = 900  # seconds
+OTA_RETRY_AFTER = 60  # seconds, plus up to as much again of jitter
+# Outlasts the devices' own admission wait (OtaStream::MAX_ADMISSION_WAIT)
+OTA_ROLLOUT_MEMBERSHIP = 6 * 3600  # seconds
+
 class FirmwareManager:
     def __init__(self, firmware_dir: Path, redis_client: redis.Redis, mqtt_client: mqtt.Client):
         self.firmware_dir = firmware_dir
@@ -30,11 +43,13 @@ class FirmwareManager:
         self.metadata_dir = firmware_dir / "metadata"
         self.rollouts_dir = firmware_dir / "rollouts"
         self.updates_dir = firmware_dir / "updates"
+        self.artifacts_dir = firmware_dir / "artifacts"
         
         # Create directories
         self.metadata_dir.mkdir(exist_ok=True)
         self.rollouts_dir.mkdir(exist_ok=True)
         self.updates_dir.mkdir(exist_ok=True)
+        self.artifacts_dir.mkdir(exist_ok=True)
         
         # Cache for firmware metadata
         self.firmware_cache = {}
@@ -66,6 +81,9 @@ class FirmwareManager:
             async with aiofiles.open(firmware_path, 'wb') as f:
                 await f.write(firmware_file)
             
+            # Build the compressed variants devices may download instead
+            artifacts = await self.build_artifacts(firmware_id, firmware_file)
+            
             # Create metadata
             metadata = FirmwareMetadata({
                 "device_type": firmware_data.device_type,
@@ -77,6 +95,8 @@ class FirmwareManager:
                 "build_date": datetime.now().isoformat(),
                 "file_size": len(firmware_file),
                 "checksum": checksum,
+                "image_md5": hashlib.md5(firmware_file).hexdigest(),
+                "artifacts": artifacts,
                 "min_compatible_version": firmware_data.min_compatible_version,
                 "max_compatible_version": firmware_data.max_compatible_version,
                 "required_capabilities": firmware_data.required_capabilities,
@@ -106,6 +126,130 @@ class FirmwareManager:
             logger.error(f"Failed to upload firmware: {e}")
             raise
     
+    async def build_artifacts(self, firmware_id: str, firmware_file: bytes) -> Dict[str, Dict[str, Any]]:
+        """Write the compressed artifacts of an image, keeping those smaller than it"""
+        built = await asyncio.to_thread(build_full_artifacts, firmware_file)
+        artifacts = {}
+        for artifact_format, data in built.items():
+            if len(data) >= len(firmware_file):
+                continue
+            artifacts[artifact_format] = await self.write_artifact(f"{firmware_id}.{artifact_format}", data)
+        return artifacts
+    
+    async def write_artifact(self, filename: str, data: bytes) -> Dict[str, Any]:
+        """Save an artifact and describe it the way update commands need it"""
+        async with aiofiles.open(self.artifacts_dir / filename, 'wb') as f:
+            await f.write(data)
+        return {
+            "file": filename,
+            "size": len(data),
+            "checksum": hashlib.sha256(data).hexdigest()
+        }
+    
+    async def get_delta_artifact(self, base_id: str, firmware_id: str) -> Optional[Dict[str, Any]]:
+        """Patch from base_id's image to firmware_id's, built on first use"""
+        firmware = self.firmware_cache.get(firmware_id)
+        if not firmware:
+            return None
+        if base_id in firmware.deltas:
+            return firmware.deltas[base_id]
+        
+        base_path = self.firmware_dir / f"{base_id}.bin"
+        firmware_path = self.firmware_dir / f"{firmware_id}.bin"
+        if not base_path.exists() or not firmware_path.exists():
+            return None
+        async with aiofiles.open(base_path, 'rb') as f:
+            base = await f.read()
+        async with aiofiles.open(firmware_path, 'rb') as f:
+            image = await f.read()
+        
+        data = await asyncio.to_thread(build_delta_artifact, base, image)
+        if len(data) >= firmware.file_size:
+            return None
+        delta = await self.write_artifact(f"{firmware_id}.delta-{base_id}", data)
+        # Container flags byte: bit 0 is a heatshrink-compressed patch
+        delta["compressed"] = bool(data[4] & 0x01)
+        
+        firmware.deltas[base_id] = delta
+        await self.save_firmware_metadata(firmware_id, firmware)
+        logger.info(f"Delta {base_id} -> {firmware_id}: {len(data)} of {firmware.file_size} bytes")
+        return delta
+    
+    def get_artifact_path(self, firmware_id: str, artifact_format: str = "full",
+                          base_id: Optional[str] = None) -> Optional[Path]:
+        """File behind a download request, or None if there is no such artifact"""
+        firmware = self.firmware_cache.get(firmware_id)
+        if not firmware:
+            return None
+        if artifact_format == "full":
+            return self.firmware_dir / f"{firmware_id}.bin"
+        if artifact_format == "delta":
+            artifact = firmware.deltas.get(base_id or "")
+        else:
+            artifact = firmware.artifacts.get(artifact_format)
+        return self.artifacts_dir / artifact["file"] if artifact else None
+    
+    def record_device_ota_capabilities(self, device_id: str, payload: Dict[str, Any]):
+        """Keep what a device answered to an OTA "check", to pick its artifacts"""
+        capabilities = {
+            "current_version": payload.get("current_version"),
+            "formats": payload.get("formats", ["full"]),
+            "heatshrink_window": payload.get("heatshrink_window", 0),
+            "image_size": payload.get("image_size"),
+            "image_md5": payload.get("image_md5")
+        }
+        self.redis_client.set(f"device_ota:{device_id}", json.dumps(capabilities))
+    
+    async def select_artifact(self, device_id: str, firmware_id: str) -> Dict[str, Any]:
+        """The smallest artifact of the firmware that the device can decode"""
+        firmware = self.firmware_cache[firmware_id]
+        best = {"format": "full", "size": firmware.file_size, "checksum": firmware.checksum}
+        
+        # Devices that never answered a check get the plain image
+        cached = self.redis_client.get(f"device_ota:{device_id}")
+        if not cached:
+            return best
+        capabilities = json.loads(cached)
+        formats = set(capabilities.get("formats", []))
+        heatshrink = capabilities.get("heatshrink_window", 0) >= HEATSHRINK_WINDOW_BITS
+        if not heatshrink:
+            formats.discard("heatshrink")
+        
+        candidates = [dict(artifact, format=artifact_format)
+                      for artifact_format, artifact in firmware.artifacts.items()
+                      if artifact_format in formats]
+        
+        if "delta" in formats:
+            base_id = self.find_firmware_by_image(firmware.device_type, capabilities.get("image_md5"),
+                                                  capabilities.get("image_size"))
+            if base_id and base_id != firmware_id:
+                delta = await self.get_delta_artifact(base_id, firmware_id)
+                if delta and (heatshrink or not delta.get("compressed")):
+                    candidates.append(dict(delta, format="delta", base=base_id))
+        
+        for candidate in candidates:
+            if candidate["size"] < best["size"]:
+                best = candidate
+        return best
+    
+    def find_firmware_by_image(self, device_type: DeviceType, image_md5: Optional[str],
+                               image_size: Optional[int]) -> Optional[str]:
+        """Id of the stored firmware whose image a device reports running"""
+        if not image_md5:
+            return None
+        for firmware_id, firmware in self.firmware_cache.items():
+            if (firmware.device_type == device_type and
+                firmware.image_md5 == image_md5.lower() and
+                firmware.file_size == image_size):
+                return firmware_id
+        return None
+    
+    async def save_firmware_metadata(self, firmware_id: str, firmware: FirmwareMetadata):
+        """Write cached metadata back to its file"""
+        metadata_path = self.metadata_dir / f"{firmware_id}.json"
+        async with aiofiles.open(metadata_path, 'w') as f:
+            await f.write(json.dumps(firmware.to_dict(), indent=2))
+    
     async def get_firmware_metadata(self, firmware_id: str) -> Optional[FirmwareMetadata]:
         """Get firmware metadata"""
         return self.firmware_cache.get(firmware_id)
@@ -142,9 +286,7 @@ class FirmwareManager:
             firmware.status = FirmwareStatus.STABLE
             
             # Save updated metadata
-            metadata_path = self.metadata_dir / f"{firmware_id}.json"
-            async with aiofiles.open(metadata_path, 'w') as f:
-                await f.write(json.dumps(firmware.to_dict(), indent=2))
+            await self.save_firmware_metadata(firmware_id, firmware)
             
             logger.info(f"Firmware {firmware_id} approved by {user_id}")
             return True
@@ -300,7 +442,8 @@ class FirmwareManager:
             return False
     
     async def update_single_device(self, device_id: str, firmware_id: str,
-                                 force_update: bool = False) -> bool:
+                                 force_update: bool = False,
+                                 rollout_id: Optional[str] = None) -> bool:
         """Update a single device"""
         try:
             # Check compatibility first
@@ -315,22 +458,39 @@ class FirmwareManager:
             if not firmware:
                 return False
             
+            # Smallest artifact the device decodes; checksum and size are the artifact's
+            artifact = await self.select_artifact(device_id, firmware_id)
+            url = f"http://localhost:3004/api/firmware/{firmware_id}/download"
+            if artifact["format"] == "delta":
+                url += f"?artifact=delta&base={artifact['base']}"
+            elif artifact["format"] != "full":
+                url += f"?artifact={artifact['format']}"
+            
             # Create update command
             update_command = {
                 "action": "update",
                 "firmware_id": firmware_id,
-                "url": f"http://localhost:3004/api/firmware/{firmware_id}/download",
+                "url": url,
                 "version": str(firmware.version),
-                "checksum": firmware.checksum,
-                "size": firmware.file_size
+                "format": artifact["format"],
+                "checksum": artifact["checksum"],
+                "size": artifact["size"],
+                # The grant's token authorizes the download (X-OTA-Token)
+                "require_grant": True
             }
+            if rollout_id:
+                # Rollout members spread their start and are held to its slot limit
+                update_command["start_window"] = OTA_START_WINDOW
+                self.redis_client.set(f"ota_device_rollout:{device_id}", rollout_id,
+                                      ex=OTA_ROLLOUT_MEMBERSHIP)
             
             # Send update command via MQTT
             topic = f"homeautomation/devices/{device_id}/ota"
             message = json.dumps(update_command)
             
             self.mqtt_client.publish(topic, message, qos=1)
-            logger.info(f"Update command sent to device {device_id}")
+            logger.info(f"Update command sent to device {device_id} "
+                        f"({artifact['format']}, {artifact['size']} of {firmware.file_size} bytes)")
             
             return True
             
@@ -463,25 +623,102 @@ class FirmwareManager:
             await f.write(json.dumps(update_status.to_dict(), indent=2))
     
     async def start_immediate_rollout(self, rollout: FirmwareRollout):
-        """Start immediate rollout"""
-        concurrent_updates = 0
-        
+        """Start immediate rollout: every device at once, slots keep the rate"""
         for device_id in rollout.target_devices:
-            if concurrent_updates >= rollout.max_concurrent_updates:
-                break
-            
-            await self.update_single_device(device_id, rollout.firmware_id)
-            concurrent_updates += 1
+            await self.update_single_device(device_id, rollout.firmware_id, rollout_id=rollout.id)
     
     async def start_gradual_rollout(self, rollout: FirmwareRollout):
-        """Start gradual rollout"""
-        # Calculate number of devices for first batch
-        batch_size = max(1, int(len(rollout.target_devices) * rollout.gradual_percentage / 100))
+        """Start gradual rollout: waves of gradual_percentage every gradual_interval"""
+        asyncio.create_task(self.run_rollout_waves(rollout.id))
+    
+    async def run_rollout_waves(self, rollout_id: str):
+        """Send the rollout wave by wave until it is done, paused or cancelled"""
+        rollout = await self.get_rollout(rollout_id)
+        if not rollout:
+            return
+        wave_size = max(1, int(len(rollout.target_devices) * rollout.gradual_percentage / 100))
+        
+        for start in range(0, len(rollout.target_devices), wave_size):
+            rollout = await self.get_rollout(rollout_id)
+            if not rollout or rollout.status != "active":
+                logger.info(f"Rollout {rollout_id} stopped before wave {start // wave_size + 1}")
+                return
+            
+            for device_id in rollout.target_devices[start:start + wave_size]:
+                await self.update_single_device(device_id, rollout.firmware_id, rollout_id=rollout_id)
+            logger.info(f"Rollout {rollout_id} wave {start // wave_size + 1} sent")
+            
+            if start + wave_size < len(rollout.target_devices):
+                await asyncio.sleep(rollout.gradual_interval)
+    
+    async def handle_slot_request(self, device_id: str):
+        """Answer a device's "waiting_for_slot" with a grant or a retry_after"""
+        rollout_id = self.redis_client.get(f"ota_device_rollout:{device_id}")
+        rollout = await self.get_rollout(rollout_id) if rollout_id else None
+        topic = f"homeautomation/devices/{device_id}/ota"
+        
+        if rollout and rollout.status != "active":
+            # Paused: ask again once the next wave could have gone out
+            self.publish_retry_after(topic, rollout.gradual_interval)
+            return
+        
+        slots_key = f"ota_slots:{rollout_id or 'adhoc'}"
+        now = time.time()
+        self.redis_client.zremrangebyscore(slots_key, "-inf", now)
+        token = self.redis_client.get(f"ota_device_slot:{device_id}")
+        limit = rollout.max_concurrent_updates if rollout else None
+        if not token and limit is not None and self.redis_client.zcard(slots_key) >= limit:
+            self.publish_retry_after(topic, OTA_RETRY_AFTER)
+            return
+        
+        # A repeated request gets the slot the device already holds
+        token = token or uuid.uuid4().hex[:16]
+        self.redis_client.zadd(slots_key, {device_id: now + OTA_SLOT_LEASE})
+        self.redis_client.set(f"ota_device_slot:{device_id}", token, ex=OTA_SLOT_LEASE)
+        self.redis_client.set(f"ota_slot:{token}", slots_key, ex=OTA_SLOT_LEASE)
+        self.mqtt_client.publish(topic, json.dumps({"action": "grant", "token": token}), qos=1)
+    
+    def publish_retry_after(self, topic: str, seconds: int):
+        # Jitter keeps devices turned away together from returning together
+        seconds = seconds + random.randint(0, seconds)
+        self.mqtt_client.publish(topic, json.dumps({"action": "retry_after", "seconds": seconds}), qos=1)
+    
+    def download_slot_valid(self, token: str) -> bool:
+        """Whether a download carrying X-OTA-Token still holds its slot"""
+        return bool(self.redis_client.exists(f"ota_slot:{token}"))
+    
+    async def handle_ota_result(self, device_id: str, result: str):
+        """Free the device's slot and count its result against the rollout"""
+        token = self.redis_client.get(f"ota_device_slot:{device_id}")
+        if token:
+            slots_key = self.redis_client.get(f"ota_slot:{token}")
+            if slots_key:
+                self.redis_client.zrem(slots_key, device_id)
+            self.redis_client.delete(f"ota_slot:{token}", f"ota_device_slot:{device_id}")
+        
+        rollout_id = self.redis_client.get(f"ota_device_rollout:{device_id}")
+        if not rollout_id:
+            return
+        self.redis_client.delete(f"ota_device_rollout:{device_id}")
+        rollout = await self.get_rollout(rollout_id)
+        if not rollout:
+            return
+        
+        if result == "success":
+            rollout.successful_updates += 1
+        else:
+            rollout.failed_updates += 1
+        rollout.pending_updates = max(0, rollout.pending_updates - 1)
         
-        # Update first batch
-        for i in range(min(batch_size, len(rollout.target_devices))):
-            device_id = rollout.target_devices[i]
-            await self.update_single_device(device_id, rollout.firmware_id)
+        finished = rollout.successful_updates + rollout.failed_updates
+        failure_rate = rollout.failed_updates * 100 / finished
+        if (rollout.pause_on_failure and rollout.status == "active" and finished >= 5 and
+                failure_rate >= rollout.rollback_on_failure_rate):
+            rollout.status = "paused"
+            logger.warning(f"Rollout {rollout_id} paused at {failure_rate:.0f}% failures")
+        elif rollout.pending_updates == 0 and rollout.status == "active":
+            rollout.status = "completed"
+        await self.save_rollout(rollout)
     
     async def schedule_rollout(self, rollout: FirmwareRollout):
         """Schedule rollout for later execution"""
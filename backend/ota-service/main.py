@@ -1,8 +1,6 @@
-from fastapi import FastAPI, HTTPException, Depends, status, UploadFile, File, Form
+from fastapi import FastAPI, HTTPException, Depends, status, UploadFile, File, Form, Request
 from fastapi.security import HTTPBearer, HTTPAuthorizationCredentials
 from fastapi.middleware.cors import CORSMiddleware
-from fastapi.responses import FileResponse
-from fastapi.staticfiles import StaticFiles
 from keycloak import KeycloakOpenID
 import os
 import jwt
@@ -18,6 +16,7 @@ import paho.mqtt.client as mqtt
 
 # Import our new modules
 from firmware_manager import FirmwareManager
+from downloads import ranged_file_response
 from models import DeviceType, FirmwareStatus, UpdateStatus, RolloutStrategy
 from schemas import (
     FirmwareUploadSchema, FirmwareMetadataSchema, FirmwareUpdateSchema,
@@ -207,8 +206,14 @@ async def shutdown_event():
     mqtt_client.disconnect()
     logger.info("OTA Service stopped")
 
-# Mount static files for firmware downloads
-app.mount("/firmware", StaticFiles(directory=str(FIRMWARE_DIR)), name="firmware")
+@app.get("/firmware/{filename}")
+async def download_firmware(filename: str, request: Request):
+    """Serve a firmware image, honouring a single byte range"""
+    file_path = FIRMWARE_DIR / Path(filename).name
+    if not file_path.is_file():
+        raise HTTPException(status_code=status.HTTP_404_NOT_FOUND, detail="Firmware not found")
+    
+    return ranged_file_response(file_path, request.headers.get("range"))
 
 @app.get("/health")
 async def health_check():
@@ -443,7 +448,7 @@ async def trigger_device_update(
             "size": firmware_info.file_size
         }
         
-        mqtt_client.publish(topic, json.dumps(message))
+        mqtt_client.publish(topic, json.dumps(message), qos=1)
         
         logger.info(f"OTA update triggered for device {device_id}: {firmware_filename}")
         
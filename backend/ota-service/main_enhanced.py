@@ -1,10 +1,10 @@
-from fastapi import FastAPI, HTTPException, Depends, status, UploadFile, File, Form
+from fastapi import FastAPI, HTTPException, Depends, status, UploadFile, File, Form, Header, Request
 from fastapi.security import HTTPBearer, HTTPAuthorizationCredentials
 from fastapi.middleware.cors import CORSMiddleware
-from fastapi.responses import FileResponse
 from fastapi.staticfiles import StaticFiles
 from keycloak import KeycloakOpenID
 import os
+import asyncio
 import jwt
 from typing import Optional, Dict, Any, List
 import redis
@@ -18,6 +18,7 @@ import paho.mqtt.client as mqtt
 
 # Import our new modules
 from firmware_manager import FirmwareManager
+from downloads import ranged_file_response
 from models import DeviceType, FirmwareStatus, UpdateStatus, RolloutStrategy
 from schemas import (
     FirmwareUploadSchema, FirmwareMetadataSchema, FirmwareUpdateSchema,
@@ -71,8 +72,9 @@ mqtt_client = mqtt.Client()
 # Initialize firmware manager
 firmware_manager = FirmwareManager(FIRMWARE_DIR, redis_client, mqtt_client)
 
-# Security scheme
+# Security scheme; downloads also accept a device's slot token instead
 security = HTTPBearer()
+optional_security = HTTPBearer(auto_error=False)
 
 async def verify_token(credentials: HTTPAuthorizationCredentials = Depends(security)) -> Dict[str, Any]:
     """Verify JWT token with Keycloak"""
@@ -113,11 +115,65 @@ async def verify_token(credentials: HTTPAuthorizationCredentials = Depends(secur
             detail="Invalid token"
         )
 
+async def verify_download(
+    x_ota_token: Optional[str] = Header(None),
+    credentials: Optional[HTTPAuthorizationCredentials] = Depends(optional_security)
+) -> Optional[Dict[str, Any]]:
+    """Authorize a download by the device's X-OTA-Token grant, else by an operator token"""
+    if x_ota_token:
+        # A rollout download must still hold its slot; the device waits and asks again
+        if not firmware_manager.download_slot_valid(x_ota_token):
+            raise HTTPException(
+                status_code=status.HTTP_503_SERVICE_UNAVAILABLE,
+                detail="Download slot expired",
+                headers={"Retry-After": "60"}
+            )
+        return None
+    if credentials is None:
+        raise HTTPException(
+            status_code=status.HTTP_403_FORBIDDEN,
+            detail="Not authenticated"
+        )
+    return await verify_token(credentials)
+
+def on_mqtt_connect(client, userdata, flags, rc):
+    if rc == 0:
+        # OTA "check" answers arrive on the device status topic
+        client.subscribe("homeautomation/devices/+/status")
+    else:
+        logger.error(f"Failed to connect to MQTT broker: {rc}")
+
+def on_mqtt_message(client, userdata, msg):
+    try:
+        topic_parts = msg.topic.split('/')
+        if len(topic_parts) >= 3:
+            device_id = topic_parts[2]
+            payload = json.loads(msg.payload.decode())
+            ota_status = payload.get("status")
+            if ota_status == "ready_for_update":
+                firmware_manager.record_device_ota_capabilities(device_id, payload)
+            elif ota_status == "waiting_for_slot":
+                asyncio.run_coroutine_threadsafe(firmware_manager.handle_slot_request(device_id), main_loop)
+            elif ota_status in ("success", "failed"):
+                asyncio.run_coroutine_threadsafe(
+                    firmware_manager.handle_ota_result(device_id, ota_status), main_loop)
+    except Exception as e:
+        logger.error(f"Error processing MQTT message: {e}")
+
+main_loop: Optional[asyncio.AbstractEventLoop] = None
+
+mqtt_client.on_connect = on_mqtt_connect
+mqtt_client.on_message = on_mqtt_message
+
 @app.on_event("startup")
 async def startup_event():
     """Initialize services on startup"""
+    global main_loop
     logger.info("Starting OTA Service")
     
+    # MQTT callbacks run on the client thread and hand work to this loop
+    main_loop = asyncio.get_running_loop()
+    
     # Connect to MQTT broker
     try:
         mqtt_client.connect(MQTT_HOST, MQTT_PORT, 60)
@@ -298,23 +354,25 @@ async def get_firmware(
 @app.get("/api/firmware/{firmware_id}/download")
 async def download_firmware(
     firmware_id: str,
-    current_user: Dict[str, Any] = Depends(verify_token)
+    request: Request,
+    artifact: str = "full",
+    base: Optional[str] = None,
+    current_user: Optional[Dict[str, Any]] = Depends(verify_download)
 ):
-    """Download firmware file"""
+    """Download firmware file, or one of its compressed or delta artifacts"""
     try:
-        firmware_path = FIRMWARE_DIR / f"{firmware_id}.bin"
-        if not firmware_path.exists():
+        firmware_path = firmware_manager.get_artifact_path(firmware_id, artifact, base)
+        if not firmware_path or not firmware_path.exists():
             raise HTTPException(
                 status_code=status.HTTP_404_NOT_FOUND,
                 detail="Firmware file not found"
             )
         
-        return FileResponse(
-            firmware_path,
-            media_type="application/octet-stream",
-            filename=f"{firmware_id}.bin"
-        )
+        # A device resumes a dropped download from where it stopped
+        return ranged_file_response(firmware_path, request.headers.get("range"), filename=firmware_path.name)
         
+    except HTTPException:
+        raise
     except Exception as e:
         logger.error(f"Failed to download firmware: {e}")
         raise HTTPException(
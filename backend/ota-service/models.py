@@ -93,6 +93,10 @@ class FirmwareMetadata:
         self.build_date = datetime.fromisoformat(data.get("build_date", datetime.now().isoformat()))
         self.file_size = data.get("file_size", 0)
         self.checksum = data.get("checksum", "")
+        self.image_md5 = data.get("image_md5", "")
+        # Format -> {file, size, checksum}; deltas are keyed by base firmware id
+        self.artifacts = data.get("artifacts", {})
+        self.deltas = data.get("deltas", {})
         self.min_compatible_version = data.get("min_compatible_version")
         self.max_compatible_version = data.get("max_compatible_version")
         self.required_capabilities = data.get("required_capabilities", [])
@@ -117,6 +121,9 @@ class FirmwareMetadata:
             "build_date": self.build_date.isoformat(),
             "file_size": self.file_size,
             "checksum": self.checksum,
+            "image_md5": self.image_md5,
+            "artifacts": self.artifacts,
+            "deltas": self.deltas,
             "min_compatible_version": self.min_compatible_version,
             "max_compatible_version": self.max_compatible_version,
             "required_capabilities": self.required_capabilities,
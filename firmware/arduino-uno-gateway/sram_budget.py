@@ -0,0 +1,72 @@
+# Post-build SRAM budget for the Uno (the [lean] profile in platformio.ini).
+#
+# Adds the static RAM the linker placed (.data + .bss) to what the
+# firmware claims at run time: the PubSubClient packet buffer on the heap
+# (MQTT_MAX_PACKET_SIZE) and the stack reserve (HA_SRAM_STACK_BUDGET).
+# Prints the total against the 2 KB of the ATmega328 with the largest
+# static symbols, and fails the build if it does not fit.
+import subprocess
+
+Import("env")
+
+RAM_BYTES = 2048
+TOP_SYMBOLS = 10
+
+
+def define(name, default):
+    for item in env.get("CPPDEFINES", []):
+        if isinstance(item, (list, tuple)) and item[0] == name:
+            return int(item[1])
+    return default
+
+
+def tool(name):
+    # avr-size sits next to avr-nm in the toolchain
+    return env.subst("$SIZETOOL").replace("size", name)
+
+
+def sections(elf):
+    sizes = {}
+    output = subprocess.check_output([tool("size"), "-A", elf], universal_newlines=True)
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] in (".data", ".bss", ".noinit"):
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def largest_symbols(elf):
+    output = subprocess.check_output([tool("nm"), "--size-sort", "-S", "-C", elf], universal_newlines=True)
+    symbols = []
+    for line in output.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4 and fields[2] in "bBdD":
+            symbols.append((int(fields[1], 16), fields[3]))
+    return sorted(symbols, reverse=True)[:TOP_SYMBOLS]
+
+
+def report(source, target, env):
+    elf = str(target[0])
+    sizes = sections(elf)
+    static = sum(sizes.values())
+    heap = define("MQTT_MAX_PACKET_SIZE", 256)
+    stack = define("HA_SRAM_STACK_BUDGET", 0)
+    total = static + heap + stack
+
+    print("SRAM budget (%d bytes)" % RAM_BYTES)
+    for name in (".data", ".bss", ".noinit"):
+        if name in sizes:
+            print("  %-8s %5d" % (name, sizes[name]))
+    print("  %-8s %5d  MQTT packet buffer" % ("heap", heap))
+    print("  %-8s %5d  HA_SRAM_STACK_BUDGET" % ("stack", stack))
+    print("  %-8s %5d  (%d free)" % ("total", total, RAM_BYTES - total))
+    print("Largest static symbols:")
+    for size, name in largest_symbols(elf):
+        print("  %5d  %s" % (size, name))
+
+    if total > RAM_BYTES:
+        print("Error: SRAM budget exceeded by %d bytes" % (total - RAM_BYTES))
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", report)
@@ -2,8 +2,17 @@
 #include <Ethernet.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <ConnectionManager.h>
+#include <StateStore.h>
 #include <DHT.h>
 #include <EEPROM.h>
+#if defined(GATEWAY_BRIDGE)
+#include <SoftwareSerial.h>
+#include <ChildBridge.h>
+#include <ChildLink.h>
+#endif
 
 // Hardware pin definitions
 #define DHT_PIN 2
@@ -12,42 +21,65 @@
 #define RELAY_PIN 7
 #define BUTTON_PIN 8
 #define ANALOG_SENSOR_PIN A0
+#if defined(GATEWAY_BRIDGE)
+// RS-485 transceiver to the sub-nodes (pins 4 and 10 belong to the
+// Ethernet shield)
+#define RS485_RX_PIN 5
+#define RS485_TX_PIN 6
+#define RS485_DE_PIN 3
+#endif
 
-// Device configuration
-const char* DEVICE_TYPE = "Arduino Gateway";
-const char* FIRMWARE_VERSION = "1.0.0";
-String DEVICE_ID = "arduino_gateway_001";
+// Device configuration; the type and version come from the build flags.
+// Strings stay in flash and are copied out only where needed.
+#ifndef DEVICE_TYPE
+#define DEVICE_TYPE "Arduino Gateway"
+#endif
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION "1.0.0"
+#endif
+const char DEVICE_ID[] PROGMEM = "arduino_gateway_001";
 
 // Network configuration
 byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
 IPAddress ip(192, 168, 1, 200);
 IPAddress server(192, 168, 1, 100);
 
-// MQTT Configuration
-const char* MQTT_SERVER = "192.168.1.100";
+// MQTT Configuration; the broker is addressed by IP (server above)
 const int MQTT_PORT = 1883;
 const char* MQTT_USER = "";
 const char* MQTT_PASSWORD = "";
 
-// Topics
-String TOPIC_BASE = "homeautomation/devices/" + DEVICE_ID;
-String TOPIC_STATUS = TOPIC_BASE + "/status";
-String TOPIC_STATE = TOPIC_BASE + "/state";
-String TOPIC_ONLINE = TOPIC_BASE + "/online";
-String TOPIC_COMMAND = TOPIC_BASE + "/command";
-
 // Sensors and clients
 DHT dht(DHT_PIN, DHT_TYPE);
 EthernetClient ethClient;
 PubSubClient mqttClient(ethClient);
 
+// Topics, connect, online and status plumbing shared with the other
+// devices. Only the base topic is kept in RAM.
+struct GatewayTraits {
+  // Ten fields, the mqtt_rx, link and persistence objects, and the copied
+  // type, version and address strings; in bridge mode also the bridge
+  // and child_link objects
+#if defined(GATEWAY_BRIDGE)
+  static const size_t BRIDGE_CAPACITY = JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(3);
+#else
+  static const size_t BRIDGE_CAPACITY = 0;
+#endif
+  static const size_t STATUS_CAPACITY = JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(5) +
+                                        JSON_OBJECT_SIZE(3) + BRIDGE_CAPACITY + sizeof(DEVICE_TYPE) +
+                                        sizeof(FIRMWARE_VERSION) + 16;
+  static const __FlashStringHelper* type() { return F(DEVICE_TYPE); }
+  static const __FlashStringHelper* firmwareVersion() { return F(FIRMWARE_VERSION); }
+  static void reportStatus(JsonDocument& status);
+};
+ha::DeviceCore<GatewayTraits> device(mqttClient);
+
 // Device state
 struct GatewayState {
   bool power = false;
   float temperature = 0.0;
   float humidity = 0.0;
   int analogValue = 0;
-  bool online = false;
   unsigned long lastHeartbeat = 0;
   unsigned long lastSensorRead = 0;
   unsigned long lastButtonPress = 0;
@@ -56,58 +88,194 @@ struct GatewayState {
 
 GatewayState gatewayState;
 
+// What survives a reboot
+struct GatewayRecord {
+  uint8_t power;
+};
+
+// Saved state is written once commands settle, into rotating EEPROM slots
+const unsigned long STATE_SAVE_SETTLE = 2000;
+const unsigned long STATE_SAVE_MAX_DELAY = 30000;
+ha::PersistedState<GatewayRecord> savedState("gateway", STATE_SAVE_SETTLE, STATE_SAVE_MAX_DELAY);
+
 // Button handling
 const unsigned long DEBOUNCE_DELAY = 50;
 
+// Follow-up work asked for by the commands in one message. It runs from
+// loop() once the message is handled: the document aliases the MQTT
+// receive buffer, which publishing overwrites, and by then the command
+// document is off the stack, so it never sits under the status document.
+struct CommandEffects {
+  bool status = false;
+  bool state = false;
+};
+CommandEffects pendingEffects;
+
+// Documents are sized for what they hold. State: six fields, the id by
+// pointer. Commands parse in place: one command, or a batch of up to
+// MAX_BATCH.
+const size_t STATE_CAPACITY = JSON_OBJECT_SIZE(6);
+const size_t MAX_BATCH = 4;
+const size_t COMMAND_CAPACITY =
+    JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(MAX_BATCH) + MAX_BATCH * (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(1));
+
+// The lean profile (platformio.ini) sets aside HA_SRAM_STACK_BUDGET for
+// the stack. The deepest document, its topic and address buffers and
+// the call frames under it (PubSubClient, the Ethernet driver, the
+// serializer) must fit.
+#if defined(HA_SRAM_STACK_BUDGET)
+const size_t STACK_FRAMES = 192;
+static_assert(GatewayTraits::STATUS_CAPACITY + ha::DeviceTopics::MAX_TOPIC + 16 + STACK_FRAMES <=
+                  HA_SRAM_STACK_BUDGET,
+              "status document does not fit the stack budget");
+static_assert(COMMAND_CAPACITY + STACK_FRAMES <= HA_SRAM_STACK_BUDGET,
+              "command document does not fit the stack budget");
+#endif
+
+#if defined(GATEWAY_BRIDGE)
+// Sub-nodes are polled one per second and count as offline after 15 s
+// of silence. Their readings go out together on <base>/children with
+// each heartbeat: {"children": {"<child>": {...}}, "timestamp": ...}.
+const unsigned long CHILD_POLL_INTERVAL = 1000;
+const unsigned long CHILD_TIMEOUT = 15000;
+const size_t CHILDREN_CAPACITY = JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(ha::ChildBridge::MAX_CHILDREN) +
+                                 ha::ChildBridge::MAX_CHILDREN * JSON_OBJECT_SIZE(5);
+#if defined(HA_SRAM_STACK_BUDGET)
+static_assert(CHILDREN_CAPACITY + ha::DeviceTopics::MAX_TOPIC + STACK_FRAMES <= HA_SRAM_STACK_BUDGET,
+              "children document does not fit the stack budget");
+#endif
+
+SoftwareSerial rs485(RS485_RX_PIN, RS485_TX_PIN);
+ha::ChildLink childLink(rs485, RS485_DE_PIN);
+
+// The children's command topics and online flags ride on the gateway's
+// own broker connection
+const ha::ChildBridgeHooks CHILD_BRIDGE_HOOKS = {
+  [](const char* topic) { return mqttClient.subscribe(topic, 1); },
+  [](const char* topic) { return mqttClient.unsubscribe(topic); },
+  [](const char* topic, const char* payload, bool retained) { return mqttClient.publish(topic, payload, retained); },
+  [](uint8_t address, uint8_t type, const uint8_t* payload, uint8_t length) {
+    return childLink.send(address, type, payload, length);
+  },
+};
+ha::ChildBridge bridge(CHILD_BRIDGE_HOOKS, CHILD_POLL_INTERVAL, CHILD_TIMEOUT);
+#endif
+
 // Function declarations
 void setupHardware();
 void setupEthernet();
 void setupMQTT();
-void connectToMQTT();
+bool connectToMQTT();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void publishStatus();
 void publishState();
-void publishOnlineStatus(bool online);
-void handleCommand(StaticJsonDocument<256>& doc);
+void handleCommand(JsonDocument& doc);
+void applyCommandEffects();
+void commandSetPower(JsonObject parameters, CommandEffects& effects);
+void commandToggle(JsonObject parameters, CommandEffects& effects);
+void commandGetStatus(JsonObject parameters, CommandEffects& effects);
+void commandGetSensors(JsonObject parameters, CommandEffects& effects);
+#if defined(GATEWAY_BRIDGE)
+void commandAddChild(JsonObject parameters, CommandEffects& effects);
+void commandRemoveChild(JsonObject parameters, CommandEffects& effects);
+void publishChildren();
+#endif
 void updateRelay();
 void handleButton();
 void readSensors();
-void saveStateToEEPROM();
-void loadStateFromEEPROM();
+void saveState();
+void loadState();
+int freeMemory();
+
+// MQTT topic routing (suffixes of the device base topic)
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+};
+ha::MqttDispatcher<COMMAND_CAPACITY> mqttDispatcher(MQTT_ROUTES);
+
+// Commands on <base>/command
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("get_sensors"), commandGetSensors },
+#if defined(GATEWAY_BRIDGE)
+  { ha::fnv1a("add_child"), commandAddChild },
+  { ha::fnv1a("remove_child"), commandRemoveChild },
+#endif
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+// MQTT reconnect state machine; the Ethernet link needs no restarting
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return Ethernet.linkStatus() != LinkOFF; },
+  nullptr,
+  connectToMQTT,
+  []() { return mqttClient.connected(); },
+  nullptr,
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
 
 void setup() {
   Serial.begin(9600);
-  Serial.println("=== Home Automation Arduino Gateway ===");
-  Serial.println("Firmware Version: " + String(FIRMWARE_VERSION));
+  Serial.println(F("=== Home Automation Arduino Gateway ==="));
+  Serial.print(F("Firmware Version: "));
+  Serial.println(F(FIRMWARE_VERSION));
   
   // Setup hardware
   setupHardware();
   
   // Load saved state
-  loadStateFromEEPROM();
+  loadState();
   
   // Setup Ethernet
   setupEthernet();
   
-  // Setup MQTT
+  // Setup MQTT; the id is only copied out of flash into the base topic
+  char deviceId[sizeof(DEVICE_ID)];
+  strcpy_P(deviceId, DEVICE_ID);
+  device.begin(deviceId);
+  mqttDispatcher.setBaseTopic(device.topics().base());
+  connection.seed(ha::fnv1aBuffer((const char*)mac, sizeof(mac)));
   setupMQTT();
   
   // Initialize DHT sensor
   dht.begin();
   
+#if defined(GATEWAY_BRIDGE)
+  // Sub-node bus and the saved child table; child command topics are
+  // matched outside the gateway's own base
+  rs485.begin(9600);
+  childLink.begin();
+  bridge.begin();
+  mqttDispatcher.setSharedRoute([](const char* topic) { return bridge.matches(topic); },
+                                [](JsonDocument& doc) { bridge.handleCommand(doc); });
+  Serial.print(F("Bridging children: "));
+  Serial.println(bridge.count());
+#endif
+  
   // Initial state update
   updateRelay();
   
-  Serial.println("Setup complete!");
+  Serial.println(F("Setup complete!"));
 }
 
 void loop() {
-  // Handle MQTT connection
-  if (!mqttClient.connected()) {
-    connectToMQTT();
-  } else {
+  // Handle MQTT connection without blocking local control
+  unsigned long now = millis();
+  connection.service(now);
+  if (connection.online()) {
     mqttClient.loop();
   }
+  applyCommandEffects();
+  
+#if defined(GATEWAY_BRIDGE)
+  // Readings from the sub-nodes, then the next poll
+  ha::ChildLink::Frame frame;
+  while (childLink.poll(frame)) {
+    bridge.receive(frame, now);
+  }
+  bridge.service(now, connection.online());
+#endif
   
   // Handle button press
   if (digitalRead(BUTTON_PIN) == LOW) {
@@ -122,7 +290,6 @@ void loop() {
   }
   
   // Read sensors every 5 seconds
-  unsigned long now = millis();
   if (now - gatewayState.lastSensorRead > 5000) {
     readSensors();
     gatewayState.lastSensorRead = now;
@@ -130,11 +297,17 @@ void loop() {
   
   // Send heartbeat every 30 seconds
   if (now - gatewayState.lastHeartbeat > 30000) {
-    publishOnlineStatus(true);
+    device.publishOnline(true);
     publishState();
+#if defined(GATEWAY_BRIDGE)
+    publishChildren();
+#endif
     gatewayState.lastHeartbeat = now;
   }
   
+  // Write the saved state once it has settled
+  savedState.service(now);
+  
   // Maintain Ethernet connection
   Ethernet.maintain();
   
@@ -142,7 +315,7 @@ void loop() {
 }
 
 void setupHardware() {
-  Serial.println("Setting up hardware...");
+  Serial.println(F("Setting up hardware..."));
   
   // Setup pins
   pinMode(LED_PIN, OUTPUT);
@@ -153,117 +326,144 @@ void setupHardware() {
   digitalWrite(LED_PIN, LOW);
   digitalWrite(RELAY_PIN, LOW);
   
-  Serial.println("Hardware setup complete");
+  Serial.println(F("Hardware setup complete"));
 }
 
 void setupEthernet() {
-  Serial.println("Setting up Ethernet...");
+  Serial.println(F("Setting up Ethernet..."));
   
   // Start Ethernet with DHCP
   if (Ethernet.begin(mac) == 0) {
-    Serial.println("Failed to configure Ethernet using DHCP");
-    Serial.println("Using static IP configuration");
+    Serial.println(F("Failed to configure Ethernet using DHCP"));
+    Serial.println(F("Using static IP configuration"));
     Ethernet.begin(mac, ip);
   }
   
   // Give the Ethernet shield time to initialize
   delay(1000);
   
-  Serial.print("IP address: ");
+  Serial.print(F("IP address: "));
   Serial.println(Ethernet.localIP());
 }
 
 void setupMQTT() {
-  Serial.println("Setting up MQTT...");
-  mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
+  Serial.println(F("Setting up MQTT..."));
+  mqttClient.setServer(server, MQTT_PORT);
   mqttClient.setCallback(mqttCallback);
-  Serial.println("MQTT setup complete");
+  Serial.println(F("MQTT setup complete"));
 }
 
-void connectToMQTT() {
-  Serial.println("Connecting to MQTT...");
+bool connectToMQTT() {
+  Serial.println(F("Connecting to MQTT..."));
   
-  if (mqttClient.connect(DEVICE_ID.c_str(), MQTT_USER, MQTT_PASSWORD)) {
-    Serial.println("MQTT connected!");
+  // Connects with a retained offline will
+  if (device.connect(MQTT_USER, MQTT_PASSWORD)) {
+    Serial.println(F("MQTT connected!"));
     
     // Subscribe to command topic
-    String commandTopic = TOPIC_COMMAND;
-    if (mqttClient.subscribe(commandTopic.c_str())) {
-      Serial.println("Subscribed to: " + commandTopic);
+    if (device.subscribe(ha::topic::COMMAND)) {
+      Serial.println(F("Subscribed to commands"));
     }
+#if defined(GATEWAY_BRIDGE)
+    // Done from loop(), by the bridge
+    bridge.subscribeAll();
+    bridge.announceAll();
+#endif
     
     // Publish online status
-    publishOnlineStatus(true);
-    publishStatus();
-    
-    gatewayState.online = true;
-  } else {
-    Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
-    gatewayState.online = false;
+    device.publishOnline(true);
+    device.publishStatus();
+    return true;
   }
+  
+  Serial.print(F("MQTT connection failed, rc="));
+  Serial.println(mqttClient.state());
+  return false;
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String topicStr = String(topic);
-  String message = "";
-  
-  for (int i = 0; i < length; i++) {
-    message += (char)payload[i];
-  }
-  
-  Serial.println("Received [" + topicStr + "]: " + message);
-  
-  // Parse JSON message
-  StaticJsonDocument<256> doc;
-  DeserializationError error = deserializeJson(doc, message);
+  mqttDispatcher.dispatch(topic, payload, length);
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects& effects = pendingEffects;
+  JsonArray batch = doc["commands"];
   
-  if (error) {
-    Serial.println("Failed to parse JSON: " + String(error.c_str()));
-    return;
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    // {"commands": [{"command": ..., "parameters": {...}}, ...]}, applied
+    // together and reported once
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
   }
   
-  if (topicStr == TOPIC_COMMAND) {
-    handleCommand(doc);
-  }
+  // Save state after any change
+  saveState();
 }
 
-void handleCommand(StaticJsonDocument<256>& doc) {
-  String command = doc["command"];
-  JsonObject parameters = doc["parameters"];
-  
-  Serial.println("Handling command: " + command);
+void applyCommandEffects() {
+  CommandEffects effects = pendingEffects;
+  pendingEffects = CommandEffects();
   
-  if (command == "set_power") {
-    gatewayState.power = parameters["power"];
-    updateRelay();
-    publishState();
-  } else if (command == "toggle") {
-    gatewayState.power = !gatewayState.power;
+  if (effects.status) {
+    device.publishStatus();
+  }
+  if (effects.state) {
     updateRelay();
     publishState();
-  } else if (command == "get_status") {
-    publishStatus();
-    publishState();
-  } else if (command == "get_sensors") {
-    readSensors();
-    publishState();
   }
-  
-  // Save state after any change
-  saveStateToEEPROM();
 }
 
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  gatewayState.power = parameters["power"];
+  effects.state = true;
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  gatewayState.power = !gatewayState.power;
+  effects.state = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandGetSensors(JsonObject, CommandEffects& effects) {
+  readSensors();
+  effects.state = true;
+}
+
+#if defined(GATEWAY_BRIDGE)
+void commandAddChild(JsonObject parameters, CommandEffects& effects) {
+  // {"child_id": "...", "address": n}
+  if (!bridge.add(parameters["child_id"], parameters["address"])) {
+    Serial.println(F("Child not added"));
+  }
+  effects.status = true;
+}
+
+void commandRemoveChild(JsonObject parameters, CommandEffects& effects) {
+  if (!bridge.remove(parameters["child_id"])) {
+    Serial.println(F("Unknown child"));
+  }
+  effects.status = true;
+}
+#endif
+
 void updateRelay() {
   digitalWrite(RELAY_PIN, gatewayState.power ? HIGH : LOW);
   digitalWrite(LED_PIN, gatewayState.power ? HIGH : LOW);
 }
 
 void handleButton() {
-  Serial.println("Button pressed - toggling power");
+  Serial.println(F("Button pressed - toggling power"));
   gatewayState.power = !gatewayState.power;
   updateRelay();
   publishState();
-  saveStateToEEPROM();
+  saveState();
 }
 
 void readSensors() {
@@ -280,64 +480,65 @@ void readSensors() {
   gatewayState.analogValue = analogRead(ANALOG_SENSOR_PIN);
 }
 
-void publishStatus() {
-  StaticJsonDocument<400> doc;
-  doc["device_id"] = DEVICE_ID;
-  doc["device_type"] = DEVICE_TYPE;
-  doc["firmware_version"] = FIRMWARE_VERSION;
-  doc["ip_address"] = Ethernet.localIP().toString();
-  doc["online"] = gatewayState.online;
-  doc["free_memory"] = freeMemory();
-  doc["uptime"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATUS.c_str(), message.c_str(), true);
-  }
+void GatewayTraits::reportStatus(JsonDocument& status) {
+  // Copied into the document; status is serialized after this returns
+  char ip[16];
+  ha::formatAddress(Ethernet.localIP(), ip);
+  status["ip_address"] = ip;
+  status["free_memory"] = freeMemory();
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  connection.reportStats(status.createNestedObject("link"));
+  savedState.reportStats(status.createNestedObject("persistence"));
+#if defined(GATEWAY_BRIDGE)
+  bridge.reportStats(status.createNestedObject("bridge"));
+  childLink.reportStats(status.createNestedObject("child_link"));
+#endif
 }
 
 void publishState() {
-  StaticJsonDocument<300> doc;
-  doc["device_id"] = DEVICE_ID;
+  HA_ASSERT_NO_ALLOC("publishState");
+  StaticJsonDocument<STATE_CAPACITY> doc;
+  doc["device_id"] = device.deviceId();
   doc["power"] = gatewayState.power;
   doc["temperature"] = gatewayState.temperature;
   doc["humidity"] = gatewayState.humidity;
   doc["analog_value"] = gatewayState.analogValue;
   doc["timestamp"] = millis();
   
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATE.c_str(), message.c_str());
-  }
+  device.publishJson(ha::topic::STATE, doc);
 }
 
-void publishOnlineStatus(bool online) {
-  StaticJsonDocument<100> doc;
-  doc["online"] = online;
+#if defined(GATEWAY_BRIDGE)
+void publishChildren() {
+  // One publish for every child with news; kept for the next heartbeat
+  // if it does not go out
+  StaticJsonDocument<CHILDREN_CAPACITY> doc;
+  if (!bridge.reportChanges(doc.createNestedObject("children"))) {
+    return;
+  }
   doc["timestamp"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_ONLINE.c_str(), message.c_str(), true);
+  if (device.publishJson(ha::topic::CHILDREN, doc)) {
+    bridge.reported();
   }
-  
-  gatewayState.online = online;
 }
+#endif
 
-void saveStateToEEPROM() {
-  EEPROM.write(0, gatewayState.power ? 1 : 0);
+void saveState() {
+  GatewayRecord record = { (uint8_t)(gatewayState.power ? 1 : 0) };
+  savedState.update(record, millis());
 }
 
-void loadStateFromEEPROM() {
-  gatewayState.power = EEPROM.read(0) == 1;
-  Serial.println("State loaded from EEPROM:");
-  Serial.println("  Power: " + String(gatewayState.power));
+void loadState() {
+  GatewayRecord record;
+  if (savedState.load(record)) {
+    gatewayState.power = record.power == 1;
+  } else {
+    // Nothing saved yet: fall back to the byte used by older firmware
+    gatewayState.power = EEPROM.read(0) == 1;
+  }
+  Serial.println(F("State loaded:"));
+  Serial.print(F("  Power: "));
+  Serial.println(gatewayState.power);
 }
 
 // Helper function to get free memory
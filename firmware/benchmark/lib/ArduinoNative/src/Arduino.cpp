@@ -0,0 +1,59 @@
+#include "Arduino.h"
+
+#include <chrono>
+#include <thread>
+
+#include "EEPROM.h"
+
+NullSerial Serial;
+EEPROMClass EEPROM;
+
+namespace {
+const std::chrono::steady_clock::time_point BOOT = std::chrono::steady_clock::now();
+
+template <typename Unit>
+unsigned long sinceBoot() {
+  return std::chrono::duration_cast<Unit>(std::chrono::steady_clock::now() - BOOT).count();
+}
+}  // namespace
+
+unsigned long millis() {
+  return sinceBoot<std::chrono::milliseconds>();
+}
+
+unsigned long micros() {
+  return sinceBoot<std::chrono::microseconds>();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  while (size--) {
+    written += write(*buffer++);
+  }
+  return written;
+}
+
+size_t Print::print(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return write(text);
+}
+
+size_t Print::print(unsigned long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", value);
+  return write(text);
+}
+
+size_t Print::print(double value, int digits) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write(text);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// The ESP8266 flavour (write, then commit), over a RAM array
+class EEPROMClass {
+ public:
+  static const uint16_t SIZE = 4096;
+
+  EEPROMClass() { memset(_bytes, 0xFF, sizeof(_bytes)); }
+
+  void begin(size_t) {}
+  uint8_t read(int address) const { return _bytes[address % SIZE]; }
+  void write(int address, uint8_t value) { _bytes[address % SIZE] = value; }
+  void update(int address, uint8_t value) { write(address, value); }
+  bool commit() { return true; }
+  uint16_t length() const { return SIZE; }
+
+ private:
+  uint8_t _bytes[SIZE];
+};
+
+extern EEPROMClass EEPROM;
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+class IPAddress {
+ public:
+  IPAddress() : _address{ 0, 0, 0, 0 } {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address{ a, b, c, d } {}
+
+  uint8_t operator[](int index) const { return _address[index]; }
+  operator uint32_t() const {
+    return _address[0] | _address[1] << 8 | _address[2] << 16 | (uint32_t)_address[3] << 24;
+  }
+
+ private:
+  uint8_t _address[4];
+};
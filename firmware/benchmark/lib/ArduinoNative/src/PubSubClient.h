@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Arduino.h"
+
+// A broker connection that is always up and swallows what is published,
+// counting messages and bytes so a benchmark can check what went out.
+// Covers the PubSubClient calls DeviceCore and the sketches make.
+class PubSubClient : public Print {
+ public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+
+  PubSubClient() {}
+
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setCallback(Callback callback) {
+    _callback = callback;
+    return *this;
+  }
+  bool setBufferSize(uint16_t) { return true; }
+
+  bool connect(const char*, const char*, const char*, const char*, uint8_t, bool, const char*, bool = true) {
+    _connected = true;
+    return true;
+  }
+  void disconnect() { _connected = false; }
+  bool connected() { return _connected; }
+  int state() { return _connected ? 0 : -1; }
+  bool loop() { return _connected; }
+
+  bool subscribe(const char*, uint8_t = 0) { return _connected; }
+  bool unsubscribe(const char*) { return _connected; }
+
+  bool publish(const char* topic, const char* payload, bool retained = false) {
+    return publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload), retained);
+  }
+  bool publish(const char*, const uint8_t*, unsigned int length, bool = false) {
+    if (!_connected) {
+      return false;
+    }
+    _messages++;
+    _bytes += length;
+    return true;
+  }
+
+  bool beginPublish(const char*, unsigned int, bool) {
+    _messages++;
+    return _connected;
+  }
+  size_t write(uint8_t) override {
+    _bytes++;
+    return 1;
+  }
+  size_t write(const uint8_t*, size_t size) override {
+    _bytes += size;
+    return size;
+  }
+  using Print::write;
+  int endPublish() { return _connected ? 1 : 0; }
+
+  // Feeds a message to the callback, as if the broker had sent it
+  void deliver(char* topic, uint8_t* payload, unsigned int length) {
+    if (_callback) {
+      _callback(topic, payload, length);
+    }
+  }
+
+  uint32_t messages() const { return _messages; }
+  uint64_t bytes() const { return _bytes; }
+
+ private:
+  Callback _callback = nullptr;
+  bool _connected = true;
+  uint32_t _messages = 0;
+  uint64_t _bytes = 0;
+};
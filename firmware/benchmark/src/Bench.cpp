@@ -0,0 +1,339 @@
+#include "Bench.h"
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+namespace {
+struct Benchmark {
+  const char* name;
+  Function function;
+};
+
+struct Result {
+  const char* name;
+  uint64_t iterations;
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp;
+};
+
+struct Options {
+  const char* filter = nullptr;
+  double minTime = 0.5;   // seconds per measurement
+  int repetitions = 3;
+  const char* json = nullptr;
+  const char* baseline = nullptr;
+  double maxRegression = 10;   // percent
+  const char* label = "";
+};
+
+std::vector<Benchmark>& registry() {
+  static std::vector<Benchmark> benchmarks;
+  return benchmarks;
+}
+
+volatile bool counting = false;
+volatile uint64_t allocationCount = 0;
+
+uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+State measure(Function function, uint64_t iterations) {
+  State state(iterations);
+  function(state);
+  return state;
+}
+
+// Grows the iteration count until one run takes minTime, then measures
+// that count repetitions times and keeps the median time. Allocations
+// per iteration are deterministic, so the worst run stands for them.
+Result run(const Benchmark& benchmark, const Options& options) {
+  uint64_t iterations = 1;
+  const uint64_t minNs = options.minTime * 1e9;
+  for (;;) {
+    State state = measure(benchmark.function, iterations);
+    if (state.elapsedNs() >= minNs || iterations >= 1000000000ULL) {
+      break;
+    }
+    double multiplier = state.elapsedNs() ? 1.4 * minNs / state.elapsedNs() : 10;
+    multiplier = std::min(multiplier, 10.0);
+    iterations = std::max<uint64_t>(iterations * multiplier, iterations + 1);
+  }
+
+  std::vector<double> times;
+  Result result = { benchmark.name, iterations, 0, 0, 0 };
+  for (int i = 0; i < options.repetitions; i++) {
+    State state = measure(benchmark.function, iterations);
+    times.push_back((double)state.elapsedNs() / iterations);
+    result.allocsPerOp = std::max(result.allocsPerOp, (double)state.allocations() / iterations);
+    result.bytesPerOp = (double)state.bytesProcessed() / iterations;
+  }
+  std::sort(times.begin(), times.end());
+  result.nsPerOp = times[times.size() / 2];
+  return result;
+}
+
+bool readFile(const char* path, std::string& out) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  char chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    out.append(chunk, length);
+  }
+  fclose(file);
+  return true;
+}
+
+bool writeResults(const std::vector<Result>& results, const Options& options) {
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(results.size()) +
+                          results.size() * JSON_OBJECT_SIZE(5));
+  JsonObject context = doc.createNestedObject("context");
+  context["label"] = options.label;
+  context["date"] = (unsigned long)time(nullptr);
+  context["min_time"] = options.minTime;
+  context["repetitions"] = options.repetitions;
+  JsonArray benchmarks = doc.createNestedArray("benchmarks");
+  for (const Result& result : results) {
+    JsonObject entry = benchmarks.createNestedObject();
+    entry["name"] = result.name;
+    entry["iterations"] = result.iterations;
+    entry["ns_per_op"] = result.nsPerOp;
+    entry["allocs_per_op"] = result.allocsPerOp;
+    entry["bytes_per_op"] = result.bytesPerOp;
+  }
+  if (doc.overflowed()) {
+    return false;
+  }
+
+  std::string text;
+  serializeJsonPretty(doc, text);
+  text += '\n';
+  FILE* file = fopen(options.json, "wb");
+  if (!file) {
+    return false;
+  }
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  return fclose(file) == 0 && written;
+}
+
+// Regressions against a stored run: slower by more than maxRegression
+// percent, or any extra allocation. Benchmarks new since the baseline
+// are listed and pass.
+int compare(const std::vector<Result>& results, const Options& options) {
+  std::string text;
+  if (!readFile(options.baseline, text)) {
+    fprintf(stderr, "Cannot read baseline %s\n", options.baseline);
+    return 2;
+  }
+  DynamicJsonDocument baseline(text.size() * 2 + 1024);
+  DeserializationError error = deserializeJson(baseline, text);
+  if (error) {
+    fprintf(stderr, "Cannot parse baseline %s: %s\n", options.baseline, error.c_str());
+    return 2;
+  }
+
+  printf("\nAgainst %s (max +%.0f%%):\n", options.baseline, options.maxRegression);
+  printf("%-40s %12s %12s %8s %8s\n", "Benchmark", "Baseline ns", "Now ns", "Change", "Allocs");
+  int regressions = 0;
+  for (const Result& result : results) {
+    JsonObjectConst before;
+    for (JsonObjectConst entry : baseline["benchmarks"].as<JsonArrayConst>()) {
+      if (strcmp(entry["name"] | "", result.name) == 0) {
+        before = entry;
+        break;
+      }
+    }
+    if (before.isNull()) {
+      printf("%-40s %12s %12.1f %8s %8.2f  new\n", result.name, "-", result.nsPerOp, "-", result.allocsPerOp);
+      continue;
+    }
+
+    double beforeNs = before["ns_per_op"] | 0.0;
+    double beforeAllocs = before["allocs_per_op"] | 0.0;
+    double change = beforeNs > 0 ? (result.nsPerOp - beforeNs) * 100 / beforeNs : 0;
+    bool slower = change > options.maxRegression;
+    bool allocates = result.allocsPerOp > beforeAllocs + 1e-9;
+    const char* verdict = slower && allocates ? "SLOWER, ALLOCATES" : slower ? "SLOWER" : allocates ? "ALLOCATES" : "ok";
+    printf("%-40s %12.1f %12.1f %+7.1f%% %8.2f  %s\n", result.name, beforeNs, result.nsPerOp, change,
+           result.allocsPerOp, verdict);
+    if (slower || allocates) {
+      regressions++;
+    }
+  }
+
+  if (regressions) {
+    printf("%d regression(s)\n", regressions);
+    return 1;
+  }
+  return 0;
+}
+
+const char* option(const char* arg, const char* name) {
+  size_t length = strlen(name);
+  return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : nullptr;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if ((value = option(argv[i], "--filter"))) {
+      options.filter = value;
+    } else if ((value = option(argv[i], "--min-time"))) {
+      options.minTime = atof(value);
+    } else if ((value = option(argv[i], "--repetitions"))) {
+      options.repetitions = std::max(1, atoi(value));
+    } else if ((value = option(argv[i], "--json"))) {
+      options.json = value;
+    } else if ((value = option(argv[i], "--baseline"))) {
+      options.baseline = value;
+    } else if ((value = option(argv[i], "--max-regression"))) {
+      options.maxRegression = atof(value);
+    } else if ((value = option(argv[i], "--label"))) {
+      options.label = value;
+    } else {
+      return false;
+    }
+  }
+  return options.minTime > 0;
+}
+}  // namespace
+
+void State::start() {
+  _running = true;
+  _startAllocations = allocationCount;
+  counting = true;
+  _startNs = nowNs();
+}
+
+void State::stop() {
+  if (!_running) {
+    return;
+  }
+  _elapsedNs += nowNs() - _startNs;
+  counting = false;
+  _allocations += allocationCount - _startAllocations;
+  _running = false;
+}
+
+void State::pauseTiming() {
+  stop();
+}
+
+void State::resumeTiming() {
+  start();
+}
+
+Registrar::Registrar(const char* name, Function function) {
+  registry().push_back({ name, function });
+}
+
+}  // namespace bench
+
+// Heap calls from the library and the benchmarks, see Bench.h. operator
+// new is routed through malloc so C++ allocations count too.
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  if (bench::counting) {
+    bench::allocationCount++;
+  }
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  if (bench::counting) {
+    bench::allocationCount++;
+  }
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+  if (bench::counting) {
+    bench::allocationCount++;
+  }
+  return __real_realloc(pointer, size);
+}
+}
+
+void* operator new(size_t size) {
+  void* pointer = malloc(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+  free(pointer);
+}
+
+int main(int argc, char** argv) {
+  bench::Options options;
+  if (!bench::parseOptions(argc, argv, options)) {
+    fprintf(stderr,
+            "usage: %s [--filter=<substring>] [--min-time=<seconds>] [--repetitions=<n>]\n"
+            "          [--json=<results.json>] [--baseline=<baseline.json>] [--max-regression=<percent>]\n"
+            "          [--label=<text>]\n",
+            argv[0]);
+    return 2;
+  }
+
+  // Registration follows link order; runs go by name, so they line up
+  std::vector<bench::Benchmark> benchmarks = bench::registry();
+  std::sort(benchmarks.begin(), benchmarks.end(),
+            [](const bench::Benchmark& a, const bench::Benchmark& b) { return strcmp(a.name, b.name) < 0; });
+
+  std::vector<bench::Result> results;
+  printf("%-40s %12s %14s %10s %10s\n", "Benchmark", "ns/op", "ops/s", "allocs/op", "bytes/op");
+  for (const bench::Benchmark& benchmark : benchmarks) {
+    if (options.filter && !strstr(benchmark.name, options.filter)) {
+      continue;
+    }
+    bench::Result result = bench::run(benchmark, options);
+    printf("%-40s %12.1f %14.0f %10.2f %10.1f\n", result.name, result.nsPerOp,
+           result.nsPerOp > 0 ? 1e9 / result.nsPerOp : 0, result.allocsPerOp, result.bytesPerOp);
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  if (options.json && !bench::writeResults(results, options)) {
+    fprintf(stderr, "Cannot write %s\n", options.json);
+    return 2;
+  }
+  return options.baseline ? bench::compare(results, options) : 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small harness in the style of Google Benchmark, which does not build
+// under PlatformIO's native platform. A benchmark is a function over a
+// State whose loop body is the timed work:
+//
+//   void lightDispatchCommand(bench::State& state) {
+//     for (auto _ : state) {
+//       ...
+//     }
+//     state.setBytesProcessed(state.iterations() * sizeof(PAYLOAD));
+//   }
+//   BENCHMARK("light/dispatch_command", lightDispatchCommand);
+//
+// The loop runs until it has taken the minimum time, and heap
+// allocations made inside it are counted (the env links with
+// -Wl,--wrap=malloc, like the *-alloccheck firmware environments).
+namespace bench {
+
+class State {
+ public:
+  explicit State(uint64_t iterations) : _iterations(iterations) {}
+
+  // What the loop variable holds; the destructor keeps compilers from
+  // warning that it goes unused
+  struct Value {
+    ~Value() {}
+  };
+
+  // Range-for support; starting the loop starts the clock
+  class Iterator {
+   public:
+    Iterator(State* state, uint64_t remaining) : _state(state), _remaining(remaining) {}
+    bool operator!=(const Iterator&) {
+      if (_remaining) {
+        return true;
+      }
+      _state->stop();
+      return false;
+    }
+    void operator++() { _remaining--; }
+    Value operator*() const { return Value(); }
+
+   private:
+    State* _state;
+    uint64_t _remaining;
+  };
+
+  Iterator begin() {
+    start();
+    return Iterator(this, _iterations);
+  }
+  Iterator end() { return Iterator(this, 0); }
+
+  // Leaves per-iteration setup out of the time and the allocation count.
+  void pauseTiming();
+  void resumeTiming();
+
+  // Payload bytes handled in total, reported per iteration.
+  void setBytesProcessed(uint64_t bytes) { _bytes = bytes; }
+
+  uint64_t iterations() const { return _iterations; }
+  uint64_t elapsedNs() const { return _elapsedNs; }
+  uint64_t allocations() const { return _allocations; }
+  uint64_t bytesProcessed() const { return _bytes; }
+
+ private:
+  void start();
+  void stop();
+
+  uint64_t _iterations;
+  uint64_t _elapsedNs = 0;
+  uint64_t _startNs = 0;
+  uint64_t _allocations = 0;
+  uint64_t _startAllocations = 0;
+  uint64_t _bytes = 0;
+  bool _running = false;
+};
+
+typedef void (*Function)(State& state);
+
+struct Registrar {
+  Registrar(const char* name, Function function);
+};
+
+// Keeps the compiler from discarding a result nothing reads.
+template <typename T>
+inline void doNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobberMemory() {
+  asm volatile("" : : : "memory");
+}
+
+}  // namespace bench
+
+#define BENCH_CONCAT_(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT_(a, b)
+#define BENCHMARK(name, function) \
+  static ::bench::Registrar BENCH_CONCAT(benchRegistrar_, __LINE__)(name, function)
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <PubSubClient.h>
+
+#include "Bench.h"
+
+// Drivers shared by the per-device suites. Each suite mirrors its
+// sketch's routes, command tables, state document and status fields
+// (those of the parts that build on the host), so the shared library is
+// measured with the messages that device actually handles.
+namespace fixtures {
+
+// Payloads are copied in before each delivery: the zero-copy parse
+// writes into the client's receive buffer, and the copy stands in for
+// the client reading the packet into it.
+const size_t MAX_MESSAGE = 1024;
+
+// A whole mqttCallback(): route, parse, handler.
+template <typename Dispatcher>
+void dispatch(bench::State& state, Dispatcher& dispatcher, const char* topic, const char* payload) {
+  char topicBuffer[128];
+  strncpy(topicBuffer, topic, sizeof(topicBuffer) - 1);
+  topicBuffer[sizeof(topicBuffer) - 1] = '\0';
+  static uint8_t buffer[MAX_MESSAGE];
+  size_t length = strlen(payload);
+  if (length > sizeof(buffer)) {
+    length = sizeof(buffer);
+  }
+  for (auto _ : state) {
+    memcpy(buffer, payload, length);
+    dispatcher.dispatch(topicBuffer, buffer, length);
+  }
+  state.setBytesProcessed(state.iterations() * length);
+}
+
+// The topic handler alone, on a document parsed once up front (in
+// place, as the dispatcher does). Handlers only read the document, so it
+// can be handed over again and again.
+template <size_t Capacity>
+void handle(bench::State& state, void (*handler)(JsonDocument& doc), const char* payload) {
+  static char buffer[MAX_MESSAGE];
+  strncpy(buffer, payload, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+  StaticJsonDocument<Capacity> doc;
+  deserializeJson(doc, buffer);
+  for (auto _ : state) {
+    handler(doc);
+  }
+}
+
+// A publish path, from document to client; the bytes are what the
+// client was handed.
+inline void publish(bench::State& state, PubSubClient& client, void (*publisher)()) {
+  uint64_t before = client.bytes();
+  for (auto _ : state) {
+    publisher();
+  }
+  state.setBytesProcessed(client.bytes() - before);
+}
+
+}  // namespace fixtures
@@ -0,0 +1,172 @@
+// arduino-uno-gateway: commands, state and status, with the Uno's
+// document capacities. JSON_*_SIZE follows the host's slot size, so the
+// documents hold the same content as on the Uno.
+
+#include <ConnectionManager.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateStore.h>
+
+#include "Fixtures.h"
+
+namespace {
+
+const char DEVICE_TYPE[] = "Arduino Gateway";
+const char FIRMWARE_VERSION[] = "1.0.0";
+
+struct GatewayTraits {
+  static const size_t STATUS_CAPACITY = JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(5) +
+                                        JSON_OBJECT_SIZE(3) + sizeof(DEVICE_TYPE) + sizeof(FIRMWARE_VERSION) + 16;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+
+PubSubClient mqttClient;
+ha::DeviceCore<GatewayTraits> device(mqttClient);
+
+struct GatewayState {
+  bool power = false;
+  float temperature = 22.5;
+  float humidity = 41.0;
+  int analogValue = 512;
+};
+GatewayState gatewayState;
+
+struct GatewayRecord {
+  uint8_t power;
+};
+ha::PersistedState<GatewayRecord> savedState("gateway", 2000, 30000);
+
+struct CommandEffects {
+  bool status = false;
+  bool state = false;
+};
+CommandEffects pendingEffects;
+
+const size_t STATE_CAPACITY = JSON_OBJECT_SIZE(6);
+const size_t MAX_BATCH = 4;
+const size_t COMMAND_CAPACITY =
+    JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(MAX_BATCH) + MAX_BATCH * (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(1));
+
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return true; },
+  []() {},
+  []() { return true; },
+  []() { return mqttClient.connected(); },
+  []() { return false; },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  gatewayState.power = parameters["power"];
+  effects.state = true;
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  gatewayState.power = !gatewayState.power;
+  effects.state = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandGetSensors(JsonObject, CommandEffects& effects) {
+  effects.state = true;
+}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("get_sensors"), commandGetSensors },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+void saveState() {
+  GatewayRecord record = { (uint8_t)(gatewayState.power ? 1 : 0) };
+  savedState.update(record, millis());
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects& effects = pendingEffects;
+  JsonArray batch = doc["commands"];
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
+  }
+  saveState();
+}
+
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+};
+ha::MqttDispatcher<COMMAND_CAPACITY> mqttDispatcher(MQTT_ROUTES);
+
+void GatewayTraits::reportStatus(JsonDocument& status) {
+  char ip[16];
+  ha::formatAddress(IPAddress(192, 168, 1, 177), ip);
+  status["ip_address"] = ip;
+  status["free_memory"] = 512;
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  connection.reportStats(status.createNestedObject("link"));
+  savedState.reportStats(status.createNestedObject("persistence"));
+}
+
+void publishState() {
+  StaticJsonDocument<STATE_CAPACITY> doc;
+  doc["device_id"] = device.deviceId();
+  doc["power"] = gatewayState.power;
+  doc["temperature"] = gatewayState.temperature;
+  doc["humidity"] = gatewayState.humidity;
+  doc["analog_value"] = gatewayState.analogValue;
+  doc["timestamp"] = millis();
+
+  device.publishJson(ha::topic::STATE, doc);
+}
+
+void setUp() {
+  device.begin("arduino_gateway_001");
+  mqttDispatcher.setBaseTopic(device.topics().base());
+}
+
+const char* const SET_POWER = "{\"command\":\"set_power\",\"parameters\":{\"power\":true}}";
+const char* const BATCH =
+    "{\"commands\":[{\"command\":\"set_power\",\"parameters\":{\"power\":true}},"
+    "{\"command\":\"get_sensors\",\"parameters\":{}}]}";
+
+void dispatchSetPower(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), SET_POWER);
+}
+BENCHMARK("gateway/dispatch/set_power", dispatchSetPower);
+
+void dispatchBatch(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), BATCH);
+}
+BENCHMARK("gateway/dispatch/batch", dispatchBatch);
+
+void handleSetPower(bench::State& state) {
+  fixtures::handle<COMMAND_CAPACITY>(state, handleCommand, SET_POWER);
+}
+BENCHMARK("gateway/handle_command/set_power", handleSetPower);
+
+void publishStateJson(bench::State& state) {
+  setUp();
+  fixtures::publish(state, mqttClient, publishState);
+}
+BENCHMARK("gateway/publish_state/json", publishStateJson);
+
+void publishStatus(bench::State& state) {
+  setUp();
+  fixtures::publish(state, mqttClient, []() { device.publishStatus(); });
+}
+BENCHMARK("gateway/publish_status", publishStatus);
+
+}  // namespace
@@ -0,0 +1,223 @@
+// esp32-smart-light: commands, state and status
+
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+
+#include "Fixtures.h"
+
+namespace {
+
+struct LightTraits {
+  static const size_t STATUS_CAPACITY = 1792;
+  static const char* type() { return "Smart Light"; }
+  static const char* firmwareVersion() { return "1.0.0"; }
+  static void reportStatus(JsonDocument& status);
+};
+
+PubSubClient mqttClient;
+ha::DeviceCore<LightTraits> device(mqttClient);
+
+struct DeviceState {
+  bool power = false;
+  int brightness = 100;
+  int color_r = 255;
+  int color_g = 255;
+  int color_b = 255;
+};
+DeviceState deviceState;
+
+struct CommandEffects {
+  bool outputs = false;
+  bool status = false;
+  bool state = false;
+  bool batched = false;
+};
+
+ha::ChangeTracker stateTracker(60000);
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return true; },
+  []() {},
+  []() { return true; },
+  []() { return mqttClient.connected(); },
+  []() { return false; },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+// The sketch hands output changes to its control task; here they land
+// in the state directly
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  deviceState.power = parameters["power"].as<bool>();
+  effects.outputs = true;
+}
+
+void commandSetBrightness(JsonObject parameters, CommandEffects& effects) {
+  deviceState.brightness = parameters["brightness"].as<int>();
+  effects.outputs = true;
+}
+
+void commandSetColor(JsonObject parameters, CommandEffects& effects) {
+  deviceState.color_r = parameters["r"].as<int>();
+  deviceState.color_g = parameters["g"].as<int>();
+  deviceState.color_b = parameters["b"].as<int>();
+  effects.outputs = true;
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  deviceState.power = !deviceState.power;
+  effects.outputs = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("set_brightness"), commandSetBrightness },
+  { ha::fnv1a("set_color"), commandSetColor },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandIgnored },
+  { ha::fnv1a("set_rules"), commandIgnored },
+  { ha::fnv1a("restart"), commandIgnored },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), commandIgnored },
+  { ha::fnv1a("check"), commandIgnored },
+  { ha::fnv1a("grant"), commandIgnored },
+  { ha::fnv1a("retry_after"), commandIgnored },
+};
+
+void finishCommands(const CommandEffects& effects) {
+  if (effects.outputs || effects.state) {
+    stateTracker.markDirty(0xFFFF);
+  }
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects effects;
+  JsonArray batch = doc["commands"];
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    effects.batched = true;
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
+  }
+  finishCommands(effects);
+}
+
+void handleOTACommand(JsonDocument& doc) {
+  CommandEffects effects;
+  ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects);
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  bench::doNotOptimize(doc["seq"].as<uint32_t>());
+}
+
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+ha::MqttDispatcher<512> mqttDispatcher(MQTT_ROUTES);
+
+void LightTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+}
+
+void publishState() {
+  StaticJsonDocument<200> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.set(ha::keys::POWER, deviceState.power);
+  state.set(ha::keys::BRIGHTNESS, deviceState.brightness);
+  state.set(ha::keys::COLOR_R, deviceState.color_r);
+  state.set(ha::keys::COLOR_G, deviceState.color_g);
+  state.set(ha::keys::COLOR_B, deviceState.color_b);
+  state.set(ha::keys::TIMESTAMP, millis());
+
+  uint8_t payload[200];
+  size_t length = state.serialize(payload, sizeof(payload));
+  if (length && mqttClient.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)),
+                                   payload, length)) {
+    stateTracker.published(millis());
+  }
+}
+
+void setUp() {
+  device.begin("smart_light_a1b2c3d4e5f6");
+  mqttDispatcher.setBaseTopic(device.topics().base());
+}
+
+const char* const SET_COLOR = "{\"command\":\"set_color\",\"parameters\":{\"r\":255,\"g\":147,\"b\":41,\"transition\":400}}";
+const char* const BATCH =
+    "{\"commands\":[{\"command\":\"set_power\",\"parameters\":{\"power\":true}},"
+    "{\"command\":\"set_brightness\",\"parameters\":{\"brightness\":60}},"
+    "{\"command\":\"set_color\",\"parameters\":{\"r\":255,\"g\":180,\"b\":90}}],\"transition\":800}";
+
+void dispatchSetColor(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), SET_COLOR);
+}
+BENCHMARK("light/dispatch/set_color", dispatchSetColor);
+
+void dispatchBatch(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), BATCH);
+}
+BENCHMARK("light/dispatch/batch", dispatchBatch);
+
+void handleSetColor(bench::State& state) {
+  fixtures::handle<512>(state, handleCommand, SET_COLOR);
+}
+BENCHMARK("light/handle_command/set_color", handleSetColor);
+
+void handleBatch(bench::State& state) {
+  fixtures::handle<512>(state, handleCommand, BATCH);
+}
+BENCHMARK("light/handle_command/batch", handleBatch);
+
+void publishStateJson(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::Json;
+  fixtures::publish(state, mqttClient, publishState);
+}
+BENCHMARK("light/publish_state/json", publishStateJson);
+
+void publishStateMsgPack(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::MsgPack;
+  fixtures::publish(state, mqttClient, publishState);
+  stateEncoding = ha::StateEncoding::Json;
+}
+BENCHMARK("light/publish_state/msgpack", publishStateMsgPack);
+
+void publishStatus(bench::State& state) {
+  setUp();
+  fixtures::publish(state, mqttClient, []() { device.publishStatus(); });
+}
+BENCHMARK("light/publish_status", publishStatus);
+
+}  // namespace
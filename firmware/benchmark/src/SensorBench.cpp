@@ -0,0 +1,250 @@
+// esp32-sensor-node: commands, windowed readings and status
+
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+#include <WindowStats.h>
+
+#include "Fixtures.h"
+
+namespace {
+
+struct SensorTraits {
+  static const size_t STATUS_CAPACITY = 2048;
+  static const char* type() { return "Sensor Node"; }
+  static const char* firmwareVersion() { return "1.0.0"; }
+  static void reportStatus(JsonDocument& status);
+};
+
+PubSubClient mqttClient;
+ha::DeviceCore<SensorTraits> device(mqttClient);
+
+const char* const DEVICE_ID = "sensor_node_a1b2c3d4e5f6";
+
+struct SensorState {
+  float temperature = 21.4;
+  float humidity = 48.2;
+  float pressure = 1013.6;
+  float light_level = 312;
+  bool motion_detected = false;
+};
+SensorState sensorState;
+
+struct Deadbands {
+  float temperature = 0.2;
+  float humidity = 1.0;
+  float pressure = 0.5;
+  float light_level = 10;
+};
+Deadbands deadbands;
+
+struct CommandEffects {
+  bool status = false;
+  bool sensors = false;
+  bool restart = false;
+};
+
+// One reading a second, smoothed over 10 s, as on the device
+const float SMOOTHING = ha::WindowStats::alphaFor(1000, 10000);
+ha::WindowStats temperatureWindow(SMOOTHING);
+ha::WindowStats humidityWindow(SMOOTHING);
+ha::WindowStats pressureWindow(SMOOTHING);
+ha::WindowStats lightWindow(SMOOTHING);
+
+ha::ChangeTracker sensorTracker(60000);
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return true; },
+  []() {},
+  []() { return true; },
+  []() { return mqttClient.connected(); },
+  []() { return false; },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+void commandGetSensors(JsonObject, CommandEffects& effects) {
+  effects.sensors = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.sensors = true;
+}
+
+void commandSetDeadbands(JsonObject parameters, CommandEffects&) {
+  deadbands.temperature = parameters["temperature"] | deadbands.temperature;
+  deadbands.humidity = parameters["humidity"] | deadbands.humidity;
+  deadbands.pressure = parameters["pressure"] | deadbands.pressure;
+  deadbands.light_level = parameters["light_level"] | deadbands.light_level;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.sensors = true;
+}
+
+void commandRestart(JsonObject, CommandEffects& effects) {
+  effects.restart = true;
+}
+
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("get_sensors"), commandGetSensors },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_deadbands"), commandSetDeadbands },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("restart"), commandRestart },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), commandIgnored },
+  { ha::fnv1a("check"), commandIgnored },
+  { ha::fnv1a("grant"), commandIgnored },
+  { ha::fnv1a("retry_after"), commandIgnored },
+};
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects effects;
+  ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  if (effects.sensors) {
+    sensorTracker.markDirty(0xFFFF);
+  }
+}
+
+void handleOTACommand(JsonDocument& doc) {
+  CommandEffects effects;
+  ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects);
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  bench::doNotOptimize(doc["seq"].as<uint32_t>());
+}
+
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+ha::MqttDispatcher<512> mqttDispatcher(MQTT_ROUTES);
+
+void SensorTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  sensorTracker.reportStats(status.createNestedObject("state_tx"));
+  JsonObject sensors = status.createNestedObject("sensors");
+  sensors["primary"] = "bme280";
+  sensors["sample_interval_ms"] = 1000;
+  JsonObject windows = sensors.createNestedObject("windows");
+  temperatureWindow.reportStats(windows.createNestedObject("temperature"));
+  humidityWindow.reportStats(windows.createNestedObject("humidity"));
+  pressureWindow.reportStats(windows.createNestedObject("pressure"));
+  lightWindow.reportStats(windows.createNestedObject("light_level"));
+}
+
+// A publish window's worth of readings, so setWindow() has data
+void fillWindows() {
+  for (int i = 0; i < 5; i++) {
+    temperatureWindow.add(sensorState.temperature + i * 0.1f);
+    humidityWindow.add(sensorState.humidity - i * 0.2f);
+    pressureWindow.add(sensorState.pressure + i * 0.05f);
+    lightWindow.add(sensorState.light_level + i * 3);
+  }
+}
+
+// Without the window resets of the sketch, so every publish carries the
+// same windows
+void publishSensorData() {
+  StaticJsonDocument<768> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.setDeviceId(DEVICE_ID);
+  state.set(ha::keys::TEMPERATURE, sensorState.temperature);
+  state.set(ha::keys::HUMIDITY, sensorState.humidity);
+  state.set(ha::keys::PRESSURE, sensorState.pressure);
+  state.set(ha::keys::LIGHT_LEVEL, sensorState.light_level);
+  state.set(ha::keys::MOTION_DETECTED, sensorState.motion_detected);
+  state.set(ha::keys::TIMESTAMP, millis());
+  state.setWindow(ha::keys::TEMPERATURE, temperatureWindow);
+  state.setWindow(ha::keys::HUMIDITY, humidityWindow);
+  state.setWindow(ha::keys::PRESSURE, pressureWindow);
+  state.setWindow(ha::keys::LIGHT_LEVEL, lightWindow);
+
+  // OfflineQueue::MAX_PAYLOAD on the device
+  uint8_t payload[512];
+  size_t length = state.serialize(payload, sizeof(payload));
+  if (length && mqttClient.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)),
+                                   payload, length)) {
+    sensorTracker.published(millis());
+  }
+}
+
+void setUp() {
+  device.begin(DEVICE_ID);
+  mqttDispatcher.setBaseTopic(device.topics().base());
+  if (temperatureWindow.count() == 0) {
+    fillWindows();
+  }
+}
+
+const char* const SET_DEADBANDS =
+    "{\"command\":\"set_deadbands\",\"parameters\":{\"temperature\":0.3,\"humidity\":1.5,\"pressure\":0.5,"
+    "\"light_level\":15}}";
+const char* const GET_SENSORS = "{\"command\":\"get_sensors\"}";
+
+void dispatchSetDeadbands(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), SET_DEADBANDS);
+}
+BENCHMARK("sensor/dispatch/set_deadbands", dispatchSetDeadbands);
+
+void dispatchGetSensors(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), GET_SENSORS);
+}
+BENCHMARK("sensor/dispatch/get_sensors", dispatchGetSensors);
+
+void handleSetDeadbands(bench::State& state) {
+  fixtures::handle<512>(state, handleCommand, SET_DEADBANDS);
+}
+BENCHMARK("sensor/handle_command/set_deadbands", handleSetDeadbands);
+
+// One reading into a window
+void windowAdd(bench::State& state) {
+  ha::WindowStats window(SMOOTHING);
+  float value = 20;
+  for (auto _ : state) {
+    window.add(value);
+    value += 0.01f;
+  }
+  bench::doNotOptimize(window.ewma());
+}
+BENCHMARK("sensor/window_add", windowAdd);
+
+void publishSensorJson(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::Json;
+  fixtures::publish(state, mqttClient, publishSensorData);
+}
+BENCHMARK("sensor/publish_state/json", publishSensorJson);
+
+void publishSensorMsgPack(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::MsgPack;
+  fixtures::publish(state, mqttClient, publishSensorData);
+  stateEncoding = ha::StateEncoding::Json;
+}
+BENCHMARK("sensor/publish_state/msgpack", publishSensorMsgPack);
+
+void publishStatus(bench::State& state) {
+  setUp();
+  fixtures::publish(state, mqttClient, []() { device.publishStatus(); });
+}
+BENCHMARK("sensor/publish_status", publishStatus);
+
+}  // namespace
@@ -0,0 +1,198 @@
+// esp8266-switch: commands, state and status
+
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+#include <StateStore.h>
+
+#include "Fixtures.h"
+
+namespace {
+
+struct SwitchTraits {
+  static const size_t STATUS_CAPACITY = 1792;
+  static const char* type() { return "Smart Switch"; }
+  static const char* firmwareVersion() { return "1.0.0"; }
+  static void reportStatus(JsonDocument& status);
+};
+
+PubSubClient mqttClient;
+ha::DeviceCore<SwitchTraits> device(mqttClient);
+
+struct SwitchState {
+  bool power = false;
+};
+SwitchState switchState;
+
+struct SwitchRecord {
+  uint8_t power;
+};
+
+struct CommandEffects {
+  bool relay = false;
+  bool status = false;
+  bool state = false;
+};
+
+ha::ChangeTracker stateTracker(60000);
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+ha::PersistedState<SwitchRecord> savedState("switch", 2000, 30000);
+
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return true; },
+  []() {},
+  []() { return true; },
+  []() { return mqttClient.connected(); },
+  []() { return false; },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  switchState.power = parameters["power"].as<bool>();
+  effects.relay = true;
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  switchState.power = !switchState.power;
+  effects.relay = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandIgnored },
+  { ha::fnv1a("set_rules"), commandIgnored },
+  { ha::fnv1a("restart"), commandIgnored },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), commandIgnored },
+  { ha::fnv1a("check"), commandIgnored },
+  { ha::fnv1a("grant"), commandIgnored },
+  { ha::fnv1a("retry_after"), commandIgnored },
+};
+
+void finishCommands(const CommandEffects& effects) {
+  if (effects.relay) {
+    SwitchRecord record = { (uint8_t)(switchState.power ? 1 : 0) };
+    savedState.update(record, millis());
+    stateTracker.markDirty(0xFFFF);
+  }
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects effects;
+  JsonArray batch = doc["commands"];
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
+  }
+  finishCommands(effects);
+}
+
+void handleOTACommand(JsonDocument& doc) {
+  CommandEffects effects;
+  ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects);
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  bench::doNotOptimize(doc["seq"].as<uint32_t>());
+}
+
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+ha::MqttDispatcher<512> mqttDispatcher(MQTT_ROUTES);
+
+void SwitchTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+  savedState.reportStats(status.createNestedObject("persistence"));
+}
+
+void publishState() {
+  StaticJsonDocument<150> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.set(ha::keys::POWER, switchState.power);
+  state.set(ha::keys::TIMESTAMP, millis());
+
+  uint8_t payload[128];
+  size_t length = state.serialize(payload, sizeof(payload));
+  if (length && mqttClient.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)),
+                                   payload, length)) {
+    stateTracker.published(millis());
+  }
+}
+
+void setUp() {
+  device.begin("smart_switch_a1b2c3d4e5f6");
+  mqttDispatcher.setBaseTopic(device.topics().base());
+}
+
+const char* const TOGGLE = "{\"command\":\"toggle\",\"parameters\":{}}";
+const char* const SET_POWER = "{\"command\":\"set_power\",\"parameters\":{\"power\":true}}";
+
+void dispatchToggle(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), TOGGLE);
+}
+BENCHMARK("switch/dispatch/toggle", dispatchToggle);
+
+void dispatchSetPower(bench::State& state) {
+  setUp();
+  fixtures::dispatch(state, mqttDispatcher, ha::Topic(device.topics(), ha::topic::COMMAND), SET_POWER);
+}
+BENCHMARK("switch/dispatch/set_power", dispatchSetPower);
+
+void handleSetPower(bench::State& state) {
+  fixtures::handle<512>(state, handleCommand, SET_POWER);
+}
+BENCHMARK("switch/handle_command/set_power", handleSetPower);
+
+void publishStateJson(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::Json;
+  fixtures::publish(state, mqttClient, publishState);
+}
+BENCHMARK("switch/publish_state/json", publishStateJson);
+
+void publishStateMsgPack(bench::State& state) {
+  setUp();
+  stateEncoding = ha::StateEncoding::MsgPack;
+  fixtures::publish(state, mqttClient, publishState);
+  stateEncoding = ha::StateEncoding::Json;
+}
+BENCHMARK("switch/publish_state/msgpack", publishStateMsgPack);
+
+void publishStatus(bench::State& state) {
+  setUp();
+  fixtures::publish(state, mqttClient, []() { device.publishStatus(); });
+}
+BENCHMARK("switch/publish_status", publishStatus);
+
+}  // namespace
@@ -0,0 +1,340 @@
+#include <OtaDecoder.h>
+#include <unity.h>
+
+// ImageDecoder against artifacts from the OTA service's own encoders
+// (backend/ota-service/artifacts.py), fed in every chunk size and read
+// through output buffers of several sizes, so each resumable path (the
+// header, the bit reader, a backref, a half-read op) gets cut somewhere.
+//
+// Vectors, from backend/ota-service:
+//   image  = bytes([0xE9]) + b"HomeAutomation firmware image " * 6 + bytes(range(64))
+//   base   = bytes((i * 31 + 7) & 0xFF for i in range(512))
+//   target = base[:200] + b"patched section!" + base[256:512] + base[:64]
+//   HEATSHRINK_ARTIFACT       = container(FLAG_HEATSHRINK, image, heatshrink_compress(image))
+//   DELTA_ARTIFACT            = container(FLAG_DELTA, target, make_delta(base, target), base)
+//   DELTA_HEATSHRINK_ARTIFACT = container(FLAG_DELTA | FLAG_HEATSHRINK, target,
+//                                         heatshrink_compress(make_delta(base, target)), base)
+
+namespace {
+
+const uint8_t HEATSHRINK_ARTIFACT[] = {
+  0x48, 0x41, 0x4f, 0x54, 0x01, 0x0a, 0x05, 0x00, 0xf5, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xf4, 0xd2, 0x2d, 0xf6, 0xdb, 0x2d, 0x06, 0xeb, 0x74, 0xb7, 0xdb, 0x6c, 0x37, 0x4b, 0x4d, 0xbe,
+  0xdd, 0x20, 0xb3, 0x5a, 0x6e, 0x56, 0xdb, 0xbd, 0x86, 0xe5, 0x65, 0x90, 0x5a, 0x6d, 0xb6, 0x1b,
+  0x3d, 0x96, 0x40, 0x07, 0x7e, 0x07, 0x7e, 0x07, 0x7e, 0x07, 0x7e, 0x07, 0x6b, 0x00, 0x80, 0xc0,
+  0xa0, 0x70, 0x48, 0x2c, 0x1a, 0x0f, 0x08, 0x84, 0xc2, 0xa1, 0x70, 0xc8, 0x6c, 0x3a, 0x1f, 0x10,
+  0x88, 0xc4, 0xa2, 0x71, 0x48, 0xac, 0x5a, 0x2f, 0x18, 0x8c, 0xc6, 0xa3, 0x71, 0xc8, 0xec, 0x7a,
+  0x3f, 0x20, 0x90, 0xc8, 0xa4, 0x72, 0x49, 0x2c, 0x9a, 0x4f, 0x28, 0x94, 0xca, 0xa5, 0x72, 0xc9,
+  0x6c, 0xba, 0x5f, 0x30, 0x98, 0xcc, 0xa6, 0x73, 0x49, 0xac, 0xda, 0x6f, 0x38, 0x9c, 0xce, 0xa7,
+  0x73, 0xc9, 0xec, 0xfa, 0x7e,
+};
+const uint8_t DELTA_ARTIFACT[] = {
+  0x48, 0x41, 0x4f, 0x54, 0x02, 0x00, 0x00, 0x00, 0x18, 0x02, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+  0x7a, 0xe0, 0x54, 0xce, 0x35, 0xe0, 0x8f, 0x0c, 0xf4, 0x1d, 0xae, 0x29, 0xcf, 0x6e, 0x28, 0xfc,
+  0x01, 0x00, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x70, 0x61,
+  0x74, 0x63, 0x68, 0x65, 0x64, 0x20, 0x73, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x21, 0x01, 0x00,
+  0x00, 0x00, 0x00, 0x40, 0x01, 0x00, 0x00,
+};
+const uint8_t DELTA_HEATSHRINK_ARTIFACT[] = {
+  0x48, 0x41, 0x4f, 0x54, 0x03, 0x0a, 0x05, 0x00, 0x18, 0x02, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+  0x7a, 0xe0, 0x54, 0xce, 0x35, 0xe0, 0x8f, 0x0c, 0xf4, 0x1d, 0xae, 0x29, 0xcf, 0x6e, 0x28, 0xfc,
+  0x80, 0xc0, 0x00, 0x00, 0xb9, 0x00, 0x10, 0x71, 0x00, 0x06, 0x2b, 0x85, 0x86, 0xe9, 0x63, 0xb4,
+  0x59, 0x6c, 0x92, 0x0b, 0x9d, 0x96, 0xc7, 0x74, 0xb4, 0xdb, 0xed, 0xd2, 0x10, 0x3a, 0x4a, 0x00,
+  0x05, 0x10,
+};
+
+const uint8_t BASE_MD5[16] = {
+  0x7a, 0xe0, 0x54, 0xce, 0x35, 0xe0, 0x8f, 0x0c, 0xf4, 0x1d, 0xae, 0x29, 0xcf, 0x6e, 0x28, 0xfc,
+};
+
+const size_t IMAGE_SIZE = 245;
+const size_t BASE_SIZE = 512;
+const size_t TARGET_SIZE = 536;
+
+uint8_t image[IMAGE_SIZE];
+uint8_t base[BASE_SIZE];
+uint8_t target[TARGET_SIZE];
+
+void buildImages() {
+  static const char TEXT[] = "HomeAutomation firmware image ";
+  size_t length = 0;
+  image[length++] = 0xE9;
+  for (int i = 0; i < 6; i++) {
+    memcpy(image + length, TEXT, sizeof(TEXT) - 1);
+    length += sizeof(TEXT) - 1;
+  }
+  for (int i = 0; i < 64; i++) {
+    image[length++] = i;
+  }
+
+  for (size_t i = 0; i < BASE_SIZE; i++) {
+    base[i] = (i * 31 + 7) & 0xFF;
+  }
+  memcpy(target, base, 200);
+  memcpy(target + 200, "patched section!", 16);
+  memcpy(target + 216, base + 256, 256);
+  memcpy(target + 472, base, 64);
+}
+
+// The running image is base; a board with a gzip-unpacking bootloader or
+// not, and one whose flash reads fail
+bool baseMatches(uint32_t size, const uint8_t* md5) {
+  return size == BASE_SIZE && memcmp(md5, BASE_MD5, sizeof(BASE_MD5)) == 0;
+}
+
+bool readBase(uint32_t offset, uint8_t* out, size_t length) {
+  if (offset > BASE_SIZE || length > BASE_SIZE - offset) {
+    return false;
+  }
+  memcpy(out, base + offset, length);
+  return true;
+}
+
+bool failRead(uint32_t, uint8_t*, size_t) { return false; }
+
+const ha::ImagePlatform BOARD = { false, baseMatches, readBase };
+const ha::ImagePlatform GZIP_BOARD = { true, baseMatches, readBase };
+const ha::ImagePlatform BROKEN_FLASH = { false, baseMatches, failRead };
+
+uint8_t output[1024];
+
+// Feeds the artifact chunkSize bytes at a time the way OtaStream does,
+// reading at most readSize per call; the bytes produced, or -1 on error.
+int decode(ha::ImageDecoder& decoder, const uint8_t* artifact, size_t length, size_t chunkSize, size_t readSize) {
+  decoder.reset();
+  size_t produced = 0;
+  for (size_t offset = 0; offset < length; offset += chunkSize) {
+    decoder.input(artifact + offset, length - offset < chunkSize ? length - offset : chunkSize);
+    do {
+      uint8_t buffer[64];
+      int n = decoder.read(buffer, readSize);
+      if (n < 0) {
+        return -1;
+      }
+      TEST_ASSERT_TRUE_MESSAGE(n > 0 || !decoder.pending(), "decoder stalled with input left");
+      TEST_ASSERT_TRUE(produced + n <= sizeof(output));
+      memcpy(output + produced, buffer, n);
+      produced += n;
+    } while (decoder.pending());
+  }
+  return produced;
+}
+
+// Every chunk size, each of the read sizes
+void decodesAtAnySplit(const ha::ImagePlatform& platform, const uint8_t* artifact, size_t length,
+                       const uint8_t* expected, size_t expectedLength, const char* format) {
+  static const size_t READ_SIZES[] = { 1, 7, 64 };
+  ha::ImageDecoder decoder(platform);
+  for (size_t chunkSize = 1; chunkSize <= length; chunkSize++) {
+    for (size_t readSize : READ_SIZES) {
+      int produced = decode(decoder, artifact, length, chunkSize, readSize);
+      TEST_ASSERT_EQUAL_STRING("", decoder.error());
+      TEST_ASSERT_EQUAL_INT((int)expectedLength, produced);
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, output, expectedLength);
+      TEST_ASSERT_TRUE(decoder.complete());
+      TEST_ASSERT_EQUAL_STRING(format, decoder.formatName());
+    }
+  }
+}
+
+// A container header; patches name base
+void header(uint8_t* out, uint8_t flags, uint8_t windowBits, uint8_t lookaheadBits, uint32_t imageSize) {
+  memset(out, 0, ha::ImageDecoder::HEADER_SIZE);
+  memcpy(out, "HAOT", 4);
+  out[4] = flags;
+  out[5] = windowBits;
+  out[6] = lookaheadBits;
+  for (int i = 0; i < 4; i++) {
+    out[8 + i] = imageSize >> (8 * i);
+    out[12 + i] = (flags & ha::ImageDecoder::DELTA ? BASE_SIZE : 0) >> (8 * i);
+  }
+  if (flags & ha::ImageDecoder::DELTA) {
+    memcpy(out + 16, BASE_MD5, sizeof(BASE_MD5));
+  }
+}
+
+void putLe32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+// Decodes artifact in one chunk and expects it to fail with why
+void rejects(const ha::ImagePlatform& platform, const uint8_t* artifact, size_t length, const char* why) {
+  ha::ImageDecoder decoder(platform);
+  TEST_ASSERT_EQUAL_INT(-1, decode(decoder, artifact, length, length, 64));
+  TEST_ASSERT_EQUAL_STRING(why, decoder.error());
+  TEST_ASSERT_FALSE(decoder.complete());
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_plain_image_passes_through() {
+  decodesAtAnySplit(BOARD, image, sizeof(image), image, sizeof(image), "full");
+}
+
+void test_heatshrink_image() {
+  decodesAtAnySplit(BOARD, HEATSHRINK_ARTIFACT, sizeof(HEATSHRINK_ARTIFACT), image, sizeof(image), "heatshrink");
+}
+
+void test_delta_image() {
+  decodesAtAnySplit(BOARD, DELTA_ARTIFACT, sizeof(DELTA_ARTIFACT), target, sizeof(target), "delta");
+}
+
+void test_delta_heatshrink_image() {
+  decodesAtAnySplit(BOARD, DELTA_HEATSHRINK_ARTIFACT, sizeof(DELTA_HEATSHRINK_ARTIFACT), target, sizeof(target),
+                    "delta+heatshrink");
+}
+
+void test_header_resolves_once_complete() {
+  ha::ImageDecoder decoder(BOARD);
+  decoder.reset();
+  uint8_t buffer[64];
+  for (size_t i = 0; i < ha::ImageDecoder::HEADER_SIZE; i++) {
+    TEST_ASSERT_FALSE(decoder.ready());
+    decoder.input(HEATSHRINK_ARTIFACT + i, 1);
+    TEST_ASSERT_EQUAL_INT(0, decoder.read(buffer, sizeof(buffer)));
+  }
+  TEST_ASSERT_TRUE(decoder.ready());
+  TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE, decoder.imageSize());
+  TEST_ASSERT_FALSE(decoder.complete());
+}
+
+void test_truncated_artifact_is_incomplete() {
+  ha::ImageDecoder decoder(BOARD);
+  decode(decoder, HEATSHRINK_ARTIFACT, sizeof(HEATSHRINK_ARTIFACT) - 4, 16, 64);
+  TEST_ASSERT_EQUAL_STRING("", decoder.error());
+  TEST_ASSERT_FALSE(decoder.complete());
+
+  // A patch cut inside an op
+  decode(decoder, DELTA_ARTIFACT, ha::ImageDecoder::HEADER_SIZE + 3, 16, 64);
+  TEST_ASSERT_FALSE(decoder.complete());
+}
+
+void test_rejects_bad_magic() {
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE];
+  memcpy(artifact, HEATSHRINK_ARTIFACT, sizeof(artifact));
+  artifact[3] = 'X';
+  rejects(BOARD, artifact, sizeof(artifact), "bad container header");
+}
+
+void test_rejects_empty_image() {
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE];
+  header(artifact, ha::ImageDecoder::HEATSHRINK, 8, 4, 0);
+  rejects(BOARD, artifact, sizeof(artifact), "bad container header");
+}
+
+void test_rejects_unknown_flags() {
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE];
+  header(artifact, 0x04, 8, 4, 16);
+  rejects(BOARD, artifact, sizeof(artifact), "unsupported image format");
+}
+
+void test_rejects_heatshrink_window() {
+  // Larger than the window buffer, too small, and a lookahead as wide as the window
+  static const uint8_t WINDOWS[][2] = { { 11, 4 }, { 3, 2 }, { 8, 8 }, { 8, 2 } };
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE];
+  for (const uint8_t* window : WINDOWS) {
+    header(artifact, ha::ImageDecoder::HEATSHRINK, window[0], window[1], 16);
+    rejects(BOARD, artifact, sizeof(artifact), "unsupported heatshrink window");
+  }
+}
+
+void test_rejects_patch_for_another_base() {
+  uint8_t artifact[sizeof(DELTA_ARTIFACT)];
+  memcpy(artifact, DELTA_ARTIFACT, sizeof(artifact));
+  artifact[16] ^= 0xFF;
+  rejects(BOARD, artifact, sizeof(artifact), "delta base mismatch");
+
+  // Same digest, other size
+  memcpy(artifact, DELTA_ARTIFACT, sizeof(artifact));
+  putLe32(artifact + 12, BASE_SIZE + 1);
+  rejects(BOARD, artifact, sizeof(artifact), "delta base mismatch");
+}
+
+void test_rejects_bad_delta_op() {
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE + 1];
+  header(artifact, ha::ImageDecoder::DELTA, 0, 0, 16);
+  artifact[ha::ImageDecoder::HEADER_SIZE] = 0x02;
+  rejects(BOARD, artifact, sizeof(artifact), "bad delta op");
+}
+
+void test_rejects_copy_out_of_range() {
+  // Past the end of the base, starting beyond it, and a length that wraps
+  static const uint32_t COPIES[][2] = { { 500, 20 }, { BASE_SIZE + 1, 1 }, { 16, 0xFFFFFFF8UL } };
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE + 9];
+  for (const uint32_t* copy : COPIES) {
+    header(artifact, ha::ImageDecoder::DELTA, 0, 0, 32);
+    artifact[ha::ImageDecoder::HEADER_SIZE] = 0x01;
+    putLe32(artifact + ha::ImageDecoder::HEADER_SIZE + 1, copy[0]);
+    putLe32(artifact + ha::ImageDecoder::HEADER_SIZE + 5, copy[1]);
+    rejects(BOARD, artifact, sizeof(artifact), "delta copy out of range");
+  }
+}
+
+void test_fails_when_base_read_fails() {
+  rejects(BROKEN_FLASH, DELTA_ARTIFACT, sizeof(DELTA_ARTIFACT), "base image read failed");
+}
+
+void test_rejects_image_overrun() {
+  // More data than the header announces, plain in a patch and compressed
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE + 5 + 6];
+  header(artifact, ha::ImageDecoder::DELTA, 0, 0, 4);
+  artifact[ha::ImageDecoder::HEADER_SIZE] = 0x00;
+  putLe32(artifact + ha::ImageDecoder::HEADER_SIZE + 1, 6);
+  memcpy(artifact + ha::ImageDecoder::HEADER_SIZE + 5, "abcdef", 6);
+  rejects(BOARD, artifact, sizeof(artifact), "image overrun");
+
+  uint8_t compressed[sizeof(HEATSHRINK_ARTIFACT)];
+  memcpy(compressed, HEATSHRINK_ARTIFACT, sizeof(compressed));
+  putLe32(compressed + 8, IMAGE_SIZE - 1);
+  rejects(BOARD, compressed, sizeof(compressed), "image overrun");
+}
+
+void test_gzip_needs_bootloader_support() {
+  static const uint8_t GZIP[] = { 0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00 };
+  rejects(BOARD, GZIP, sizeof(GZIP), "gzip images not supported");
+  decodesAtAnySplit(GZIP_BOARD, GZIP, sizeof(GZIP), GZIP, sizeof(GZIP), "full");
+}
+
+void test_failure_is_final() {
+  uint8_t artifact[ha::ImageDecoder::HEADER_SIZE];
+  header(artifact, 0x04, 8, 4, 16);
+  ha::ImageDecoder decoder(BOARD);
+  TEST_ASSERT_EQUAL_INT(-1, decode(decoder, artifact, sizeof(artifact), sizeof(artifact), 64));
+  decoder.input(image, sizeof(image));
+  uint8_t buffer[64];
+  TEST_ASSERT_EQUAL_INT(-1, decoder.read(buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_STRING("unsupported image format", decoder.error());
+
+  // Until reset
+  TEST_ASSERT_EQUAL_INT((int)sizeof(image), decode(decoder, image, sizeof(image), 64, 64));
+  TEST_ASSERT_TRUE(decoder.complete());
+}
+
+int main(int, char**) {
+  buildImages();
+  UNITY_BEGIN();
+  RUN_TEST(test_plain_image_passes_through);
+  RUN_TEST(test_heatshrink_image);
+  RUN_TEST(test_delta_image);
+  RUN_TEST(test_delta_heatshrink_image);
+  RUN_TEST(test_header_resolves_once_complete);
+  RUN_TEST(test_truncated_artifact_is_incomplete);
+  RUN_TEST(test_rejects_bad_magic);
+  RUN_TEST(test_rejects_empty_image);
+  RUN_TEST(test_rejects_unknown_flags);
+  RUN_TEST(test_rejects_heatshrink_window);
+  RUN_TEST(test_rejects_patch_for_another_base);
+  RUN_TEST(test_rejects_bad_delta_op);
+  RUN_TEST(test_rejects_copy_out_of_range);
+  RUN_TEST(test_fails_when_base_read_fails);
+  RUN_TEST(test_rejects_image_overrun);
+  RUN_TEST(test_gzip_needs_bootloader_support);
+  RUN_TEST(test_failure_is_final);
+  return UNITY_END();
+}
@@ -342,6 +342,69 @@ EOF
     log "INFO" "Build report generated: $report_file"
 }
 
+# Run the host unit tests (benchmark/test, env:test), then benchmark the
+# message hot paths on the host (benchmark/, env:native) and record the
+# numbers with the release. With a stored baseline a run that
+# is slower by more than BENCH_MAX_REGRESSION percent, or allocates where
+# it did not, fails the pipeline.
+run_benchmarks() {
+    local bench_dir="$FIRMWARE_DIR/benchmark"
+    local baseline="$bench_dir/baseline.json"
+    local version=$(echo "$BUILD_CONFIG" | jq -r '.version')
+    local build_number=$(echo "$BUILD_CONFIG" | jq -r '.build_number')
+    local results_dir="$DIST_DIR/benchmarks"
+    local results="$results_dir/bench-$version-$build_number.json"
+    
+    cd "$bench_dir"
+    log "INFO" "Running host unit tests"
+    pio test -e test | tee -a "$LOG_DIR/benchmark.log"
+    local test_status=${PIPESTATUS[0]}
+    if [[ $test_status -ne 0 ]]; then
+        log "ERROR" "Host unit tests failed"
+        return 1
+    fi
+    
+    log "INFO" "Building native benchmarks"
+    mkdir -p "$results_dir"
+    if ! pio run -e native; then
+        log "ERROR" "Benchmark build failed"
+        return 1
+    fi
+    
+    local args=("--json=$results" "--label=$version-$build_number")
+    if [[ -f "$baseline" ]]; then
+        args+=("--baseline=$baseline" "--max-regression=${BENCH_MAX_REGRESSION:-10}")
+    else
+        log "WARN" "No benchmark baseline yet, recording only (see benchmark-baseline)"
+    fi
+    
+    log "INFO" "Running benchmarks"
+    "$bench_dir/.pio/build/native/program" "${args[@]}" | tee -a "$LOG_DIR/benchmark.log"
+    local status=${PIPESTATUS[0]}
+    if [[ $status -eq 1 ]]; then
+        log "ERROR" "Benchmark regression against $baseline, results in $results"
+        return 1
+    elif [[ $status -ne 0 ]]; then
+        log "ERROR" "Benchmark run failed"
+        return 1
+    fi
+    
+    ln -sf "$(basename "$results")" "$results_dir/bench-latest.json"
+    log "INFO" "Benchmark results saved to $results"
+}
+
+# Make the latest recorded benchmark run the baseline later runs are held to
+update_benchmark_baseline() {
+    local latest="$DIST_DIR/benchmarks/bench-latest.json"
+    
+    if [[ ! -f "$latest" ]]; then
+        log "ERROR" "No benchmark results recorded yet, run the benchmark command first"
+        return 1
+    fi
+    cp "$latest" "$FIRMWARE_DIR/benchmark/baseline.json"
+    log "INFO" "Benchmark baseline updated from $(readlink "$latest")"
+}
+
 # Upload firmware to OTA service
 upload_to_ota_service() {
     local ota_service_url="http://localhost:3004"
@@ -433,6 +496,7 @@ main() {
     case $command in
         build)
             build_all
+            run_benchmarks
             increment_build_number
             ;;
         clean)
@@ -443,15 +507,24 @@ main() {
             ;;
         build-and-upload)
             build_all
+            run_benchmarks
             increment_build_number
             upload_to_ota_service
             ;;
+        benchmark)
+            run_benchmarks
+            ;;
+        benchmark-baseline)
+            update_benchmark_baseline
+            ;;
         *)
-            echo "Usage: $0 {build|clean|upload|build-and-upload}"
+            echo "Usage: $0 {build|clean|upload|build-and-upload|benchmark|benchmark-baseline}"
             echo "  build           - Build firmware for all platforms"
             echo "  clean           - Clean build artifacts"
             echo "  upload          - Upload built firmware to OTA service"
             echo "  build-and-upload - Build and upload firmware"
+            echo "  benchmark       - Run the native benchmarks, against the baseline if any"
+            echo "  benchmark-baseline - Keep the latest benchmark run as the baseline"
             exit 1
             ;;
     esac
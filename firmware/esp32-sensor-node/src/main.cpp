@@ -1,19 +1,35 @@
 #include <WiFi.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <OfflineQueue.h>
+#include <SampleRing.h>
+#include <WindowStats.h>
 #include <WiFiManager.h>
 #include <ESPAsyncWebServer.h>
 #include <AsyncElegantOTA.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
 #include <esp_task_wdt.h>
-#include <DHT.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <DhtReader.h>
+#include <EdgeCapture.h>
+#include <Metrics.h>
 #include <Adafruit_BME280.h>
 #include <Wire.h>
-#include <HTTPUpdate.h>
+#ifdef SENSOR_LOW_POWER
+#include <esp_sleep.h>
+#include <esp_wifi.h>
+#include <driver/gpio.h>
+#endif
 
 // Hardware pin definitions
 #define DHT_PIN 4
-#define DHT_TYPE DHT22
 #define MOTION_PIN 5
 #define LIGHT_SENSOR_PIN A0
 #define LED_PIN 2
@@ -31,42 +47,275 @@ const int MQTT_PORT = 1883;
 const char* MQTT_USER = "";
 const char* MQTT_PASSWORD = "";
 
-// Topics
-String TOPIC_BASE = "";
-String TOPIC_STATUS = "";
-String TOPIC_STATE = "";
-String TOPIC_ONLINE = "";
-String TOPIC_COMMAND = "";
-String TOPIC_OTA = "";
-
-// Sensors
-DHT dht(DHT_PIN, DHT_TYPE);
+// Sensors. Only the primary one is read for temperature and humidity:
+// the BME280 when it is fitted (it also gives pressure), else the DHT22.
+// Build with SENSOR_PRIMARY_DHT to keep the DHT22 primary regardless.
+enum class PrimarySensor : uint8_t { Dht, Bme280 };
+ha::DhtReader dht(DHT_PIN, ha::DhtReader::Model::Dht22);
 Adafruit_BME280 bme;
 bool bmeAvailable = false;
+PrimarySensor primarySensor = PrimarySensor::Dht;
+
+// The BME280 runs in forced mode: each sample triggers one conversion
+// and the results are read once the status register says it is done,
+// so the I2C bus is only busy for the register reads. x1 oversampling
+// of all three takes 9.3 ms at most.
+const uint8_t BME_I2C_ADDRESS = 0x76;
+const uint8_t BME_REG_STATUS = 0xF3;
+const uint8_t BME_REG_CTRL_MEAS = 0xF4;
+const uint8_t BME_STATUS_MEASURING = 0x08;
+const uint8_t BME_CTRL_MEAS_FORCED_X1 = 0x25;   // osrs_t x1, osrs_p x1, forced
+const unsigned long BME_CONVERSION_MS = 10;
+const unsigned long BME_TIMEOUT_MS = 50;
+
+// What the status register says; Failed when it could not be read
+enum class BmeStatus : uint8_t { Ready, Measuring, Failed };
+
+// Motion edges are captured in the pin interrupt and published as events
+// on <base>/event as soon as the network task sees them, apart from the
+// telemetry cadence: {"event":"motion","motion":true,"timestamp":...}.
+// Events wait for the broker at most MOTION_EVENT_MAX_AGE; an older one
+// would switch lights for motion long gone.
+const unsigned long MOTION_DEBOUNCE = 100;
+const uint8_t MOTION_EVENT_QUEUE = 4;
+#ifdef SENSOR_LOW_POWER
+const unsigned long MOTION_EVENT_MAX_AGE = 15000;   // a radio bring-up
+#else
+const unsigned long MOTION_EVENT_MAX_AGE = 5000;
+#endif
+ha::EdgeCapture motion(MOTION_PIN, MOTION_DEBOUNCE);
 
-// WiFi and MQTT clients
+// Events not yet published, oldest first (network task)
+ha::EdgeCapture::Event motionEvents[MOTION_EVENT_QUEUE];
+uint8_t motionEventCount = 0;
+uint32_t motionEventsPublished = 0;
+uint32_t motionEventsDropped = 0;
+
+// The sample being taken by the control task
+struct SampleProgress {
+  bool active = false;
+  bool requested = false;   // get_sensors: publish even inside the deadbands
+  bool primaryStarted = false;
+  unsigned long startedAt = 0;
+  uint16_t fresh = 0;       // SensorField bits actually read this time
+};
+uint32_t bmeTimeouts = 0;
+uint32_t bmeErrors = 0;
+
+// WiFi and MQTT clients; the async transport brings its own socket
+#if defined(HA_ASYNC_MQTT)
+ha::MqttClient mqttClient;
+#else
 WiFiClient wifiClient;
-PubSubClient mqttClient(wifiClient);
+ha::MqttClient mqttClient(wifiClient);
+#endif
 AsyncWebServer server(80);
 
-// Device state
+// Topics, connect, online and status plumbing shared with the other devices
+struct SensorTraits {
+  static const size_t STATUS_CAPACITY = 2048;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+ha::DeviceCore<SensorTraits> device(mqttClient);
+
+// Device state; plain data so a copy can live in RTC memory
 struct SensorState {
-  float temperature = 0.0;
-  float humidity = 0.0;
-  float pressure = 0.0;
-  int light_level = 0;
-  bool motion_detected = false;
-  bool online = false;
+  float temperature;
+  float humidity;
+  float pressure;
+  int light_level;
+  bool motion_detected;
+};
+
+// Connection bookkeeping
+struct NetworkState {
   unsigned long lastHeartbeat = 0;
-  unsigned long lastSensorRead = 0;
-  unsigned long lastPublish = 0;
+  unsigned long lastActivity = 0;   // MQTT connect or last command handled
+  unsigned long lastMetrics = 0;
+};
+
+// Metrics also go out on <base>/metrics, for collectors that cannot scrape
+const unsigned long METRICS_INTERVAL = 60000;
+
+// One reading as buffered for the batched /samples topic
+struct Sample {
+  uint32_t timestamp;   // millis() when sampled
+  SensorState state;
+};
+
+SensorState sampledState;           // written by the control task
+SensorState sensorState;            // network task's smoothed reading
+NetworkState networkState;
+
+// Every sample is kept until it has gone out in a batch. Samples are
+// flushed as one message per batch interval; a backlog left by an outage
+// drains one batch at a time, paced so the broker and the TCP window
+// keep up. A failed publish backs off to the normal interval.
+const uint8_t SAMPLE_BATCH_VERSION = 1;
+const size_t SAMPLE_BATCH_MAX = 16;
+const unsigned long SAMPLE_BATCH_INTERVAL = 30000;
+const unsigned long SAMPLE_DRAIN_INTERVAL = 250;
+const unsigned long SAMPLE_RECORD_INTERVAL = 5000;   // one smoothed sample per 5 s
+const size_t SAMPLE_RING_CAPACITY = 120;   // 10 min at 5 s, internal RAM
+#ifdef BOARD_HAS_PSRAM
+const size_t SAMPLE_RING_PSRAM_CAPACITY = 4096;   // ~5.7 h at 5 s
+#endif
+
+Sample sampleStorage[SAMPLE_RING_CAPACITY];
+ha::SampleRing<Sample> sampleRing;   // network task
+bool sampleRingInPsram = false;
+unsigned long lastSampleRecorded = 0;
+bool sampleRecorded = false;
+unsigned long lastBatchAttempt = 0;
+bool lastBatchFailed = false;
+uint32_t sampleBatches = 0;
+uint32_t sampleBatchFailures = 0;
+
+#ifdef SENSOR_LOW_POWER
+// Battery mode (env:esp32dev-battery): light sleep between sample windows,
+// waking on the sample timer or on either edge of MOTION_PIN. The radio is
+// only brought up when a publish is due. MOTION_PIN is not an RTC GPIO, so
+// deep sleep could not wake on it.
+const unsigned long LOW_POWER_COMMAND_WINDOW = 2000;   // stay online for queued commands
+const unsigned long LOW_POWER_MAX_AWAKE = 20000;       // then give up on the radio
+const uint32_t RETAINED_MAGIC = 0x534E4C50;
+
+// Kept in RTC memory that is not cleared on reset, so a brownout or
+// watchdog reset on a sagging battery keeps the AP cache and the
+// published baseline.
+struct RetainedState {
+  uint32_t magic;
+  uint8_t bssid[6];
+  int32_t channel;              // 0 when no AP is cached
+  SensorState published;        // last sample the broker accepted
+  uint32_t cycles;
+  uint32_t radioCycles;
+  uint32_t motionWakes;
+  uint32_t fastReconnects;
+  uint32_t lastAwakeMs;
+  uint32_t maxAwakeMs;
+  uint64_t totalAwakeMs;
+};
+
+RTC_NOINIT_ATTR RetainedState retained;
+SensorState& publishedSensorState = retained.published;
+
+// Current wake cycle
+unsigned long cycleStart = 0;
+bool cycleSampled = false;
+bool cycleUsedRadio = false;
+bool fastJoinTried = false;
+bool fastJoinPending = false;
+
+// Holds the radio off after cycles that could not reach the broker
+ha::Backoff radioBackoff(30000, 900000);
+#else
+SensorState publishedSensorState;   // last sample the broker accepted
+#endif
+
+// Minimum movement before a reading counts as changed; set via "set_deadbands"
+struct SensorDeadbands {
+  float temperature = 0.2;   // degC
+  float humidity = 1.0;      // %RH
+  float pressure = 0.5;      // hPa
+  float light_level = 50;    // ADC counts
+};
+
+SensorDeadbands deadbands;
+
+// Dirty bits for SensorState fields not yet published
+enum SensorField : uint16_t {
+  FIELD_TEMPERATURE = 1 << 0,
+  FIELD_HUMIDITY = 1 << 1,
+  FIELD_PRESSURE = 1 << 2,
+  FIELD_LIGHT_LEVEL = 1 << 3,
+  FIELD_MOTION = 1 << 4,
+  FIELD_ALL = FIELD_TEMPERATURE | FIELD_HUMIDITY | FIELD_PRESSURE | FIELD_LIGHT_LEVEL | FIELD_MOTION
+};
+
+// Sensor data is published on change, plus a keepalive copy every 5 minutes
+const unsigned long SENSOR_KEEPALIVE_INTERVAL = 300000;
+ha::ChangeTracker sensorTracker(SENSOR_KEEPALIVE_INTERVAL);
+
+// Sampling period; the smoothing below is derived from it
+#ifdef SENSOR_LOW_POWER
+const unsigned long SENSOR_READ_INTERVAL = 5000;   // one sample per wake
+#else
+const unsigned long SENSOR_READ_INTERVAL = 1000;
+#endif
+
+// Every sample goes through a per-field window between publishes:
+// sensorState, the deadbands and the sample ring see the EWMA, and each
+// state publish carries the window's min/max/mean and sample count
+// before it starts over. Sampling at 1 Hz thus smooths out the ADC
+// jitter of the light sensor without publishing any more often.
+const unsigned long SENSOR_SMOOTHING_TAU = 10000;   // EWMA time constant
+const float SENSOR_SMOOTHING_ALPHA = ha::WindowStats::alphaFor(SENSOR_READ_INTERVAL, SENSOR_SMOOTHING_TAU);
+ha::WindowStats temperatureWindow(SENSOR_SMOOTHING_ALPHA);
+ha::WindowStats humidityWindow(SENSOR_SMOOTHING_ALPHA);
+ha::WindowStats pressureWindow(SENSOR_SMOOTHING_ALPHA);
+ha::WindowStats lightWindow(SENSOR_SMOOTHING_ALPHA);
+
+// State wire format, negotiated with the backend (see StateEncoding.h)
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+// Task layout: the control task samples the sensors on core 1; the
+// network task owns WiFi and the MQTT client on core 0. They only talk
+// through the two queues below.
+const BaseType_t CONTROL_CORE = 1;
+const BaseType_t NETWORK_CORE = 0;
+const UBaseType_t CONTROL_PRIORITY = 3;
+const UBaseType_t NETWORK_PRIORITY = 1;
+const TickType_t CONTROL_POLL_TICKS = pdMS_TO_TICKS(100);
+const TickType_t NETWORK_POLL_TICKS = pdMS_TO_TICKS(10);
+
+#ifdef SENSOR_LOW_POWER
+// Samples are taken only when the sleep cycle asks, so the control task is
+// never in the middle of a sensor read when the chip goes to sleep
+const bool SAMPLE_ON_TIMER = false;
+#else
+const bool SAMPLE_ON_TIMER = true;
+#endif
+
+#ifdef SENSOR_LOW_POWER
+// The sleep cycle holds unsent readings until the radio is up
+const bool PUBLISH_WHILE_OFFLINE = false;
+#else
+// Offline, publishSensorData() goes to the flash queue for replay
+const bool PUBLISH_WHILE_OFFLINE = true;
+#endif
+
+enum ControlAction : uint8_t {
+  ACTION_SAMPLE,   // get_sensors: publish even inside the deadbands
+  ACTION_WAKE      // start of a low-power cycle
 };
 
-SensorState sensorState;
+struct ControlCommand {
+  ControlAction action;
+};
+
+struct SensorUpdate {
+  Sample sample;
+  bool requested;   // answer to get_sensors: publish even inside the deadbands
+  uint16_t fresh;   // SensorField bits read in this sample; the rest are stale
+};
 
-// OTA update variables
-bool otaInProgress = false;
-String otaUrl = "";
+QueueHandle_t controlQueue;   // ControlCommand: network -> control
+QueueHandle_t sampleQueue;    // SensorUpdate: control -> network, every sample
+
+// Follow-up work asked for by a command. It runs once the command has
+// been read, because the document aliases the MQTT receive buffer and
+// publishing overwrites it.
+struct CommandEffects {
+  bool status = false;
+  bool sensors = false;
+  bool restart = false;
+};
+
+// Firmware download requested on <base>/ota
+ha::OtaStream ota;
 
 // Function declarations
 void setupHardware();
@@ -75,27 +324,103 @@ void setupMQTT();
 void setupOTA();
 void setupTopics();
 void connectToWiFi();
-void connectToMQTT();
+bool connectToMQTT();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void publishStatus();
-void publishSensorData();
-void publishOnlineStatus(bool online);
+bool publishSensorData();
+bool sampleBatchDue(unsigned long now);
+bool publishSampleBatch();
+void setupSampleRing();
 void handleCommand(JsonDocument& doc);
+void commandGetSensors(JsonObject parameters, CommandEffects& effects);
+void commandGetStatus(JsonObject parameters, CommandEffects& effects);
+void commandSetDeadbands(JsonObject parameters, CommandEffects& effects);
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects);
+void commandRestart(JsonObject parameters, CommandEffects& effects);
+void otaActionUpdate(JsonObject request, CommandEffects& effects);
+void otaActionCheck(JsonObject request, CommandEffects& effects);
+void otaActionGrant(JsonObject request, CommandEffects& effects);
+void otaActionRetryAfter(JsonObject request, CommandEffects& effects);
 void handleOTACommand(JsonDocument& doc);
-void readSensors();
-void performOTAUpdate();
+void handleReplayAck(JsonDocument& doc);
+void startSample(SampleProgress& sample, unsigned long now);
+bool serviceSample(SampleProgress& sample, unsigned long now);
+bool bmeTrigger();
+void captureMotionEvents(unsigned long now);
+void publishMotionEvents(unsigned long now);
+BmeStatus bmeStatus();
+void applySample(const SensorUpdate& update);
+void trackSensorChanges();
+void controlTask(void* parameter);
+void networkTask(void* parameter);
+bool radioWanted(unsigned long now);
+#ifdef SENSOR_LOW_POWER
+bool restoreRetainedState();
+void rememberAccessPoint();
+bool readyToSleep(unsigned long now);
+void sleepUntilNextSample();
+void reportPowerStats(JsonObject obj);
+#endif
+
+// MQTT topic routing (suffixes of the device base topic)
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+ha::MqttDispatcher<512> mqttDispatcher(MQTT_ROUTES);
+
+// Commands on <base>/command
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("get_sensors"), commandGetSensors },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_deadbands"), commandSetDeadbands },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("restart"), commandRestart },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+// Actions on <base>/ota
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), otaActionUpdate },
+  { ha::fnv1a("check"), otaActionCheck },
+  { ha::fnv1a("grant"), otaActionGrant },
+  { ha::fnv1a("retry_after"), otaActionRetryAfter },
+};
+static_assert(ha::uniqueCommandHashes(OTA_ACTIONS), "OTA action names collide");
+
+// WiFi/MQTT reconnect state machine, serviced from networkTask()
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return WiFi.status() == WL_CONNECTED; },
+  connectToWiFi,
+  connectToMQTT,
+  []() { return mqttClient.connected(); },
+  []() { return device.connecting(); },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+// Store-and-forward for state published while the broker is out of reach
+const ha::OfflineQueueHooks OFFLINE_QUEUE_HOOKS = {
+  []() { return mqttClient.connected(); },
+  [](const char* topic, const uint8_t* payload, size_t length, bool retained) {
+    return mqttClient.publish(topic, payload, length, retained);
+  },
+};
+ha::OfflineQueue offlineQueue(LittleFS, OFFLINE_QUEUE_HOOKS);
 
 void setup() {
   Serial.begin(115200);
   Serial.println("\n=== Home Automation Sensor Node ===");
   Serial.println("Firmware Version: " + String(FIRMWARE_VERSION));
   
-  // Initialize watchdog
+  // Initialize watchdog; each task subscribes itself
   esp_task_wdt_init(30, true);
-  esp_task_wdt_add(NULL);
+  
+  controlQueue = xQueueCreate(4, sizeof(ControlCommand));
+  sampleQueue = xQueueCreate(8, sizeof(SensorUpdate));
   
   // Setup hardware
   setupHardware();
+  setupSampleRing();
   
   // Generate device ID from MAC
   MAC_ADDRESS = WiFi.macAddress();
@@ -105,10 +430,23 @@ void setup() {
   
   Serial.println("Device ID: " + DEVICE_ID);
   Serial.println("MAC Address: " + MAC_ADDRESS);
+  connection.seed(ha::fnv1aBuffer(MAC_ADDRESS.c_str(), MAC_ADDRESS.length()));
   
   // Setup topics
   setupTopics();
   
+#ifdef SENSOR_LOW_POWER
+  // With a cached AP the radio stays off until there is something to send;
+  // the local web server is unreachable while asleep, so it is not started
+  radioBackoff.seed(ha::fnv1aBuffer(MAC_ADDRESS.c_str(), MAC_ADDRESS.length()));
+  if (!restoreRetainedState()) {
+    setupWiFi();
+    rememberAccessPoint();
+  }
+  
+  // Setup MQTT
+  setupMQTT();
+#else
   // Setup WiFi
   setupWiFi();
   
@@ -117,51 +455,154 @@ void setup() {
   
   // Setup OTA
   setupOTA();
+#endif
+  
+  // Start the control and network tasks
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, NULL, CONTROL_PRIORITY, NULL, CONTROL_CORE);
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, NETWORK_PRIORITY, NULL, NETWORK_CORE);
   
   Serial.println("Setup complete!");
 }
 
 void loop() {
-  // Reset watchdog
-  esp_task_wdt_reset();
+  // Everything runs in controlTask() and networkTask()
+  vTaskDelete(NULL);
+}
+
+void controlTask(void* parameter) {
+  esp_task_wdt_add(NULL);
+  ControlCommand cmd;
+  unsigned long lastSensorRead = 0;
+  bool pending = false;
+  SampleProgress sample;
   
-  // Handle WiFi connection
-  if (WiFi.status() != WL_CONNECTED) {
-    connectToWiFi();
+  for (;;) {
+    esp_task_wdt_reset();
+    
+    // A sample in progress is stepped every tick; sensor I/O never waits
+    TickType_t wait = sample.active ? 1 : CONTROL_POLL_TICKS;
+    if (xQueueReceive(controlQueue, &cmd, wait) == pdTRUE) {
+      pending = true;
+      sample.requested = sample.requested || cmd.action == ACTION_SAMPLE;
+    }
+    
+    // Sample every interval, or right away when asked
+    unsigned long now = millis();
+    if (!sample.active &&
+        (pending || (SAMPLE_ON_TIMER && (lastSensorRead == 0 || now - lastSensorRead >= SENSOR_READ_INTERVAL)))) {
+      pending = false;
+      lastSensorRead = now;
+      startSample(sample, now);
+    }
+    
+    if (sample.active && serviceSample(sample, now)) {
+      SensorUpdate update = { { now, sampledState }, sample.requested, sample.fresh };
+      sample.requested = false;
+      if (xQueueSend(sampleQueue, &update, 0) != pdTRUE) {
+        Serial.println("Sample queue full, sample dropped");
+      }
+    }
   }
+}
+
+void networkTask(void* parameter) {
+  esp_task_wdt_add(NULL);
+  SensorUpdate update;
+  ha::LoopTimer pass;
   
-  // Handle MQTT connection
-  if (!mqttClient.connected()) {
-    connectToMQTT();
-  } else {
-    mqttClient.loop();
-  }
+#ifdef SENSOR_LOW_POWER
+  // First cycle: take a sample straight away
+  ControlCommand wake = { ACTION_WAKE };
+  xQueueSend(controlQueue, &wake, 0);
+#endif
   
-  // Read sensors every 5 seconds
-  unsigned long now = millis();
-  if (now - sensorState.lastSensorRead > 5000) {
-    readSensors();
-    sensorState.lastSensorRead = now;
+  for (;;) {
+    esp_task_wdt_reset();
+    pass.start();
+    
+    // Motion first: it is the one thing here somebody is waiting for
+    unsigned long now = millis();
+    captureMotionEvents(now);
+    
+    // Handle WiFi/MQTT connection without blocking sampling
+    if (radioWanted(now)) {
+      connection.service(now);
+      if (connection.online()) {
+        mqttClient.loop();
+        offlineQueue.service(now);
+      }
+    }
+    publishMotionEvents(now);
+    
+    // Pick up new samples from the control task; this also paces the loop
+    pass.pause();
+    bool received = xQueueReceive(sampleQueue, &update, NETWORK_POLL_TICKS) == pdTRUE;
+    pass.resume();
+    if (received) {
+      applySample(update);
+      trackSensorChanges();
+      if (update.requested) {
+        sensorTracker.markDirty(FIELD_ALL);
+      }
+#ifdef SENSOR_LOW_POWER
+      cycleSampled = true;
+#endif
+    }
+    
+    // Publish sensor data when a reading left its deadband, or as a keepalive
+    now = millis();
+    if ((PUBLISH_WHILE_OFFLINE || mqttClient.connected()) && sensorTracker.due(now)) {
+      publishSensorData();
+    }
+    
+    // Flush buffered samples as one batched message
+    if (sampleBatchDue(now)) {
+      publishSampleBatch();
+    }
+    
+    // Send heartbeat every 60 seconds
+    if (now - networkState.lastHeartbeat > 60000) {
+      device.publishOnline(true);
+      networkState.lastHeartbeat = now;
+    }
+    
+    if (now - networkState.lastMetrics >= METRICS_INTERVAL && device.publishMetrics()) {
+      networkState.lastMetrics = now;
+    }
+    
+    // Report the firmware download, which streams on a task of its own
+    device.reportOta(ota);
+    pass.stop();
+    
+#ifdef SENSOR_LOW_POWER
+    if (readyToSleep(millis())) {
+      sleepUntilNextSample();
+    }
+#endif
   }
-  
-  // Publish sensor data every 30 seconds
-  if (now - sensorState.lastPublish > 30000) {
-    publishSensorData();
-    sensorState.lastPublish = now;
+}
+
+bool radioWanted(unsigned long now) {
+#ifdef SENSOR_LOW_POWER
+  // Keep the radio off unless there is something to send or receive
+  if (connection.online() || !ota.idle()) {
+    return true;
   }
-  
-  // Send heartbeat every 60 seconds
-  if (now - sensorState.lastHeartbeat > 60000) {
-    publishOnlineStatus(true);
-    sensorState.lastHeartbeat = now;
+  // A motion event does not wait for the sample
+  if (motionEventCount && radioBackoff.ready(now)) {
+    cycleUsedRadio = true;
+    return true;
   }
-  
-  // Handle OTA update if requested
-  if (otaInProgress) {
-    performOTAUpdate();
+  // Bring the radio up for a due publish, or before the ring overwrites samples
+  bool ringFilling = sampleRing.size() + SAMPLE_BATCH_MAX >= sampleRing.capacity();
+  if (!cycleSampled || !(sensorTracker.due(now) || ringFilling) || !radioBackoff.ready(now)) {
+    return false;
   }
-  
-  delay(1000);
+  cycleUsedRadio = true;
+  return true;
+#else
+  return true;
+#endif
 }
 
 void setupHardware() {
@@ -170,21 +611,39 @@ void setupHardware() {
   // Initialize EEPROM
   EEPROM.begin(512);
   
+  // Offline queue storage
+  if (LittleFS.begin(true)) {
+    offlineQueue.begin();
+  } else {
+    Serial.println("LittleFS mount failed, offline queue disabled");
+  }
+  
   // Setup pins
   pinMode(LED_PIN, OUTPUT);
   pinMode(BUTTON_PIN, INPUT_PULLUP);
   pinMode(MOTION_PIN, INPUT);
+  motion.begin();
   
-  // Initialize DHT sensor
-  dht.begin();
+  // Initialize DHT sensor on its RMT capture channel
+  if (!dht.begin()) {
+    Serial.println("DHT22 capture channel not available");
+  }
   
-  // Initialize BME280 sensor
-  if (bme.begin(0x76)) {
+  // Initialize BME280 sensor, sleeping between forced conversions
+  Wire.setClock(400000);
+  if (bme.begin(BME_I2C_ADDRESS)) {
     bmeAvailable = true;
+    bme.setSampling(Adafruit_BME280::MODE_FORCED, Adafruit_BME280::SAMPLING_X1, Adafruit_BME280::SAMPLING_X1,
+                    Adafruit_BME280::SAMPLING_X1, Adafruit_BME280::FILTER_OFF);
     Serial.println("BME280 sensor initialized");
   } else {
     Serial.println("BME280 sensor not found, using DHT22 only");
   }
+#ifndef SENSOR_PRIMARY_DHT
+  if (bmeAvailable) {
+    primarySensor = PrimarySensor::Bme280;
+  }
+#endif
   
   Serial.println("Hardware setup complete");
 }
@@ -237,246 +696,597 @@ void setupOTA() {
     request->send(200, "application/json", response);
   });
   
+  // Hot-path latency histograms and counters for a Prometheus scrape
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    ha::MetricsSnapshot snapshot;
+    ha::snapshotMetrics(snapshot);
+    AsyncResponseStream* response = request->beginResponseStream(ha::METRICS_CONTENT_TYPE);
+    ha::writeMetrics(*response, snapshot);
+    request->send(response);
+  });
+  
   server.begin();
   Serial.println("OTA and web server started");
 }
 
 void setupTopics() {
-  TOPIC_BASE = "homeautomation/devices/" + DEVICE_ID;
-  TOPIC_STATUS = TOPIC_BASE + "/status";
-  TOPIC_STATE = TOPIC_BASE + "/state";
-  TOPIC_ONLINE = TOPIC_BASE + "/online";
-  TOPIC_COMMAND = TOPIC_BASE + "/command";
-  TOPIC_OTA = TOPIC_BASE + "/ota";
+  device.begin(DEVICE_ID.c_str());
+  mqttDispatcher.setBaseTopic(device.topics().base());
+  offlineQueue.setBaseTopic(device.topics().base());
 }
 
 void connectToWiFi() {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Connecting to WiFi...");
-    WiFi.begin();
-    
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
-    
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("\nWiFi connected!");
-    } else {
-      Serial.println("\nWiFi connection failed, will retry...");
-    }
+  // Only starts the join; ConnectionManager polls WiFi.status() and
+  // retries with backoff if it does not come up in time.
+  Serial.println("Connecting to WiFi...");
+#ifdef SENSOR_LOW_POWER
+  // The first join of a cycle skips the scan and goes straight to the cached
+  // AP; if that times out the retry falls back to a normal join
+  wifi_config_t conf;
+  WiFi.mode(WIFI_STA);
+  esp_wifi_set_storage(WIFI_STORAGE_RAM);
+  if (!fastJoinTried && retained.channel != 0 &&
+      esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK && conf.sta.ssid[0]) {
+    fastJoinTried = true;
+    fastJoinPending = true;
+    WiFi.begin(reinterpret_cast<const char*>(conf.sta.ssid), reinterpret_cast<const char*>(conf.sta.password),
+               retained.channel, retained.bssid);
+    return;
   }
+  fastJoinPending = false;
+#endif
+  WiFi.begin();
 }
 
-void connectToMQTT() {
-  if (WiFi.status() != WL_CONNECTED) return;
-  
+bool connectToMQTT() {
   Serial.println("Connecting to MQTT...");
   
-  String willTopic = TOPIC_ONLINE;
-  String willMessage = "{\"online\":false}";
-  
-  if (mqttClient.connect(DEVICE_ID.c_str(), MQTT_USER, MQTT_PASSWORD, 
-                        willTopic.c_str(), 1, true, willMessage.c_str())) {
+  if (device.connect(MQTT_USER, MQTT_PASSWORD)) {
     Serial.println("MQTT connected!");
     
-    mqttClient.subscribe(TOPIC_COMMAND.c_str());
-    mqttClient.subscribe(TOPIC_OTA.c_str());
+    // A resumed session still has the subscriptions, and the broker
+    // delivers the QoS1 commands it queued meanwhile (or while asleep)
+    bool resumed = device.resumed();
+    if (!resumed) {
+      device.subscribe(ha::topic::COMMAND);
+      device.subscribe(ha::topic::OTA);
+      device.subscribe(ha::topic::REPLAY);
+    }
     
-    publishOnlineStatus(true);
-    publishStatus();
+#ifdef SENSOR_LOW_POWER
+    if (fastJoinPending) {
+      retained.fastReconnects++;
+      fastJoinPending = false;
+    }
+    rememberAccessPoint();
+    radioBackoff.reset();
+#endif
     
-    sensorState.online = true;
-  } else {
-    Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
-    sensorState.online = false;
+    device.publishOnline(true);
+    if (!resumed || !device.statusCurrent()) {
+      device.publishStatus();
+    }
+    sensorTracker.markDirty(FIELD_ALL);
+    networkState.lastActivity = millis();
+    return true;
   }
-}
-
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String topicStr = String(topic);
-  String message = "";
   
-  for (int i = 0; i < length; i++) {
-    message += (char)payload[i];
+  // The async transport is still waiting for the broker; ConnectionManager
+  // calls back in once it has answered
+  if (device.connecting()) {
+    return false;
   }
   
-  Serial.println("Received [" + topicStr + "]: " + message);
-  
-  StaticJsonDocument<512> doc;
-  DeserializationError error = deserializeJson(doc, message);
-  
-  if (error) {
-    Serial.println("Failed to parse JSON: " + String(error.c_str()));
-    return;
-  }
-  
-  if (topicStr == TOPIC_COMMAND) {
-    handleCommand(doc);
-  } else if (topicStr == TOPIC_OTA) {
-    handleOTACommand(doc);
-  }
+  Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
+  return false;
+}
+
+void mqttCallback(char* topic, byte* payload, unsigned int length) {
+  HA_TIME_SCOPE(MqttCallback);
+  mqttDispatcher.dispatch(topic, payload, length);
 }
 
 void handleCommand(JsonDocument& doc) {
-  String command = doc["command"];
+  CommandEffects effects;
+  const char* command = doc["command"];
+  networkState.lastActivity = millis();
+  
+  if (!ha::dispatchCommand(COMMANDS, command, doc["parameters"], effects)) {
+    Serial.println("Unknown command ignored");
+  }
   
-  if (command == "get_sensors") {
-    readSensors();
+  if (effects.status) {
+    device.publishStatus();
+  }
+  if (effects.sensors) {
     publishSensorData();
-  } else if (command == "get_status") {
-    publishStatus();
-  } else if (command == "restart") {
-    publishOnlineStatus(false);
+  }
+  if (effects.restart) {
+    device.publishOnline(false);
     delay(1000);
     ESP.restart();
   }
 }
 
+void commandGetSensors(JsonObject, CommandEffects&) {
+  // Sampled on the control task; published once the reading arrives
+  ControlCommand cmd = { ACTION_SAMPLE };
+  xQueueSend(controlQueue, &cmd, 0);
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+}
+
+void commandSetDeadbands(JsonObject parameters, CommandEffects&) {
+  deadbands.temperature = parameters["temperature"] | deadbands.temperature;
+  deadbands.humidity = parameters["humidity"] | deadbands.humidity;
+  deadbands.pressure = parameters["pressure"] | deadbands.pressure;
+  deadbands.light_level = parameters["light_level"] | deadbands.light_level;
+  trackSensorChanges();
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.sensors = true;
+}
+
+void commandRestart(JsonObject, CommandEffects& effects) {
+  effects.restart = true;
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  // Our own replay marker, echoed back by the broker
+  offlineQueue.acknowledge(doc["seq"].as<uint32_t>());
+}
+
 void handleOTACommand(JsonDocument& doc) {
-  String action = doc["action"];
-  
-  if (action == "update") {
-    otaUrl = doc["url"].as<String>();
-    Serial.println("OTA update requested: " + otaUrl);
-    otaInProgress = true;
-  } else if (action == "check") {
-    StaticJsonDocument<200> response;
-    response["device_id"] = DEVICE_ID;
-    response["current_version"] = FIRMWARE_VERSION;
-    response["status"] = "ready_for_update";
-    
-    String responseStr;
-    serializeJson(response, responseStr);
-    mqttClient.publish(TOPIC_STATUS.c_str(), responseStr.c_str());
+  CommandEffects effects;
+  if (!ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects)) {
+    Serial.println("Unknown OTA action");
   }
 }
 
-void readSensors() {
-  // Read DHT sensor
-  float temp = dht.readTemperature();
-  float hum = dht.readHumidity();
-  
-  if (!isnan(temp) && !isnan(hum)) {
-    sensorState.temperature = temp;
-    sensorState.humidity = hum;
+void otaActionUpdate(JsonObject request, CommandEffects&) {
+  // "checksum" is the image SHA-256, as the OTA service sends it
+  const char* url = request["url"];
+  Serial.print("OTA update requested: ");
+  Serial.println(url ? url : "(none)");
+  if (ota.start(url, request["checksum"].as<const char*>(), request["size"] | 0,
+                request["start_window"] | 0, request["require_grant"] | false)) {
+    ota.startTask();
   }
-  
-  // Read BME280 if available
-  if (bmeAvailable) {
-    sensorState.temperature = bme.readTemperature();
-    sensorState.humidity = bme.readHumidity();
-    sensorState.pressure = bme.readPressure() / 100.0F; // Convert to hPa
+}
+
+void otaActionCheck(JsonObject, CommandEffects&) {
+  device.publishOtaCheck();
+}
+
+void otaActionGrant(JsonObject request, CommandEffects&) {
+  // Download slot for a scheduled update
+  ota.grant(request["token"]);
+}
+
+void otaActionRetryAfter(JsonObject request, CommandEffects&) {
+  ota.retryAfter(request["seconds"] | 0);
+}
+
+void startSample(SampleProgress& sample, unsigned long now) {
+  // Kick off the primary sensor; if it cannot start (a DHT22 read less
+  // than 2 s ago) the sample keeps its last values
+  sample.active = true;
+  sample.startedAt = now;
+  sample.fresh = 0;
+  if (primarySensor == PrimarySensor::Bme280) {
+    sample.primaryStarted = bmeTrigger();
+  } else {
+    sample.primaryStarted = dht.start(now);
+  }
+}
+
+bool serviceSample(SampleProgress& sample, unsigned long now) {
+  // True once the sample is complete, with sampledState updated
+  if (sample.primaryStarted && primarySensor == PrimarySensor::Bme280) {
+    if (now - sample.startedAt < BME_CONVERSION_MS) {
+      return false;
+    }
+    BmeStatus status = bmeStatus();
+    if (status == BmeStatus::Measuring) {
+      if (now - sample.startedAt < BME_TIMEOUT_MS) {
+        return false;
+      }
+      bmeTimeouts++;
+    } else if (status == BmeStatus::Failed) {
+      // The data registers would only repeat the last conversion
+      bmeErrors++;
+    } else {
+      sampledState.temperature = bme.readTemperature();
+      sampledState.humidity = bme.readHumidity();
+      sampledState.pressure = bme.readPressure() / 100.0F; // Convert to hPa
+      sample.fresh |= FIELD_TEMPERATURE | FIELD_HUMIDITY | FIELD_PRESSURE;
+    }
+  } else if (sample.primaryStarted) {
+    ha::DhtReader::Result result = dht.service(now);
+    if (result == ha::DhtReader::Result::Busy) {
+      return false;
+    }
+    if (result == ha::DhtReader::Result::Ready) {
+      sampledState.temperature = dht.temperature();
+      sampledState.humidity = dht.humidity();
+      sample.fresh |= FIELD_TEMPERATURE | FIELD_HUMIDITY;
+    }
   }
   
   // Read light sensor
-  sensorState.light_level = analogRead(LIGHT_SENSOR_PIN);
+  sampledState.light_level = analogRead(LIGHT_SENSOR_PIN);
   
   // Read motion sensor
-  sensorState.motion_detected = digitalRead(MOTION_PIN);
+  sampledState.motion_detected = digitalRead(MOTION_PIN);
+  sample.fresh |= FIELD_LIGHT_LEVEL | FIELD_MOTION;
+  
+  sample.active = false;
+  return true;
+}
+
+void captureMotionEvents(unsigned long now) {
+  ha::EdgeCapture::Event event;
+  while (motion.poll(event, now)) {
+    // A full queue gives up the oldest: the newest says where motion is
+    if (motionEventCount == MOTION_EVENT_QUEUE) {
+      memmove(motionEvents, motionEvents + 1, sizeof(motionEvents[0]) * (MOTION_EVENT_QUEUE - 1));
+      motionEventCount--;
+      motionEventsDropped++;
+    }
+    motionEvents[motionEventCount++] = event;
+  }
+}
+
+void publishMotionEvents(unsigned long now) {
+  HA_ASSERT_NO_ALLOC("publishMotionEvents");
+  uint8_t done = 0;
+  while (done < motionEventCount) {
+    const ha::EdgeCapture::Event& event = motionEvents[done];
+    if (now - event.at > MOTION_EVENT_MAX_AGE) {
+      motionEventsDropped++;
+    } else {
+      if (!mqttClient.connected()) {
+        break;
+      }
+      char payload[64];
+      snprintf(payload, sizeof(payload), "{\"event\":\"motion\",\"motion\":%s,\"timestamp\":%lu}",
+               event.level ? "true" : "false", (unsigned long)event.at);
+      if (!device.publish(ha::topic::EVENT, payload)) {
+        break;
+      }
+      motionEventsPublished++;
+    }
+    done++;
+  }
+  if (done) {
+    memmove(motionEvents, motionEvents + done, sizeof(motionEvents[0]) * (motionEventCount - done));
+    motionEventCount -= done;
+  }
+}
+
+bool bmeTrigger() {
+  // Writing the mode starts one conversion, after which the chip sleeps
+  Wire.beginTransmission(BME_I2C_ADDRESS);
+  Wire.write(BME_REG_CTRL_MEAS);
+  Wire.write(BME_CTRL_MEAS_FORCED_X1);
+  return Wire.endTransmission() == 0;
 }
 
-void publishSensorData() {
-  StaticJsonDocument<400> doc;
-  doc["device_id"] = DEVICE_ID;
-  doc["temperature"] = sensorState.temperature;
-  doc["humidity"] = sensorState.humidity;
-  doc["pressure"] = sensorState.pressure;
-  doc["light_level"] = sensorState.light_level;
-  doc["motion_detected"] = sensorState.motion_detected;
-  doc["timestamp"] = millis();
+BmeStatus bmeStatus() {
+  Wire.beginTransmission(BME_I2C_ADDRESS);
+  Wire.write(BME_REG_STATUS);
+  if (Wire.endTransmission(false) != 0 || Wire.requestFrom(BME_I2C_ADDRESS, (uint8_t)1) != 1) {
+    return BmeStatus::Failed;
+  }
+  return Wire.read() & BME_STATUS_MEASURING ? BmeStatus::Measuring : BmeStatus::Ready;
+}
+
+void applySample(const SensorUpdate& update) {
+  // Fresh readings feed their windows; a skipped or failed read (a DHT22
+  // asked again within 2 s) leaves the window and the smoothed value alone
+  const SensorState& raw = update.sample.state;
+  if (update.fresh & FIELD_TEMPERATURE) {
+    temperatureWindow.add(raw.temperature);
+  }
+  if (update.fresh & FIELD_HUMIDITY) {
+    humidityWindow.add(raw.humidity);
+  }
+  if (update.fresh & FIELD_PRESSURE) {
+    pressureWindow.add(raw.pressure);
+  }
+  if (update.fresh & FIELD_LIGHT_LEVEL) {
+    lightWindow.add(raw.light_level);
+  }
   
-  String message;
-  serializeJson(doc, message);
+  if (temperatureWindow.seeded()) {
+    sensorState.temperature = temperatureWindow.ewma();
+  }
+  if (humidityWindow.seeded()) {
+    sensorState.humidity = humidityWindow.ewma();
+  }
+  if (pressureWindow.seeded()) {
+    sensorState.pressure = pressureWindow.ewma();
+  }
+  if (lightWindow.seeded()) {
+    sensorState.light_level = lroundf(lightWindow.ewma());
+  }
+  sensorState.motion_detected = raw.motion_detected;
   
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATE.c_str(), message.c_str());
+  // The ring keeps the batch rate it had before faster sampling
+  unsigned long at = update.sample.timestamp;
+  if (update.requested || !sampleRecorded || at - lastSampleRecorded >= SAMPLE_RECORD_INTERVAL) {
+    Sample smoothed = { update.sample.timestamp, sensorState };
+    sampleRing.push(smoothed);
+    lastSampleRecorded = at;
+    sampleRecorded = true;
   }
 }
 
-void publishStatus() {
-  StaticJsonDocument<300> doc;
-  doc["device_id"] = DEVICE_ID;
-  doc["device_type"] = DEVICE_TYPE;
-  doc["firmware_version"] = FIRMWARE_VERSION;
-  doc["mac_address"] = MAC_ADDRESS;
-  doc["ip_address"] = WiFi.localIP().toString();
-  doc["online"] = sensorState.online;
-  doc["wifi_rssi"] = WiFi.RSSI();
-  doc["free_heap"] = ESP.getFreeHeap();
-  doc["uptime"] = millis();
+void trackSensorChanges() {
+  // Compare against what was last published so slow drift still reports
+  const SensorState& last = publishedSensorState;
   
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATUS.c_str(), message.c_str(), true);
+  if (ha::outsideDeadband(sensorState.temperature, last.temperature, deadbands.temperature)) {
+    sensorTracker.markDirty(FIELD_TEMPERATURE);
+  }
+  if (ha::outsideDeadband(sensorState.humidity, last.humidity, deadbands.humidity)) {
+    sensorTracker.markDirty(FIELD_HUMIDITY);
+  }
+  if (ha::outsideDeadband(sensorState.pressure, last.pressure, deadbands.pressure)) {
+    sensorTracker.markDirty(FIELD_PRESSURE);
+  }
+  if (ha::outsideDeadband(sensorState.light_level, last.light_level, deadbands.light_level)) {
+    sensorTracker.markDirty(FIELD_LIGHT_LEVEL);
+  }
+  if (sensorState.motion_detected != last.motion_detected) {
+    sensorTracker.markDirty(FIELD_MOTION);
   }
 }
 
-void publishOnlineStatus(bool online) {
-  StaticJsonDocument<100> doc;
-  doc["online"] = online;
-  doc["timestamp"] = millis();
+bool publishSensorData() {
+  HA_ASSERT_NO_ALLOC("publishSensorData");
+  StaticJsonDocument<768> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.setDeviceId(DEVICE_ID.c_str());
+  state.set(ha::keys::TEMPERATURE, sensorState.temperature);
+  state.set(ha::keys::HUMIDITY, sensorState.humidity);
+  state.set(ha::keys::PRESSURE, sensorState.pressure);
+  state.set(ha::keys::LIGHT_LEVEL, sensorState.light_level);
+  state.set(ha::keys::MOTION_DETECTED, sensorState.motion_detected);
+  state.set(ha::keys::TIMESTAMP, millis());
+  state.setWindow(ha::keys::TEMPERATURE, temperatureWindow);
+  state.setWindow(ha::keys::HUMIDITY, humidityWindow);
+  state.setWindow(ha::keys::PRESSURE, pressureWindow);
+  state.setWindow(ha::keys::LIGHT_LEVEL, lightWindow);
   
-  String message;
-  serializeJson(doc, message);
+  uint8_t payload[ha::OfflineQueue::MAX_PAYLOAD];
+  size_t length = state.serialize(payload, sizeof(payload));
   
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_ONLINE.c_str(), message.c_str(), true);
+  // Offline (or while older messages are still queued) this goes to flash
+  if (length == 0 || !offlineQueue.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload, length)) {
+    return false;
   }
   
-  sensorState.online = online;
+  publishedSensorState = sensorState;
+  sensorTracker.published(millis());
+  temperatureWindow.reset();
+  humidityWindow.reset();
+  pressureWindow.reset();
+  lightWindow.reset();
+  return true;
 }
 
-void performOTAUpdate() {
-  if (otaUrl.length() == 0) {
-    otaInProgress = false;
-    return;
+void setupSampleRing() {
+#ifdef BOARD_HAS_PSRAM
+  // One allocation at boot; the ring itself never allocates
+  if (psramFound()) {
+    Sample* storage = static_cast<Sample*>(ps_malloc(SAMPLE_RING_PSRAM_CAPACITY * sizeof(Sample)));
+    if (storage) {
+      sampleRing.begin(storage, SAMPLE_RING_PSRAM_CAPACITY);
+      sampleRingInPsram = true;
+      return;
+    }
+  }
+#endif
+  sampleRing.begin(sampleStorage, SAMPLE_RING_CAPACITY);
+}
+
+bool sampleBatchDue(unsigned long now) {
+  if (sampleRing.empty() || !mqttClient.connected()) {
+    return false;
   }
   
-  Serial.println("Starting OTA update from: " + otaUrl);
+  unsigned long wait = SAMPLE_BATCH_INTERVAL;
+#ifdef SENSOR_LOW_POWER
+  // The radio is only up briefly, so flush whenever it is
+  wait = SAMPLE_DRAIN_INTERVAL;
+#endif
+  if (sampleRing.size() > SAMPLE_BATCH_MAX) {
+    wait = SAMPLE_DRAIN_INTERVAL;
+  }
+  if (lastBatchFailed) {
+    wait = SAMPLE_BATCH_INTERVAL;
+  }
+  return now - lastBatchAttempt >= wait;
+}
+
+bool publishSampleBatch() {
+  HA_ASSERT_NO_ALLOC("publishSampleBatch");
+  size_t count = sampleRing.size() < SAMPLE_BATCH_MAX ? sampleRing.size() : SAMPLE_BATCH_MAX;
   
-  StaticJsonDocument<200> status;
-  status["device_id"] = DEVICE_ID;
-  status["status"] = "updating";
-  status["progress"] = 0;
+  // Rows are [t, tc*100, rh*10, pa*10, lx, mo]; "t" at the top level is the
+  // publish time on the same clock, so the backend can date each row
+  StaticJsonDocument<2048> doc;
+  doc["v"] = SAMPLE_BATCH_VERSION;
+  doc["id"] = DEVICE_ID.c_str();
+  doc["t"] = millis();
+  JsonArray rows = doc.createNestedArray("s");
+  for (size_t i = 0; i < count; i++) {
+    const Sample& sample = sampleRing.at(i);
+    JsonArray row = rows.createNestedArray();
+    row.add(sample.timestamp);
+    row.add(lroundf(sample.state.temperature * 100));
+    row.add(lroundf(sample.state.humidity * 10));
+    row.add(lroundf(sample.state.pressure * 10));
+    row.add(sample.state.light_level);
+    row.add(sample.state.motion_detected ? 1 : 0);
+  }
   
-  String statusStr;
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
+  bool binary = stateEncoding == ha::StateEncoding::MsgPack;
+  uint8_t payload[1024];
+  size_t length = binary ? serializeMsgPack(doc, payload, sizeof(payload))
+                         : serializeJson(doc, reinterpret_cast<char*>(payload), sizeof(payload));
   
-  WiFiClient client;
-  t_httpUpdate_return ret = httpUpdate.update(client, otaUrl);
+  // Streamed, so the batch does not have to fit PubSubClient's packet buffer
+  lastBatchAttempt = millis();
+  ha::Topic topic(device.topics(), binary ? ha::topic::SAMPLES_BIN : ha::topic::SAMPLES);
+  lastBatchFailed = length == 0 || !mqttClient.beginPublish(topic, length, false) ||
+                    mqttClient.write(payload, length) != length || !mqttClient.endPublish();
+  if (lastBatchFailed) {
+    sampleBatchFailures++;
+    return false;
+  }
   
-  switch (ret) {
-    case HTTP_UPDATE_FAILED:
-      Serial.println("OTA Update failed: " + httpUpdate.getLastErrorString());
-      status["status"] = "failed";
-      status["error"] = httpUpdate.getLastErrorString();
-      break;
-      
-    case HTTP_UPDATE_NO_UPDATES:
-      Serial.println("No OTA updates available");
-      status["status"] = "no_update";
-      break;
-      
-    case HTTP_UPDATE_OK:
-      Serial.println("OTA Update successful, restarting...");
-      status["status"] = "success";
-      break;
+  sampleRing.consume(count);
+  sampleBatches++;
+  return true;
+}
+
+void SensorTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+#if defined(HA_ASYNC_MQTT)
+  mqttClient.reportStats(status.createNestedObject("mqtt_tx"));
+#endif
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  sensorTracker.reportStats(status.createNestedObject("state_tx"));
+  offlineQueue.reportStats(status.createNestedObject("offline_queue"));
+  ota.reportStats(status.createNestedObject("ota"));
+  JsonObject sensors = status.createNestedObject("sensors");
+  sensors["primary"] = primarySensor == PrimarySensor::Bme280 ? "bme280" : "dht22";
+  sensors["bme_timeouts"] = bmeTimeouts;
+  sensors["bme_errors"] = bmeErrors;
+  dht.reportStats(sensors.createNestedObject("dht"));
+  sensors["sample_interval_ms"] = SENSOR_READ_INTERVAL;
+  JsonObject windows = sensors.createNestedObject("windows");
+  temperatureWindow.reportStats(windows.createNestedObject("temperature"));
+  humidityWindow.reportStats(windows.createNestedObject("humidity"));
+  pressureWindow.reportStats(windows.createNestedObject("pressure"));
+  lightWindow.reportStats(windows.createNestedObject("light_level"));
+  JsonObject motionStats = sensors.createNestedObject("motion");
+  motion.reportStats(motionStats);
+  motionStats["published"] = motionEventsPublished;
+  motionStats["dropped"] = motionEventsDropped;
+  JsonObject samples = status.createNestedObject("samples");
+  sampleRing.reportStats(samples);
+  samples["psram"] = sampleRingInPsram;
+  samples["batches"] = sampleBatches;
+  samples["batch_failures"] = sampleBatchFailures;
+#ifdef SENSOR_LOW_POWER
+  reportPowerStats(status.createNestedObject("power"));
+#endif
+}
+
+#ifdef SENSOR_LOW_POWER
+bool restoreRetainedState() {
+  // RTC_NOINIT memory holds garbage after power-on
+  if (esp_reset_reason() == ESP_RST_POWERON || retained.magic != RETAINED_MAGIC) {
+    memset(&retained, 0, sizeof(retained));
+    retained.magic = RETAINED_MAGIC;
+    return false;
   }
   
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
+  Serial.println("Retained state restored, AP channel " + String(retained.channel));
+  return retained.channel != 0;
+}
+
+void rememberAccessPoint() {
+  const uint8_t* bssid = WiFi.BSSID();
+  if (WiFi.status() == WL_CONNECTED && bssid) {
+    memcpy(retained.bssid, bssid, sizeof(retained.bssid));
+    retained.channel = WiFi.channel();
+  }
+}
+
+bool readyToSleep(unsigned long now) {
+  if (!cycleSampled || !ota.idle()) {
+    return false;
+  }
   
-  otaInProgress = false;
-  otaUrl = "";
+  // Radio trouble: sleep anyway and hold the radio off for a while; the
+  // unpublished sample stays dirty and goes out on a later cycle
+  if (now - cycleStart >= LOW_POWER_MAX_AWAKE) {
+    if (!connection.online()) {
+      radioBackoff.failed(now);
+    }
+    return true;
+  }
   
-  if (ret == HTTP_UPDATE_OK) {
-    delay(2000);
-    ESP.restart();
+  if (connection.online()) {
+    return !sensorTracker.due(now) && (sampleRing.empty() || lastBatchFailed) && offlineQueue.empty() &&
+           !motionEventCount && device.flushed() && now - networkState.lastActivity >= LOW_POWER_COMMAND_WINDOW;
   }
-}
\ No newline at end of file
+  return !radioWanted(now);
+}
+
+void sleepUntilNextSample() {
+  unsigned long now = millis();
+  uint32_t awakeMs = now - cycleStart;
+  retained.cycles++;
+  retained.lastAwakeMs = awakeMs;
+  retained.totalAwakeMs += awakeMs;
+  if (awakeMs > retained.maxAwakeMs) {
+    retained.maxAwakeMs = awakeMs;
+  }
+  if (cycleUsedRadio) {
+    retained.radioCycles++;
+  }
+  
+  // Radio fully off; the next cycle reconnects through the AP cache
+  if (WiFi.getMode() != WIFI_OFF) {
+    mqttClient.disconnect();
+    WiFi.disconnect(true);
+    WiFi.mode(WIFI_OFF);
+    connection.suspend(now);
+  }
+  
+  // Wake for the next sample window, or on a MOTION_PIN edge in either
+  // direction (the level that would wake us is the one the pin is not at)
+  unsigned long sleepMs = awakeMs < SENSOR_READ_INTERVAL ? SENSOR_READ_INTERVAL - awakeMs : 1;
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000ULL);
+  gpio_wakeup_enable((gpio_num_t)MOTION_PIN, digitalRead(MOTION_PIN) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  Serial.flush();
+  
+  esp_light_sleep_start();
+  
+  // RAM and both tasks resume here; millis() includes the time asleep
+  cycleStart = millis();
+  cycleSampled = false;
+  cycleUsedRadio = false;
+  fastJoinTried = false;
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+    retained.motionWakes++;
+  }
+  
+  ControlCommand wake = { ACTION_WAKE };
+  xQueueSend(controlQueue, &wake, 0);
+}
+
+void reportPowerStats(JsonObject obj) {
+  obj["mode"] = "light_sleep";
+  obj["sample_interval_ms"] = SENSOR_READ_INTERVAL;
+  obj["cycles"] = retained.cycles;
+  obj["radio_cycles"] = retained.radioCycles;
+  obj["motion_wakes"] = retained.motionWakes;
+  obj["fast_reconnects"] = retained.fastReconnects;
+  obj["last_awake_ms"] = retained.lastAwakeMs;
+  obj["max_awake_ms"] = retained.maxAwakeMs;
+  obj["avg_awake_ms"] = retained.cycles ? (uint32_t)(retained.totalAwakeMs / retained.cycles) : 0;
+}
+#endif
@@ -1,19 +1,41 @@
 #include <WiFi.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <OfflineQueue.h>
+#include <TopicGroups.h>
+#include <LocalRules.h>
+#include <Metrics.h>
+#include <StateStore.h>
+#include <FastBoot.h>
+#include <PerceptualCurve.h>
 #include <WiFiManager.h>
 #include <ESPAsyncWebServer.h>
 #include <AsyncElegantOTA.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
 #include <esp_task_wdt.h>
+#include <driver/ledc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
 // Hardware pin definitions
 #define LED_PIN 2
+#define LED_R_PIN 25
+#define LED_G_PIN 26
+#define LED_B_PIN 27
 #define BUTTON_PIN 0
 #define RELAY_PIN 4
-#define PWM_CHANNEL 0
+#define PWM_CHANNEL 0      // onboard LED, follows brightness only
+#define PWM_CHANNEL_R 1
+#define PWM_CHANNEL_G 2
+#define PWM_CHANNEL_B 3
 #define PWM_FREQ 5000
-#define PWM_RESOLUTION 8
+#define PWM_RESOLUTION 13  // the most LEDC allows at 5 kHz
 
 // Device configuration
 const char* DEVICE_TYPE = "Smart Light";
@@ -27,19 +49,24 @@ const int MQTT_PORT = 1883;
 const char* MQTT_USER = "";  // Add if authentication is required
 const char* MQTT_PASSWORD = "";
 
-// Topics
-String TOPIC_BASE = "";
-String TOPIC_STATUS = "";
-String TOPIC_STATE = "";
-String TOPIC_ONLINE = "";
-String TOPIC_COMMAND = "";
-String TOPIC_OTA = "";
-
-// WiFi and MQTT clients
+// WiFi and MQTT clients; the async transport brings its own socket
+#if defined(HA_ASYNC_MQTT)
+ha::MqttClient mqttClient;
+#else
 WiFiClient wifiClient;
-PubSubClient mqttClient(wifiClient);
+ha::MqttClient mqttClient(wifiClient);
+#endif
 AsyncWebServer server(80);
 
+// Topics, connect, online and status plumbing shared with the other devices
+struct LightTraits {
+  static const size_t STATUS_CAPACITY = 2048;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+ha::DeviceCore<LightTraits> device(mqttClient);
+
 // Device state
 struct DeviceState {
   bool power = false;
@@ -47,57 +74,274 @@ struct DeviceState {
   int color_r = 255;
   int color_g = 255;
   int color_b = 255;
-  bool online = false;
+};
+
+// Connection bookkeeping
+struct NetworkState {
   unsigned long lastHeartbeat = 0;
-  unsigned long lastStateUpdate = 0;
+  unsigned long lastMetrics = 0;
+};
+
+// Metrics also go out on <base>/metrics, for collectors that cannot scrape
+const unsigned long METRICS_INTERVAL = 60000;
+
+// What survives a reboot; bytes only, so it compares and stores as-is
+struct LightRecord {
+  uint8_t power;
+  uint8_t brightness;
+  uint8_t color_r;
+  uint8_t color_g;
+  uint8_t color_b;
 };
 
-DeviceState deviceState;
+DeviceState deviceState;     // owned by the control task, drives the outputs
+DeviceState reportedState;   // network task's copy, what publishState() sends
+DeviceState batchBase;       // control task: the outputs before the open batch
+bool batchOpen = false;      // control task
+NetworkState networkState;
+
+// Dirty bits for DeviceState fields not yet published
+enum StateField : uint16_t {
+  FIELD_POWER = 1 << 0,
+  FIELD_BRIGHTNESS = 1 << 1,
+  FIELD_COLOR = 1 << 2,
+  FIELD_ALL = FIELD_POWER | FIELD_BRIGHTNESS | FIELD_COLOR
+};
+
+// State is published on change, plus a keepalive copy every 5 minutes
+const unsigned long STATE_KEEPALIVE_INTERVAL = 300000;
+ha::ChangeTracker stateTracker(STATE_KEEPALIVE_INTERVAL);   // network task
+ha::ChangeTracker outputTracker(0);                         // control task
+
+// Saved state is written once commands settle, not on every change
+const unsigned long STATE_SAVE_SETTLE = 2000;
+const unsigned long STATE_SAVE_MAX_DELAY = 30000;
+ha::PersistedState<LightRecord> savedState("light", STATE_SAVE_SETTLE, STATE_SAVE_MAX_DELAY);   // control task
+
+// State wire format, negotiated with the backend (see StateEncoding.h)
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
 
 // Button handling
-volatile bool buttonPressed = false;
 unsigned long lastButtonPress = 0;
 const unsigned long DEBOUNCE_DELAY = 50;
 
-// OTA update variables
-bool otaInProgress = false;
-String otaUrl = "";
+// Light output. Levels are perceptual lightness in 8.8 fixed point and go
+// through the CIE curve (built at compile time) to 13-bit duty.
+const uint8_t LIGHT_CHANNELS = 4;
+const uint8_t LIGHT_PWM_CHANNELS[LIGHT_CHANNELS] = { PWM_CHANNEL, PWM_CHANNEL_R, PWM_CHANNEL_G, PWM_CHANNEL_B };
+const uint16_t PWM_MAX_DUTY = (1 << PWM_RESOLUTION) - 1;
+constexpr ha::DutyTable<256> LIGHT_CURVE = ha::perceptualCurve(PWM_MAX_DUTY);
+
+// Transitions run as a chain of short LEDC hardware fades, so the duty
+// ramps without CPU work in between and the curve is followed piecewise.
+// The IDF blocks a new fade until the running one ends, so steps are kept
+// short; a new target takes over at the next step.
+const uint32_t FADE_STEP_MS = 100;
+const uint32_t DEFAULT_TRANSITION_MS = 500;
+const uint32_t MAX_TRANSITION_MS = 60000;
+
+struct LightTransition {
+  uint16_t from[LIGHT_CHANNELS];
+  uint16_t to[LIGHT_CHANNELS];
+  uint16_t level[LIGHT_CHANNELS];   // where the running step ends
+  unsigned long start = 0;
+  uint32_t duration = 0;
+  unsigned long nextStep = 0;
+  bool active = false;
+};
+
+LightTransition transition;   // control task
+
+// Task layout: the control task owns the button, relay and PWM on core 1;
+// the network task owns WiFi and the MQTT client on core 0. They only talk
+// through the two queues below.
+const BaseType_t CONTROL_CORE = 1;
+const BaseType_t NETWORK_CORE = 0;
+const UBaseType_t CONTROL_PRIORITY = 3;
+const UBaseType_t NETWORK_PRIORITY = 1;
+const TickType_t CONTROL_IDLE_TICKS = pdMS_TO_TICKS(1000);
+const TickType_t NETWORK_POLL_TICKS = pdMS_TO_TICKS(10);
+const TickType_t BATCH_CLOSE_TICKS = pdMS_TO_TICKS(50);
+
+enum ControlAction : uint8_t {
+  ACTION_BUTTON,
+  ACTION_SET_POWER,
+  ACTION_TOGGLE,
+  ACTION_SET_BRIGHTNESS,
+  ACTION_SET_COLOR,
+  ACTION_SAVE_STATE,
+  ACTION_APPLY_OUTPUTS,
+  ACTION_DISCARD_OUTPUTS
+};
+
+struct ControlCommand {
+  ControlAction action;
+  int values[3];
+  uint32_t transition;   // fade time for output changes, ms
+  bool deferred;         // batch member: outputs wait for ACTION_APPLY_OUTPUTS
+};
+
+QueueHandle_t controlQueue;   // ControlCommand: network/web/ISR -> control
+QueueHandle_t stateMailbox;   // DeviceState: control -> network, latest wins
+QueueHandle_t statsMailbox;   // ha::PersistenceStats: control -> network, latest wins
+
+// Follow-up work asked for by the commands in one message. It runs once
+// the whole message is handled, because the document aliases the MQTT
+// receive buffer and publishing or subscribing overwrites it.
+struct CommandEffects {
+  bool batched = false;   // outputs are held for ACTION_APPLY_OUTPUTS
+  bool failed = false;    // a batch member did not fit the control queue
+  bool outputs = false;
+  bool status = false;
+  bool state = false;
+  bool restart = false;
+};
+
+// Batches turned away because the control queue could not take them
+// whole; network task
+uint32_t rejectedBatches = 0;
+
+// Firmware download requested on <base>/ota
+ha::OtaStream ota;
+
+// Cached AP join and boot-phase timings (see FastBoot.h)
+ha::FastBoot fastBoot;
 
 // Function declarations
-void setupHardware();
+void setupOutputs();
+void setupStorage();
 void setupWiFi();
 void setupMQTT();
 void setupOTA();
 void setupTopics();
 void connectToWiFi();
-void connectToMQTT();
+bool connectToMQTT();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void publishStatus();
-void publishState();
-void publishOnlineStatus(bool online);
+bool publishState();
 void handleCommand(JsonDocument& doc);
+void handleSharedTopic(JsonDocument& doc);
+void runCommand(const char* command, JsonObject parameters, CommandEffects& effects);
+void finishCommands(const CommandEffects& effects);
+void commandSetPower(JsonObject parameters, CommandEffects& effects);
+void commandSetBrightness(JsonObject parameters, CommandEffects& effects);
+void commandSetColor(JsonObject parameters, CommandEffects& effects);
+void commandToggle(JsonObject parameters, CommandEffects& effects);
+void commandGetStatus(JsonObject parameters, CommandEffects& effects);
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects);
+void commandSetGroups(JsonObject parameters, CommandEffects& effects);
+void commandSetRules(JsonObject parameters, CommandEffects& effects);
+void commandRestart(JsonObject parameters, CommandEffects& effects);
+void otaActionUpdate(JsonObject request, CommandEffects& effects);
+void otaActionCheck(JsonObject request, CommandEffects& effects);
+void otaActionGrant(JsonObject request, CommandEffects& effects);
+void otaActionRetryAfter(JsonObject request, CommandEffects& effects);
 void handleOTACommand(JsonDocument& doc);
-void updateLED();
+void handleReplayAck(JsonDocument& doc);
+void updateLED(uint32_t transitionMs);
+void serviceTransition(unsigned long now);
+uint32_t transitionParameter(JsonObject parameters);
 void handleButton();
 void IRAM_ATTR buttonISR();
-void saveStateToEEPROM();
-void loadStateFromEEPROM();
-void performOTAUpdate();
+void saveState();
+void loadState();
+void controlTask(void* parameter);
+void networkTask(void* parameter);
+bool sendControl(ControlAction action, int a = 0, int b = 0, int c = 0, uint32_t transitionMs = DEFAULT_TRANSITION_MS,
+                 bool deferred = false);
+void sendOutput(CommandEffects& effects, ControlAction action, int a, int b, int c, uint32_t transitionMs);
+void closeBatch(ControlAction action, uint32_t transitionMs);
+void applyControlCommand(const ControlCommand& cmd);
+
+// MQTT topic routing (suffixes of the device base topic)
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+ha::MqttDispatcher<512> mqttDispatcher(MQTT_ROUTES);
+
+// Commands on <base>/command and group topics
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("set_brightness"), commandSetBrightness },
+  { ha::fnv1a("set_color"), commandSetColor },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandSetGroups },
+  { ha::fnv1a("set_rules"), commandSetRules },
+  { ha::fnv1a("restart"), commandRestart },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+// Actions on <base>/ota
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), otaActionUpdate },
+  { ha::fnv1a("check"), otaActionCheck },
+  { ha::fnv1a("grant"), otaActionGrant },
+  { ha::fnv1a("retry_after"), otaActionRetryAfter },
+};
+static_assert(ha::uniqueCommandHashes(OTA_ACTIONS), "OTA action names collide");
+
+// WiFi/MQTT reconnect state machine, serviced from networkTask()
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return WiFi.status() == WL_CONNECTED; },
+  connectToWiFi,
+  connectToMQTT,
+  []() { return mqttClient.connected(); },
+  []() { return device.connecting(); },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+// Store-and-forward for state published while the broker is out of reach
+const ha::OfflineQueueHooks OFFLINE_QUEUE_HOOKS = {
+  []() { return mqttClient.connected(); },
+  [](const char* topic, const uint8_t* payload, size_t length, bool retained) {
+    return mqttClient.publish(topic, payload, length, retained);
+  },
+};
+ha::OfflineQueue offlineQueue(LittleFS, OFFLINE_QUEUE_HOOKS);
+
+// Group and scene command topics this device is a member of
+const ha::TopicGroupHooks TOPIC_GROUP_HOOKS = {
+  [](const char* topic) { return mqttClient.subscribe(topic, 1); },
+  [](const char* topic) { return mqttClient.unsubscribe(topic); },
+};
+ha::TopicGroups topicGroups(LittleFS, TOPIC_GROUP_HOOKS);
+
+// Rules that act on peer state here, without the backend (see LocalRules.h).
+// Peer state is subscribed at QoS0: a stale copy queued by the broker
+// should not fire a rule after a reconnect.
+const ha::LocalRuleHooks LOCAL_RULE_HOOKS = {
+  [](const char* topic) { return mqttClient.subscribe(topic, 0); },
+  [](const char* topic) { return mqttClient.unsubscribe(topic); },
+  handleCommand,
+};
+ha::LocalRules localRules(LittleFS, LOCAL_RULE_HOOKS);
 
 void setup() {
   Serial.begin(115200);
   Serial.println("\n=== Home Automation Smart Light ===");
   Serial.println("Firmware Version: " + String(FIRMWARE_VERSION));
   
-  // Initialize watchdog
+  // Initialize watchdog; each task subscribes itself
   esp_task_wdt_init(30, true);
-  esp_task_wdt_add(NULL);
   
-  // Setup hardware
-  setupHardware();
+  // Queues must exist before the button interrupt is attached
+  controlQueue = xQueueCreate(16, sizeof(ControlCommand));
+  stateMailbox = xQueueCreate(1, sizeof(DeviceState));
+  statsMailbox = xQueueCreate(1, sizeof(ha::PersistenceStats));
+  
+  // Saved state goes back on the outputs first, so after a power blip
+  // the light is at its old level before the radio is even up
+  setupOutputs();
+  loadState();
+  updateLED(0);
+  reportedState = deviceState;
+  fastBoot.mark(ha::FastBoot::OUTPUTS);
   
-  // Load saved state
-  loadStateFromEEPROM();
+  // The button works from here on, while the network comes up
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, NULL, CONTROL_PRIORITY, NULL, CONTROL_CORE);
   
   // Generate device ID from MAC
   MAC_ADDRESS = WiFi.macAddress();
@@ -107,77 +351,217 @@ void setup() {
   
   Serial.println("Device ID: " + DEVICE_ID);
   Serial.println("MAC Address: " + MAC_ADDRESS);
+  connection.seed(ha::fnv1aBuffer(MAC_ADDRESS.c_str(), MAC_ADDRESS.length()));
   
   // Setup topics
   setupTopics();
   
-  // Setup WiFi
+  // Setup WiFi; a cached AP is joined in the background
   setupWiFi();
   
-  // Setup MQTT
+  // Mount storage while the join runs
+  setupStorage();
+  fastBoot.mark(ha::FastBoot::STORAGE);
+  
+  // The network task connects as soon as the link is up, while the web
+  // server is still starting
   setupMQTT();
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, NETWORK_PRIORITY, NULL, NETWORK_CORE);
   
   // Setup OTA
   setupOTA();
   
-  // Initial state update
-  updateLED();
-  
+  fastBoot.mark(ha::FastBoot::SETUP);
   Serial.println("Setup complete!");
 }
 
 void loop() {
-  // Reset watchdog
-  esp_task_wdt_reset();
+  // Everything runs in controlTask() and networkTask()
+  vTaskDelete(NULL);
+}
+
+void controlTask(void* parameter) {
+  esp_task_wdt_add(NULL);
+  ControlCommand cmd;
+  ha::PersistenceStats posted;
   
-  // Handle WiFi connection
-  if (WiFi.status() != WL_CONNECTED) {
-    connectToWiFi();
+  for (;;) {
+    esp_task_wdt_reset();
+    
+    // Woken immediately by the button ISR or a queued command, and for
+    // the next fade step while a transition runs
+    TickType_t wait = CONTROL_IDLE_TICKS;
+    if (transition.active) {
+      long untilStep = (long)(transition.nextStep - millis());
+      wait = untilStep > 0 ? pdMS_TO_TICKS(untilStep) : 0;
+    }
+    if (xQueueReceive(controlQueue, &cmd, wait) == pdTRUE) {
+      applyControlCommand(cmd);
+    }
+    
+    unsigned long now = millis();
+    serviceTransition(now);
+    
+    // Write the saved state once it has settled
+    savedState.service(now);
+    
+    // savedState is ours; the network task reports a copy of its counters
+    ha::PersistenceStats stats = savedState.stats();
+    if (stats.updates != posted.updates || stats.writes != posted.writes) {
+      xQueueOverwrite(statsMailbox, &stats);
+      posted = stats;
+    }
   }
+}
+
+void networkTask(void* parameter) {
+  esp_task_wdt_add(NULL);
+  DeviceState update;
+  ha::LoopTimer pass;
   
-  // Handle MQTT connection
-  if (!mqttClient.connected()) {
-    connectToMQTT();
-  } else {
-    mqttClient.loop();
+  for (;;) {
+    esp_task_wdt_reset();
+    pass.start();
+    
+    // Handle WiFi/MQTT connection without blocking local control
+    unsigned long now = millis();
+    connection.service(now);
+    if (connection.online()) {
+      mqttClient.loop();
+      offlineQueue.service(now);
+    }
+    
+    // Act on peer state the rules saw in this pass
+    localRules.service();
+    
+    // Pick up output changes from the control task; this also paces the loop.
+    // The mailbox only keeps the latest state, so diff against what we had.
+    pass.pause();
+    bool received = xQueueReceive(stateMailbox, &update, NETWORK_POLL_TICKS) == pdTRUE;
+    pass.resume();
+    if (received) {
+      stateTracker.update(reportedState.power, update.power, FIELD_POWER);
+      stateTracker.update(reportedState.brightness, update.brightness, FIELD_BRIGHTNESS);
+      stateTracker.update(reportedState.color_r, update.color_r, FIELD_COLOR);
+      stateTracker.update(reportedState.color_g, update.color_g, FIELD_COLOR);
+      stateTracker.update(reportedState.color_b, update.color_b, FIELD_COLOR);
+    }
+    
+    // Send heartbeat every 30 seconds
+    now = millis();
+    if (now - networkState.lastHeartbeat > 30000) {
+      device.publishOnline(true);
+      networkState.lastHeartbeat = now;
+    }
+    
+    if (now - networkState.lastMetrics >= METRICS_INTERVAL && device.publishMetrics()) {
+      networkState.lastMetrics = now;
+    }
+    
+    // Send state update when it changed, or as a periodic keepalive;
+    // while offline it is queued for replay
+    if (stateTracker.due(now)) {
+      publishState();
+    }
+    
+    // Report the firmware download, which streams on a task of its own
+    device.reportOta(ota, []() { sendControl(ACTION_SAVE_STATE); });
+    pass.stop();
   }
-  
-  // Handle button press
-  if (buttonPressed) {
-    handleButton();
-    buttonPressed = false;
+}
+
+bool sendControl(ControlAction action, int a, int b, int c, uint32_t transitionMs, bool deferred) {
+  ControlCommand cmd = { action, { a, b, c }, transitionMs, deferred };
+  if (xQueueSend(controlQueue, &cmd, 0) != pdTRUE) {
+    Serial.println("Control queue full, command dropped");
+    HA_COUNT_EVENT(DroppedCommands, 1);
+    return false;
   }
-  
-  // Send heartbeat every 30 seconds
-  unsigned long now = millis();
-  if (now - deviceState.lastHeartbeat > 30000) {
-    publishOnlineStatus(true);
-    deviceState.lastHeartbeat = now;
+  return true;
+}
+
+// An output command from a message; in a batch, a dropped one fails it
+void sendOutput(CommandEffects& effects, ControlAction action, int a, int b, int c, uint32_t transitionMs) {
+  if (!sendControl(action, a, b, c, transitionMs, effects.batched)) {
+    effects.failed = true;
   }
-  
-  // Send state update every 5 seconds if state changed
-  if (now - deviceState.lastStateUpdate > 5000) {
-    publishState();
-    deviceState.lastStateUpdate = now;
+  effects.outputs = true;
+}
+
+// The command closing a batch waits for room; without it the members
+// already queued would hang on until the next command
+void closeBatch(ControlAction action, uint32_t transitionMs) {
+  ControlCommand cmd = { action, { 0, 0, 0 }, transitionMs, false };
+  if (xQueueSend(controlQueue, &cmd, BATCH_CLOSE_TICKS) != pdTRUE) {
+    Serial.println("Control queue full, batch left open");
+    HA_COUNT_EVENT(DroppedCommands, 1);
+  }
+}
+
+void applyControlCommand(const ControlCommand& cmd) {
+  if (cmd.deferred && !batchOpen) {
+    batchBase = deviceState;
+    batchOpen = true;
   }
   
-  // Handle OTA update if requested
-  if (otaInProgress) {
-    performOTAUpdate();
+  switch (cmd.action) {
+    case ACTION_BUTTON:
+      handleButton();
+      break;
+    case ACTION_SET_POWER:
+      outputTracker.update(deviceState.power, cmd.values[0] != 0, FIELD_POWER);
+      break;
+    case ACTION_TOGGLE:
+      outputTracker.update(deviceState.power, !deviceState.power, FIELD_POWER);
+      break;
+    case ACTION_SET_BRIGHTNESS:
+      outputTracker.update(deviceState.brightness, constrain(cmd.values[0], 0, 100), FIELD_BRIGHTNESS);
+      break;
+    case ACTION_SET_COLOR:
+      outputTracker.update(deviceState.color_r, constrain(cmd.values[0], 0, 255), FIELD_COLOR);
+      outputTracker.update(deviceState.color_g, constrain(cmd.values[1], 0, 255), FIELD_COLOR);
+      outputTracker.update(deviceState.color_b, constrain(cmd.values[2], 0, 255), FIELD_COLOR);
+      break;
+    case ACTION_SAVE_STATE:
+      // Ahead of a restart, don't wait for the settle delay
+      savedState.flush();
+      break;
+    case ACTION_APPLY_OUTPUTS:
+      batchOpen = false;
+      break;
+    case ACTION_DISCARD_OUTPUTS:
+      // A batch that did not arrive whole changes nothing
+      if (batchOpen) {
+        deviceState = batchBase;
+        batchOpen = false;
+      }
+      outputTracker.takeDirty();
+      return;
   }
   
-  delay(100);
+  // Drive the outputs first, then hand the new state to the network task;
+  // a batch does this once, on its closing ACTION_APPLY_OUTPUTS
+  if (!cmd.deferred && outputTracker.takeDirty()) {
+    updateLED(cmd.transition);
+    saveState();
+    xQueueOverwrite(stateMailbox, &deviceState);
+  }
 }
 
-void setupHardware() {
-  Serial.println("Setting up hardware...");
+void setupOutputs() {
+  Serial.println("Setting up outputs...");
   
-  // Initialize EEPROM
+  // Initialize EEPROM (state from older firmware is still read from it)
   EEPROM.begin(512);
   
-  // Setup LED PWM
-  ledcSetup(PWM_CHANNEL, PWM_FREQ, PWM_RESOLUTION);
-  ledcAttachPin(LED_PIN, PWM_CHANNEL);
+  // Setup LED PWM, with the hardware fade service on top
+  const uint8_t pins[LIGHT_CHANNELS] = { LED_PIN, LED_R_PIN, LED_G_PIN, LED_B_PIN };
+  for (uint8_t i = 0; i < LIGHT_CHANNELS; i++) {
+    ledcSetup(LIGHT_PWM_CHANNELS[i], PWM_FREQ, PWM_RESOLUTION);
+    ledcAttachPin(pins[i], LIGHT_PWM_CHANNELS[i]);
+    transition.level[i] = 0;
+  }
+  ledc_fade_func_install(0);
   
   // Setup relay pin
   pinMode(RELAY_PIN, OUTPUT);
@@ -187,12 +571,29 @@ void setupHardware() {
   pinMode(BUTTON_PIN, INPUT_PULLUP);
   attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), buttonISR, FALLING);
   
-  Serial.println("Hardware setup complete");
+  Serial.println("Outputs setup complete");
+}
+
+void setupStorage() {
+  // Offline queue storage; mounting (a format on first boot) is the slow part
+  if (LittleFS.begin(true)) {
+    offlineQueue.begin();
+    topicGroups.begin();
+    localRules.begin();
+  } else {
+    Serial.println("LittleFS mount failed, offline queue, groups and rules disabled");
+  }
 }
 
 void setupWiFi() {
   Serial.println("Setting up WiFi...");
   
+  // The AP of the last boot, joined without a scan; ConnectionManager
+  // takes the join from there. The portal is only for a first boot.
+  if (fastBoot.beginJoin()) {
+    return;
+  }
+  
   WiFiManager wifiManager;
   
   // Set timeout for configuration portal
@@ -257,280 +658,423 @@ void setupOTA() {
   server.on("/control", HTTP_POST, [](AsyncWebServerRequest *request){
     if (request->hasParam("power", true)) {
       String powerParam = request->getParam("power", true)->value();
-      deviceState.power = (powerParam == "true" || powerParam == "1");
-      updateLED();
-      publishState();
+      sendControl(ACTION_SET_POWER, powerParam == "true" || powerParam == "1");
       request->send(200, "text/plain", "OK");
     } else {
       request->send(400, "text/plain", "Missing power parameter");
     }
   });
   
+  // Hot-path latency histograms and counters for a Prometheus scrape
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    ha::MetricsSnapshot snapshot;
+    ha::snapshotMetrics(snapshot);
+    AsyncResponseStream* response = request->beginResponseStream(ha::METRICS_CONTENT_TYPE);
+    ha::writeMetrics(*response, snapshot);
+    request->send(response);
+  });
+  
   server.begin();
   Serial.println("OTA and web server started");
 }
 
 void setupTopics() {
-  TOPIC_BASE = "homeautomation/devices/" + DEVICE_ID;
-  TOPIC_STATUS = TOPIC_BASE + "/status";
-  TOPIC_STATE = TOPIC_BASE + "/state";
-  TOPIC_ONLINE = TOPIC_BASE + "/online";
-  TOPIC_COMMAND = TOPIC_BASE + "/command";
-  TOPIC_OTA = TOPIC_BASE + "/ota";
-  
-  Serial.println("Topics configured:");
-  Serial.println("  Status: " + TOPIC_STATUS);
-  Serial.println("  State: " + TOPIC_STATE);
-  Serial.println("  Online: " + TOPIC_ONLINE);
-  Serial.println("  Command: " + TOPIC_COMMAND);
-  Serial.println("  OTA: " + TOPIC_OTA);
+  device.begin(DEVICE_ID.c_str());
+  mqttDispatcher.setBaseTopic(device.topics().base());
+  offlineQueue.setBaseTopic(device.topics().base());
+  mqttDispatcher.setSharedRoute([](const char* topic) { return localRules.matches(topic) || topicGroups.contains(topic); },
+                                 handleSharedTopic);
+  
+  Serial.print("Topics configured under: ");
+  Serial.println(device.topics().base());
 }
 
 void connectToWiFi() {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Connecting to WiFi...");
+  // Only starts the join; ConnectionManager polls WiFi.status() and
+  // retries with backoff if it does not come up in time.
+  Serial.println("Connecting to WiFi...");
+  if (!fastBoot.join()) {
     WiFi.begin();
-    
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
-    
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("\nWiFi connected!");
-      Serial.println("IP: " + WiFi.localIP().toString());
-    } else {
-      Serial.println("\nWiFi connection failed, will retry...");
-    }
   }
 }
 
-void connectToMQTT() {
-  if (WiFi.status() != WL_CONNECTED) {
-    return;
-  }
-  
+bool connectToMQTT() {
   Serial.println("Connecting to MQTT...");
   
-  // Create will message for offline status
-  String willTopic = TOPIC_ONLINE;
-  String willMessage = "{\"online\":false}";
+  // The link is up: cache its AP for the next boot
+  fastBoot.linkUp();
   
-  if (mqttClient.connect(DEVICE_ID.c_str(), MQTT_USER, MQTT_PASSWORD, 
-                        willTopic.c_str(), 1, true, willMessage.c_str())) {
+  // Connects with a retained offline will
+  if (device.connect(MQTT_USER, MQTT_PASSWORD)) {
     Serial.println("MQTT connected!");
+    fastBoot.mark(ha::FastBoot::BROKER);
     
-    // Subscribe to command topic
-    if (mqttClient.subscribe(TOPIC_COMMAND.c_str())) {
-      Serial.println("Subscribed to: " + TOPIC_COMMAND);
+    // A resumed session still has the subscriptions, and the broker
+    // delivers the QoS1 commands it queued meanwhile
+    bool resumed = device.resumed();
+    if (resumed) {
+      Serial.println("MQTT session resumed");
+    } else {
+      // Subscribe to command topics
+      if (device.subscribe(ha::topic::COMMAND)) {
+        Serial.println("Subscribed to commands");
+      }
+      
+      if (device.subscribe(ha::topic::OTA)) {
+        Serial.println("Subscribed to OTA");
+      }
+      
+      // Replay markers from the offline queue come back here
+      device.subscribe(ha::topic::REPLAY);
+      topicGroups.subscribeAll();
+      localRules.subscribeAll();
     }
     
-    if (mqttClient.subscribe(TOPIC_OTA.c_str())) {
-      Serial.println("Subscribed to: " + TOPIC_OTA);
+    // The will has marked the device offline; the retained status only
+    // needs redoing if the session or the address is new
+    device.publishOnline(true);
+    if (!resumed || !device.statusCurrent()) {
+      device.publishStatus();
     }
-    
-    // Publish online status
-    publishOnlineStatus(true);
-    publishStatus();
-    
-    deviceState.online = true;
-  } else {
-    Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
-    deviceState.online = false;
+    stateTracker.markDirty(FIELD_ALL);
+    return true;
   }
-}
-
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String topicStr = String(topic);
-  String message = "";
   
-  for (int i = 0; i < length; i++) {
-    message += (char)payload[i];
+  // The async transport is still waiting for the broker; ConnectionManager
+  // calls back in once it has answered
+  if (device.connecting()) {
+    return false;
   }
   
-  Serial.println("Received [" + topicStr + "]: " + message);
-  
-  // Parse JSON message
-  StaticJsonDocument<512> doc;
-  DeserializationError error = deserializeJson(doc, message);
+  Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
+  return false;
+}
+
+void mqttCallback(char* topic, byte* payload, unsigned int length) {
+  HA_TIME_SCOPE(MqttCallback);
+  mqttDispatcher.dispatch(topic, payload, length);
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects effects;
+  JsonArray batch = doc["commands"];
   
-  if (error) {
-    Serial.println("Failed to parse JSON: " + String(error.c_str()));
-    return;
+  if (batch.isNull()) {
+    runCommand(doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    // {"commands": [{"command": ..., "parameters": {...}}, ...], "transition": ms}
+    // The outputs change once, with one fade, after the last command.
+    // All or nothing: without room for every member and the closing
+    // command, none is queued.
+    if (uxQueueSpacesAvailable(controlQueue) < batch.size() + 1) {
+      Serial.println("Control queue full, batch rejected");
+      HA_COUNT_EVENT(DroppedCommands, batch.size());
+      rejectedBatches++;
+      return;
+    }
+    effects.batched = true;
+    for (JsonObject entry : batch) {
+      runCommand(entry["command"].as<const char*>(), entry["parameters"], effects);
+      if (effects.failed) {
+        break;
+      }
+    }
+    if (effects.failed) {
+      // The button or the web server took the room meanwhile; the members
+      // already queued go with the batch
+      rejectedBatches++;
+      closeBatch(ACTION_DISCARD_OUTPUTS, 0);
+    } else if (effects.outputs) {
+      closeBatch(ACTION_APPLY_OUTPUTS, transitionParameter(doc.as<JsonObject>()));
+    }
   }
   
-  if (topicStr == TOPIC_COMMAND) {
+  finishCommands(effects);
+}
+
+void handleSharedTopic(JsonDocument& doc) {
+  // State or events of a peer the local rules follow, else a group or
+  // scene command
+  if (localRules.matched()) {
+    localRules.evaluate(doc);
+  } else {
     handleCommand(doc);
-  } else if (topicStr == TOPIC_OTA) {
-    handleOTACommand(doc);
   }
 }
 
-void handleCommand(JsonDocument& doc) {
-  String command = doc["command"];
-  JsonObject parameters = doc["parameters"];
+void runCommand(const char* command, JsonObject parameters, CommandEffects& effects) {
+  Serial.print("Handling command: ");
+  Serial.println(command ? command : "(none)");
   
-  Serial.println("Handling command: " + command);
-  
-  if (command == "set_power") {
-    deviceState.power = parameters["power"];
-    updateLED();
-    publishState();
+  if (!ha::dispatchCommand(COMMANDS, command, parameters, effects)) {
+    Serial.println("Unknown command ignored");
   }
-  else if (command == "set_brightness") {
-    deviceState.brightness = parameters["brightness"];
-    if (deviceState.brightness < 0) deviceState.brightness = 0;
-    if (deviceState.brightness > 100) deviceState.brightness = 100;
-    updateLED();
-    publishState();
+}
+
+// Output changes are applied by the control task, which reports back
+// through the state mailbox
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  sendOutput(effects, ACTION_SET_POWER, parameters["power"].as<bool>(), 0, 0, transitionParameter(parameters));
+}
+
+void commandSetBrightness(JsonObject parameters, CommandEffects& effects) {
+  sendOutput(effects, ACTION_SET_BRIGHTNESS, parameters["brightness"].as<int>(), 0, 0, transitionParameter(parameters));
+}
+
+void commandSetColor(JsonObject parameters, CommandEffects& effects) {
+  sendOutput(effects, ACTION_SET_COLOR, parameters["r"].as<int>(), parameters["g"].as<int>(), parameters["b"].as<int>(),
+             transitionParameter(parameters));
+}
+
+void commandToggle(JsonObject parameters, CommandEffects& effects) {
+  sendOutput(effects, ACTION_TOGGLE, 0, 0, 0, transitionParameter(parameters));
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetGroups(JsonObject parameters, CommandEffects& effects) {
+  // {"groups": [...], "scenes": [...]}; subscriptions move in finishCommands()
+  if (!topicGroups.stage(parameters)) {
+    Serial.println("Invalid group membership ignored");
   }
-  else if (command == "set_color") {
-    deviceState.color_r = parameters["r"];
-    deviceState.color_g = parameters["g"];
-    deviceState.color_b = parameters["b"];
-    updateLED();
-    publishState();
+  effects.status = true;
+}
+
+void commandSetRules(JsonObject parameters, CommandEffects& effects) {
+  // {"rules": [...]}; subscriptions move in finishCommands()
+  if (!localRules.stage(parameters)) {
+    Serial.println("Invalid rules ignored");
   }
-  else if (command == "toggle") {
-    deviceState.power = !deviceState.power;
-    updateLED();
-    publishState();
+  effects.status = true;
+}
+
+void commandRestart(JsonObject, CommandEffects& effects) {
+  effects.restart = true;
+}
+
+void finishCommands(const CommandEffects& effects) {
+  topicGroups.commit();
+  localRules.commit();
+  
+  if (effects.status) {
+    device.publishStatus();
   }
-  else if (command == "get_status") {
-    publishStatus();
+  if (effects.state) {
     publishState();
   }
-  else if (command == "restart") {
+  
+  if (effects.restart) {
     Serial.println("Restart command received");
-    publishOnlineStatus(false);
+    device.publishOnline(false);
+    sendControl(ACTION_SAVE_STATE);
     delay(1000);
     ESP.restart();
   }
-  
-  // Save state after any change
-  saveStateToEEPROM();
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  // Our own replay marker, echoed back by the broker
+  offlineQueue.acknowledge(doc["seq"].as<uint32_t>());
 }
 
 void handleOTACommand(JsonDocument& doc) {
-  String action = doc["action"];
-  
-  if (action == "update") {
-    otaUrl = doc["url"].as<String>();
-    Serial.println("OTA update requested: " + otaUrl);
-    otaInProgress = true;
-  } else if (action == "check") {
-    // Publish current firmware version
-    StaticJsonDocument<200> response;
-    response["device_id"] = DEVICE_ID;
-    response["current_version"] = FIRMWARE_VERSION;
-    response["status"] = "ready_for_update";
-    
-    String responseStr;
-    serializeJson(response, responseStr);
-    mqttClient.publish(TOPIC_STATUS.c_str(), responseStr.c_str());
+  CommandEffects effects;
+  if (!ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects)) {
+    Serial.println("Unknown OTA action");
+  }
+}
+
+void otaActionUpdate(JsonObject request, CommandEffects&) {
+  // "checksum" is the image SHA-256, as the OTA service sends it
+  const char* url = request["url"];
+  Serial.print("OTA update requested: ");
+  Serial.println(url ? url : "(none)");
+  if (ota.start(url, request["checksum"].as<const char*>(), request["size"] | 0,
+                request["start_window"] | 0, request["require_grant"] | false)) {
+    ota.startTask();
   }
 }
 
-void updateLED() {
+void otaActionCheck(JsonObject, CommandEffects&) {
+  device.publishOtaCheck();
+}
+
+void otaActionGrant(JsonObject request, CommandEffects&) {
+  // Download slot for a scheduled update
+  ota.grant(request["token"]);
+}
+
+void otaActionRetryAfter(JsonObject request, CommandEffects&) {
+  ota.retryAfter(request["seconds"] | 0);
+}
+
+uint32_t transitionParameter(JsonObject parameters) {
+  // Optional "transition" in ms on any output command
+  uint32_t transitionMs = parameters["transition"] | DEFAULT_TRANSITION_MS;
+  return transitionMs > MAX_TRANSITION_MS ? MAX_TRANSITION_MS : transitionMs;
+}
+
+void updateLED(uint32_t transitionMs) {
+  // Target lightness per channel; colour is scaled by brightness
+  uint16_t target[LIGHT_CHANNELS] = { 0, 0, 0, 0 };
   if (deviceState.power) {
-    // Turn on relay
-    digitalWrite(RELAY_PIN, HIGH);
+    const int colour[LIGHT_CHANNELS] = { 255, deviceState.color_r, deviceState.color_g, deviceState.color_b };
+    for (uint8_t i = 0; i < LIGHT_CHANNELS; i++) {
+      target[i] = (uint32_t)colour[i] * deviceState.brightness * 256 / 100;
+    }
     
-    // Set LED brightness (simplified - just use brightness value)
-    int pwmValue = map(deviceState.brightness, 0, 100, 0, 255);
-    ledcWrite(PWM_CHANNEL, pwmValue);
-  } else {
-    // Turn off relay and LED
-    digitalWrite(RELAY_PIN, LOW);
-    ledcWrite(PWM_CHANNEL, 0);
+    // The relay goes on before fading in; off only once faded out
+    digitalWrite(RELAY_PIN, HIGH);
+  }
+  
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < LIGHT_CHANNELS; i++) {
+    transition.from[i] = transition.level[i];
+    transition.to[i] = target[i];
   }
+  transition.start = now;
+  transition.duration = transitionMs;
+  transition.nextStep = now;
+  transition.active = true;
+  serviceTransition(now);
+}
+
+void serviceTransition(unsigned long now) {
+  if (!transition.active || (long)(now - transition.nextStep) < 0) {
+    return;
+  }
+  
+  uint32_t elapsed = now - transition.start;
+  if (elapsed >= transition.duration) {
+    // The last step has landed (or there was nothing to fade)
+    for (uint8_t i = 0; i < LIGHT_CHANNELS; i++) {
+      if (transition.level[i] != transition.to[i]) {
+        transition.level[i] = transition.to[i];
+        ledcWrite(LIGHT_PWM_CHANNELS[i], LIGHT_CURVE.interpolate(transition.level[i]));
+      }
+    }
+    transition.active = false;
+    if (!deviceState.power) {
+      digitalWrite(RELAY_PIN, LOW);
+    }
+    return;
+  }
+  
+  // Hand the next step to the LEDC hardware
+  uint32_t stepEnd = elapsed + FADE_STEP_MS;
+  if (stepEnd > transition.duration) {
+    stepEnd = transition.duration;
+  }
+  for (uint8_t i = 0; i < LIGHT_CHANNELS; i++) {
+    int32_t delta = (int32_t)transition.to[i] - transition.from[i];
+    transition.level[i] = transition.from[i] + (int32_t)((int64_t)delta * stepEnd / transition.duration);
+    ledc_channel_t channel = (ledc_channel_t)LIGHT_PWM_CHANNELS[i];
+    ledc_set_fade_with_time(LEDC_HIGH_SPEED_MODE, channel, LIGHT_CURVE.interpolate(transition.level[i]), stepEnd - elapsed);
+    ledc_fade_start(LEDC_HIGH_SPEED_MODE, channel, LEDC_FADE_NO_WAIT);
+  }
+  transition.nextStep = now + (stepEnd - elapsed);
 }
 
 void IRAM_ATTR buttonISR() {
   unsigned long now = millis();
   if (now - lastButtonPress > DEBOUNCE_DELAY) {
-    buttonPressed = true;
     lastButtonPress = now;
+    ControlCommand cmd = { ACTION_BUTTON, { 0, 0, 0 }, DEFAULT_TRANSITION_MS, false };
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(controlQueue, &cmd, &woken);
+    if (woken) {
+      portYIELD_FROM_ISR();
+    }
   }
 }
 
 void handleButton() {
   Serial.println("Button pressed - toggling power");
-  deviceState.power = !deviceState.power;
-  updateLED();
-  publishState();
-  saveStateToEEPROM();
+  outputTracker.update(deviceState.power, !deviceState.power, FIELD_POWER);
 }
 
-void publishStatus() {
-  StaticJsonDocument<300> doc;
-  doc["device_id"] = DEVICE_ID;
-  doc["device_type"] = DEVICE_TYPE;
-  doc["firmware_version"] = FIRMWARE_VERSION;
-  doc["mac_address"] = MAC_ADDRESS;
-  doc["ip_address"] = WiFi.localIP().toString();
-  doc["online"] = deviceState.online;
-  doc["wifi_rssi"] = WiFi.RSSI();
-  doc["free_heap"] = ESP.getFreeHeap();
-  doc["uptime"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATUS.c_str(), message.c_str(), true);
-  }
+void LightTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+#if defined(HA_ASYNC_MQTT)
+  mqttClient.reportStats(status.createNestedObject("mqtt_tx"));
+#endif
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+  status["rejected_batches"] = rejectedBatches;
+  offlineQueue.reportStats(status.createNestedObject("offline_queue"));
+  topicGroups.reportStats(status.createNestedObject("groups"));
+  localRules.reportStats(status.createNestedObject("rules"));
+  ha::PersistenceStats persistence;
+  xQueuePeek(statsMailbox, &persistence, 0);
+  persistence.report(status.createNestedObject("persistence"));
+  ota.reportStats(status.createNestedObject("ota"));
+  fastBoot.reportStats(status.createNestedObject("boot"));
 }
 
-void publishState() {
+bool publishState() {
+  HA_ASSERT_NO_ALLOC("publishState");
   StaticJsonDocument<200> doc;
-  doc["power"] = deviceState.power;
-  doc["brightness"] = deviceState.brightness;
-  doc["color_r"] = deviceState.color_r;
-  doc["color_g"] = deviceState.color_g;
-  doc["color_b"] = deviceState.color_b;
-  doc["timestamp"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATE.c_str(), message.c_str());
+  ha::StateEncoder state(doc, stateEncoding);
+  state.set(ha::keys::POWER, reportedState.power);
+  state.set(ha::keys::BRIGHTNESS, reportedState.brightness);
+  state.set(ha::keys::COLOR_R, reportedState.color_r);
+  state.set(ha::keys::COLOR_G, reportedState.color_g);
+  state.set(ha::keys::COLOR_B, reportedState.color_b);
+  state.set(ha::keys::TIMESTAMP, millis());
+  
+  uint8_t payload[200];
+  size_t length = state.serialize(payload, sizeof(payload));
+  
+  // Offline (or while older messages are still queued) this goes to flash
+  if (length == 0 || !offlineQueue.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload, length)) {
+    return false;
   }
-}
-
-void publishOnlineStatus(bool online) {
-  StaticJsonDocument<100> doc;
-  doc["online"] = online;
-  doc["timestamp"] = millis();
   
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_ONLINE.c_str(), message.c_str(), true);
+  stateTracker.published(millis());
+  // Only one that reached the broker counts, not one queued to flash
+  if (fastBoot.marked(ha::FastBoot::BROKER)) {
+    fastBoot.mark(ha::FastBoot::FIRST_STATE);
   }
-  
-  deviceState.online = online;
+  return true;
 }
 
-void saveStateToEEPROM() {
-  EEPROM.write(0, deviceState.power ? 1 : 0);
-  EEPROM.write(1, deviceState.brightness);
-  EEPROM.write(2, deviceState.color_r);
-  EEPROM.write(3, deviceState.color_g);
-  EEPROM.write(4, deviceState.color_b);
-  EEPROM.commit();
+void saveState() {
+  LightRecord record = {
+    (uint8_t)(deviceState.power ? 1 : 0),
+    (uint8_t)deviceState.brightness,
+    (uint8_t)deviceState.color_r,
+    (uint8_t)deviceState.color_g,
+    (uint8_t)deviceState.color_b
+  };
+  savedState.update(record, millis());
 }
 
-void loadStateFromEEPROM() {
-  deviceState.power = EEPROM.read(0) == 1;
-  deviceState.brightness = EEPROM.read(1);
-  deviceState.color_r = EEPROM.read(2);
-  deviceState.color_g = EEPROM.read(3);
-  deviceState.color_b = EEPROM.read(4);
+void loadState() {
+  LightRecord record;
+  if (savedState.load(record)) {
+    deviceState.power = record.power == 1;
+    deviceState.brightness = record.brightness;
+    deviceState.color_r = record.color_r;
+    deviceState.color_g = record.color_g;
+    deviceState.color_b = record.color_b;
+  } else {
+    // Nothing saved yet: fall back to the fixed EEPROM layout used before
+    deviceState.power = EEPROM.read(0) == 1;
+    deviceState.brightness = EEPROM.read(1);
+    deviceState.color_r = EEPROM.read(2);
+    deviceState.color_g = EEPROM.read(3);
+    deviceState.color_b = EEPROM.read(4);
+  }
   
   // Validate loaded values
   if (deviceState.brightness > 100) deviceState.brightness = 100;
@@ -538,59 +1082,7 @@ void loadStateFromEEPROM() {
   if (deviceState.color_g > 255) deviceState.color_g = 255;
   if (deviceState.color_b > 255) deviceState.color_b = 255;
   
-  Serial.println("State loaded from EEPROM:");
+  Serial.println("State loaded:");
   Serial.println("  Power: " + String(deviceState.power));
   Serial.println("  Brightness: " + String(deviceState.brightness));
 }
-
-void performOTAUpdate() {
-  if (otaUrl.length() == 0) {
-    otaInProgress = false;
-    return;
-  }
-  
-  Serial.println("Starting OTA update from: " + otaUrl);
-  
-  // Publish update status
-  StaticJsonDocument<200> status;
-  status["device_id"] = DEVICE_ID;
-  status["status"] = "updating";
-  status["progress"] = 0;
-  
-  String statusStr;
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
-  
-  // Perform HTTP OTA update
-  WiFiClient client;
-  t_httpUpdate_return ret = httpUpdate.update(client, otaUrl);
-  
-  switch (ret) {
-    case HTTP_UPDATE_FAILED:
-      Serial.println("OTA Update failed: " + httpUpdate.getLastErrorString());
-      status["status"] = "failed";
-      status["error"] = httpUpdate.getLastErrorString();
-      break;
-      
-    case HTTP_UPDATE_NO_UPDATES:
-      Serial.println("No OTA updates available");
-      status["status"] = "no_update";
-      break;
-      
-    case HTTP_UPDATE_OK:
-      Serial.println("OTA Update successful, restarting...");
-      status["status"] = "success";
-      break;
-  }
-  
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
-  
-  otaInProgress = false;
-  otaUrl = "";
-  
-  if (ret == HTTP_UPDATE_OK) {
-    delay(2000);
-    ESP.restart();
-  }
-}
\ No newline at end of file
@@ -1,11 +1,22 @@
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <DeviceCore.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+#include <ChangeTracker.h>
+#include <ConnectionManager.h>
+#include <OfflineQueue.h>
+#include <TopicGroups.h>
+#include <LocalRules.h>
+#include <Metrics.h>
+#include <StateStore.h>
+#include <FastBoot.h>
 #include <WiFiManager.h>
 #include <ESPAsyncWebServer.h>
 #include <AsyncElegantOTA.h>
 #include <EEPROM.h>
-#include <ESP8266httpUpdate.h>
+#include <LittleFS.h>
 
 // Hardware pin definitions
 #define RELAY_PIN 5    // D1
@@ -24,69 +35,218 @@ const int MQTT_PORT = 1883;
 const char* MQTT_USER = "";
 const char* MQTT_PASSWORD = "";
 
-// Topics
-String TOPIC_BASE = "";
-String TOPIC_STATUS = "";
-String TOPIC_STATE = "";
-String TOPIC_ONLINE = "";
-String TOPIC_COMMAND = "";
-String TOPIC_OTA = "";
-
-// WiFi and MQTT clients
+// WiFi and MQTT clients; the async transport brings its own socket
+#if defined(HA_ASYNC_MQTT)
+ha::MqttClient mqttClient;
+#else
 WiFiClient wifiClient;
-PubSubClient mqttClient(wifiClient);
+ha::MqttClient mqttClient(wifiClient);
+
+// PubSubClient connects synchronously, so every attempt holds loop()
+// (button, relay, saved state) until the broker answers or these expire
+const unsigned long MQTT_CONNECT_TIMEOUT_MS = 2000;   // TCP connect
+const uint16_t MQTT_SOCKET_TIMEOUT_S = 2;             // CONNACK and reads
+#endif
 AsyncWebServer server(80);
 
+// Topics, connect, online and status plumbing shared with the other devices
+struct SwitchTraits {
+  static const size_t STATUS_CAPACITY = 2048;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+ha::DeviceCore<SwitchTraits> device(mqttClient);
+
 // Device state
 struct SwitchState {
   bool power = false;
-  bool online = false;
   unsigned long lastHeartbeat = 0;
-  unsigned long lastStateUpdate = 0;
+  unsigned long lastMetrics = 0;
   unsigned long lastButtonPress = 0;
 };
 
 SwitchState switchState;
 
+// What survives a reboot
+struct SwitchRecord {
+  uint8_t power;
+};
+
+// Saved state is written once commands settle, not on every change. Each
+// EEPROM.commit() rewrites the whole emulated sector, so fewer commits is
+// what saves the flash here.
+const unsigned long STATE_SAVE_SETTLE = 2000;
+const unsigned long STATE_SAVE_MAX_DELAY = 30000;
+ha::PersistedState<SwitchRecord> savedState("switch", STATE_SAVE_SETTLE, STATE_SAVE_MAX_DELAY);
+
+// Dirty bits for SwitchState fields not yet published
+enum StateField : uint16_t {
+  FIELD_POWER = 1 << 0,
+  FIELD_ALL = FIELD_POWER
+};
+
+// State is published on change, plus a keepalive copy every 5 minutes
+const unsigned long STATE_KEEPALIVE_INTERVAL = 300000;
+ha::ChangeTracker stateTracker(STATE_KEEPALIVE_INTERVAL);
+
+// State wire format, negotiated with the backend (see StateEncoding.h)
+ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+// Metrics also go out on <base>/metrics, for collectors that cannot scrape
+const unsigned long METRICS_INTERVAL = 60000;
+
 // Button handling
 volatile bool buttonPressed = false;
 const unsigned long DEBOUNCE_DELAY = 50;
 
-// OTA update variables
-bool otaInProgress = false;
-String otaUrl = "";
+// Follow-up work asked for by the commands in one message. It runs once
+// the whole message is handled, because the document aliases the MQTT
+// receive buffer and publishing or subscribing overwrites it.
+struct CommandEffects {
+  bool status = false;
+  bool state = false;
+  bool restart = false;
+};
+
+// Firmware download requested on <base>/ota
+ha::OtaStream ota;
+
+// Cached AP join and boot-phase timings (see FastBoot.h). Its record sits
+// in EEPROM 512.., past the saved state's slots.
+ha::FastBoot fastBoot(512, 512);
 
 // Function declarations
-void setupHardware();
+void setupOutputs();
+void setupStorage();
 void setupWiFi();
 void setupMQTT();
 void setupOTA();
 void setupTopics();
 void connectToWiFi();
-void connectToMQTT();
+bool connectToMQTT();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void publishStatus();
-void publishState();
-void publishOnlineStatus(bool online);
+bool publishState();
 void handleCommand(JsonDocument& doc);
+void handleSharedTopic(JsonDocument& doc);
+void runCommand(const char* command, JsonObject parameters, CommandEffects& effects);
+void finishCommands(const CommandEffects& effects);
+void commandSetPower(JsonObject parameters, CommandEffects& effects);
+void commandToggle(JsonObject parameters, CommandEffects& effects);
+void commandGetStatus(JsonObject parameters, CommandEffects& effects);
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects);
+void commandSetGroups(JsonObject parameters, CommandEffects& effects);
+void commandSetRules(JsonObject parameters, CommandEffects& effects);
+void commandRestart(JsonObject parameters, CommandEffects& effects);
+void otaActionUpdate(JsonObject request, CommandEffects& effects);
+void otaActionCheck(JsonObject request, CommandEffects& effects);
+void otaActionGrant(JsonObject request, CommandEffects& effects);
+void otaActionRetryAfter(JsonObject request, CommandEffects& effects);
 void handleOTACommand(JsonDocument& doc);
+void handleReplayAck(JsonDocument& doc);
 void updateRelay();
 void handleButton();
 void IRAM_ATTR buttonISR();
-void saveStateToEEPROM();
-void loadStateFromEEPROM();
-void performOTAUpdate();
+void saveState();
+void loadState();
+
+// MQTT topic routing (suffixes of the device base topic)
+const ha::TopicRoute MQTT_ROUTES[] = {
+  { ha::fnv1a(ha::topic::COMMAND), handleCommand },
+  { ha::fnv1a(ha::topic::OTA), handleOTACommand },
+  { ha::fnv1a(ha::topic::REPLAY), handleReplayAck },
+};
+const size_t COMMAND_CAPACITY = 512;
+ha::MqttDispatcher<COMMAND_CAPACITY> mqttDispatcher(MQTT_ROUTES);
+
+// State publishes serialize into a stack document and buffer
+const size_t STATE_CAPACITY = 150;
+const size_t STATE_PAYLOAD = 128;
+
+// The loop runs on the 4 KB cont stack (HA_SRAM_STACK_BUDGET in
+// platformio.ini). The deepest path is a command message: the
+// dispatcher's document, then a state publish or an OTA check answer
+// from finishCommands(), under the PubSubClient, LittleFS and serializer
+// frames. The status document is kept in DeviceCore, off the stack.
+#if defined(HA_SRAM_STACK_BUDGET)
+const size_t STACK_FRAMES = 1536;
+static_assert(COMMAND_CAPACITY + STATE_CAPACITY + STATE_PAYLOAD + ha::DeviceTopics::MAX_TOPIC + STACK_FRAMES <=
+                  HA_SRAM_STACK_BUDGET,
+              "command and state documents do not fit the stack budget");
+static_assert(COMMAND_CAPACITY + ha::DeviceCore<SwitchTraits>::MAX_STACK_DOCUMENT + ha::DeviceTopics::MAX_TOPIC +
+                      STACK_FRAMES <=
+                  HA_SRAM_STACK_BUDGET,
+              "command and reply documents do not fit the stack budget");
+#endif
+
+// Commands on <base>/command and group topics
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandSetGroups },
+  { ha::fnv1a("set_rules"), commandSetRules },
+  { ha::fnv1a("restart"), commandRestart },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+// Actions on <base>/ota
+constexpr ha::CommandRoute<CommandEffects> OTA_ACTIONS[] = {
+  { ha::fnv1a("update"), otaActionUpdate },
+  { ha::fnv1a("check"), otaActionCheck },
+  { ha::fnv1a("grant"), otaActionGrant },
+  { ha::fnv1a("retry_after"), otaActionRetryAfter },
+};
+static_assert(ha::uniqueCommandHashes(OTA_ACTIONS), "OTA action names collide");
+
+// WiFi/MQTT reconnect state machine, serviced from loop()
+const ha::ConnectionHooks CONNECTION_HOOKS = {
+  []() { return WiFi.status() == WL_CONNECTED; },
+  connectToWiFi,
+  connectToMQTT,
+  []() { return mqttClient.connected(); },
+  []() { return device.connecting(); },
+};
+ha::ConnectionManager connection(CONNECTION_HOOKS);
+
+// Store-and-forward for state published while the broker is out of reach
+const ha::OfflineQueueHooks OFFLINE_QUEUE_HOOKS = {
+  []() { return mqttClient.connected(); },
+  [](const char* topic, const uint8_t* payload, size_t length, bool retained) {
+    return mqttClient.publish(topic, payload, length, retained);
+  },
+};
+ha::OfflineQueue offlineQueue(LittleFS, OFFLINE_QUEUE_HOOKS);
+
+// Group and scene command topics this device is a member of
+const ha::TopicGroupHooks TOPIC_GROUP_HOOKS = {
+  [](const char* topic) { return mqttClient.subscribe(topic, 1); },
+  [](const char* topic) { return mqttClient.unsubscribe(topic); },
+};
+ha::TopicGroups topicGroups(LittleFS, TOPIC_GROUP_HOOKS);
+
+// Rules that act on peer state here, without the backend (see LocalRules.h).
+// Peer state is subscribed at QoS0: a stale copy queued by the broker
+// should not fire a rule after a reconnect.
+const ha::LocalRuleHooks LOCAL_RULE_HOOKS = {
+  [](const char* topic) { return mqttClient.subscribe(topic, 0); },
+  [](const char* topic) { return mqttClient.unsubscribe(topic); },
+  handleCommand,
+};
+ha::LocalRules localRules(LittleFS, LOCAL_RULE_HOOKS);
 
 void setup() {
   Serial.begin(115200);
   Serial.println("\n=== Home Automation Smart Switch ===");
   Serial.println("Firmware Version: " + String(FIRMWARE_VERSION));
   
-  // Setup hardware
-  setupHardware();
-  
-  // Load saved state
-  loadStateFromEEPROM();
+  // Saved state goes back on the relay first, so after a power blip the
+  // load is back on before the radio is even up
+  setupOutputs();
+  loadState();
+  updateRelay();
+  fastBoot.mark(ha::FastBoot::OUTPUTS);
   
   // Generate device ID from MAC
   MAC_ADDRESS = WiFi.macAddress();
@@ -96,38 +256,44 @@ void setup() {
   
   Serial.println("Device ID: " + DEVICE_ID);
   Serial.println("MAC Address: " + MAC_ADDRESS);
+  connection.seed(ha::fnv1aBuffer(MAC_ADDRESS.c_str(), MAC_ADDRESS.length()));
   
   // Setup topics
   setupTopics();
   
-  // Setup WiFi
+  // Setup WiFi; a cached AP is joined in the background
   setupWiFi();
   
+  // Mount storage and start the web server while the join runs; the
+  // first loop() pass connects
+  setupStorage();
+  fastBoot.mark(ha::FastBoot::STORAGE);
+  
   // Setup MQTT
   setupMQTT();
   
   // Setup OTA
   setupOTA();
   
-  // Initial state update
-  updateRelay();
-  
+  fastBoot.mark(ha::FastBoot::SETUP);
   Serial.println("Setup complete!");
 }
 
 void loop() {
-  // Handle WiFi connection
-  if (WiFi.status() != WL_CONNECTED) {
-    connectToWiFi();
-  }
+  ha::LoopTimer pass;
+  pass.start();
   
-  // Handle MQTT connection
-  if (!mqttClient.connected()) {
-    connectToMQTT();
-  } else {
+  // Handle WiFi/MQTT connection without blocking local control
+  unsigned long now = millis();
+  connection.service(now);
+  if (connection.online()) {
     mqttClient.loop();
+    offlineQueue.service(now);
   }
   
+  // Act on peer state the rules saw in this pass
+  localRules.service();
+  
   // Handle button press
   if (buttonPressed) {
     handleButton();
@@ -135,31 +301,42 @@ void loop() {
   }
   
   // Send heartbeat every 30 seconds
-  unsigned long now = millis();
   if (now - switchState.lastHeartbeat > 30000) {
-    publishOnlineStatus(true);
+    device.publishOnline(true);
     switchState.lastHeartbeat = now;
   }
   
-  // Send state update every 5 seconds if state changed
-  if (now - switchState.lastStateUpdate > 5000) {
-    publishState();
-    switchState.lastStateUpdate = now;
+  if (now - switchState.lastMetrics >= METRICS_INTERVAL && device.publishMetrics()) {
+    switchState.lastMetrics = now;
   }
   
-  // Handle OTA update if requested
-  if (otaInProgress) {
-    performOTAUpdate();
+  // Send state update when it changed, or as a periodic keepalive;
+  // while offline it is queued for replay
+  if (stateTracker.due(now)) {
+    // Changes made over HTTP are only saved from here
+    if (stateTracker.isDirty()) {
+      saveState();
+    }
+    publishState();
   }
   
-  delay(100);
+  // Write the saved state once it has settled
+  savedState.service(now);
+  
+  // Stream a requested firmware update a chunk per pass, and report it
+  ota.service(now);
+  device.reportOta(ota, []() { savedState.flush(); });
+  
+  // Spin faster while downloading so the transfer is not paced by the delay
+  pass.stop();
+  delay(ota.active() ? 1 : 100);
 }
 
-void setupHardware() {
-  Serial.println("Setting up hardware...");
+void setupOutputs() {
+  Serial.println("Setting up outputs...");
   
-  // Initialize EEPROM
-  EEPROM.begin(512);
+  // Initialize EEPROM: saved state below 512, the AP cache above
+  EEPROM.begin(1024);
   
   // Setup pins
   pinMode(RELAY_PIN, OUTPUT);
@@ -173,12 +350,29 @@ void setupHardware() {
   // Setup button interrupt
   attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), buttonISR, FALLING);
   
-  Serial.println("Hardware setup complete");
+  Serial.println("Outputs setup complete");
+}
+
+void setupStorage() {
+  // Offline queue storage
+  if (LittleFS.begin()) {
+    offlineQueue.begin();
+    topicGroups.begin();
+    localRules.begin();
+  } else {
+    Serial.println("LittleFS mount failed, offline queue, groups and rules disabled");
+  }
 }
 
 void setupWiFi() {
   Serial.println("Setting up WiFi...");
   
+  // The AP of the last boot, joined without a scan; ConnectionManager
+  // takes the join from there. The portal is only for a first boot.
+  if (fastBoot.beginJoin()) {
+    return;
+  }
+  
   WiFiManager wifiManager;
   wifiManager.setConfigPortalTimeout(300);
   
@@ -197,6 +391,10 @@ void setupMQTT() {
   mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
   mqttClient.setCallback(mqttCallback);
   mqttClient.setKeepAlive(60);
+#if !defined(HA_ASYNC_MQTT)
+  wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
+#endif
   Serial.println("MQTT setup complete");
 }
 
@@ -223,144 +421,227 @@ void setupOTA() {
   server.on("/control", HTTP_POST, [](AsyncWebServerRequest *request){
     if (request->hasParam("power", true)) {
       String powerParam = request->getParam("power", true)->value();
-      switchState.power = (powerParam == "true" || powerParam == "1");
+      // Runs in the TCP (sys) context: loop() publishes and saves the change,
+      // so the offline queue's files are only ever touched from there
+      stateTracker.update(switchState.power, powerParam == "true" || powerParam == "1", FIELD_POWER);
       updateRelay();
-      publishState();
       request->send(200, "text/plain", "OK");
     } else {
       request->send(400, "text/plain", "Missing power parameter");
     }
   });
   
+  // Hot-path latency histograms and counters for a Prometheus scrape
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    ha::MetricsSnapshot snapshot;
+    ha::snapshotMetrics(snapshot);
+    AsyncResponseStream* response = request->beginResponseStream(ha::METRICS_CONTENT_TYPE);
+    ha::writeMetrics(*response, snapshot);
+    request->send(response);
+  });
+  
   server.begin();
   Serial.println("OTA and web server started");
 }
 
 void setupTopics() {
-  TOPIC_BASE = "homeautomation/devices/" + DEVICE_ID;
-  TOPIC_STATUS = TOPIC_BASE + "/status";
-  TOPIC_STATE = TOPIC_BASE + "/state";
-  TOPIC_ONLINE = TOPIC_BASE + "/online";
-  TOPIC_COMMAND = TOPIC_BASE + "/command";
-  TOPIC_OTA = TOPIC_BASE + "/ota";
+  device.begin(DEVICE_ID.c_str());
+  mqttDispatcher.setBaseTopic(device.topics().base());
+  offlineQueue.setBaseTopic(device.topics().base());
+  mqttDispatcher.setSharedRoute([](const char* topic) { return localRules.matches(topic) || topicGroups.contains(topic); },
+                                 handleSharedTopic);
 }
 
 void connectToWiFi() {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Connecting to WiFi...");
+  // Only starts the join; ConnectionManager polls WiFi.status() and
+  // retries with backoff if it does not come up in time.
+  Serial.println("Connecting to WiFi...");
+  if (!fastBoot.join()) {
     WiFi.begin();
-    
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
-    
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("\nWiFi connected!");
-    } else {
-      Serial.println("\nWiFi connection failed, will retry...");
-    }
   }
 }
 
-void connectToMQTT() {
-  if (WiFi.status() != WL_CONNECTED) return;
-  
+bool connectToMQTT() {
   Serial.println("Connecting to MQTT...");
   
-  String willTopic = TOPIC_ONLINE;
-  String willMessage = "{\"online\":false}";
+  // The link is up: cache its AP for the next boot
+  fastBoot.linkUp();
   
-  if (mqttClient.connect(DEVICE_ID.c_str(), MQTT_USER, MQTT_PASSWORD, 
-                        willTopic.c_str(), 1, true, willMessage.c_str())) {
+  if (device.connect(MQTT_USER, MQTT_PASSWORD)) {
     Serial.println("MQTT connected!");
+    fastBoot.mark(ha::FastBoot::BROKER);
     
-    mqttClient.subscribe(TOPIC_COMMAND.c_str());
-    mqttClient.subscribe(TOPIC_OTA.c_str());
-    
-    publishOnlineStatus(true);
-    publishStatus();
+    // A resumed session still has the subscriptions, and the broker
+    // delivers the QoS1 commands it queued meanwhile
+    bool resumed = device.resumed();
+    if (!resumed) {
+      device.subscribe(ha::topic::COMMAND);
+      device.subscribe(ha::topic::OTA);
+      device.subscribe(ha::topic::REPLAY);
+      topicGroups.subscribeAll();
+      localRules.subscribeAll();
+    }
     
-    switchState.online = true;
-  } else {
-    Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
-    switchState.online = false;
+    device.publishOnline(true);
+    if (!resumed || !device.statusCurrent()) {
+      device.publishStatus();
+    }
+    stateTracker.markDirty(FIELD_ALL);
+    return true;
+  }
+  
+  // The async transport is still waiting for the broker; ConnectionManager
+  // calls back in once it has answered
+  if (device.connecting()) {
+    return false;
   }
+  
+  Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
+  return false;
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String topicStr = String(topic);
-  String message = "";
+  HA_TIME_SCOPE(MqttCallback);
+  mqttDispatcher.dispatch(topic, payload, length);
+}
+
+void handleCommand(JsonDocument& doc) {
+  CommandEffects effects;
+  JsonArray batch = doc["commands"];
   
-  for (int i = 0; i < length; i++) {
-    message += (char)payload[i];
+  if (batch.isNull()) {
+    runCommand(doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    // {"commands": [{"command": ..., "parameters": {...}}, ...]}, applied
+    // together: one relay change and one state publish
+    for (JsonObject entry : batch) {
+      runCommand(entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
   }
   
-  Serial.println("Received [" + topicStr + "]: " + message);
-  
-  StaticJsonDocument<512> doc;
-  DeserializationError error = deserializeJson(doc, message);
-  
-  if (error) {
-    Serial.println("Failed to parse JSON: " + String(error.c_str()));
-    return;
+  finishCommands(effects);
+}
+
+void handleSharedTopic(JsonDocument& doc) {
+  // State or events of a peer the local rules follow, else a group or
+  // scene command
+  if (localRules.matched()) {
+    localRules.evaluate(doc);
+  } else {
+    handleCommand(doc);
   }
+}
+
+void runCommand(const char* command, JsonObject parameters, CommandEffects& effects) {
+  Serial.print("Handling command: ");
+  Serial.println(command ? command : "(none)");
   
-  if (topicStr == TOPIC_COMMAND) {
-    handleCommand(doc);
-  } else if (topicStr == TOPIC_OTA) {
-    handleOTACommand(doc);
+  if (!ha::dispatchCommand(COMMANDS, command, parameters, effects)) {
+    Serial.println("Unknown command ignored");
   }
 }
 
-void handleCommand(JsonDocument& doc) {
-  String command = doc["command"];
-  JsonObject parameters = doc["parameters"];
+void commandSetPower(JsonObject parameters, CommandEffects&) {
+  stateTracker.update(switchState.power, parameters["power"].as<bool>(), FIELD_POWER);
+}
+
+void commandToggle(JsonObject, CommandEffects&) {
+  stateTracker.update(switchState.power, !switchState.power, FIELD_POWER);
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetGroups(JsonObject parameters, CommandEffects& effects) {
+  // {"groups": [...], "scenes": [...]}; subscriptions move in finishCommands()
+  if (!topicGroups.stage(parameters)) {
+    Serial.println("Invalid group membership ignored");
+  }
+  effects.status = true;
+}
+
+void commandSetRules(JsonObject parameters, CommandEffects& effects) {
+  // {"rules": [...]}; subscriptions move in finishCommands()
+  if (!localRules.stage(parameters)) {
+    Serial.println("Invalid rules ignored");
+  }
+  effects.status = true;
+}
+
+void commandRestart(JsonObject, CommandEffects& effects) {
+  effects.restart = true;
+}
+
+void finishCommands(const CommandEffects& effects) {
+  topicGroups.commit();
+  localRules.commit();
   
-  Serial.println("Handling command: " + command);
+  if (effects.status) {
+    device.publishStatus();
+  }
   
-  if (command == "set_power") {
-    switchState.power = parameters["power"];
+  // Apply and report only what actually changed
+  bool changed = stateTracker.isDirty();
+  if (changed) {
     updateRelay();
+  }
+  if (changed || effects.state) {
     publishState();
-  } else if (command == "toggle") {
-    switchState.power = !switchState.power;
-    updateRelay();
-    publishState();
-  } else if (command == "get_status") {
-    publishStatus();
-    publishState();
-  } else if (command == "restart") {
+  }
+  
+  saveState();
+  
+  if (effects.restart) {
     Serial.println("Restart command received");
-    publishOnlineStatus(false);
+    device.publishOnline(false);
+    savedState.flush();
     delay(1000);
     ESP.restart();
   }
-  
-  saveStateToEEPROM();
+}
+
+void handleReplayAck(JsonDocument& doc) {
+  // Our own replay marker, echoed back by the broker
+  offlineQueue.acknowledge(doc["seq"].as<uint32_t>());
 }
 
 void handleOTACommand(JsonDocument& doc) {
-  String action = doc["action"];
-  
-  if (action == "update") {
-    otaUrl = doc["url"].as<String>();
-    Serial.println("OTA update requested: " + otaUrl);
-    otaInProgress = true;
-  } else if (action == "check") {
-    StaticJsonDocument<200> response;
-    response["device_id"] = DEVICE_ID;
-    response["current_version"] = FIRMWARE_VERSION;
-    response["status"] = "ready_for_update";
-    
-    String responseStr;
-    serializeJson(response, responseStr);
-    mqttClient.publish(TOPIC_STATUS.c_str(), responseStr.c_str());
+  CommandEffects effects;
+  if (!ha::dispatchCommand(OTA_ACTIONS, doc["action"].as<const char*>(), doc.as<JsonObject>(), effects)) {
+    Serial.println("Unknown OTA action");
   }
 }
 
+void otaActionUpdate(JsonObject request, CommandEffects&) {
+  // "checksum" is the image SHA-256, as the OTA service sends it
+  const char* url = request["url"];
+  Serial.print("OTA update requested: ");
+  Serial.println(url ? url : "(none)");
+  ota.start(url, request["checksum"].as<const char*>(), request["size"] | 0, request["start_window"] | 0,
+            request["require_grant"] | false);
+}
+
+void otaActionCheck(JsonObject, CommandEffects&) {
+  device.publishOtaCheck();
+}
+
+void otaActionGrant(JsonObject request, CommandEffects&) {
+  // Download slot for a scheduled update
+  ota.grant(request["token"]);
+}
+
+void otaActionRetryAfter(JsonObject request, CommandEffects&) {
+  ota.retryAfter(request["seconds"] | 0);
+}
+
 void updateRelay() {
   digitalWrite(RELAY_PIN, switchState.power ? HIGH : LOW);
   digitalWrite(LED_PIN, switchState.power ? LOW : HIGH); // LED is inverted
@@ -376,117 +657,64 @@ void IRAM_ATTR buttonISR() {
 
 void handleButton() {
   Serial.println("Button pressed - toggling power");
-  switchState.power = !switchState.power;
+  stateTracker.update(switchState.power, !switchState.power, FIELD_POWER);
   updateRelay();
   publishState();
-  saveStateToEEPROM();
-}
-
-void publishStatus() {
-  StaticJsonDocument<300> doc;
-  doc["device_id"] = DEVICE_ID;
-  doc["device_type"] = DEVICE_TYPE;
-  doc["firmware_version"] = FIRMWARE_VERSION;
-  doc["mac_address"] = MAC_ADDRESS;
-  doc["ip_address"] = WiFi.localIP().toString();
-  doc["online"] = switchState.online;
-  doc["wifi_rssi"] = WiFi.RSSI();
-  doc["free_heap"] = ESP.getFreeHeap();
-  doc["uptime"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATUS.c_str(), message.c_str(), true);
-  }
+  saveState();
 }
 
-void publishState() {
-  StaticJsonDocument<150> doc;
-  doc["power"] = switchState.power;
-  doc["timestamp"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_STATE.c_str(), message.c_str());
-  }
+void SwitchTraits::reportStatus(JsonDocument& status) {
+  mqttDispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+#if defined(HA_ASYNC_MQTT)
+  mqttClient.reportStats(status.createNestedObject("mqtt_tx"));
+#endif
+  connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+  offlineQueue.reportStats(status.createNestedObject("offline_queue"));
+  topicGroups.reportStats(status.createNestedObject("groups"));
+  localRules.reportStats(status.createNestedObject("rules"));
+  savedState.reportStats(status.createNestedObject("persistence"));
+  ota.reportStats(status.createNestedObject("ota"));
+  fastBoot.reportStats(status.createNestedObject("boot"));
 }
 
-void publishOnlineStatus(bool online) {
-  StaticJsonDocument<100> doc;
-  doc["online"] = online;
-  doc["timestamp"] = millis();
-  
-  String message;
-  serializeJson(doc, message);
-  
-  if (mqttClient.connected()) {
-    mqttClient.publish(TOPIC_ONLINE.c_str(), message.c_str(), true);
+bool publishState() {
+  HA_ASSERT_NO_ALLOC("publishState");
+  StaticJsonDocument<STATE_CAPACITY> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.set(ha::keys::POWER, switchState.power);
+  state.set(ha::keys::TIMESTAMP, millis());
+  
+  uint8_t payload[STATE_PAYLOAD];
+  size_t length = state.serialize(payload, sizeof(payload));
+  
+  // Offline (or while older messages are still queued) this goes to flash
+  if (length == 0 || !offlineQueue.publish(ha::Topic(device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload, length)) {
+    return false;
   }
   
-  switchState.online = online;
+  stateTracker.published(millis());
+  // Only one that reached the broker counts, not one queued to flash
+  if (fastBoot.marked(ha::FastBoot::BROKER)) {
+    fastBoot.mark(ha::FastBoot::FIRST_STATE);
+  }
+  return true;
 }
 
-void saveStateToEEPROM() {
-  EEPROM.write(0, switchState.power ? 1 : 0);
-  EEPROM.commit();
+void saveState() {
+  SwitchRecord record = { (uint8_t)(switchState.power ? 1 : 0) };
+  savedState.update(record, millis());
 }
 
-void loadStateFromEEPROM() {
-  switchState.power = EEPROM.read(0) == 1;
-  Serial.println("State loaded from EEPROM:");
+void loadState() {
+  SwitchRecord record;
+  if (savedState.load(record)) {
+    switchState.power = record.power == 1;
+  } else {
+    // Nothing saved yet: fall back to the byte used by older firmware
+    switchState.power = EEPROM.read(0) == 1;
+  }
+  Serial.println("State loaded:");
   Serial.println("  Power: " + String(switchState.power));
 }
-
-void performOTAUpdate() {
-  if (otaUrl.length() == 0) {
-    otaInProgress = false;
-    return;
-  }
-  
-  Serial.println("Starting OTA update from: " + otaUrl);
-  
-  StaticJsonDocument<200> status;
-  status["device_id"] = DEVICE_ID;
-  status["status"] = "updating";
-  status["progress"] = 0;
-  
-  String statusStr;
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
-  
-  WiFiClient client;
-  t_httpUpdate_return ret = ESPhttpUpdate.update(client, otaUrl);
-  
-  switch (ret) {
-    case HTTP_UPDATE_FAILED:
-      Serial.println("OTA Update failed: " + ESPhttpUpdate.getLastErrorString());
-      status["status"] = "failed";
-      status["error"] = ESPhttpUpdate.getLastErrorString();
-      break;
-      
-    case HTTP_UPDATE_NO_UPDATES:
-      Serial.println("No OTA updates available");
-      status["status"] = "no_update";
-      break;
-      
-    case HTTP_UPDATE_OK:
-      Serial.println("OTA Update successful, restarting...");
-      status["status"] = "success";
-      break;
-  }
-  
-  serializeJson(status, statusStr);
-  mqttClient.publish(TOPIC_STATUS.c_str(), statusStr.c_str());
-  
-  otaInProgress = false;
-  otaUrl = "";
-  
-  if (ret == HTTP_UPDATE_OK) {
-    delay(2000);
-    ESP.restart();
-  }
-}
\ No newline at end of file
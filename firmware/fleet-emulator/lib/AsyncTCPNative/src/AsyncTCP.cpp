@@ -0,0 +1,482 @@
+#include "AsyncTCP.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+AsyncTcpFaults asyncTcpFaults;
+AsyncTcpStats asyncTcpStats;
+
+namespace {
+// A connection its owner gave up on while the peer was out of reach. The
+// socket stays open, as the broker has not been told, until the network
+// is back (then it is reset, as the station would) or the broker has
+// surely timed it out.
+struct HalfOpen {
+  int fd;
+  AsyncTcpLink* link;
+  bool silent;
+  unsigned long closeAt;
+};
+
+const unsigned long HALF_OPEN_MAX = 180000;
+const unsigned long NO_DEADLINE = 0xFFFFFFFFUL;
+const int MAX_READS_PER_POLL = 64;
+
+std::vector<AsyncClient*> clients;
+std::vector<HalfOpen> halfOpen;
+AsyncTcpLink* currentLink = nullptr;
+
+std::mt19937& rng() {
+  static std::mt19937 generator(asyncTcpFaults.seed);
+  return generator;
+}
+
+double uniform() {
+  return std::uniform_real_distribution<double>(0, 1)(rng());
+}
+
+bool reachable(const AsyncTcpLink* link) {
+  return !link || (link->up && !asyncTcpFaults.partitioned);
+}
+
+void resetAndClose(int fd) {
+  struct linger hard = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+  ::close(fd);
+}
+
+void sweepHalfOpen(unsigned long now) {
+  for (size_t i = 0; i < halfOpen.size();) {
+    HalfOpen& entry = halfOpen[i];
+    if ((long)(now - entry.closeAt) >= 0 || (!entry.silent && reachable(entry.link))) {
+      resetAndClose(entry.fd);
+      entry = halfOpen.back();
+      halfOpen.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
+bool resolve(const char* host, uint16_t port, sockaddr_in& address) {
+  static std::map<std::string, in_addr> cache;
+  auto found = cache.find(host);
+  if (found == cache.end()) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host, nullptr, &hints, &result) != 0 || !result) {
+      return false;
+    }
+    in_addr resolved = reinterpret_cast<sockaddr_in*>(result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    found = cache.emplace(host, resolved).first;
+  }
+  address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr = found->second;
+  return true;
+}
+}  // namespace
+
+void asyncTcpUseLink(AsyncTcpLink* link) {
+  currentLink = link;
+}
+
+void asyncTcpPoll(unsigned long timeoutMs) {
+  static std::vector<AsyncClient*> polled;
+  static std::vector<pollfd> fds;
+  static std::vector<int> slots;
+  unsigned long now = millis();
+
+  // Callbacks may close and reopen clients, so this pass works on a copy
+  polled = clients;
+  fds.clear();
+  slots.clear();
+  unsigned long wait = timeoutMs;
+  for (AsyncClient* client : polled) {
+    wait = std::min(wait, client->nextDeadline(now));
+    int events = client->pollEvents();
+    slots.push_back(events ? (int)fds.size() : -1);
+    if (events) {
+      fds.push_back({ client->_fd, (short)events, 0 });
+    }
+  }
+  if (fds.empty()) {
+    if (wait) {
+      delay(wait);
+    }
+  } else {
+    poll(fds.data(), fds.size(), (int)wait);
+  }
+
+  now = millis();
+  for (size_t i = 0; i < polled.size(); i++) {
+    AsyncClient* client = polled[i];
+    int slot = slots[i];
+    int events = slot >= 0 && fds[slot].fd == client->_fd ? fds[slot].revents : 0;
+    client->service(events, now);
+  }
+  sweepHalfOpen(now);
+}
+
+AsyncClient::~AsyncClient() {
+  if (_phase != Phase::Closed) {
+    shut(true);
+  }
+}
+
+void AsyncClient::onConnect(ConnectHandler handler, void* arg) {
+  _connectHandler = handler;
+  _connectArg = arg;
+}
+
+void AsyncClient::onDisconnect(ConnectHandler handler, void* arg) {
+  _disconnectHandler = handler;
+  _disconnectArg = arg;
+}
+
+void AsyncClient::onData(DataHandler handler, void* arg) {
+  _dataHandler = handler;
+  _dataArg = arg;
+}
+
+bool AsyncClient::connect(const char* host, uint16_t port) {
+  if (_phase != Phase::Closed) {
+    return false;
+  }
+  asyncTcpStats.connects++;
+  _link = currentLink;
+  _silent = false;
+  _openAt = 0;
+  _dropAt = 0;
+  _lastRelease = 0;
+
+  // Refused as by an unreachable port: the disconnect comes from a poll
+  if (_link && uniform() < asyncTcpFaults.connectFailure) {
+    asyncTcpStats.refused++;
+    _phase = Phase::Refused;
+    enlist();
+    return true;
+  }
+
+  sockaddr_in address;
+  if (!resolve(host, port, address)) {
+    asyncTcpStats.failed++;
+    return false;
+  }
+  _fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0) {
+    asyncTcpStats.failed++;
+    return false;
+  }
+  fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+  int flag = _noDelay ? 1 : 0;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  if (::connect(_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 && errno != EINPROGRESS) {
+    ::close(_fd);
+    _fd = -1;
+    asyncTcpStats.failed++;
+    return false;
+  }
+  _phase = Phase::Connecting;
+  enlist();
+  return true;
+}
+
+void AsyncClient::close(bool now) {
+  if (_phase == Phase::Closed) {
+    return;
+  }
+  shut(now);
+  if (_disconnectHandler) {
+    _disconnectHandler(_disconnectArg, this);
+  }
+}
+
+size_t AsyncClient::space() const {
+  if (_phase != Phase::Open) {
+    return 0;
+  }
+  size_t used = _unsent.size() + _outboundBytes;
+  return used < SEND_BUFFER ? SEND_BUFFER - used : 0;
+}
+
+size_t AsyncClient::add(const char* data, size_t size, uint8_t) {
+  size = std::min(size, space());
+  _unsent.append(data, size);
+  return size;
+}
+
+bool AsyncClient::send() {
+  if (_phase != Phase::Open || _unsent.empty()) {
+    return false;
+  }
+  // Written by the next poll, as lwIP's thread would
+  _outboundBytes += _unsent.size();
+  _outbound.push_back({ delay(), std::move(_unsent), 0 });
+  _unsent.clear();
+  return true;
+}
+
+bool AsyncClient::stalled() const {
+  return _silent || !reachable(_link);
+}
+
+// When data handed over now arrives at the other end: the added latency,
+// never overtaking what was sent before
+unsigned long AsyncClient::delay() {
+  unsigned long now = millis();
+  if (!_link) {
+    return now;
+  }
+  unsigned long at = now + asyncTcpFaults.latencyMs;
+  if (asyncTcpFaults.jitterMs) {
+    at += rng()() % (asyncTcpFaults.jitterMs + 1);
+  }
+  if (_lastRelease && (long)(_lastRelease - at) > 0) {
+    at = _lastRelease;
+  }
+  _lastRelease = at;
+  return at;
+}
+
+int AsyncClient::pollEvents() const {
+  if (_fd < 0 || stalled()) {
+    return 0;
+  }
+  if (_phase == Phase::Connecting) {
+    return _openAt ? 0 : POLLOUT;
+  }
+  int events = POLLIN;
+  if (!_outbound.empty() && (long)(millis() - _outbound.front().releaseAt) >= 0) {
+    events |= POLLOUT;
+  }
+  return events;
+}
+
+unsigned long AsyncClient::nextDeadline(unsigned long now) const {
+  if (_phase == Phase::Refused) {
+    return 0;
+  }
+  if (stalled()) {
+    return NO_DEADLINE;
+  }
+  unsigned long deadline = NO_DEADLINE;
+  auto consider = [&](unsigned long at) {
+    long until = (long)(at - now);
+    deadline = std::min(deadline, until > 0 ? (unsigned long)until : 0UL);
+  };
+  if (_openAt) {
+    consider(_openAt);
+  }
+  if (_dropAt) {
+    consider(_dropAt);
+  }
+  if (!_outbound.empty()) {
+    consider(_outbound.front().releaseAt);
+  }
+  if (!_inbound.empty()) {
+    consider(_inbound.front().releaseAt);
+  }
+  return deadline;
+}
+
+void AsyncClient::service(int events, unsigned long now) {
+  switch (_phase) {
+    case Phase::Closed:
+      break;
+
+    case Phase::Refused:
+      fail(false);
+      break;
+
+    case Phase::Connecting:
+      if (stalled()) {
+        break;
+      }
+      if (!_openAt && (events & (POLLOUT | POLLERR | POLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error) {
+          asyncTcpStats.failed++;
+          fail(false);
+          break;
+        }
+        // The handshake took a round trip
+        _openAt = now + 2 * (delay() - now);
+      }
+      if (_openAt && (long)(now - _openAt) >= 0) {
+        finishConnect(now);
+      }
+      break;
+
+    case Phase::Open:
+      if (stalled()) {
+        break;
+      }
+      if (_dropAt && (long)(now - _dropAt) >= 0) {
+        _dropAt = 0;
+        if (uniform() < asyncTcpFaults.silentDrops) {
+          // Gone quiet, as after a NAT or access point lost the flow
+          asyncTcpStats.silenced++;
+          _silent = true;
+        } else {
+          asyncTcpStats.resets++;
+          fail(false);
+        }
+        break;
+      }
+      if (events & (POLLIN | POLLHUP | POLLERR)) {
+        readAvailable();
+      }
+      if (_phase == Phase::Open) {
+        deliverDue(now);
+      }
+      if (_phase == Phase::Open) {
+        writeDue(now);
+      }
+      break;
+  }
+}
+
+void AsyncClient::finishConnect(unsigned long now) {
+  _phase = Phase::Open;
+  _openAt = 0;
+  asyncTcpStats.established++;
+  asyncTcpStats.open++;
+  if (_link && asyncTcpFaults.dropMtbfMs) {
+    // Exponential lifetimes: drops arrive at a steady rate across the fleet
+    _dropAt = now + (unsigned long)(-log(1 - uniform()) * asyncTcpFaults.dropMtbfMs) + 1;
+  }
+  if (_connectHandler) {
+    _connectHandler(_connectArg, this);
+  }
+}
+
+void AsyncClient::writeDue(unsigned long now) {
+  while (!_outbound.empty() && (long)(now - _outbound.front().releaseAt) >= 0) {
+    Chunk& chunk = _outbound.front();
+    ssize_t written = ::send(_fd, chunk.data.data() + chunk.offset, chunk.data.size() - chunk.offset, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fail(true);
+      }
+      return;
+    }
+    asyncTcpStats.bytesSent += written;
+    chunk.offset += written;
+    if (chunk.offset < chunk.data.size()) {
+      return;
+    }
+    _outboundBytes -= chunk.data.size();
+    _outbound.pop_front();
+  }
+}
+
+void AsyncClient::readAvailable() {
+  char buffer[MSS];
+  for (int i = 0; i < MAX_READS_PER_POLL; i++) {
+    ssize_t length = recv(_fd, buffer, sizeof(buffer), 0);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    bool closed = length <= 0;
+    if (!closed) {
+      asyncTcpStats.bytesReceived += length;
+    }
+    if (!_link || (!asyncTcpFaults.latencyMs && !asyncTcpFaults.jitterMs && _inbound.empty())) {
+      if (closed) {
+        fail(true);
+        return;
+      }
+      if (_dataHandler) {
+        _dataHandler(_dataArg, this, buffer, length);
+      }
+      if (_phase != Phase::Open) {
+        return;
+      }
+    } else {
+      _inbound.push_back({ delay(), closed ? std::string() : std::string(buffer, length), 0 });
+    }
+    if (closed) {
+      return;
+    }
+  }
+}
+
+void AsyncClient::deliverDue(unsigned long now) {
+  while (!_inbound.empty() && (long)(now - _inbound.front().releaseAt) >= 0) {
+    std::string data = std::move(_inbound.front().data);
+    _inbound.pop_front();
+    if (data.empty()) {
+      fail(true);
+      return;
+    }
+    if (_dataHandler) {
+      _dataHandler(_dataArg, this, &data[0], data.size());
+    }
+    if (_phase != Phase::Open) {
+      return;
+    }
+  }
+}
+
+void AsyncClient::fail(bool remote) {
+  if (remote) {
+    asyncTcpStats.remoteCloses++;
+  }
+  close(!remote);
+}
+
+void AsyncClient::shut(bool reset) {
+  if (_fd >= 0) {
+    if (stalled()) {
+      halfOpen.push_back({ _fd, _link, _silent, millis() + HALF_OPEN_MAX });
+    } else if (reset) {
+      resetAndClose(_fd);
+    } else {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+  if (_phase == Phase::Open) {
+    asyncTcpStats.open--;
+  }
+  _phase = Phase::Closed;
+  _unsent.clear();
+  _outbound.clear();
+  _outboundBytes = 0;
+  _inbound.clear();
+  delist();
+}
+
+// Registered while not closed; the slot makes leaving constant time,
+// which matters when a whole fleet drops at once
+void AsyncClient::enlist() {
+  _slot = clients.size();
+  clients.push_back(this);
+}
+
+void AsyncClient::delist() {
+  AsyncClient* last = clients.back();
+  clients[_slot] = last;
+  last->_slot = _slot;
+  clients.pop_back();
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+
+// AsyncTCP's AsyncClient on non-blocking host sockets, so AsyncMqtt runs
+// unchanged in a host process. One thread drives every client: each
+// asyncTcpPoll() waits on all sockets at once and runs the callbacks, so
+// as on the ESP they come in between the owner's loop() calls, and
+// thousands of connections need no thread each.
+//
+// The parts of lwIP AsyncMqtt depends on are kept: space() is bounded by
+// the ESP32's send buffer, data arrives in MSS-sized pieces and close()
+// reports the disconnect before it returns.
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+// The network a connection rides on, e.g. an emulated device's WiFi.
+// While it is down the connection neither sends nor receives, as with a
+// station out of range: it either recovers or its owner times it out.
+struct AsyncTcpLink {
+  bool up = true;
+};
+
+// Faults for connections opened on a link (see asyncTcpUseLink); others,
+// like a load generator's, get a clean network.
+struct AsyncTcpFaults {
+  float connectFailure = 0;          // share of connects refused
+  unsigned long latencyMs = 0;       // added one way, each way
+  unsigned long jitterMs = 0;        // up to this much more, per send
+  unsigned long dropMtbfMs = 0;      // mean connection lifetime, 0 = forever
+  float silentDrops = 0;             // share of drops that go quiet instead of resetting
+  bool partitioned = false;          // broker unreachable: connects hang, traffic stalls
+  uint32_t seed = 1;
+};
+
+struct AsyncTcpStats {
+  uint32_t connects = 0;
+  uint32_t established = 0;
+  uint32_t refused = 0;        // injected
+  uint32_t failed = 0;         // by the host or the broker
+  uint32_t resets = 0;         // injected
+  uint32_t silenced = 0;       // injected
+  uint32_t remoteCloses = 0;
+  uint32_t open = 0;
+  uint64_t bytesSent = 0;
+  uint64_t bytesReceived = 0;
+};
+
+extern AsyncTcpFaults asyncTcpFaults;
+extern AsyncTcpStats asyncTcpStats;
+
+// Connections opened from here on ride link; nullptr for none.
+void asyncTcpUseLink(AsyncTcpLink* link);
+
+// Moves data and runs callbacks for every client, waiting up to
+// timeoutMs for something to happen.
+void asyncTcpPoll(unsigned long timeoutMs);
+
+class AsyncClient {
+ public:
+  typedef std::function<void(void*, AsyncClient*)> ConnectHandler;
+  typedef std::function<void(void*, AsyncClient*, void* data, size_t length)> DataHandler;
+
+  // lwIP's TCP_SND_BUF and TCP_MSS in the ESP32 Arduino core
+  static const size_t SEND_BUFFER = 5744;
+  static const size_t MSS = 1436;
+
+  AsyncClient() {}
+  ~AsyncClient();
+  AsyncClient(const AsyncClient&) = delete;
+  AsyncClient& operator=(const AsyncClient&) = delete;
+
+  void onConnect(ConnectHandler handler, void* arg = nullptr);
+  void onDisconnect(ConnectHandler handler, void* arg = nullptr);
+  void onData(DataHandler handler, void* arg = nullptr);
+  void setNoDelay(bool noDelay) { _noDelay = noDelay; }
+
+  // Starts the connect; onConnect or onDisconnect follows from a poll.
+  // The host name is resolved once and remembered.
+  bool connect(const char* host, uint16_t port);
+  bool connected() const { return _phase == Phase::Open; }
+  // Drops the connection (a reset with now) and reports the disconnect.
+  void close(bool now = false);
+
+  size_t space() const;
+  size_t add(const char* data, size_t size, uint8_t flags = ASYNC_WRITE_FLAG_COPY);
+  bool send();
+
+ private:
+  friend void asyncTcpPoll(unsigned long timeoutMs);
+
+  enum class Phase : uint8_t { Closed, Refused, Connecting, Open };
+
+  struct Chunk {
+    unsigned long releaseAt;
+    std::string data;
+    size_t offset;
+  };
+
+  bool stalled() const;
+  unsigned long delay();
+  int pollEvents() const;
+  void service(int events, unsigned long now);
+  void finishConnect(unsigned long now);
+  void writeDue(unsigned long now);
+  void readAvailable();
+  void deliverDue(unsigned long now);
+  void fail(bool remote);
+  void shut(bool reset);
+  unsigned long nextDeadline(unsigned long now) const;
+  void enlist();
+  void delist();
+
+  int _fd = -1;
+  size_t _slot = 0;
+  Phase _phase = Phase::Closed;
+  AsyncTcpLink* _link = nullptr;
+  bool _noDelay = false;
+  bool _silent = false;
+  unsigned long _openAt = 0;      // connect answered; onConnect once the RTT has passed
+  unsigned long _dropAt = 0;
+  unsigned long _lastRelease = 0;
+
+  std::string _unsent;
+  std::deque<Chunk> _outbound;
+  size_t _outboundBytes = 0;
+  std::deque<Chunk> _inbound;     // an empty chunk marks the peer's close
+
+  ConnectHandler _connectHandler;
+  void* _connectArg = nullptr;
+  ConnectHandler _disconnectHandler;
+  void* _disconnectArg = nullptr;
+  DataHandler _dataHandler;
+  void* _dataArg = nullptr;
+};
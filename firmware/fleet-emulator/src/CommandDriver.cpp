@@ -0,0 +1,303 @@
+#include "CommandDriver.h"
+
+#include <algorithm>
+
+namespace fleet {
+
+namespace {
+const char DEVICE_TOPIC_PREFIX[] = "homeautomation/devices/";
+const uint16_t KEEP_ALIVE = 60;
+const unsigned long PING_INTERVAL = 30000;
+const unsigned long RETRY_INTERVAL = 1000;
+}  // namespace
+
+double LatencySamples::percentileMs(double fraction) const {
+  if (_samples.empty()) {
+    return 0;
+  }
+  std::vector<uint32_t> sorted(_samples);
+  size_t rank = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+  std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+  return sorted[rank] / 1000.0;
+}
+
+double LatencySamples::maxMs() const {
+  return _samples.empty() ? 0 : *std::max_element(_samples.begin(), _samples.end()) / 1000.0;
+}
+
+CommandDriver::CommandDriver(const BrokerConfig& broker, Fleet& fleet, uint32_t seed)
+    : _broker(broker), _fleet(fleet), _rng(seed ? seed : 1) {
+  snprintf(_clientId, sizeof(_clientId), "fleet-driver-%08lx", (unsigned long)seed);
+  _index.reserve(fleet.size());
+  for (size_t i = 0; i < fleet.size(); i++) {
+    _index[fleet.device(i).id()] = i;
+  }
+  _outstanding.assign(fleet.size(), 0);
+  _sentAtUs.assign(fleet.size(), 0);
+
+  _client.onConnect([this](void*, AsyncClient*) {
+    // CONNECT, clean session: nothing queued for us from an earlier run
+    std::string body;
+    appendString(body, "MQTT");
+    body += (char)4;
+    uint8_t flags = 0x02;
+    if (_broker.user) {
+      flags |= 0x80;
+    }
+    if (_broker.password) {
+      flags |= 0x40;
+    }
+    body += (char)flags;
+    appendShort(body, KEEP_ALIVE);
+    appendString(body, _clientId);
+    if (_broker.user) {
+      appendString(body, _broker.user);
+    }
+    if (_broker.password) {
+      appendString(body, _broker.password);
+    }
+    queuePacket(CONNECT << 4, body);
+  });
+  _client.onDisconnect([this](void*, AsyncClient*) {
+    // Commands in flight are lost with the subscription; they expire
+    _connecting = false;
+    _ready = false;
+    _retryAt = millis() + RETRY_INTERVAL;
+    _rx.clear();
+    _tx.clear();
+  });
+  _client.onData([this](void*, AsyncClient*, void* data, size_t length) {
+    onData(static_cast<const uint8_t*>(data), length);
+  });
+}
+
+void CommandDriver::start(float rate, unsigned long timeoutMs) {
+  _rate = rate;
+  _timeoutMs = timeoutMs;
+  _credit = 0;
+  _lastSend = millis();
+}
+
+void CommandDriver::service(unsigned long now) {
+  if (!_connecting && !_ready && (long)(now - _retryAt) >= 0) {
+    connect(now);
+  }
+  if (_ready) {
+    if (now - _lastPing >= PING_INTERVAL) {
+      queuePacket(PINGREQ << 4, std::string());
+      _lastPing = now;
+    }
+    sendCommands(now);
+  }
+  expire(now);
+  flush();
+}
+
+void CommandDriver::connect(unsigned long now) {
+  _client.setNoDelay(true);
+  _connecting = _client.connect(_broker.host, _broker.port);
+  if (!_connecting) {
+    _retryAt = now + RETRY_INTERVAL;
+  }
+}
+
+void CommandDriver::sendCommands(unsigned long now) {
+  if (_rate <= 0) {
+    return;
+  }
+  // A slow pass owes at most a second's worth, not a burst
+  _credit = std::min(_credit + _rate * (now - _lastSend) / 1000.0, std::max(1.0, (double)_rate));
+  _lastSend = now;
+  while (_credit >= 1) {
+    _credit -= 1;
+    bool sent = false;
+    for (int attempt = 0; attempt < 8 && !sent; attempt++) {
+      size_t device = random() % _fleet.size();
+      if (!_outstanding[device] && _fleet.device(device).online()) {
+        sent = sendCommand(device);
+      }
+    }
+    if (!sent) {
+      _stats.skipped++;
+    }
+  }
+}
+
+bool CommandDriver::sendCommand(size_t device) {
+  VirtualDevice& target = _fleet.device(device);
+  std::string topic(DEVICE_TOPIC_PREFIX);
+  topic += target.id();
+  topic += ha::topic::COMMAND;
+
+  // QoS1, as the backend sends them; the PUBACK is not waited for
+  if (++_packetId == 0) {
+    _packetId = 1;
+  }
+  std::string body;
+  appendString(body, topic.data(), topic.size());
+  appendShort(body, _packetId);
+  body += target.sampleCommand();
+  queuePacket(PUBLISH << 4 | 0x02, body);
+
+  if (++_serial == 0) {
+    _serial = 1;
+  }
+  _outstanding[device] = _serial;
+  _sentAtUs[device] = micros();
+  _pending.push_back({ device, _serial, millis() });
+  _stats.sent++;
+  return true;
+}
+
+void CommandDriver::expire(unsigned long now) {
+  while (!_pending.empty()) {
+    const Pending& oldest = _pending.front();
+    if (_outstanding[oldest.device] == oldest.serial) {
+      if (now - oldest.sentAt < _timeoutMs) {
+        break;
+      }
+      _outstanding[oldest.device] = 0;
+      _stats.lost++;
+    }
+    _pending.pop_front();
+  }
+}
+
+void CommandDriver::queuePacket(uint8_t header, const std::string& body) {
+  _tx += (char)header;
+  size_t remaining = body.size();
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    _tx += (char)(remaining ? digit | 0x80 : digit);
+  } while (remaining);
+  _tx += body;
+  flush();
+}
+
+void CommandDriver::flush() {
+  if (_tx.empty() || !_client.connected()) {
+    return;
+  }
+  size_t added = _client.add(_tx.data(), _tx.size());
+  if (added) {
+    _client.send();
+    _tx.erase(0, added);
+  }
+}
+
+void CommandDriver::onData(const uint8_t* data, size_t length) {
+  _rx.append(reinterpret_cast<const char*>(data), length);
+  size_t offset = 0;
+  while (_rx.size() - offset >= 2) {
+    const uint8_t* packet = reinterpret_cast<const uint8_t*>(_rx.data()) + offset;
+    size_t available = _rx.size() - offset;
+    size_t remaining = 0;
+    size_t header = 1;
+    bool complete = false;
+    for (int shift = 0; header < available && shift < 28; shift += 7) {
+      uint8_t digit = packet[header++];
+      remaining |= (size_t)(digit & 0x7F) << shift;
+      if (!(digit & 0x80)) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete || available - header < remaining) {
+      break;
+    }
+    handlePacket(packet[0], packet + header, remaining);
+    if (!_client.connected()) {
+      return;
+    }
+    offset += header + remaining;
+  }
+  _rx.erase(0, offset);
+}
+
+void CommandDriver::handlePacket(uint8_t header, const uint8_t* body, size_t length) {
+  switch (header >> 4) {
+    case CONNACK:
+      if (length < 2 || body[1] != 0) {
+        fprintf(stderr, "Command driver: broker refused the connection (%d)\n", length < 2 ? -1 : body[1]);
+        _client.close();
+        return;
+      }
+      {
+        std::string subscribe;
+        appendShort(subscribe, 1);
+        appendString(subscribe, "homeautomation/devices/+/state");
+        subscribe += (char)0;
+        appendString(subscribe, "homeautomation/devices/+/state/bin");
+        subscribe += (char)0;
+        queuePacket(SUBSCRIBE << 4 | 0x02, subscribe);
+      }
+      break;
+    case SUBACK:
+      _connecting = false;
+      _ready = true;
+      _lastPing = millis();
+      _lastSend = millis();
+      _stats.connects++;
+      break;
+    case PUBLISH: {
+      if (length < 2) {
+        return;
+      }
+      size_t topicLength = (size_t)body[0] << 8 | body[1];
+      if (2 + topicLength > length) {
+        return;
+      }
+      uint8_t qos = (header >> 1) & 0x03;
+      if (qos && 2 + topicLength + 2 <= length) {
+        std::string ack(reinterpret_cast<const char*>(body) + 2 + topicLength, 2);
+        queuePacket(PUBACK << 4, ack);
+      }
+      handleState(reinterpret_cast<const char*>(body) + 2, topicLength);
+      break;
+    }
+    default:
+      // PUBACK and PINGRESP need nothing
+      break;
+  }
+}
+
+void CommandDriver::handleState(const char* topic, size_t length) {
+  size_t prefix = sizeof(DEVICE_TOPIC_PREFIX) - 1;
+  if (length <= prefix || strncmp(topic, DEVICE_TOPIC_PREFIX, prefix) != 0) {
+    return;
+  }
+  const char* id = topic + prefix;
+  const char* end = static_cast<const char*>(memchr(id, '/', length - prefix));
+  if (!end) {
+    return;
+  }
+  auto found = _index.find(std::string(id, end - id));
+  if (found == _index.end() || !_outstanding[found->second]) {
+    return;
+  }
+  uint32_t latency = micros() - _sentAtUs[found->second];
+  _outstanding[found->second] = 0;
+  _latencies.add(latency);
+  _window.add(latency);
+  _stats.answered++;
+}
+
+void CommandDriver::appendString(std::string& out, const char* value, size_t length) {
+  appendShort(out, length);
+  out.append(value, length);
+}
+
+void CommandDriver::appendShort(std::string& out, uint16_t value) {
+  out += (char)(value >> 8);
+  out += (char)(value & 0xFF);
+}
+
+uint32_t CommandDriver::random() {
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+}  // namespace fleet
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Fleet.h"
+
+// The backend's side of a command: publishes commands to online devices
+// at a set rate and times each until the device's next state publish,
+// which is what a user waiting on a tap sees. It has its own connection
+// on a clean network, with just enough MQTT 3.1.1 for the job, so that
+// it measures the fleet and not itself.
+namespace fleet {
+
+// Command-to-state latencies, in microseconds
+class LatencySamples {
+ public:
+  void add(uint32_t us) { _samples.push_back(us); }
+  void clear() { _samples.clear(); }
+  size_t count() const { return _samples.size(); }
+  // Latency at fraction (0.5 for the median) of the sorted samples; 0
+  // without any.
+  double percentileMs(double fraction) const;
+  double maxMs() const;
+
+ private:
+  std::vector<uint32_t> _samples;
+};
+
+struct CommandStats {
+  uint32_t sent = 0;
+  uint32_t answered = 0;
+  uint32_t lost = 0;      // no state within the timeout
+  uint32_t skipped = 0;   // no online device free to take one
+  uint32_t connects = 0;
+};
+
+class CommandDriver {
+ public:
+  CommandDriver(const BrokerConfig& broker, Fleet& fleet, uint32_t seed);
+  CommandDriver(const CommandDriver&) = delete;
+  CommandDriver& operator=(const CommandDriver&) = delete;
+
+  // Commands per second across the fleet, 0 for none. One command per
+  // device is outstanding at a time.
+  void start(float rate, unsigned long timeoutMs);
+  void service(unsigned long now);
+
+  bool connected() const { return _ready; }
+  const CommandStats& stats() const { return _stats; }
+  const LatencySamples& latencies() const { return _latencies; }
+  // Since the last call to clearWindow()
+  const LatencySamples& window() const { return _window; }
+  void clearWindow() { _window.clear(); }
+
+ private:
+  enum PacketType : uint8_t {
+    CONNECT = 1,
+    CONNACK = 2,
+    PUBLISH = 3,
+    PUBACK = 4,
+    SUBSCRIBE = 8,
+    SUBACK = 9,
+    PINGREQ = 12,
+    PINGRESP = 13,
+  };
+
+  struct Pending {
+    size_t device;
+    uint32_t serial;
+    unsigned long sentAt;
+  };
+
+  void connect(unsigned long now);
+  void sendCommands(unsigned long now);
+  bool sendCommand(size_t device);
+  void expire(unsigned long now);
+
+  void queuePacket(uint8_t header, const std::string& body);
+  void flush();
+  void onData(const uint8_t* data, size_t length);
+  void handlePacket(uint8_t header, const uint8_t* body, size_t length);
+  void handleState(const char* topic, size_t length);
+
+  static void appendString(std::string& out, const char* value, size_t length);
+  static void appendString(std::string& out, const char* value) { appendString(out, value, strlen(value)); }
+  static void appendShort(std::string& out, uint16_t value);
+
+  uint32_t random();
+
+  const BrokerConfig& _broker;
+  Fleet& _fleet;
+  uint32_t _rng;
+  char _clientId[32];
+
+  AsyncClient _client;
+  bool _connecting = false;
+  bool _ready = false;
+  unsigned long _retryAt = 0;
+  unsigned long _lastPing = 0;
+  std::string _rx;
+  std::string _tx;
+  uint16_t _packetId = 0;
+
+  float _rate = 0;
+  unsigned long _timeoutMs = 0;
+  double _credit = 0;
+  unsigned long _lastSend = 0;
+
+  std::unordered_map<std::string, size_t> _index;   // device id to fleet index
+  std::vector<uint32_t> _outstanding;               // per device: serial of its command, 0 for none
+  std::vector<unsigned long> _sentAtUs;
+  std::deque<Pending> _pending;                     // in send order
+  uint32_t _serial = 0;
+
+  CommandStats _stats;
+  LatencySamples _latencies;
+  LatencySamples _window;
+};
+
+}  // namespace fleet
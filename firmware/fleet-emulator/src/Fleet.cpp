@@ -0,0 +1,119 @@
+#include "Fleet.h"
+
+#include <algorithm>
+
+namespace fleet {
+
+void Fleet::build(uint32_t count, const FleetMix& mix, unsigned long joinMs) {
+  // Types are dealt in proportion as the indexes go, so any prefix of the
+  // fleet has about the same mix as the whole
+  unsigned total = mix.lights + mix.switches + mix.sensors;
+  uint32_t lights = 0;
+  uint32_t switches = 0;
+  _devices.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    DeviceConfig config = { i, _seed, &_broker, joinMs };
+    uint32_t built = i + 1;
+    if (lights * total < (uint64_t)built * mix.lights) {
+      _devices.emplace_back(createLight(config));
+      lights++;
+    } else if (switches * total < (uint64_t)built * mix.switches) {
+      _devices.emplace_back(createSwitch(config));
+      switches++;
+    } else {
+      _devices.emplace_back(createSensor(config));
+    }
+  }
+}
+
+void Fleet::schedulePowerOn(unsigned long start, unsigned long ramp) {
+  _start = start;
+  _powerOrder.resize(_devices.size());
+  for (size_t i = 0; i < _powerOrder.size(); i++) {
+    _powerOrder[i] = i;
+  }
+  // Fisher-Yates, so neighbouring indexes do not come up together
+  for (size_t i = _powerOrder.size(); i > 1; i--) {
+    std::swap(_powerOrder[i - 1], _powerOrder[random() % i]);
+  }
+  _powerAt.resize(_devices.size());
+  for (size_t i = 0; i < _powerAt.size(); i++) {
+    _powerAt[i] = start + (_powerAt.size() > 1 ? ramp * i / (_powerAt.size() - 1) : 0);
+  }
+  _nextPowerOn = 0;
+}
+
+void Fleet::addLinkOutage(const Outage& outage) {
+  ScheduledOutage scheduled = { outage, false, false, false, {} };
+  for (size_t i = 0; i < _devices.size(); i++) {
+    if (random() % 10000 < outage.share * 10000) {
+      scheduled.devices.push_back(i);
+    }
+  }
+  _outages.push_back(scheduled);
+}
+
+void Fleet::addBrokerOutage(const Outage& outage) {
+  _outages.push_back({ outage, true, false, false, {} });
+}
+
+void Fleet::service(unsigned long now) {
+  while (_nextPowerOn < _powerOrder.size() && (long)(now - _powerAt[_nextPowerOn]) >= 0) {
+    _devices[_powerOrder[_nextPowerOn]]->powerOn(now);
+    _nextPowerOn++;
+  }
+
+  for (ScheduledOutage& scheduled : _outages) {
+    unsigned long elapsed = now - _start;
+    if (!scheduled.started && elapsed >= scheduled.outage.at) {
+      begin(scheduled);
+    }
+    if (scheduled.started && !scheduled.ended && elapsed >= scheduled.outage.at + scheduled.outage.duration) {
+      end(scheduled);
+    }
+  }
+
+  for (const std::unique_ptr<VirtualDevice>& device : _devices) {
+    device->service(now);
+  }
+}
+
+void Fleet::begin(ScheduledOutage& scheduled) {
+  scheduled.started = true;
+  if (scheduled.broker) {
+    _brokerOutages++;
+    asyncTcpFaults.partitioned = true;
+    return;
+  }
+  for (size_t index : scheduled.devices) {
+    _devices[index]->setOutage(true);
+  }
+}
+
+void Fleet::end(ScheduledOutage& scheduled) {
+  scheduled.ended = true;
+  if (scheduled.broker) {
+    asyncTcpFaults.partitioned = --_brokerOutages > 0;
+    return;
+  }
+  for (size_t index : scheduled.devices) {
+    _devices[index]->setOutage(false);
+  }
+}
+
+DeviceCounters Fleet::collect() const {
+  DeviceCounters counters;
+  for (const std::unique_ptr<VirtualDevice>& device : _devices) {
+    device->collect(counters);
+  }
+  return counters;
+}
+
+uint32_t Fleet::random() {
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+}  // namespace fleet
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "VirtualDevice.h"
+
+// The emulated devices and what happens to them over a run: when each
+// powers on, and which outages they live through.
+namespace fleet {
+
+// Relative shares of each device type
+struct FleetMix {
+  unsigned lights = 60;
+  unsigned switches = 30;
+  unsigned sensors = 10;
+};
+
+// An outage starting at (milliseconds into the run) and lasting duration.
+// A link outage takes down the access point of share of the devices; a
+// broker outage partitions the broker from all of them.
+struct Outage {
+  unsigned long at;
+  unsigned long duration;
+  float share;
+};
+
+class Fleet {
+ public:
+  Fleet(const BrokerConfig& broker, uint32_t seed) : _broker(broker), _seed(seed), _rng(seed ? seed : 1) {}
+
+  // Builds the devices; each index is the same device in every run with
+  // the same seed.
+  void build(uint32_t count, const FleetMix& mix, unsigned long joinMs);
+  // Power-on times spread evenly over ramp from start, in random order.
+  void schedulePowerOn(unsigned long start, unsigned long ramp);
+  void addLinkOutage(const Outage& outage);
+  void addBrokerOutage(const Outage& outage);
+
+  void service(unsigned long now);
+
+  size_t size() const { return _devices.size(); }
+  VirtualDevice& device(size_t index) { return *_devices[index]; }
+  DeviceCounters collect() const;
+
+ private:
+  struct ScheduledOutage {
+    Outage outage;
+    bool broker;
+    bool started;
+    bool ended;
+    std::vector<size_t> devices;   // link outages: the devices affected
+  };
+
+  uint32_t random();
+  void begin(ScheduledOutage& scheduled);
+  void end(ScheduledOutage& scheduled);
+
+  const BrokerConfig& _broker;
+  uint32_t _seed;
+  uint32_t _rng;
+  unsigned long _start = 0;
+  unsigned _brokerOutages = 0;   // overlapping ones keep the partition up
+  std::vector<std::unique_ptr<VirtualDevice>> _devices;
+  std::vector<size_t> _powerOrder;
+  std::vector<unsigned long> _powerAt;
+  size_t _nextPowerOn = 0;
+  std::vector<ScheduledOutage> _outages;
+};
+
+}  // namespace fleet
@@ -0,0 +1,240 @@
+// esp32-smart-light's network task. The sketch hands output changes to
+// its control task, which fades and reports back; here they land in the
+// reported state at once.
+
+#include <ChangeTracker.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+
+#include "VirtualDevice.h"
+
+namespace fleet {
+
+namespace {
+
+const char DEVICE_TYPE[] = "Smart Light";
+const char FIRMWARE_VERSION[] = "1.0.0";
+
+struct LightTraits {
+  static const size_t STATUS_CAPACITY = 1792;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+
+struct DeviceState {
+  bool power = false;
+  int brightness = 100;
+  int color_r = 255;
+  int color_g = 255;
+  int color_b = 255;
+};
+
+enum StateField : uint16_t {
+  FIELD_POWER = 1 << 0,
+  FIELD_BRIGHTNESS = 1 << 1,
+  FIELD_COLOR = 1 << 2,
+  FIELD_ALL = FIELD_POWER | FIELD_BRIGHTNESS | FIELD_COLOR
+};
+
+const unsigned long HEARTBEAT_INTERVAL = 30000;
+const unsigned long STATE_KEEPALIVE_INTERVAL = 300000;
+
+class LightDevice;
+
+struct CommandEffects {
+  LightDevice& light;
+  bool status = false;
+  bool state = false;
+};
+
+class LightDevice : public VirtualDevice {
+ public:
+  explicit LightDevice(const DeviceConfig& config);
+
+  const char* sampleCommand() const override { return "{\"command\":\"toggle\",\"parameters\":{}}"; }
+
+  static LightDevice& current() { return static_cast<LightDevice&>(VirtualDevice::current()); }
+
+  void handleCommand(JsonDocument& doc);
+  void reportStatus(JsonDocument& status);
+
+  DeviceState state;
+  ha::ChangeTracker stateTracker{ STATE_KEEPALIVE_INTERVAL };
+  ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+ protected:
+  bool connectBroker() override;
+  bool brokerConnecting() const override { return _device.connecting(); }
+  void dispatch(char* topic, uint8_t* payload, unsigned int length) override {
+    _dispatcher.dispatch(topic, payload, length);
+  }
+  void tick(unsigned long now) override;
+  uint32_t commandsHandled() const override { return _dispatcher.stats().messages; }
+  uint32_t parseErrors() const override { return _dispatcher.stats().parseErrors; }
+
+ private:
+  static const ha::TopicRoute MQTT_ROUTES[3];
+
+  void finishCommands(const CommandEffects& effects);
+  bool publishState();
+
+  ha::DeviceCore<LightTraits> _device{ _mqtt };
+  ha::MqttDispatcher<512> _dispatcher{ MQTT_ROUTES };
+  unsigned long _lastHeartbeat = 0;
+};
+
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  LightDevice& light = effects.light;
+  light.stateTracker.update(light.state.power, parameters["power"].as<bool>(), FIELD_POWER);
+}
+
+void commandSetBrightness(JsonObject parameters, CommandEffects& effects) {
+  LightDevice& light = effects.light;
+  light.stateTracker.update(light.state.brightness, constrain(parameters["brightness"].as<int>(), 0, 100),
+                            FIELD_BRIGHTNESS);
+}
+
+void commandSetColor(JsonObject parameters, CommandEffects& effects) {
+  LightDevice& light = effects.light;
+  light.stateTracker.update(light.state.color_r, constrain(parameters["r"].as<int>(), 0, 255), FIELD_COLOR);
+  light.stateTracker.update(light.state.color_g, constrain(parameters["g"].as<int>(), 0, 255), FIELD_COLOR);
+  light.stateTracker.update(light.state.color_b, constrain(parameters["b"].as<int>(), 0, 255), FIELD_COLOR);
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  LightDevice& light = effects.light;
+  light.stateTracker.update(light.state.power, !light.state.power, FIELD_POWER);
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], effects.light.stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+// Groups and rules live in flash, restart needs a reboot: not emulated
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("set_brightness"), commandSetBrightness },
+  { ha::fnv1a("set_color"), commandSetColor },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandIgnored },
+  { ha::fnv1a("set_rules"), commandIgnored },
+  { ha::fnv1a("restart"), commandIgnored },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+const ha::TopicRoute LightDevice::MQTT_ROUTES[3] = {
+  { ha::fnv1a(ha::topic::COMMAND), [](JsonDocument& doc) { LightDevice::current().handleCommand(doc); } },
+  { ha::fnv1a(ha::topic::OTA), [](JsonDocument&) {} },
+  { ha::fnv1a(ha::topic::REPLAY), [](JsonDocument&) {} },
+};
+
+void LightTraits::reportStatus(JsonDocument& status) {
+  LightDevice::current().reportStatus(status);
+}
+
+LightDevice::LightDevice(const DeviceConfig& config) : VirtualDevice(config, "smart_light_") {
+  _device.begin(_id);
+  _dispatcher.setBaseTopic(_device.topics().base());
+  setupMqtt(60, 30);
+}
+
+bool LightDevice::connectBroker() {
+  if (_device.connect(broker().user, broker().password)) {
+    bool resumed = _device.resumed();
+    if (!resumed) {
+      _device.subscribe(ha::topic::COMMAND);
+      _device.subscribe(ha::topic::OTA);
+      _device.subscribe(ha::topic::REPLAY);
+    }
+    _device.publishOnline(true);
+    if (!resumed) {
+      _device.publishStatus();
+    }
+    stateTracker.markDirty(FIELD_ALL);
+    return true;
+  }
+  return false;
+}
+
+void LightDevice::tick(unsigned long now) {
+  if (now - _lastHeartbeat > HEARTBEAT_INTERVAL) {
+    _device.publishOnline(true);
+    _lastHeartbeat = now;
+  }
+  if (stateTracker.due(now)) {
+    publishState();
+  }
+}
+
+void LightDevice::handleCommand(JsonDocument& doc) {
+  CommandEffects effects{ *this };
+  JsonArray batch = doc["commands"];
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
+  }
+  finishCommands(effects);
+}
+
+void LightDevice::finishCommands(const CommandEffects& effects) {
+  if (effects.status) {
+    _device.publishStatus();
+  }
+  if (effects.state) {
+    publishState();
+  }
+}
+
+void LightDevice::reportStatus(JsonDocument& status) {
+  _dispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  _mqtt.reportStats(status.createNestedObject("mqtt_tx"));
+  _connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+}
+
+// Without the offline queue: a state that cannot go out now waits for
+// the tracker to call again
+bool LightDevice::publishState() {
+  StaticJsonDocument<200> doc;
+  ha::StateEncoder encoder(doc, stateEncoding);
+  encoder.set(ha::keys::POWER, state.power);
+  encoder.set(ha::keys::BRIGHTNESS, state.brightness);
+  encoder.set(ha::keys::COLOR_R, state.color_r);
+  encoder.set(ha::keys::COLOR_G, state.color_g);
+  encoder.set(ha::keys::COLOR_B, state.color_b);
+  encoder.set(ha::keys::TIMESTAMP, millis());
+
+  uint8_t payload[200];
+  size_t length = encoder.serialize(payload, sizeof(payload));
+  if (length == 0 ||
+      !_mqtt.publish(ha::Topic(_device.topics(), encoder.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload,
+                     length)) {
+    return false;
+  }
+  stateTracker.published(millis());
+  return true;
+}
+
+}  // namespace
+
+VirtualDevice* createLight(const DeviceConfig& config) {
+  return new LightDevice(config);
+}
+
+}  // namespace fleet
@@ -0,0 +1,381 @@
+// esp32-sensor-node's network task, always awake. The control task's
+// readings are a random walk around a room's values, one per second.
+
+#include <ChangeTracker.h>
+#include <MqttDispatch.h>
+#include <SampleRing.h>
+#include <StateEncoding.h>
+#include <WindowStats.h>
+
+#include "VirtualDevice.h"
+
+namespace fleet {
+
+namespace {
+
+const char DEVICE_TYPE[] = "Sensor Node";
+const char FIRMWARE_VERSION[] = "1.0.0";
+
+struct SensorTraits {
+  static const size_t STATUS_CAPACITY = 2048;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+
+struct SensorState {
+  float temperature;
+  float humidity;
+  float pressure;
+  int light_level;
+  bool motion_detected;
+};
+
+struct Sample {
+  uint32_t timestamp;
+  SensorState state;
+};
+
+struct SensorDeadbands {
+  float temperature = 0.2;
+  float humidity = 1.0;
+  float pressure = 0.5;
+  float light_level = 50;
+};
+
+enum SensorField : uint16_t {
+  FIELD_TEMPERATURE = 1 << 0,
+  FIELD_HUMIDITY = 1 << 1,
+  FIELD_PRESSURE = 1 << 2,
+  FIELD_LIGHT_LEVEL = 1 << 3,
+  FIELD_MOTION = 1 << 4,
+  FIELD_ALL = FIELD_TEMPERATURE | FIELD_HUMIDITY | FIELD_PRESSURE | FIELD_LIGHT_LEVEL | FIELD_MOTION
+};
+
+const unsigned long HEARTBEAT_INTERVAL = 60000;
+const unsigned long SENSOR_KEEPALIVE_INTERVAL = 300000;
+const unsigned long SENSOR_READ_INTERVAL = 1000;
+const unsigned long SENSOR_SMOOTHING_TAU = 10000;
+const float SENSOR_SMOOTHING_ALPHA = ha::WindowStats::alphaFor(SENSOR_READ_INTERVAL, SENSOR_SMOOTHING_TAU);
+
+const uint8_t SAMPLE_BATCH_VERSION = 1;
+const size_t SAMPLE_BATCH_MAX = 16;
+const unsigned long SAMPLE_BATCH_INTERVAL = 30000;
+const unsigned long SAMPLE_RECORD_INTERVAL = 5000;
+const size_t SAMPLE_RING_CAPACITY = 120;
+
+class SensorDevice;
+
+struct CommandEffects {
+  SensorDevice& sensor;
+  bool status = false;
+  bool sensors = false;
+};
+
+class SensorDevice : public VirtualDevice {
+ public:
+  explicit SensorDevice(const DeviceConfig& config);
+
+  const char* sampleCommand() const override { return "{\"command\":\"get_sensors\"}"; }
+
+  static SensorDevice& current() { return static_cast<SensorDevice&>(VirtualDevice::current()); }
+
+  void handleCommand(JsonDocument& doc);
+  void reportStatus(JsonDocument& status);
+  void trackSensorChanges();
+
+  SensorDeadbands deadbands;
+  ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+ protected:
+  bool connectBroker() override;
+  bool brokerConnecting() const override { return _device.connecting(); }
+  void dispatch(char* topic, uint8_t* payload, unsigned int length) override {
+    _dispatcher.dispatch(topic, payload, length);
+  }
+  void tick(unsigned long now) override;
+  uint32_t commandsHandled() const override { return _dispatcher.stats().messages; }
+  uint32_t parseErrors() const override { return _dispatcher.stats().parseErrors; }
+
+ private:
+  static const ha::TopicRoute MQTT_ROUTES[3];
+
+  float walk(float value, float step, float low, float high);
+  void readSensors(unsigned long now, bool requested);
+  bool publishSensorData();
+  bool publishSampleBatch();
+
+  ha::DeviceCore<SensorTraits> _device{ _mqtt };
+  ha::MqttDispatcher<512> _dispatcher{ MQTT_ROUTES };
+  ha::ChangeTracker _sensorTracker{ SENSOR_KEEPALIVE_INTERVAL };
+  ha::WindowStats _temperatureWindow{ SENSOR_SMOOTHING_ALPHA };
+  ha::WindowStats _humidityWindow{ SENSOR_SMOOTHING_ALPHA };
+  ha::WindowStats _pressureWindow{ SENSOR_SMOOTHING_ALPHA };
+  ha::WindowStats _lightWindow{ SENSOR_SMOOTHING_ALPHA };
+  Sample _sampleStorage[SAMPLE_RING_CAPACITY];
+  ha::SampleRing<Sample> _sampleRing;
+  SensorState _raw;
+  SensorState _sensorState;
+  SensorState _publishedSensorState = {};
+  unsigned long _lastHeartbeat = 0;
+  unsigned long _lastSensorRead = 0;
+  unsigned long _lastSampleRecorded = 0;
+  unsigned long _lastBatchAttempt = 0;
+  bool _sampleRecorded = false;
+};
+
+void commandGetSensors(JsonObject, CommandEffects& effects) {
+  effects.sensors = true;
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+}
+
+void commandSetDeadbands(JsonObject parameters, CommandEffects& effects) {
+  SensorDeadbands& deadbands = effects.sensor.deadbands;
+  deadbands.temperature = parameters["temperature"] | deadbands.temperature;
+  deadbands.humidity = parameters["humidity"] | deadbands.humidity;
+  deadbands.pressure = parameters["pressure"] | deadbands.pressure;
+  deadbands.light_level = parameters["light_level"] | deadbands.light_level;
+  effects.sensor.trackSensorChanges();
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], effects.sensor.stateEncoding);
+  effects.status = true;
+  effects.sensors = true;
+}
+
+// A restart needs a reboot: not emulated
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("get_sensors"), commandGetSensors },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_deadbands"), commandSetDeadbands },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("restart"), commandIgnored },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+const ha::TopicRoute SensorDevice::MQTT_ROUTES[3] = {
+  { ha::fnv1a(ha::topic::COMMAND), [](JsonDocument& doc) { SensorDevice::current().handleCommand(doc); } },
+  { ha::fnv1a(ha::topic::OTA), [](JsonDocument&) {} },
+  { ha::fnv1a(ha::topic::REPLAY), [](JsonDocument&) {} },
+};
+
+void SensorTraits::reportStatus(JsonDocument& status) {
+  SensorDevice::current().reportStatus(status);
+}
+
+SensorDevice::SensorDevice(const DeviceConfig& config) : VirtualDevice(config, "sensor_node_") {
+  _device.begin(_id);
+  _dispatcher.setBaseTopic(_device.topics().base());
+  setupMqtt(60, 0);
+  _sampleRing.begin(_sampleStorage, SAMPLE_RING_CAPACITY);
+
+  // Each room starts somewhere of its own
+  _raw.temperature = 19.0f + (random() % 600) / 100.0f;
+  _raw.humidity = 35.0f + (random() % 300) / 10.0f;
+  _raw.pressure = 1000.0f + (random() % 300) / 10.0f;
+  _raw.light_level = 200 + random() % 600;
+  _raw.motion_detected = false;
+  _sensorState = _raw;
+}
+
+bool SensorDevice::connectBroker() {
+  if (_device.connect(broker().user, broker().password)) {
+    bool resumed = _device.resumed();
+    if (!resumed) {
+      _device.subscribe(ha::topic::COMMAND);
+      _device.subscribe(ha::topic::OTA);
+      _device.subscribe(ha::topic::REPLAY);
+    }
+    _device.publishOnline(true);
+    if (!resumed) {
+      _device.publishStatus();
+    }
+    _sensorTracker.markDirty(FIELD_ALL);
+    return true;
+  }
+  return false;
+}
+
+void SensorDevice::tick(unsigned long now) {
+  if (_lastSensorRead == 0 || now - _lastSensorRead >= SENSOR_READ_INTERVAL) {
+    readSensors(now, false);
+  }
+  if (!_mqtt.connected()) {
+    return;
+  }
+
+  if (now - _lastHeartbeat > HEARTBEAT_INTERVAL) {
+    _device.publishOnline(true);
+    _lastHeartbeat = now;
+  }
+  if (_sensorTracker.due(now)) {
+    publishSensorData();
+  }
+  if (!_sampleRing.empty() && now - _lastBatchAttempt >= SAMPLE_BATCH_INTERVAL) {
+    publishSampleBatch();
+  }
+}
+
+float SensorDevice::walk(float value, float step, float low, float high) {
+  float delta = step * ((int32_t)(random() % 2001) - 1000) / 1000.0f;
+  return constrain(value + delta, low, high);
+}
+
+void SensorDevice::readSensors(unsigned long now, bool requested) {
+  _lastSensorRead = now;
+  _raw.temperature = walk(_raw.temperature, 0.05f, 10.0f, 35.0f);
+  _raw.humidity = walk(_raw.humidity, 0.2f, 10.0f, 90.0f);
+  _raw.pressure = walk(_raw.pressure, 0.1f, 950.0f, 1050.0f);
+  _raw.light_level = lroundf(walk(_raw.light_level, 15.0f, 0.0f, 4095.0f));
+  // Someone walks in now and then, and stays a minute or so
+  if (random() % 120 == 0) {
+    _raw.motion_detected = !_raw.motion_detected;
+  }
+
+  _temperatureWindow.add(_raw.temperature);
+  _humidityWindow.add(_raw.humidity);
+  _pressureWindow.add(_raw.pressure);
+  _lightWindow.add(_raw.light_level);
+  _sensorState.temperature = _temperatureWindow.ewma();
+  _sensorState.humidity = _humidityWindow.ewma();
+  _sensorState.pressure = _pressureWindow.ewma();
+  _sensorState.light_level = lroundf(_lightWindow.ewma());
+  _sensorState.motion_detected = _raw.motion_detected;
+
+  if (requested || !_sampleRecorded || now - _lastSampleRecorded >= SAMPLE_RECORD_INTERVAL) {
+    Sample smoothed = { (uint32_t)now, _sensorState };
+    _sampleRing.push(smoothed);
+    _lastSampleRecorded = now;
+    _sampleRecorded = true;
+  }
+  trackSensorChanges();
+}
+
+void SensorDevice::trackSensorChanges() {
+  const SensorState& last = _publishedSensorState;
+  if (ha::outsideDeadband(_sensorState.temperature, last.temperature, deadbands.temperature)) {
+    _sensorTracker.markDirty(FIELD_TEMPERATURE);
+  }
+  if (ha::outsideDeadband(_sensorState.humidity, last.humidity, deadbands.humidity)) {
+    _sensorTracker.markDirty(FIELD_HUMIDITY);
+  }
+  if (ha::outsideDeadband(_sensorState.pressure, last.pressure, deadbands.pressure)) {
+    _sensorTracker.markDirty(FIELD_PRESSURE);
+  }
+  if (ha::outsideDeadband(_sensorState.light_level, last.light_level, deadbands.light_level)) {
+    _sensorTracker.markDirty(FIELD_LIGHT_LEVEL);
+  }
+  if (_sensorState.motion_detected != last.motion_detected) {
+    _sensorTracker.markDirty(FIELD_MOTION);
+  }
+}
+
+void SensorDevice::handleCommand(JsonDocument& doc) {
+  CommandEffects effects{ *this };
+  ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+
+  if (effects.status) {
+    _device.publishStatus();
+  }
+  if (effects.sensors) {
+    // The sketch samples on the control task first; here the reading is
+    // taken on the spot
+    readSensors(millis(), true);
+    publishSensorData();
+  }
+}
+
+void SensorDevice::reportStatus(JsonDocument& status) {
+  _dispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  _mqtt.reportStats(status.createNestedObject("mqtt_tx"));
+  _connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  _sensorTracker.reportStats(status.createNestedObject("state_tx"));
+  JsonObject sensors = status.createNestedObject("sensors");
+  sensors["sample_interval_ms"] = SENSOR_READ_INTERVAL;
+  JsonObject windows = sensors.createNestedObject("windows");
+  _temperatureWindow.reportStats(windows.createNestedObject("temperature"));
+  _humidityWindow.reportStats(windows.createNestedObject("humidity"));
+  _pressureWindow.reportStats(windows.createNestedObject("pressure"));
+  _lightWindow.reportStats(windows.createNestedObject("light_level"));
+}
+
+bool SensorDevice::publishSensorData() {
+  StaticJsonDocument<768> doc;
+  ha::StateEncoder state(doc, stateEncoding);
+  state.setDeviceId(_id);
+  state.set(ha::keys::TEMPERATURE, _sensorState.temperature);
+  state.set(ha::keys::HUMIDITY, _sensorState.humidity);
+  state.set(ha::keys::PRESSURE, _sensorState.pressure);
+  state.set(ha::keys::LIGHT_LEVEL, _sensorState.light_level);
+  state.set(ha::keys::MOTION_DETECTED, _sensorState.motion_detected);
+  state.set(ha::keys::TIMESTAMP, millis());
+  state.setWindow(ha::keys::TEMPERATURE, _temperatureWindow);
+  state.setWindow(ha::keys::HUMIDITY, _humidityWindow);
+  state.setWindow(ha::keys::PRESSURE, _pressureWindow);
+  state.setWindow(ha::keys::LIGHT_LEVEL, _lightWindow);
+
+  uint8_t payload[512];
+  size_t length = state.serialize(payload, sizeof(payload));
+  if (length == 0 ||
+      !_mqtt.publish(ha::Topic(_device.topics(), state.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload,
+                     length)) {
+    return false;
+  }
+
+  _publishedSensorState = _sensorState;
+  _sensorTracker.published(millis());
+  _temperatureWindow.reset();
+  _humidityWindow.reset();
+  _pressureWindow.reset();
+  _lightWindow.reset();
+  return true;
+}
+
+bool SensorDevice::publishSampleBatch() {
+  size_t count = _sampleRing.size() < SAMPLE_BATCH_MAX ? _sampleRing.size() : SAMPLE_BATCH_MAX;
+
+  StaticJsonDocument<2048> doc;
+  doc["v"] = SAMPLE_BATCH_VERSION;
+  doc["id"] = (const char*)_id;
+  doc["t"] = millis();
+  JsonArray rows = doc.createNestedArray("s");
+  for (size_t i = 0; i < count; i++) {
+    const Sample& sample = _sampleRing.at(i);
+    JsonArray row = rows.createNestedArray();
+    row.add(sample.timestamp);
+    row.add(lroundf(sample.state.temperature * 100));
+    row.add(lroundf(sample.state.humidity * 10));
+    row.add(lroundf(sample.state.pressure * 10));
+    row.add(sample.state.light_level);
+    row.add(sample.state.motion_detected ? 1 : 0);
+  }
+
+  bool binary = stateEncoding == ha::StateEncoding::MsgPack;
+  uint8_t payload[1024];
+  size_t length = binary ? serializeMsgPack(doc, payload, sizeof(payload))
+                         : serializeJson(doc, reinterpret_cast<char*>(payload), sizeof(payload));
+
+  _lastBatchAttempt = millis();
+  ha::Topic topic(_device.topics(), binary ? ha::topic::SAMPLES_BIN : ha::topic::SAMPLES);
+  if (length == 0 || !_mqtt.beginPublish(topic, length, false) || _mqtt.write(payload, length) != length ||
+      !_mqtt.endPublish()) {
+    return false;
+  }
+  _sampleRing.consume(count);
+  return true;
+}
+
+}  // namespace
+
+VirtualDevice* createSensor(const DeviceConfig& config) {
+  return new SensorDevice(config);
+}
+
+}  // namespace fleet
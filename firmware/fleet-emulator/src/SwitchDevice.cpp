@@ -0,0 +1,207 @@
+// esp8266-switch's loop(), network side: the relay follows the state.
+
+#include <ChangeTracker.h>
+#include <MqttDispatch.h>
+#include <StateEncoding.h>
+
+#include "VirtualDevice.h"
+
+namespace fleet {
+
+namespace {
+
+const char DEVICE_TYPE[] = "Smart Switch";
+const char FIRMWARE_VERSION[] = "1.0.0";
+
+struct SwitchTraits {
+  static const size_t STATUS_CAPACITY = 1792;
+  static const char* type() { return DEVICE_TYPE; }
+  static const char* firmwareVersion() { return FIRMWARE_VERSION; }
+  static void reportStatus(JsonDocument& status);
+};
+
+enum StateField : uint16_t {
+  FIELD_POWER = 1 << 0,
+  FIELD_ALL = FIELD_POWER
+};
+
+const unsigned long HEARTBEAT_INTERVAL = 30000;
+const unsigned long STATE_KEEPALIVE_INTERVAL = 300000;
+
+class SwitchDevice;
+
+struct CommandEffects {
+  SwitchDevice& device;
+  bool status = false;
+  bool state = false;
+};
+
+class SwitchDevice : public VirtualDevice {
+ public:
+  explicit SwitchDevice(const DeviceConfig& config);
+
+  const char* sampleCommand() const override { return "{\"command\":\"toggle\",\"parameters\":{}}"; }
+
+  static SwitchDevice& current() { return static_cast<SwitchDevice&>(VirtualDevice::current()); }
+
+  void handleCommand(JsonDocument& doc);
+  void reportStatus(JsonDocument& status);
+
+  bool power = false;
+  ha::ChangeTracker stateTracker{ STATE_KEEPALIVE_INTERVAL };
+  ha::StateEncoding stateEncoding = ha::StateEncoding::Json;
+
+ protected:
+  bool connectBroker() override;
+  bool brokerConnecting() const override { return _device.connecting(); }
+  void dispatch(char* topic, uint8_t* payload, unsigned int length) override {
+    _dispatcher.dispatch(topic, payload, length);
+  }
+  void tick(unsigned long now) override;
+  uint32_t commandsHandled() const override { return _dispatcher.stats().messages; }
+  uint32_t parseErrors() const override { return _dispatcher.stats().parseErrors; }
+
+ private:
+  static const ha::TopicRoute MQTT_ROUTES[3];
+
+  void finishCommands(const CommandEffects& effects);
+  bool publishState();
+
+  ha::DeviceCore<SwitchTraits> _device{ _mqtt };
+  ha::MqttDispatcher<512> _dispatcher{ MQTT_ROUTES };
+  unsigned long _lastHeartbeat = 0;
+};
+
+void commandSetPower(JsonObject parameters, CommandEffects& effects) {
+  SwitchDevice& device = effects.device;
+  device.stateTracker.update(device.power, parameters["power"].as<bool>(), FIELD_POWER);
+}
+
+void commandToggle(JsonObject, CommandEffects& effects) {
+  SwitchDevice& device = effects.device;
+  device.stateTracker.update(device.power, !device.power, FIELD_POWER);
+}
+
+void commandGetStatus(JsonObject, CommandEffects& effects) {
+  effects.status = true;
+  effects.state = true;
+}
+
+void commandSetEncoding(JsonObject parameters, CommandEffects& effects) {
+  ha::parseStateEncoding(parameters["encoding"], effects.device.stateEncoding);
+  effects.status = true;
+  effects.state = true;
+}
+
+// Groups and rules live in flash, restart needs a reboot: not emulated
+void commandIgnored(JsonObject, CommandEffects&) {}
+
+constexpr ha::CommandRoute<CommandEffects> COMMANDS[] = {
+  { ha::fnv1a("set_power"), commandSetPower },
+  { ha::fnv1a("toggle"), commandToggle },
+  { ha::fnv1a("get_status"), commandGetStatus },
+  { ha::fnv1a("set_encoding"), commandSetEncoding },
+  { ha::fnv1a("set_groups"), commandIgnored },
+  { ha::fnv1a("set_rules"), commandIgnored },
+  { ha::fnv1a("restart"), commandIgnored },
+};
+static_assert(ha::uniqueCommandHashes(COMMANDS), "command names collide");
+
+const ha::TopicRoute SwitchDevice::MQTT_ROUTES[3] = {
+  { ha::fnv1a(ha::topic::COMMAND), [](JsonDocument& doc) { SwitchDevice::current().handleCommand(doc); } },
+  { ha::fnv1a(ha::topic::OTA), [](JsonDocument&) {} },
+  { ha::fnv1a(ha::topic::REPLAY), [](JsonDocument&) {} },
+};
+
+void SwitchTraits::reportStatus(JsonDocument& status) {
+  SwitchDevice::current().reportStatus(status);
+}
+
+SwitchDevice::SwitchDevice(const DeviceConfig& config) : VirtualDevice(config, "smart_switch_") {
+  _device.begin(_id);
+  _dispatcher.setBaseTopic(_device.topics().base());
+  setupMqtt(60, 0);
+}
+
+bool SwitchDevice::connectBroker() {
+  if (_device.connect(broker().user, broker().password)) {
+    bool resumed = _device.resumed();
+    if (!resumed) {
+      _device.subscribe(ha::topic::COMMAND);
+      _device.subscribe(ha::topic::OTA);
+      _device.subscribe(ha::topic::REPLAY);
+    }
+    _device.publishOnline(true);
+    if (!resumed) {
+      _device.publishStatus();
+    }
+    stateTracker.markDirty(FIELD_ALL);
+    return true;
+  }
+  return false;
+}
+
+void SwitchDevice::tick(unsigned long now) {
+  if (now - _lastHeartbeat > HEARTBEAT_INTERVAL) {
+    _device.publishOnline(true);
+    _lastHeartbeat = now;
+  }
+  if (stateTracker.due(now)) {
+    publishState();
+  }
+}
+
+void SwitchDevice::handleCommand(JsonDocument& doc) {
+  CommandEffects effects{ *this };
+  JsonArray batch = doc["commands"];
+  if (batch.isNull()) {
+    ha::dispatchCommand(COMMANDS, doc["command"].as<const char*>(), doc["parameters"], effects);
+  } else {
+    for (JsonObject entry : batch) {
+      ha::dispatchCommand(COMMANDS, entry["command"].as<const char*>(), entry["parameters"], effects);
+    }
+  }
+  finishCommands(effects);
+}
+
+void SwitchDevice::finishCommands(const CommandEffects& effects) {
+  if (effects.status) {
+    _device.publishStatus();
+  }
+  if (effects.state) {
+    publishState();
+  }
+}
+
+void SwitchDevice::reportStatus(JsonDocument& status) {
+  _dispatcher.reportStats(status.createNestedObject("mqtt_rx"));
+  _mqtt.reportStats(status.createNestedObject("mqtt_tx"));
+  _connection.reportStats(status.createNestedObject("link"));
+  ha::reportStateEncodings(status, stateEncoding);
+  stateTracker.reportStats(status.createNestedObject("state_tx"));
+}
+
+bool SwitchDevice::publishState() {
+  StaticJsonDocument<150> doc;
+  ha::StateEncoder encoder(doc, stateEncoding);
+  encoder.set(ha::keys::POWER, power);
+  encoder.set(ha::keys::TIMESTAMP, millis());
+
+  uint8_t payload[128];
+  size_t length = encoder.serialize(payload, sizeof(payload));
+  if (length == 0 ||
+      !_mqtt.publish(ha::Topic(_device.topics(), encoder.topic(ha::topic::STATE, ha::topic::STATE_BIN)), payload,
+                     length)) {
+    return false;
+  }
+  stateTracker.published(millis());
+  return true;
+}
+
+}  // namespace
+
+VirtualDevice* createSwitch(const DeviceConfig& config) {
+  return new SwitchDevice(config);
+}
+
+}  // namespace fleet
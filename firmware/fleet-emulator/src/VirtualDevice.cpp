@@ -0,0 +1,163 @@
+#include "VirtualDevice.h"
+
+#include <MqttDispatch.h>
+
+namespace fleet {
+
+namespace {
+// Espressif's OUI; the rest of the MAC is the index run through a
+// bijection, so ids stay unique and a seed gives the same fleet again
+// (and with it the broker's persistent sessions)
+const uint32_t ESPRESSIF_OUI = 0x240AC4;
+
+uint32_t macSuffix(uint32_t index, uint32_t fleetSeed) {
+  return (index * 0x9E3779B1UL + fleetSeed) & 0xFFFFFF;
+}
+}  // namespace
+
+VirtualDevice* VirtualDevice::_current = nullptr;
+
+const ha::ConnectionHooks VirtualDevice::CONNECTION_HOOKS = {
+  []() { return current()._link.up; },
+  []() { current().beginLink(); },
+  []() { return current().connectBroker(); },
+  []() { return current()._mqtt.connected(); },
+  []() { return current().brokerConnecting(); },
+};
+
+VirtualDevice::Scope::Scope(VirtualDevice& device) {
+  _current = &device;
+  asyncTcpUseLink(&device._link);
+}
+
+VirtualDevice::Scope::~Scope() {
+  _current = nullptr;
+  asyncTcpUseLink(nullptr);
+}
+
+VirtualDevice::VirtualDevice(const DeviceConfig& config, const char* idPrefix)
+    : _connection(CONNECTION_HOOKS), _broker(*config.broker), _joinMs(config.joinMs) {
+  uint32_t suffix = macSuffix(config.index, config.fleetSeed);
+  snprintf(_mac, sizeof(_mac), "%02X:%02X:%02X:%02X:%02X:%02X", (unsigned)(ESPRESSIF_OUI >> 16),
+           (unsigned)(ESPRESSIF_OUI >> 8) & 0xFF, (unsigned)ESPRESSIF_OUI & 0xFF, (unsigned)(suffix >> 16),
+           (unsigned)(suffix >> 8) & 0xFF, (unsigned)suffix & 0xFF);
+
+  // As the sketches build it: prefix + MAC, colons dropped, lower case
+  size_t length = snprintf(_id, sizeof(_id), "%s", idPrefix);
+  for (const char* c = _mac; *c && length + 1 < sizeof(_id); c++) {
+    if (*c != ':') {
+      _id[length++] = tolower(*c);
+    }
+  }
+  _id[length] = '\0';
+
+  uint32_t seed = ha::fnv1aBuffer(_mac, strlen(_mac));
+  _connection.seed(seed);
+  _rng = seed ? seed : 1;
+  _link.up = false;
+}
+
+void VirtualDevice::setupMqtt(uint16_t keepAlive, uint16_t socketTimeout) {
+  _mqtt.setServer(_broker.host, _broker.port);
+  _mqtt.setCallback([](char* topic, uint8_t* payload, unsigned int length) {
+    current().dispatch(topic, payload, length);
+  });
+  _mqtt.setKeepAlive(keepAlive);
+  if (socketTimeout) {
+    _mqtt.setSocketTimeout(socketTimeout);
+  }
+}
+
+void VirtualDevice::powerOn(unsigned long now) {
+  // setup() waits for WiFi before the tasks start; here the first pass
+  // finds the join under way
+  _powered = true;
+  _joining = true;
+  _joinAt = now + _joinMs / 2 + random() % (_joinMs + 1);
+}
+
+void VirtualDevice::service(unsigned long now) {
+  if (!_powered) {
+    return;
+  }
+  Scope scope(*this);
+  if (_joining && (long)(now - _joinAt) >= 0) {
+    _joining = false;
+    _link.up = !_outage;
+  }
+
+  _connection.service(now);
+  if (_connection.online()) {
+    _mqtt.loop();
+  }
+  tick(now);
+}
+
+void VirtualDevice::setOutage(bool outage) {
+  _outage = outage;
+  if (outage) {
+    _link.up = false;
+    _joining = false;
+  }
+}
+
+void VirtualDevice::beginLink() {
+  // WiFi.begin(): joins after a while, unless the access point is gone
+  if (_outage || _joining) {
+    return;
+  }
+  _joining = true;
+  _joinAt = millis() + _joinMs / 2 + random() % (_joinMs + 1);
+}
+
+uint32_t VirtualDevice::random() {
+  // xorshift32, as Backoff
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+void VirtualDevice::collect(DeviceCounters& counters) const {
+  counters.devices++;
+  if (!_powered) {
+    return;
+  }
+  counters.powered++;
+  switch (_connection.state()) {
+    case ha::ConnectionManager::ONLINE:
+      counters.online++;
+      break;
+    case ha::ConnectionManager::LINK_DOWN:
+    case ha::ConnectionManager::LINK_CONNECTING:
+      counters.linkDown++;
+      break;
+    case ha::ConnectionManager::BROKER_WAIT:
+      counters.brokerWait++;
+      break;
+    case ha::ConnectionManager::BROKER_CONNECTING:
+      counters.brokerConnecting++;
+      break;
+  }
+
+  // Read back through reportStats(), as the status publish does
+  StaticJsonDocument<512> doc;
+  JsonObject tx = doc.createNestedObject("tx");
+  JsonObject link = doc.createNestedObject("link");
+  _mqtt.reportStats(tx);
+  _connection.reportStats(link);
+  counters.reconnects += link["reconnects"] | 0u;
+  counters.linkFailures += link["link_failures"] | 0u;
+  counters.brokerFailures += link["broker_failures"] | 0u;
+  counters.published += tx["published"] | 0u;
+  counters.acked += tx["acked"] | 0u;
+  counters.resent += tx["resent"] | 0u;
+  counters.refused += tx["refused"] | 0u;
+  counters.received += tx["received"] | 0u;
+  counters.inboundDropped += tx["inbound_dropped"] | 0u;
+  counters.timeouts += tx["timeouts"] | 0u;
+  counters.commands += commandsHandled();
+  counters.parseErrors += parseErrors();
+}
+
+}  // namespace fleet
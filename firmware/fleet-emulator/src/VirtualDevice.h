@@ -0,0 +1,130 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncTCP.h>
+#include <ConnectionManager.h>
+#include <DeviceCore.h>
+
+// One emulated device: the network side of its sketch (ConnectionManager,
+// the AsyncMqtt session, DeviceCore, the dispatcher and command tables)
+// over a WiFi link of its own, with its own state. The library drives the
+// device through plain function hooks, written for a device that has one
+// of each; the device being serviced is current(), and the hooks and
+// Traits find their way back through it.
+namespace fleet {
+
+// Where and how every device connects
+struct BrokerConfig {
+  const char* host = "localhost";
+  uint16_t port = 1883;
+  const char* user = nullptr;
+  const char* password = nullptr;
+};
+
+struct DeviceConfig {
+  uint32_t index;
+  uint32_t fleetSeed;
+  const BrokerConfig* broker;
+  unsigned long joinMs;   // mean WiFi join time
+};
+
+// Fleet totals of what the devices' own counters say
+struct DeviceCounters {
+  uint32_t devices = 0;
+  uint32_t powered = 0;
+  uint32_t online = 0;
+  uint32_t linkDown = 0;
+  uint32_t brokerWait = 0;
+  uint32_t brokerConnecting = 0;
+  uint32_t reconnects = 0;
+  uint32_t linkFailures = 0;
+  uint32_t brokerFailures = 0;
+  uint32_t published = 0;
+  uint32_t acked = 0;
+  uint32_t resent = 0;
+  uint32_t refused = 0;
+  uint32_t received = 0;
+  uint32_t inboundDropped = 0;
+  uint32_t timeouts = 0;
+  uint32_t commands = 0;
+  uint32_t parseErrors = 0;
+};
+
+class VirtualDevice {
+ public:
+  explicit VirtualDevice(const DeviceConfig& config, const char* idPrefix);
+  virtual ~VirtualDevice() {}
+  VirtualDevice(const VirtualDevice&) = delete;
+  VirtualDevice& operator=(const VirtualDevice&) = delete;
+
+  // Boots: the WiFi join starts, the tasks begin on the next pass.
+  void powerOn(unsigned long now);
+  // One pass of the sketch's network loop.
+  void service(unsigned long now);
+
+  // An access point outage: the link drops and cannot be joined until
+  // it ends.
+  void setOutage(bool outage);
+
+  const char* id() const { return _id; }
+  bool powered() const { return _powered; }
+  bool online() const { return _connection.online(); }
+
+  // A command the backend might send this device, and that it answers
+  // with a state publish.
+  virtual const char* sampleCommand() const = 0;
+
+  virtual void collect(DeviceCounters& counters) const;
+
+  static VirtualDevice& current() { return *_current; }
+
+ protected:
+  // The sketch's connectToMQTT(), ConnectionManager's connectBroker hook.
+  virtual bool connectBroker() = 0;
+  virtual bool brokerConnecting() const = 0;
+  virtual void dispatch(char* topic, uint8_t* payload, unsigned int length) = 0;
+  // The rest of the network loop: heartbeats and state publishes.
+  virtual void tick(unsigned long now) = 0;
+  virtual uint32_t commandsHandled() const = 0;
+  virtual uint32_t parseErrors() const = 0;
+
+  // Set up as in the sketch's setupMQTT(); a socketTimeout of 0 keeps
+  // the client's default
+  void setupMqtt(uint16_t keepAlive, uint16_t socketTimeout);
+  const BrokerConfig& broker() const { return _broker; }
+  uint32_t random();
+
+  ha::AsyncMqtt _mqtt;
+  ha::ConnectionManager _connection;
+  char _mac[18];
+  char _id[40];
+
+ private:
+  // Makes a device current while it runs
+  class Scope {
+   public:
+    explicit Scope(VirtualDevice& device);
+    ~Scope();
+  };
+
+  void beginLink();
+
+  static const ha::ConnectionHooks CONNECTION_HOOKS;
+  static VirtualDevice* _current;
+
+  const BrokerConfig& _broker;
+  AsyncTcpLink _link;
+  unsigned long _joinMs;
+  unsigned long _joinAt = 0;
+  bool _joining = false;
+  bool _powered = false;
+  bool _outage = false;
+  uint32_t _rng;
+};
+
+VirtualDevice* createLight(const DeviceConfig& config);
+VirtualDevice* createSwitch(const DeviceConfig& config);
+VirtualDevice* createSensor(const DeviceConfig& config);
+
+}  // namespace fleet
@@ -0,0 +1,361 @@
+// A fleet of emulated devices against a real broker, for load and fault
+// tests of the broker and the backend: every device runs the firmware's
+// own connection, MQTT and command code (see VirtualDevice.h), and a
+// command driver times command round trips as the fleet sees them.
+//
+//   pio run -e native
+//   .pio/build/native/program --broker=localhost:1883 --devices=5000 --duration=600
+//
+// A line of fleet totals goes out every --report seconds; --json writes
+// a summary of the run for comparing runs.
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <string>
+
+#include "CommandDriver.h"
+
+namespace {
+
+struct Options {
+  fleet::BrokerConfig broker;
+  uint32_t devices = 100;
+  fleet::FleetMix mix;
+  unsigned long durationMs = 300000;
+  unsigned long rampMs = 60000;
+  unsigned long joinMs = 3000;
+  uint32_t seed = 1;
+  float commandRate = 1;
+  unsigned long commandTimeoutMs = 10000;
+  unsigned long reportMs = 10000;
+  const char* json = nullptr;
+  const char* label = "";
+  std::vector<fleet::Outage> linkOutages;
+  std::vector<fleet::Outage> brokerOutages;
+  std::string host;
+};
+
+volatile sig_atomic_t stopping = 0;
+
+void onSignal(int) {
+  stopping = 1;
+}
+
+unsigned long secondsToMs(const char* value) {
+  return (unsigned long)(atof(value) * 1000);
+}
+
+// "light:60,switch:30,sensor:10"; types left out get no share
+bool parseMix(const char* value, fleet::FleetMix& mix) {
+  mix = fleet::FleetMix{ 0, 0, 0 };
+  std::string list(value);
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string entry = list.substr(start, end - start);
+    size_t colon = entry.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    std::string type = entry.substr(0, colon);
+    unsigned share = (unsigned)atoi(entry.c_str() + colon + 1);
+    if (type == "light") {
+      mix.lights = share;
+    } else if (type == "switch") {
+      mix.switches = share;
+    } else if (type == "sensor") {
+      mix.sensors = share;
+    } else {
+      return false;
+    }
+    start = end + 1;
+  }
+  return mix.lights + mix.switches + mix.sensors > 0;
+}
+
+// "AT:DURATION[:SHARE]", in seconds into the run
+bool parseOutage(const char* value, float defaultShare, fleet::Outage& outage) {
+  double at = 0;
+  double duration = 0;
+  float share = defaultShare;
+  int fields = sscanf(value, "%lf:%lf:%f", &at, &duration, &share);
+  if (fields < 2 || at < 0 || duration <= 0 || share < 0 || share > 1) {
+    return false;
+  }
+  outage = { (unsigned long)(at * 1000), (unsigned long)(duration * 1000), share };
+  return true;
+}
+
+const char* option(const char* arg, const char* name) {
+  size_t length = strlen(name);
+  return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : nullptr;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    fleet::Outage outage;
+    if ((value = option(argv[i], "--broker"))) {
+      options.host = value;
+      size_t colon = options.host.rfind(':');
+      if (colon != std::string::npos) {
+        options.broker.port = (uint16_t)atoi(options.host.c_str() + colon + 1);
+        options.host.resize(colon);
+      }
+    } else if ((value = option(argv[i], "--user"))) {
+      options.broker.user = value;
+    } else if ((value = option(argv[i], "--password"))) {
+      options.broker.password = value;
+    } else if ((value = option(argv[i], "--devices"))) {
+      options.devices = (uint32_t)atol(value);
+    } else if ((value = option(argv[i], "--mix"))) {
+      if (!parseMix(value, options.mix)) {
+        return false;
+      }
+    } else if ((value = option(argv[i], "--duration"))) {
+      options.durationMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--ramp"))) {
+      options.rampMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--join-time"))) {
+      options.joinMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--seed"))) {
+      options.seed = (uint32_t)strtoul(value, nullptr, 0);
+    } else if ((value = option(argv[i], "--command-rate"))) {
+      options.commandRate = atof(value);
+    } else if ((value = option(argv[i], "--command-timeout"))) {
+      options.commandTimeoutMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--connect-fail"))) {
+      asyncTcpFaults.connectFailure = atof(value);
+    } else if ((value = option(argv[i], "--latency"))) {
+      asyncTcpFaults.latencyMs = strtoul(value, nullptr, 10);
+    } else if ((value = option(argv[i], "--jitter"))) {
+      asyncTcpFaults.jitterMs = strtoul(value, nullptr, 10);
+    } else if ((value = option(argv[i], "--drop-mtbf"))) {
+      asyncTcpFaults.dropMtbfMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--silent-drops"))) {
+      asyncTcpFaults.silentDrops = atof(value);
+    } else if ((value = option(argv[i], "--link-outage"))) {
+      if (!parseOutage(value, 1, outage)) {
+        return false;
+      }
+      options.linkOutages.push_back(outage);
+    } else if ((value = option(argv[i], "--broker-outage"))) {
+      if (!parseOutage(value, 1, outage)) {
+        return false;
+      }
+      options.brokerOutages.push_back(outage);
+    } else if ((value = option(argv[i], "--report"))) {
+      options.reportMs = secondsToMs(value);
+    } else if ((value = option(argv[i], "--json"))) {
+      options.json = value;
+    } else if ((value = option(argv[i], "--label"))) {
+      options.label = value;
+    } else {
+      return false;
+    }
+  }
+  if (!options.host.empty()) {
+    options.broker.host = options.host.c_str();
+  }
+  return options.devices > 0 && options.durationMs > 0 && options.reportMs > 0;
+}
+
+// One socket per device, plus the driver's and some slack
+bool raiseFileLimit(rlim_t needed) {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return false;
+  }
+  if (limit.rlim_cur >= needed) {
+    return true;
+  }
+  limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? needed : std::min(needed, limit.rlim_max);
+  return setrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur >= needed;
+}
+
+// Fleet totals at one point in the run, and the rates since the last
+struct Report {
+  unsigned long at = 0;
+  fleet::DeviceCounters counters;
+  fleet::CommandStats commands;
+};
+
+double perSecond(uint32_t now, uint32_t before, unsigned long ms) {
+  return ms ? (now - before) * 1000.0 / ms : 0;
+}
+
+void printReport(const Report& report, const Report& last, const fleet::CommandDriver& driver) {
+  const fleet::DeviceCounters& c = report.counters;
+  const fleet::DeviceCounters& p = last.counters;
+  unsigned long ms = report.at - last.at;
+  printf("%6.0fs  up %u/%u online %u link %u wait %u conn %u | pub %.0f/s recv %.0f/s reconnects %u | "
+         "cmd %.1f/s p50 %.1f p99 %.1f ms lost %u | tcp open %u reset %u silent %u\n",
+         report.at / 1000.0, c.powered, c.devices, c.online, c.linkDown, c.brokerWait, c.brokerConnecting,
+         perSecond(c.published, p.published, ms), perSecond(c.received, p.received, ms), c.reconnects,
+         perSecond(report.commands.answered, last.commands.answered, ms), driver.window().percentileMs(0.5),
+         driver.window().percentileMs(0.99), report.commands.lost, asyncTcpStats.open, asyncTcpStats.resets,
+         asyncTcpStats.silenced);
+  fflush(stdout);
+}
+
+bool writeSummary(const Options& options, const Report& report, const fleet::CommandDriver& driver,
+                  unsigned long allOnlineMs) {
+  DynamicJsonDocument doc(4096);
+  JsonObject context = doc.createNestedObject("context");
+  context["label"] = options.label;
+  context["date"] = (unsigned long)time(nullptr);
+  context["devices"] = options.devices;
+  context["duration_s"] = report.at / 1000.0;
+  context["ramp_s"] = options.rampMs / 1000.0;
+  context["seed"] = options.seed;
+  JsonObject mix = context.createNestedObject("mix");
+  mix["light"] = options.mix.lights;
+  mix["switch"] = options.mix.switches;
+  mix["sensor"] = options.mix.sensors;
+  JsonObject faults = context.createNestedObject("faults");
+  faults["connect_fail"] = asyncTcpFaults.connectFailure;
+  faults["latency_ms"] = asyncTcpFaults.latencyMs;
+  faults["jitter_ms"] = asyncTcpFaults.jitterMs;
+  faults["drop_mtbf_s"] = asyncTcpFaults.dropMtbfMs / 1000.0;
+  faults["silent_drops"] = asyncTcpFaults.silentDrops;
+  faults["link_outages"] = options.linkOutages.size();
+  faults["broker_outages"] = options.brokerOutages.size();
+
+  const fleet::DeviceCounters& c = report.counters;
+  JsonObject devices = doc.createNestedObject("devices");
+  devices["powered"] = c.powered;
+  devices["online"] = c.online;
+  if (allOnlineMs) {
+    devices["all_online_s"] = allOnlineMs / 1000.0;
+  }
+  devices["reconnects"] = c.reconnects;
+  devices["link_failures"] = c.linkFailures;
+  devices["broker_failures"] = c.brokerFailures;
+  devices["published"] = c.published;
+  devices["acked"] = c.acked;
+  devices["resent"] = c.resent;
+  devices["refused"] = c.refused;
+  devices["received"] = c.received;
+  devices["inbound_dropped"] = c.inboundDropped;
+  devices["timeouts"] = c.timeouts;
+  devices["commands"] = c.commands;
+  devices["parse_errors"] = c.parseErrors;
+
+  JsonObject commands = doc.createNestedObject("commands");
+  const fleet::CommandStats& stats = driver.stats();
+  commands["sent"] = stats.sent;
+  commands["answered"] = stats.answered;
+  commands["lost"] = stats.lost;
+  commands["skipped"] = stats.skipped;
+  commands["p50_ms"] = driver.latencies().percentileMs(0.5);
+  commands["p99_ms"] = driver.latencies().percentileMs(0.99);
+  commands["max_ms"] = driver.latencies().maxMs();
+
+  JsonObject tcp = doc.createNestedObject("tcp");
+  tcp["connects"] = asyncTcpStats.connects;
+  tcp["established"] = asyncTcpStats.established;
+  tcp["refused"] = asyncTcpStats.refused;
+  tcp["failed"] = asyncTcpStats.failed;
+  tcp["resets"] = asyncTcpStats.resets;
+  tcp["silenced"] = asyncTcpStats.silenced;
+  tcp["remote_closes"] = asyncTcpStats.remoteCloses;
+  tcp["bytes_sent"] = asyncTcpStats.bytesSent;
+  tcp["bytes_received"] = asyncTcpStats.bytesReceived;
+  if (doc.overflowed()) {
+    return false;
+  }
+
+  std::string text;
+  serializeJsonPretty(doc, text);
+  text += '\n';
+  FILE* file = fopen(options.json, "wb");
+  if (!file) {
+    return false;
+  }
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  return fclose(file) == 0 && written;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    fprintf(stderr,
+            "usage: %s [--broker=<host:port>] [--user=<name>] [--password=<secret>]\n"
+            "          [--devices=<n>] [--mix=light:60,switch:30,sensor:10] [--duration=<s>] [--ramp=<s>]\n"
+            "          [--join-time=<s>] [--seed=<n>] [--command-rate=<per s>] [--command-timeout=<s>]\n"
+            "          [--connect-fail=<share>] [--latency=<ms>] [--jitter=<ms>] [--drop-mtbf=<s>]\n"
+            "          [--silent-drops=<share>] [--link-outage=<at:duration[:share]>]...\n"
+            "          [--broker-outage=<at:duration>]... [--report=<s>] [--json=<summary.json>] [--label=<text>]\n",
+            argv[0]);
+    return 2;
+  }
+  if (!raiseFileLimit(options.devices + 64)) {
+    fprintf(stderr, "Cannot raise the open file limit to %lu\n", (unsigned long)options.devices + 64);
+    return 2;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+  asyncTcpFaults.seed = options.seed;
+
+  fleet::Fleet fleet(options.broker, options.seed);
+  fleet.build(options.devices, options.mix, options.joinMs);
+  for (const fleet::Outage& outage : options.linkOutages) {
+    fleet.addLinkOutage(outage);
+  }
+  for (const fleet::Outage& outage : options.brokerOutages) {
+    fleet.addBrokerOutage(outage);
+  }
+  fleet::CommandDriver driver(options.broker, fleet, options.seed ^ 0x5EED);
+
+  printf("%u devices (light:%u switch:%u sensor:%u) against %s:%u for %.0f s\n", options.devices,
+         options.mix.lights, options.mix.switches, options.mix.sensors, options.broker.host, options.broker.port,
+         options.durationMs / 1000.0);
+  unsigned long start = millis();
+  fleet.schedulePowerOn(start, options.rampMs);
+  driver.start(options.commandRate, options.commandTimeoutMs);
+
+  Report last;
+  Report report;
+  unsigned long allOnlineMs = 0;
+  for (;;) {
+    unsigned long now = millis();
+    fleet.service(now);
+    driver.service(now);
+    asyncTcpPoll(5);
+
+    unsigned long elapsed = millis() - start;
+    bool done = elapsed >= options.durationMs || stopping;
+    if (done || elapsed - last.at >= options.reportMs) {
+      report.at = elapsed;
+      report.counters = fleet.collect();
+      report.commands = driver.stats();
+      if (!allOnlineMs && report.counters.online == report.counters.devices) {
+        allOnlineMs = elapsed;
+      }
+      printReport(report, last, driver);
+      driver.clearWindow();
+      last = report;
+    }
+    if (done) {
+      break;
+    }
+  }
+
+  const fleet::CommandStats& stats = driver.stats();
+  printf("commands: %u sent, %u answered, %u lost, %u skipped; p50 %.1f p99 %.1f max %.1f ms\n", stats.sent,
+         stats.answered, stats.lost, stats.skipped, driver.latencies().percentileMs(0.5),
+         driver.latencies().percentileMs(0.99), driver.latencies().maxMs());
+  if (options.json && !writeSummary(options, report, driver, allOnlineMs)) {
+    fprintf(stderr, "Cannot write %s\n", options.json);
+    return 1;
+  }
+  return 0;
+}
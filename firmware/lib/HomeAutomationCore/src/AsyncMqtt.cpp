@@ -0,0 +1,747 @@
+#include "AsyncMqtt.h"
+
+#if defined(HA_ASYNC_MQTT)
+
+namespace ha {
+
+namespace {
+// Packet types (fixed header high nibble)
+const uint8_t CONNECT = 0x10;
+const uint8_t CONNACK = 0x20;
+const uint8_t PUBLISH = 0x30;
+const uint8_t PUBACK = 0x40;
+const uint8_t SUBSCRIBE = 0x82;
+const uint8_t SUBACK = 0x90;
+const uint8_t UNSUBSCRIBE = 0xA2;
+const uint8_t UNSUBACK = 0xB0;
+const uint8_t PINGREQ = 0xC0;
+const uint8_t PINGRESP = 0xD0;
+const uint8_t DISCONNECT = 0xE0;
+
+const uint8_t PUBLISH_DUP = 0x08;
+const uint8_t PUBLISH_QOS1 = 0x02;
+const uint8_t PUBLISH_RETAIN = 0x01;
+
+size_t lengthBytes(size_t length) {
+  return length < 128 ? 1 : length < 16384 ? 2 : length < 2097152 ? 3 : 4;
+}
+
+uint8_t* putLength(uint8_t* out, size_t length) {
+  do {
+    uint8_t byte = length & 0x7F;
+    length >>= 7;
+    *out++ = length ? byte | 0x80 : byte;
+  } while (length);
+  return out;
+}
+
+uint8_t* putString(uint8_t* out, const char* s, size_t length) {
+  *out++ = length >> 8;
+  *out++ = length & 0xFF;
+  memcpy(out, s, length);
+  return out + length;
+}
+}  // namespace
+
+AsyncMqtt::Guard::Guard(AsyncMqtt& owner) : _owner(owner) {
+#if defined(ESP32)
+  portENTER_CRITICAL(&_owner._lock);
+#endif
+}
+
+AsyncMqtt::Guard::~Guard() {
+#if defined(ESP32)
+  portEXIT_CRITICAL(&_owner._lock);
+#endif
+}
+
+AsyncMqtt::AsyncMqtt() {
+  _tcp.onConnect(onConnect, this);
+  _tcp.onDisconnect(onDisconnect, this);
+  _tcp.onData(onData, this);
+  _tcp.setNoDelay(true);
+}
+
+AsyncMqtt& AsyncMqtt::setServer(const char* host, uint16_t port) {
+  _host = host;
+  _port = port;
+  return *this;
+}
+
+AsyncMqtt& AsyncMqtt::setCallback(Callback callback) {
+  _callback = callback;
+  return *this;
+}
+
+AsyncMqtt& AsyncMqtt::setKeepAlive(uint16_t seconds) {
+  _keepAlive = seconds;
+  return *this;
+}
+
+AsyncMqtt& AsyncMqtt::setSocketTimeout(uint16_t seconds) {
+  _socketTimeout = seconds * 1000UL;
+  return *this;
+}
+
+AsyncMqtt& AsyncMqtt::setPublishQos(uint8_t qos) {
+  _publishQos = qos ? 1 : 0;
+  return *this;
+}
+
+bool AsyncMqtt::connect(const char* id, const char* user, const char* password, const char* willTopic,
+                        uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) {
+  if (_phase == Phase::Connected) {
+    return true;
+  }
+  if (connecting()) {
+    return false;
+  }
+  if (_phase == Phase::Connecting || _dropPending || _tcp.connected()) {
+    // A connect that timed out or was refused
+    if (_phase == Phase::Connecting) {
+      _timeouts++;
+      _closeState = CONNECTION_TIMEOUT;
+    } else {
+      _closeState = _state;
+    }
+    _tcp.close(true);
+    _dropPending = false;
+    _phase = Phase::Idle;
+  }
+  if (!_host) {
+    _state = CONNECT_FAILED;
+    return false;
+  }
+
+  // Built now, written by onConnect once TCP is up
+  bool will = willTopic && willMessage;
+  size_t idLength = strlen(id);
+  size_t willTopicLength = will ? strlen(willTopic) : 0;
+  size_t willMessageLength = will ? strlen(willMessage) : 0;
+  size_t userLength = user ? strlen(user) : 0;
+  size_t passwordLength = password ? strlen(password) : 0;
+  size_t remaining = 10 + 2 + idLength;
+  if (will) {
+    remaining += 2 + willTopicLength + 2 + willMessageLength;
+  }
+  if (user) {
+    remaining += 2 + userLength;
+  }
+  if (password) {
+    remaining += 2 + passwordLength;
+  }
+  if (1 + lengthBytes(remaining) + remaining > sizeof(_connect)) {
+    _state = CONNECT_FAILED;
+    return false;
+  }
+
+  uint8_t flags = cleanSession ? 0x02 : 0;
+  if (will) {
+    flags |= 0x04 | (willQos & 0x03) << 3 | (willRetain ? 0x20 : 0);
+  }
+  if (user) {
+    flags |= 0x80;
+  }
+  if (password) {
+    flags |= 0x40;
+  }
+  uint8_t* out = _connect;
+  *out++ = CONNECT;
+  out = putLength(out, remaining);
+  out = putString(out, "MQTT", 4);
+  *out++ = 0x04;  // protocol level 3.1.1
+  *out++ = flags;
+  *out++ = _keepAlive >> 8;
+  *out++ = _keepAlive & 0xFF;
+  out = putString(out, id, idLength);
+  if (will) {
+    out = putString(out, willTopic, willTopicLength);
+    out = putString(out, willMessage, willMessageLength);
+  }
+  if (user) {
+    out = putString(out, user, userLength);
+  }
+  if (password) {
+    out = putString(out, password, passwordLength);
+  }
+  _connectLength = out - _connect;
+
+  _connectStarted = millis();
+  _phase = Phase::Connecting;
+  if (!_tcp.connect(_host, _port)) {
+    _phase = Phase::Idle;
+    _state = CONNECT_FAILED;
+  }
+  return false;
+}
+
+bool AsyncMqtt::connecting() const {
+  return _phase == Phase::Connecting && millis() - _connectStarted < _socketTimeout;
+}
+
+void AsyncMqtt::disconnect() {
+  if (_phase == Phase::Connected && _sendOffset == 0 && _tcp.space() >= 2) {
+    // Between packets, so the broker discards the will
+    const uint8_t packet[2] = { DISCONNECT, 0 };
+    _tcp.add(reinterpret_cast<const char*>(packet), sizeof(packet), ASYNC_WRITE_FLAG_COPY);
+    _tcp.send();
+  }
+  if (_phase != Phase::Idle || _tcp.connected()) {
+    drop(DISCONNECTED);
+  }
+  _phase = Phase::Idle;
+  _state = DISCONNECTED;
+}
+
+bool AsyncMqtt::loop() {
+  if (!connected()) {
+    return false;
+  }
+  if (_dropPending) {
+    _dropPending = false;
+    drop(CONNECTION_LOST);
+    return false;
+  }
+  unsigned long now = millis();
+
+  // A broker that has stopped acknowledging is as good as gone
+  bool stalled = false;
+  {
+    Guard guard(*this);
+    for (uint8_t i = 0; i < _count; i++) {
+      const Packet& packet = _packets[(_first + i) % MAX_QUEUED];
+      if (packet.send == Send::Sent && (packet.flags & AWAITS_ACK)) {
+        stalled = now - packet.sentAt >= _socketTimeout;
+        break;
+      }
+    }
+  }
+  if (stalled || (_pingOutstanding && now - _pingAt >= _socketTimeout)) {
+    _timeouts++;
+    drop(CONNECTION_TIMEOUT);
+    return false;
+  }
+
+  deliver();
+  if (!connected()) {
+    return false;
+  }
+
+  if (_keepAlive && !_pingOutstanding && now - _lastOutbound >= _keepAlive * 1000UL &&
+      queueControl(PINGREQ, 0)) {
+    _pingOutstanding = true;
+    _pingAt = now;
+  }
+
+  pump(now);
+  return connected();
+}
+
+bool AsyncMqtt::subscribe(const char* topic, uint8_t qos) {
+  return queueSubscription(SUBSCRIBE, topic, qos > 1 ? 1 : qos);
+}
+
+bool AsyncMqtt::unsubscribe(const char* topic) { return queueSubscription(UNSUBSCRIBE, topic, 0); }
+
+bool AsyncMqtt::publish(const char* topic, const char* payload, bool retained) {
+  return publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload), retained);
+}
+
+bool AsyncMqtt::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  if (!beginPublish(topic, length, retained)) {
+    return false;
+  }
+  write(payload, length);
+  return endPublish();
+}
+
+bool AsyncMqtt::beginPublish(const char* topic, unsigned int length, bool retained) {
+  _writing = false;
+  if (!connected()) {
+    return false;
+  }
+  size_t topicLength = strlen(topic);
+  size_t remaining = 2 + topicLength + (_publishQos ? 2 : 0) + length;
+  size_t total = 1 + lengthBytes(remaining) + remaining;
+  int32_t start = total <= QUEUE_BYTES ? reserve(total) : -1;
+  if (start < 0) {
+    _refused++;
+    return false;
+  }
+
+  uint8_t* out = _pool + start;
+  *out++ = PUBLISH | (_publishQos ? PUBLISH_QOS1 : 0) | (retained ? PUBLISH_RETAIN : 0);
+  out = putLength(out, remaining);
+  out = putString(out, topic, topicLength);
+  _writeId = 0;
+  if (_publishQos) {
+    _writeId = nextId();
+    *out++ = _writeId >> 8;
+    *out++ = _writeId & 0xFF;
+  }
+  _writeStart = start;
+  _writePos = out - _pool;
+  _writeEnd = start + total;
+  _writing = true;
+  return true;
+}
+
+size_t AsyncMqtt::write(uint8_t c) {
+  if (!_writing || _writePos >= _writeEnd) {
+    return 0;
+  }
+  _pool[_writePos++] = c;
+  return 1;
+}
+
+size_t AsyncMqtt::write(const uint8_t* buffer, size_t size) {
+  if (!_writing) {
+    return 0;
+  }
+  if (size > _writeEnd - _writePos) {
+    size = _writeEnd - _writePos;
+  }
+  memcpy(_pool + _writePos, buffer, size);
+  _writePos += size;
+  return size;
+}
+
+int AsyncMqtt::endPublish() {
+  if (!_writing) {
+    return 0;
+  }
+  _writing = false;
+  // A short write leaves the reservation unused
+  if (_writePos != _writeEnd || !connected()) {
+    _refused++;
+    return 0;
+  }
+  uint8_t flags = _writeId ? AWAITS_ACK | RESEND : 0;
+  if (!commit(_writeStart, _writeEnd - _writeStart, flags, _writeId)) {
+    _refused++;
+    return 0;
+  }
+  _published++;
+  return 1;
+}
+
+void AsyncMqtt::reportStats(JsonObject obj) const {
+  obj["state"] = (int)_state;
+  obj["session_present"] = sessionPresent();
+  obj["queued"] = (uint8_t)_count;
+  obj["in_flight"] = _inFlight;
+  obj["published"] = _published;
+  obj["acked"] = _acked;
+  obj["resent"] = _resent;
+  obj["refused"] = _refused;
+  obj["received"] = _received;
+  obj["inbound_dropped"] = _inboundDropped;
+  obj["timeouts"] = _timeouts;
+}
+
+uint16_t AsyncMqtt::nextId() {
+  if (++_lastId == 0) {
+    _lastId = 1;
+  }
+  return _lastId;
+}
+
+int32_t AsyncMqtt::reserve(size_t length) {
+  Guard guard(*this);
+  if (_count >= MAX_QUEUED) {
+    return -1;
+  }
+  if (_count == 0) {
+    _poolHead = _poolTail = 0;
+  }
+  // Packets are contiguous; the free space is [head, end) + [0, tail)
+  // or [head, tail), and head never catches up with tail
+  if (_poolHead >= _poolTail) {
+    if (QUEUE_BYTES - _poolHead >= length) {
+      return _poolHead;
+    }
+    return length < _poolTail ? 0 : -1;
+  }
+  return _poolTail - _poolHead > length ? (int32_t)_poolHead : -1;
+}
+
+bool AsyncMqtt::commit(size_t start, size_t length, uint8_t flags, uint16_t id) {
+  Guard guard(*this);
+  // The session may have ended since reserve(); the slot is still free
+  if (_count >= MAX_QUEUED) {
+    return false;
+  }
+  if (_count == 0) {
+    _poolTail = start;
+  }
+  Packet& packet = _packets[(_first + _count) % MAX_QUEUED];
+  packet.start = start;
+  packet.length = length;
+  packet.id = id;
+  packet.flags = flags;
+  packet.send = Send::Queued;
+  packet.sentAt = 0;
+  _poolHead = start + length;
+  _count++;
+  return true;
+}
+
+bool AsyncMqtt::queueControl(uint8_t type, uint16_t id) {
+  uint8_t packet[4] = { type, 0, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF) };
+  size_t length = 2;
+  if (type == PUBACK) {
+    packet[1] = 2;
+    length = 4;
+  }
+  int32_t start = reserve(length);
+  if (start < 0) {
+    return false;
+  }
+  memcpy(_pool + start, packet, length);
+  return commit(start, length, CONTROL, 0);
+}
+
+bool AsyncMqtt::queueSubscription(uint8_t type, const char* topic, uint8_t qos) {
+  if (!connected()) {
+    _subscriptionsLost = true;
+    return false;
+  }
+  size_t topicLength = strlen(topic);
+  size_t remaining = 2 + 2 + topicLength + (type == SUBSCRIBE ? 1 : 0);
+  size_t total = 1 + lengthBytes(remaining) + remaining;
+  int32_t start = total <= QUEUE_BYTES ? reserve(total) : -1;
+  if (start < 0) {
+    _refused++;
+    _subscriptionsLost = true;
+    return false;
+  }
+  uint16_t id = nextId();
+  uint8_t* out = _pool + start;
+  *out++ = type;
+  out = putLength(out, remaining);
+  *out++ = id >> 8;
+  *out++ = id & 0xFF;
+  out = putString(out, topic, topicLength);
+  if (type == SUBSCRIBE) {
+    *out++ = qos;
+  }
+  return commit(start, total, AWAITS_ACK, id);
+}
+
+void AsyncMqtt::popDone() {
+  // Called with the lock held
+  while (_count && _packets[_first].send == Send::Done) {
+    _first = (_first + 1) % MAX_QUEUED;
+    _count--;
+  }
+  _poolTail = _count ? _packets[_first].start : _poolHead;
+}
+
+void AsyncMqtt::acknowledge(uint16_t id) {
+  // Called with the lock held
+  for (uint8_t i = 0; i < _count; i++) {
+    Packet& packet = _packets[(_first + i) % MAX_QUEUED];
+    if (packet.send == Send::Sent && (packet.flags & AWAITS_ACK) && packet.id == id) {
+      packet.send = Send::Done;
+      _inFlight--;
+      _acked++;
+      popDone();
+      return;
+    }
+  }
+}
+
+void AsyncMqtt::deliver() {
+  for (;;) {
+    InboxSlot* slot;
+    {
+      Guard guard(*this);
+      if (!_inboxCount) {
+        return;
+      }
+      slot = &_inbox[_inboxFirst];
+    }
+
+    // Topic, [packet id], payload; the topic is moved back over its
+    // length so it can be NUL-terminated in place, as PubSubClient does
+    uint8_t* data = slot->data;
+    uint8_t qos = (slot->header >> 1) & 0x03;
+    size_t topicLength = slot->length >= 2 ? (data[0] << 8) | data[1] : 0;
+    size_t offset = 2 + topicLength + (qos ? 2 : 0);
+    if (slot->length >= 2 && offset <= slot->length) {
+      uint16_t id = qos ? (data[2 + topicLength] << 8) | data[3 + topicLength] : 0;
+      memmove(data, data + 2, topicLength);
+      data[topicLength] = '\0';
+      if (_callback) {
+        _callback(reinterpret_cast<char*>(data), data + offset, slot->length - offset);
+      }
+      if (qos) {
+        queueControl(PUBACK, id);
+      }
+    }
+
+    Guard guard(*this);
+    _inboxFirst = (_inboxFirst + 1) % INBOX_SLOTS;
+    _inboxCount--;
+  }
+}
+
+void AsyncMqtt::pump(unsigned long now) {
+  bool wrote = false;
+  for (;;) {
+    size_t start;
+    size_t length;
+    size_t offset;
+    uint32_t session;
+    {
+      Guard guard(*this);
+      // A packet half written goes first. Otherwise the oldest queued one,
+      // unless it is a QoS1 publish beyond the window: then it and any
+      // publish behind it wait for acks, and only pings and acks go ahead.
+      Packet* next = _sendOffset ? &_packets[_sendSlot] : nullptr;
+      bool held = false;
+      for (uint8_t i = 0; !next && i < _count; i++) {
+        Packet& packet = _packets[(_first + i) % MAX_QUEUED];
+        if (packet.send != Send::Queued) {
+          continue;
+        }
+        if ((packet.flags & CONTROL) ||
+            (!held && (!(packet.flags & AWAITS_ACK) || _inFlight < MAX_IN_FLIGHT))) {
+          next = &packet;
+        } else {
+          held = true;
+        }
+      }
+      if (!next) {
+        break;
+      }
+      _sendSlot = next - _packets;
+      start = next->start;
+      length = next->length;
+      offset = _sendOffset;
+      session = _session;
+    }
+
+    size_t room = _tcp.space();
+    if (!room) {
+      break;
+    }
+    size_t chunk = length - offset < room ? length - offset : room;
+    // Copied: control and QoS0 packets are freed once written
+    size_t added = _tcp.add(reinterpret_cast<const char*>(_pool + start + offset), chunk, ASYNC_WRITE_FLAG_COPY);
+    if (!added) {
+      break;
+    }
+    wrote = true;
+
+    Guard guard(*this);
+    if (session != _session) {
+      break;
+    }
+    _sendOffset += added;
+    if (_sendOffset < length) {
+      continue;
+    }
+    _sendOffset = 0;
+    _lastOutbound = now;
+    Packet& packet = _packets[_sendSlot];
+    packet.sentAt = now;
+    if (packet.flags & AWAITS_ACK) {
+      packet.send = Send::Sent;
+      _inFlight++;
+    } else {
+      packet.send = Send::Done;
+    }
+    popDone();
+  }
+  if (wrote) {
+    _tcp.send();
+  }
+}
+
+void AsyncMqtt::drop(int reason) {
+  _closeState = reason;
+  _tcp.close(true);
+}
+
+void AsyncMqtt::onConnect(void* arg, AsyncClient* client) {
+  AsyncMqtt* self = static_cast<AsyncMqtt*>(arg);
+  self->_rx = Rx::Header;
+  self->_lastOutbound = millis();
+  client->add(reinterpret_cast<const char*>(self->_connect), self->_connectLength, ASYNC_WRITE_FLAG_COPY);
+  client->send();
+}
+
+void AsyncMqtt::onDisconnect(void* arg, AsyncClient*) {
+  AsyncMqtt* self = static_cast<AsyncMqtt*>(arg);
+  Guard guard(*self);
+  // A refused connect keeps the broker's code
+  if (self->_closeState != CONNECTION_LOST) {
+    self->_state = self->_closeState;
+  } else if (self->_phase == Phase::Connecting) {
+    self->_state = CONNECT_FAILED;
+  } else if (self->_phase == Phase::Connected) {
+    self->_state = CONNECTION_LOST;
+  }
+  self->_closeState = CONNECTION_LOST;
+  self->_phase = Phase::Idle;
+  self->_session++;
+  self->_sendOffset = 0;
+  self->_inFlight = 0;
+  self->_pingOutstanding = false;
+
+  // Unacknowledged publishes go again, flagged as duplicates; the rest
+  // (subscriptions, pings, acks) belongs to the connection that ended,
+  // and a subscription left unanswered has to be made again
+  for (uint8_t i = 0; i < self->_count; i++) {
+    Packet& packet = self->_packets[(self->_first + i) % MAX_QUEUED];
+    if (packet.flags & RESEND) {
+      if (packet.send == Send::Sent) {
+        self->_pool[packet.start] |= PUBLISH_DUP;
+        packet.send = Send::Queued;
+        self->_resent++;
+      }
+    } else if (packet.flags & (AWAITS_ACK | CONTROL)) {
+      if ((packet.flags & AWAITS_ACK) && packet.send != Send::Done) {
+        self->_subscriptionsLost = true;
+      }
+      packet.send = Send::Done;
+    }
+  }
+  self->popDone();
+}
+
+void AsyncMqtt::onData(void* arg, AsyncClient*, void* data, size_t length) {
+  static_cast<AsyncMqtt*>(arg)->receive(static_cast<const uint8_t*>(data), length);
+}
+
+void AsyncMqtt::receive(const uint8_t* data, size_t length) {
+  while (length) {
+    switch (_rx) {
+      case Rx::Header:
+        _rxHeader = *data++;
+        length--;
+        _rxLength = 0;
+        _rxShift = 0;
+        _rx = Rx::Length;
+        break;
+
+      case Rx::Length: {
+        uint8_t byte = *data++;
+        length--;
+        _rxLength |= (uint32_t)(byte & 0x7F) << _rxShift;
+        _rxShift += 7;
+        if (byte & 0x80) {
+          if (_rxShift > 21) {
+            // Not MQTT; drop the connection from loop()
+            _rx = Rx::Header;
+            _dropPending = true;
+            return;
+          }
+          break;
+        }
+        beginBody();
+        if (_rxLength == 0) {
+          finishPacket();
+        }
+        break;
+      }
+
+      case Rx::Body: {
+        size_t chunk = _rxLength - _rxPos < length ? _rxLength - _rxPos : length;
+        if (_rxPos < _rxCapacity) {
+          size_t keep = _rxCapacity - _rxPos < chunk ? _rxCapacity - _rxPos : chunk;
+          memcpy(_rxTarget + _rxPos, data, keep);
+        }
+        _rxPos += chunk;
+        data += chunk;
+        length -= chunk;
+        if (_rxPos == _rxLength) {
+          finishPacket();
+        }
+        break;
+      }
+    }
+  }
+}
+
+void AsyncMqtt::beginBody() {
+  _rx = Rx::Body;
+  _rxPos = 0;
+  _rxTarget = _rxSmall;
+  _rxCapacity = sizeof(_rxSmall);
+  if ((_rxHeader & 0xF0) != PUBLISH) {
+    return;
+  }
+
+  // Messages that do not fit the inbox are skipped over
+  Guard guard(*this);
+  if (_inboxCount < INBOX_SLOTS && _rxLength <= MAX_INBOUND) {
+    _rxTarget = _inbox[(_inboxFirst + _inboxCount) % INBOX_SLOTS].data;
+    _rxCapacity = MAX_INBOUND;
+  } else {
+    _rxTarget = nullptr;
+    _rxCapacity = 0;
+    _inboundDropped++;
+  }
+}
+
+void AsyncMqtt::finishPacket() {
+  _rx = Rx::Header;
+  uint16_t id = _rxLength >= 2 ? (_rxSmall[0] << 8) | _rxSmall[1] : 0;
+
+  Guard guard(*this);
+  switch (_rxHeader & 0xF0) {
+    case CONNACK:
+      if (_phase != Phase::Connecting) {
+        break;
+      }
+      if (_rxLength >= 2 && _rxSmall[1] == 0) {
+        _phase = Phase::Connected;
+        _state = CONNECTED;
+        // Either way the caller now knows what to subscribe again; losses
+        // from here on count against the next resume
+        _sessionPresent = (_rxSmall[0] & 0x01) && !_subscriptionsLost;
+        _subscriptionsLost = false;
+      } else {
+        // Refused; connect() closes the socket on its next try
+        _phase = Phase::Idle;
+        _state = CONNECT_FAILED;
+        if (_rxLength >= 2) {
+          _state = _rxSmall[1];
+        }
+        _dropPending = true;
+      }
+      break;
+
+    case PUBLISH:
+      if (_rxTarget) {
+        InboxSlot& slot = _inbox[(_inboxFirst + _inboxCount) % INBOX_SLOTS];
+        slot.header = _rxHeader;
+        slot.length = _rxLength;
+        _inboxCount++;
+        _received++;
+      }
+      break;
+
+    case SUBACK:
+      if (_rxLength >= 3 && _rxSmall[2] == 0x80) {
+        _subscriptionsLost = true;
+      }
+      acknowledge(id);
+      break;
+
+    case PUBACK:
+    case UNSUBACK:
+      acknowledge(id);
+      break;
+
+    case PINGRESP:
+      _pingOutstanding = false;
+      break;
+  }
+}
+
+}  // namespace ha
+
+#endif
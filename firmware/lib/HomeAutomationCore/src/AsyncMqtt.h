@@ -0,0 +1,237 @@
+#pragma once
+
+#if defined(HA_ASYNC_MQTT)
+
+// HA_NATIVE_ASYNC_TCP: the host AsyncClient the fleet emulator provides
+#if !defined(ESP32) && !defined(ESP8266) && !defined(HA_NATIVE_ASYNC_TCP)
+#error "HA_ASYNC_MQTT needs AsyncTCP (ESP32), ESPAsyncTCP (ESP8266) or HA_NATIVE_ASYNC_TCP"
+#endif
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#if defined(ESP8266)
+#include <ESPAsyncTCP.h>
+#else
+#include <AsyncTCP.h>
+#endif
+
+namespace ha {
+
+// MQTT 3.1.1 client on the AsyncTCP stack the web server already runs on,
+// with the part of PubSubClient's API the devices use, so DeviceCore and
+// the sketches take either (see MqttClient in DeviceCore.h).
+//
+// Nothing waits on the network. publish() encodes the packet into a
+// bounded queue and returns; loop() writes queued packets as the TCP
+// send buffer frees up, so a payload may be larger than that buffer. QoS1
+// publishes are pipelined, up to MAX_IN_FLIGHT awaiting PUBACK, and stay
+// queued until acknowledged: after a reconnect they are resent with DUP
+// set. A broker that stops acknowledging (or answering pings) for the
+// socket timeout gets the connection dropped rather than the device
+// stalled. A full queue refuses the publish and counts it.
+//
+// connect() only starts the connection: connecting() stays true until
+// the broker answers (or the socket timeout passes), and once it has
+// accepted, connect() returns true. With a persistent session the resent
+// publishes are the ones the broker expects, and sessionPresent() tells
+// whether the subscriptions survived.
+//
+// The AsyncTCP callbacks parse incoming packets into a small inbox; the
+// messages reach the callback from loop(), on the caller's task, as with
+// PubSubClient. All other client calls belong to that task too.
+class AsyncMqtt : public Print {
+ public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+
+  // state() codes, as PubSubClient's; CONNACK refusals are 1..5
+  static const int CONNECTION_TIMEOUT = -4;
+  static const int CONNECTION_LOST = -3;
+  static const int CONNECT_FAILED = -2;
+  static const int DISCONNECTED = -1;
+  static const int CONNECTED = 0;
+
+#if defined(ESP32) || defined(HA_NATIVE_ASYNC_TCP)
+  static const size_t QUEUE_BYTES = 8192;
+#else
+  static const size_t QUEUE_BYTES = 4096;
+#endif
+  static const uint8_t MAX_QUEUED = 32;
+  static const uint8_t MAX_IN_FLIGHT = 8;
+  // Largest incoming packet, and how many may wait for loop()
+  static const size_t MAX_INBOUND = 1024;
+  static const uint8_t INBOX_SLOTS = 2;
+  static const size_t MAX_CONNECT = 256;
+
+  AsyncMqtt();
+
+  // host must stay valid, as with PubSubClient.
+  AsyncMqtt& setServer(const char* host, uint16_t port);
+  AsyncMqtt& setCallback(Callback callback);
+  AsyncMqtt& setKeepAlive(uint16_t seconds);
+  // How long a connect, a PUBACK or a ping answer may take.
+  AsyncMqtt& setSocketTimeout(uint16_t seconds);
+  // QoS of every publish, 0 or 1 (the default).
+  AsyncMqtt& setPublishQos(uint8_t qos);
+
+  bool connect(const char* id, const char* user = nullptr, const char* password = nullptr,
+               const char* willTopic = nullptr, uint8_t willQos = 0, bool willRetain = false,
+               const char* willMessage = nullptr, bool cleanSession = true);
+  void disconnect();
+  bool connected() const { return _phase == Phase::Connected; }
+  bool connecting() const;
+  int state() const { return _state; }
+  // The broker resumed a persistent session and every subscription made
+  // during the last connection went through (none was refused, failed or
+  // cut off unanswered), so none has to be made again.
+  bool sessionPresent() const { return _sessionPresent; }
+
+  // Delivers received messages, keeps the connection alive and writes
+  // what the send buffer takes; false while not connected.
+  bool loop();
+
+  bool subscribe(const char* topic, uint8_t qos = 0);
+  bool unsubscribe(const char* topic);
+
+  // Queued; false if not connected or the queue has no room.
+  bool publish(const char* topic, const char* payload, bool retained = false);
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained = false);
+
+  // Streams one publish of exactly length bytes into the queue.
+  bool beginPublish(const char* topic, unsigned int length, bool retained);
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int endPublish();
+
+  // Every queued packet written and every QoS1 publish acknowledged.
+  bool flushed() const { return _count == 0; }
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  enum class Phase : uint8_t { Idle, Connecting, Connected };
+  enum class Send : uint8_t { Queued, Sent, Done };
+  enum class Rx : uint8_t { Header, Length, Body };
+
+  // One encoded packet in the pool
+  struct Packet {
+    uint16_t start;
+    uint16_t length;
+    uint16_t id;
+    uint8_t flags;
+    Send send;
+    unsigned long sentAt;
+  };
+
+  // Packet flags: answered by an ack with its id; resent after reconnect;
+  // a ping or ack, which may pass publishes held back by the window
+  static const uint8_t AWAITS_ACK = 0x01;
+  static const uint8_t RESEND = 0x02;
+  static const uint8_t CONTROL = 0x04;
+
+  struct InboxSlot {
+    uint8_t header;
+    uint16_t length;
+    uint8_t data[MAX_INBOUND];
+  };
+
+  class Guard {
+   public:
+    explicit Guard(AsyncMqtt& owner);
+    ~Guard();
+
+   private:
+    AsyncMqtt& _owner;
+  };
+
+  static void onConnect(void* arg, AsyncClient* client);
+  static void onDisconnect(void* arg, AsyncClient* client);
+  static void onData(void* arg, AsyncClient* client, void* data, size_t length);
+
+  uint16_t nextId();
+  int32_t reserve(size_t length);
+  bool commit(size_t start, size_t length, uint8_t flags, uint16_t id);
+  bool queueControl(uint8_t type, uint16_t id);
+  bool queueSubscription(uint8_t type, const char* topic, uint8_t qos);
+  void popDone();
+  void acknowledge(uint16_t id);
+  void deliver();
+  void pump(unsigned long now);
+  void drop(int reason);
+
+  void receive(const uint8_t* data, size_t length);
+  void beginBody();
+  void finishPacket();
+
+  AsyncClient _tcp;
+  const char* _host = nullptr;
+  uint16_t _port = 1883;
+  Callback _callback = nullptr;
+  uint16_t _keepAlive = 15;
+  unsigned long _socketTimeout = 15000;
+  uint8_t _publishQos = 1;
+
+  volatile Phase _phase = Phase::Idle;
+  volatile int _state = DISCONNECTED;
+  volatile int _closeState = CONNECTION_LOST;
+  volatile bool _dropPending = false;
+  volatile bool _sessionPresent = false;
+  volatile bool _subscriptionsLost = false;
+  unsigned long _connectStarted = 0;
+  uint8_t _connect[MAX_CONNECT];
+  size_t _connectLength = 0;
+
+  // Outbound: packets in FIFO order over a ring of pool bytes. Only the
+  // caller's task adds; acks and disconnects come from the TCP callbacks.
+  uint8_t _pool[QUEUE_BYTES];
+  size_t _poolHead = 0;
+  size_t _poolTail = 0;
+  Packet _packets[MAX_QUEUED];
+  uint8_t _first = 0;
+  volatile uint8_t _count = 0;
+  uint8_t _inFlight = 0;
+  uint8_t _sendSlot = 0;
+  size_t _sendOffset = 0;
+  uint32_t _session = 0;
+  uint16_t _lastId = 0;
+
+  // The publish being streamed by beginPublish()
+  bool _writing = false;
+  size_t _writeStart = 0;
+  size_t _writePos = 0;
+  size_t _writeEnd = 0;
+  uint16_t _writeId = 0;
+
+  volatile unsigned long _lastOutbound = 0;
+  volatile bool _pingOutstanding = false;
+  unsigned long _pingAt = 0;
+
+  // Inbound: parser state (TCP callbacks only) and the inbox
+  Rx _rx = Rx::Header;
+  uint8_t _rxHeader = 0;
+  uint32_t _rxLength = 0;
+  uint8_t _rxShift = 0;
+  uint32_t _rxPos = 0;
+  uint8_t* _rxTarget = nullptr;
+  size_t _rxCapacity = 0;
+  uint8_t _rxSmall[4];
+  InboxSlot _inbox[INBOX_SLOTS];
+  uint8_t _inboxFirst = 0;
+  volatile uint8_t _inboxCount = 0;
+
+#if defined(ESP32)
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+  uint32_t _published = 0;
+  uint32_t _acked = 0;
+  uint32_t _resent = 0;
+  uint32_t _refused = 0;
+  uint32_t _received = 0;
+  uint32_t _inboundDropped = 0;
+  uint32_t _timeouts = 0;
+};
+
+}  // namespace ha
+
+#endif
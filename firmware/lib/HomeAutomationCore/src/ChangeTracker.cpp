@@ -0,0 +1,20 @@
+#include "ChangeTracker.h"
+
+namespace ha {
+
+void ChangeTracker::published(unsigned long now) {
+  if (_dirty) {
+    _changePublishes++;
+  } else {
+    _keepalivePublishes++;
+  }
+  _dirty = 0;
+  _lastPublish = now;
+}
+
+void ChangeTracker::reportStats(JsonObject obj) const {
+  obj["changes"] = _changePublishes;
+  obj["keepalives"] = _keepalivePublishes;
+}
+
+}  // namespace ha
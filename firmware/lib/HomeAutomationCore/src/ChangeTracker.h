@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Per-field dirty bits for change-driven publishing. A publish is due
+// when any field changed since the last successful publish, or when the
+// keepalive interval has passed without one.
+class ChangeTracker {
+ public:
+  explicit ChangeTracker(unsigned long keepaliveMs) : _keepaliveMs(keepaliveMs) {}
+
+  // Assigns value to field and marks bit dirty if it actually changed.
+  template <typename T>
+  bool update(T& field, T value, uint16_t bit) {
+    if (field == value) {
+      return false;
+    }
+    field = value;
+    _dirty |= bit;
+    return true;
+  }
+
+  void markDirty(uint16_t bits) { _dirty |= bits; }
+  bool isDirty(uint16_t bits = 0xFFFF) const { return (_dirty & bits) != 0; }
+  uint16_t dirtyFields() const { return _dirty; }
+
+  // Returns and clears the dirty bits without counting a publish; for
+  // trackers that only detect changes and hand them on.
+  uint16_t takeDirty() {
+    uint16_t dirty = _dirty;
+    _dirty = 0;
+    return dirty;
+  }
+
+  bool due(unsigned long now) const {
+    return _dirty != 0 || now - _lastPublish >= _keepaliveMs;
+  }
+
+  // Call after the broker accepted the publish.
+  void published(unsigned long now);
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  unsigned long _keepaliveMs;
+  unsigned long _lastPublish = 0;
+  uint16_t _dirty = 0;
+  uint32_t _changePublishes = 0;
+  uint32_t _keepalivePublishes = 0;
+};
+
+// True when current has moved at least deadband away from reference.
+inline bool outsideDeadband(float current, float reference, float deadband) {
+  return fabsf(current - reference) >= deadband;
+}
+
+}  // namespace ha
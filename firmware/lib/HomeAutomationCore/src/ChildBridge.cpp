@@ -0,0 +1,319 @@
+#include "ChildBridge.h"
+
+#include "DeviceCore.h"
+#include "MqttDispatch.h"
+
+namespace ha {
+
+namespace {
+bool validId(const char* id) {
+  if (!id || !*id || strlen(id) > ChildBridge::MAX_ID_LENGTH) {
+    return false;
+  }
+  for (const char* c = id; *c; c++) {
+    if (!isalnum(*c) && *c != '_' && *c != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// homeautomation/devices/<id><suffix>, composed as the device's own
+bool childTopic(const char* id, const char* suffix, char* out, size_t size) {
+  DeviceTopics topics;
+  return topics.begin(id) && topics.format(out, size, suffix);
+}
+
+int16_t readInt16(const uint8_t* bytes) { return (int16_t)(bytes[0] | bytes[1] << 8); }
+}  // namespace
+
+ChildBridge::ChildBridge(const ChildBridgeHooks& hooks, unsigned long pollInterval, unsigned long timeout,
+                         uint16_t base, uint16_t length)
+    : _hooks(hooks), _pollInterval(pollInterval), _timeout(timeout), _store("children", sizeof(Table), base, length) {}
+
+void ChildBridge::begin() {
+  if (!_store.load(&_table) || _table.count > MAX_CHILDREN) {
+    _table = {};
+  }
+  for (uint8_t i = 0; i < _table.count; i++) {
+    _table.entries[i].id[MAX_ID_LENGTH] = '\0';
+    // Already subscribed if the session survives; subscribeAll() decides
+    _children[i] = {};
+  }
+}
+
+bool ChildBridge::add(const char* id, uint8_t address) {
+  if (!validId(id)) {
+    return false;
+  }
+  int8_t index = find(id);
+  int8_t holder = findAddress(address);
+  if (holder >= 0 && holder != index) {
+    return false;
+  }
+  if (index >= 0) {
+    if (_children[index].flags & REMOVED) {
+      // Back before its removal went out: take it over again
+      _children[index] = {};
+      _children[index].flags = SUBSCRIBE;
+    }
+  } else {
+    if (_table.count >= MAX_CHILDREN) {
+      return false;
+    }
+    index = _table.count++;
+    strcpy(_table.entries[index].id, id);
+    _children[index] = {};
+    _children[index].flags = SUBSCRIBE;
+  }
+  _table.entries[index].address = address;
+  _pendingSave = true;
+  return true;
+}
+
+bool ChildBridge::remove(const char* id) {
+  int8_t index = id ? find(id) : -1;
+  if (index < 0 || (_children[index].flags & REMOVED)) {
+    return false;
+  }
+  _children[index].flags = REMOVED;
+  _pendingSave = true;
+  return true;
+}
+
+void ChildBridge::subscribeAll() {
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (!(_children[i].flags & REMOVED)) {
+      _children[i].flags |= SUBSCRIBE;
+    }
+  }
+}
+
+void ChildBridge::announceAll() {
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (!(_children[i].flags & REMOVED)) {
+      _children[i].flags |= ANNOUNCE;
+    }
+  }
+}
+
+void ChildBridge::service(unsigned long now, bool connected) {
+  // Children that stopped answering go offline once
+  for (uint8_t i = 0; i < _table.count; i++) {
+    Child& child = _children[i];
+    if ((child.flags & ONLINE) && !(child.flags & REMOVED) && now - child.lastSeen > _timeout) {
+      child.flags = (child.flags & ~ONLINE) | ANNOUNCE | CHANGED;
+      _timeouts++;
+    }
+  }
+
+  if (connected) {
+    char topic[DeviceTopics::MAX_TOPIC];
+    bool removed = false;
+    for (uint8_t i = 0; i < _table.count; i++) {
+      Child& child = _children[i];
+      const char* id = _table.entries[i].id;
+      if (child.flags & REMOVED) {
+        // The retained flag goes with the child
+        if (childTopic(id, topic::ONLINE, topic, sizeof(topic))) {
+          _hooks.publish(topic, "{\"online\":false}", true);
+        }
+        if (childTopic(id, topic::COMMAND, topic, sizeof(topic))) {
+          _hooks.unsubscribe(topic);
+        }
+        removed = true;
+        continue;
+      }
+      if ((child.flags & SUBSCRIBE) && childTopic(id, topic::COMMAND, topic, sizeof(topic)) &&
+          _hooks.subscribe(topic)) {
+        child.flags &= ~SUBSCRIBE;
+      }
+      if (child.flags & ANNOUNCE) {
+        const char* payload = child.flags & ONLINE ? "{\"online\":true}" : "{\"online\":false}";
+        if (childTopic(id, topic::ONLINE, topic, sizeof(topic)) && _hooks.publish(topic, payload, true)) {
+          child.flags &= ~ANNOUNCE;
+        }
+      }
+    }
+    if (removed) {
+      compact();
+    }
+  }
+
+  if (_pendingSave) {
+    // Removed children are left out; they stay in RAM until unsubscribed
+    Table saved = {};
+    for (uint8_t i = 0; i < _table.count; i++) {
+      if (!(_children[i].flags & REMOVED)) {
+        saved.entries[saved.count++] = _table.entries[i];
+      }
+    }
+    if (_store.save(&saved)) {
+      _pendingSave = false;
+    }
+  }
+
+  // One child per interval, so a silent one costs a single timeout slot
+  if (_table.count && now - _lastPoll >= _pollInterval) {
+    _lastPoll = now;
+    for (uint8_t tries = 0; tries < _table.count; tries++) {
+      uint8_t index = _nextPoll++ % _table.count;
+      if (!(_children[index].flags & REMOVED)) {
+        _hooks.send(_table.entries[index].address, ChildLink::POLL, nullptr, 0);
+        _polls++;
+        break;
+      }
+    }
+    _nextPoll %= _table.count;
+  }
+}
+
+void ChildBridge::receive(const ChildLink::Frame& frame, unsigned long now) {
+  int8_t index = findAddress(frame.address);
+  if (index < 0 || frame.type != ChildLink::READING || frame.length < 7) {
+    return;
+  }
+  Child& child = _children[index];
+  ChildReading reading = { readInt16(frame.payload), (uint16_t)readInt16(frame.payload + 2),
+                           readInt16(frame.payload + 4), frame.payload[6] };
+  if (memcmp(&reading, &child.reading, sizeof(reading)) != 0 || !(child.flags & ONLINE)) {
+    child.flags |= CHANGED;
+  }
+  if (!(child.flags & ONLINE)) {
+    child.flags |= ONLINE | ANNOUNCE;
+  }
+  child.reading = reading;
+  child.lastSeen = now;
+  _readings++;
+}
+
+bool ChildBridge::matches(const char* topic) {
+  char candidate[DeviceTopics::MAX_TOPIC];
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (!(_children[i].flags & REMOVED) &&
+        childTopic(_table.entries[i].id, topic::COMMAND, candidate, sizeof(candidate)) &&
+        strcmp(topic, candidate) == 0) {
+      _matched = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ChildBridge::handleCommand(JsonDocument& doc) {
+  int8_t index = _matched;
+  _matched = -1;
+  if (index < 0) {
+    return;
+  }
+  JsonArrayConst batch = doc["commands"];
+  if (batch.isNull()) {
+    relay(index, doc.as<JsonObjectConst>());
+  } else {
+    for (JsonObjectConst entry : batch) {
+      relay(index, entry);
+    }
+  }
+}
+
+void ChildBridge::relay(uint8_t index, JsonObjectConst command) {
+  const char* name = command["command"];
+  if (!name) {
+    return;
+  }
+  uint8_t address = _table.entries[index].address;
+  uint32_t hash = fnv1aBuffer(name, strlen(name));
+  uint8_t output;
+  if (hash == fnv1a("set_power")) {
+    output = command["parameters"]["power"].as<bool>() ? 1 : 0;
+  } else if (hash == fnv1a("toggle")) {
+    output = 2;
+  } else if (hash == fnv1a("get_state")) {
+    // Answered with a reading, which marks the child changed
+    _children[index].flags |= CHANGED;
+    _hooks.send(address, ChildLink::POLL, nullptr, 0);
+    _relayed++;
+    return;
+  } else {
+    return;
+  }
+  _hooks.send(address, ChildLink::COMMAND, &output, 1);
+  _relayed++;
+}
+
+bool ChildBridge::reportChanges(JsonObject children) {
+  bool any = false;
+  for (uint8_t i = 0; i < _table.count; i++) {
+    Child& child = _children[i];
+    if ((child.flags & REMOVED) || !(child.flags & (CHANGED | REPORTING))) {
+      continue;
+    }
+    // The id stays put until the batch is serialized, so it is not copied
+    JsonObject entry = children.createNestedObject(_table.entries[i].id);
+    entry["online"] = (child.flags & ONLINE) != 0;
+    if (child.flags & ONLINE) {
+      entry["temperature"] = child.reading.temperature / 10.0;
+      entry["humidity"] = child.reading.humidity / 10.0;
+      entry["value"] = child.reading.value;
+      entry["power"] = child.reading.power != 0;
+    }
+    child.flags = (child.flags & ~CHANGED) | REPORTING;
+    any = true;
+  }
+  return any;
+}
+
+void ChildBridge::reported() {
+  for (uint8_t i = 0; i < _table.count; i++) {
+    _children[i].flags &= ~REPORTING;
+  }
+}
+
+void ChildBridge::reportStats(JsonObject obj) const {
+  uint8_t online = 0;
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (_children[i].flags & ONLINE) {
+      online++;
+    }
+  }
+  obj["children"] = _table.count;
+  obj["online"] = online;
+  obj["polls"] = _polls;
+  obj["readings"] = _readings;
+  obj["relayed"] = _relayed;
+  obj["timeouts"] = _timeouts;
+}
+
+int8_t ChildBridge::find(const char* id) const {
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (strcmp(_table.entries[i].id, id) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int8_t ChildBridge::findAddress(uint8_t address) const {
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (_table.entries[i].address == address && !(_children[i].flags & REMOVED)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void ChildBridge::compact() {
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < _table.count; i++) {
+    if (!(_children[i].flags & REMOVED)) {
+      _table.entries[kept] = _table.entries[i];
+      _children[kept] = _children[i];
+      kept++;
+    }
+  }
+  _table.count = kept;
+  _nextPoll = 0;
+  _matched = -1;
+}
+
+}  // namespace ha
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "ChildLink.h"
+#include "StateStore.h"
+
+namespace ha {
+
+// MQTT and link operations the bridge drives.
+struct ChildBridgeHooks {
+  bool (*subscribe)(const char* topic);
+  bool (*unsubscribe)(const char* topic);
+  bool (*publish)(const char* topic, const char* payload, bool retained);
+  bool (*send)(uint8_t address, uint8_t type, const uint8_t* payload, uint8_t length);
+};
+
+// What a sub-node reports, little-endian in a READING frame: tenths of a
+// degree and of a percent, one raw input, and its output.
+struct ChildReading {
+  int16_t temperature;
+  uint16_t humidity;
+  int16_t value;
+  uint8_t power;
+};
+
+// Sub-nodes behind the gateway, each a device of its own to the backend
+// under homeautomation/devices/<child>/..., all over the gateway's one
+// broker connection. The table (id and bus address per child) is kept in
+// EEPROM. The bridge polls the children in turn, subscribes their
+// command topics and relays commands as link frames, and keeps each
+// child's retained online flag. Readings are not published one by one:
+// reportChanges() collects every child with news for one batched publish
+// per heartbeat.
+class ChildBridge {
+ public:
+  static const uint8_t MAX_CHILDREN = 4;
+  static const size_t MAX_ID_LENGTH = 15;
+
+  // The table's EEPROM region follows the state store's default one.
+  ChildBridge(const ChildBridgeHooks& hooks, unsigned long pollInterval, unsigned long timeout,
+              uint16_t base = 512, uint16_t length = 512);
+
+  // Loads the saved table.
+  void begin();
+
+  // Register (or re-address) and drop a child. The id is copied, and
+  // the subscriptions follow in service(), once the command document that
+  // asked for it is done with. False on a bad id or a full table.
+  bool add(const char* id, uint8_t address);
+  bool remove(const char* id);
+  uint8_t count() const { return _table.count; }
+
+  // After a broker (re)connect: subscribe every child, unless the session
+  // was resumed, and republish every online flag.
+  void subscribeAll();
+  void announceAll();
+
+  // Polls the next child, marks silent ones offline, and carries out
+  // pending subscription and online changes while connected.
+  void service(unsigned long now, bool connected);
+  // A frame from the link.
+  void receive(const ChildLink::Frame& frame, unsigned long now);
+
+  // homeautomation/devices/<child>/command of a known child; the child is
+  // remembered for the handleCommand() that follows.
+  bool matches(const char* topic);
+  // set_power, toggle and get_state for the matched child, relayed as
+  // frames; the answer arrives as a reading.
+  void handleCommand(JsonDocument& doc);
+
+  // {"<child>": {...}, ...} for every child with a new reading or online
+  // change; false if there is none. reported() clears them once the
+  // batch is out.
+  bool reportChanges(JsonObject children);
+  void reported();
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  // Persisted
+  struct Entry {
+    uint8_t address;
+    char id[MAX_ID_LENGTH + 1];
+  };
+  struct Table {
+    uint8_t count;
+    Entry entries[MAX_CHILDREN];
+  };
+
+  // Child flags: news for the next batch; in the batch being published;
+  // answering; online flag to publish; command topic to subscribe; removed,
+  // command topic to unsubscribe
+  static const uint8_t CHANGED = 0x01;
+  static const uint8_t REPORTING = 0x02;
+  static const uint8_t ONLINE = 0x04;
+  static const uint8_t ANNOUNCE = 0x08;
+  static const uint8_t SUBSCRIBE = 0x10;
+  static const uint8_t REMOVED = 0x20;
+
+  struct Child {
+    ChildReading reading;
+    unsigned long lastSeen;
+    uint8_t flags;
+  };
+
+  int8_t find(const char* id) const;
+  int8_t findAddress(uint8_t address) const;
+  void relay(uint8_t index, JsonObjectConst command);
+  void compact();
+
+  const ChildBridgeHooks& _hooks;
+  unsigned long _pollInterval;
+  unsigned long _timeout;
+  RecordStore _store;
+  Table _table = {};
+  Child _children[MAX_CHILDREN] = {};
+  bool _pendingSave = false;
+  uint8_t _nextPoll = 0;
+  unsigned long _lastPoll = 0;
+  int8_t _matched = -1;
+
+  uint32_t _polls = 0;
+  uint32_t _readings = 0;
+  uint32_t _relayed = 0;
+  uint32_t _timeouts = 0;
+};
+
+}  // namespace ha
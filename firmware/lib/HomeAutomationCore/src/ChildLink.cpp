@@ -0,0 +1,119 @@
+#include "ChildLink.h"
+
+namespace ha {
+
+namespace {
+void crc8(uint8_t& crc, uint8_t byte) {
+  // CRC-8/MAXIM, as the state store's records
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    uint8_t mix = (crc ^ byte) & 1;
+    crc >>= 1;
+    if (mix) {
+      crc ^= 0x8C;
+    }
+    byte >>= 1;
+  }
+}
+
+uint8_t frameCrc(const ChildLink::Frame& frame) {
+  uint8_t crc = 0;
+  crc8(crc, frame.address);
+  crc8(crc, frame.type);
+  crc8(crc, frame.length);
+  for (uint8_t i = 0; i < frame.length; i++) {
+    crc8(crc, frame.payload[i]);
+  }
+  return crc;
+}
+}  // namespace
+
+ChildLink::ChildLink(Stream& stream, int8_t dePin) : _stream(stream), _dePin(dePin) {}
+
+void ChildLink::begin() {
+  if (_dePin >= 0) {
+    pinMode(_dePin, OUTPUT);
+    digitalWrite(_dePin, LOW);
+  }
+}
+
+bool ChildLink::send(uint8_t address, uint8_t type, const uint8_t* payload, uint8_t length) {
+  if (length > MAX_PAYLOAD) {
+    return false;
+  }
+  Frame frame = { address, type, length, {} };
+  if (length) {
+    memcpy(frame.payload, payload, length);
+  }
+
+  // Drive the bus only for the frame, then hand it back for the answer
+  if (_dePin >= 0) {
+    digitalWrite(_dePin, HIGH);
+  }
+  _stream.write(START);
+  _stream.write(address);
+  _stream.write(type);
+  _stream.write(length);
+  _stream.write(frame.payload, length);
+  _stream.write(frameCrc(frame));
+  _stream.flush();
+  if (_dePin >= 0) {
+    digitalWrite(_dePin, LOW);
+  }
+  _sent++;
+  return true;
+}
+
+bool ChildLink::poll(Frame& frame) {
+  while (_stream.available() > 0) {
+    uint8_t byte = _stream.read();
+    switch (_rx) {
+      case Rx::Start:
+        if (byte == START) {
+          _rx = Rx::Address;
+        }
+        break;
+      case Rx::Address:
+        _frame.address = byte;
+        _rx = Rx::Type;
+        break;
+      case Rx::Type:
+        _frame.type = byte;
+        _rx = Rx::Length;
+        break;
+      case Rx::Length:
+        if (byte > MAX_PAYLOAD) {
+          _crcErrors++;
+          _rx = Rx::Start;
+          break;
+        }
+        _frame.length = byte;
+        _received = 0;
+        _rx = byte ? Rx::Payload : Rx::Crc;
+        break;
+      case Rx::Payload:
+        _frame.payload[_received++] = byte;
+        if (_received == _frame.length) {
+          _rx = Rx::Crc;
+        }
+        break;
+      case Rx::Crc:
+        _rx = Rx::Start;
+        if (byte != frameCrc(_frame)) {
+          _crcErrors++;
+          break;
+        }
+        _frames++;
+        frame = _frame;
+        return true;
+    }
+  }
+  return false;
+}
+
+void ChildLink::reportStats(JsonObject obj) const {
+  obj["sent"] = _sent;
+  obj["frames"] = _frames;
+  obj["crc_errors"] = _crcErrors;
+}
+
+}  // namespace ha
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Frames to and from sub-nodes on a half-duplex serial bus: RS-485
+// through a MAX485-style transceiver, or any Stream a radio bridge
+// presents. The gateway is the only master, so a child only talks when
+// asked, and the bus needs no arbitration.
+//
+//   0x7E, address, type, length, payload[length], CRC-8/MAXIM
+//
+// The CRC covers address through payload. A byte that does not start a
+// frame, or a frame failing its CRC, is dropped and the parser waits for
+// the next 0x7E.
+class ChildLink {
+ public:
+  static const uint8_t START = 0x7E;
+  static const uint8_t MAX_PAYLOAD = 8;
+
+  // Frame types: gateway asks for a reading; child answers with one;
+  // gateway sets the child's output
+  static const uint8_t POLL = 'P';
+  static const uint8_t READING = 'R';
+  static const uint8_t COMMAND = 'C';
+
+  struct Frame {
+    uint8_t address;
+    uint8_t type;
+    uint8_t length;
+    uint8_t payload[MAX_PAYLOAD];
+  };
+
+  // dePin drives the transceiver's driver enable; -1 when there is none.
+  explicit ChildLink(Stream& stream, int8_t dePin = -1);
+
+  void begin();
+  bool send(uint8_t address, uint8_t type, const uint8_t* payload, uint8_t length);
+  // Parses what has arrived; true once frame holds a whole valid frame.
+  bool poll(Frame& frame);
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  enum class Rx : uint8_t { Start, Address, Type, Length, Payload, Crc };
+
+  Stream& _stream;
+  int8_t _dePin;
+
+  Rx _rx = Rx::Start;
+  Frame _frame = {};
+  uint8_t _received = 0;
+
+  uint32_t _sent = 0;
+  uint32_t _frames = 0;
+  uint32_t _crcErrors = 0;
+};
+
+}  // namespace ha
@@ -0,0 +1,180 @@
+#include "ConnectionManager.h"
+
+#include "Metrics.h"
+
+namespace ha {
+
+namespace {
+// How long a link (WiFi) join may take before it counts as failed
+const unsigned long LINK_CONNECT_TIMEOUT = 10000;
+const unsigned long LINK_RETRY_BASE = 2000;
+const unsigned long BROKER_RETRY_BASE = 1000;
+const unsigned long RETRY_MAX = 60000;
+// Spread of the first broker attempt after an outage
+const unsigned long BROKER_START_WINDOW = 5000;
+}  // namespace
+
+void Backoff::start(unsigned long now, unsigned long windowMs) {
+  _attempts = 0;
+  _nextAttempt = now + (windowMs ? random() % windowMs : 0);
+}
+
+void Backoff::failed(unsigned long now) {
+  unsigned long window = _baseMs;
+  for (uint8_t i = 0; i < _attempts && window < _maxMs; i++) {
+    window <<= 1;
+  }
+  if (window > _maxMs) {
+    window = _maxMs;
+  }
+  if (_attempts < 255) {
+    _attempts++;
+  }
+  // Equal jitter: half of the window is fixed, half is random
+  _nextAttempt = now + window / 2 + random() % (window / 2 + 1);
+}
+
+uint32_t Backoff::random() {
+  // xorshift32
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+ConnectionManager::ConnectionManager(const ConnectionHooks& hooks)
+    : _hooks(hooks),
+      _linkBackoff(LINK_RETRY_BASE, RETRY_MAX),
+      _brokerBackoff(BROKER_RETRY_BASE, RETRY_MAX) {}
+
+void ConnectionManager::seed(uint32_t seed) {
+  _linkBackoff.seed(seed);
+  _brokerBackoff.seed(seed ^ 0xA5A5A5A5UL);
+}
+
+void ConnectionManager::service(unsigned long now) {
+  bool linkUp = _hooks.linkUp();
+
+  switch (_state) {
+    case LINK_DOWN:
+      if (linkUp) {
+        enter(BROKER_WAIT, now);
+      } else if (_hooks.beginLink && _linkBackoff.ready(now)) {
+        _hooks.beginLink();
+        enter(LINK_CONNECTING, now);
+      }
+      break;
+
+    case LINK_CONNECTING:
+      if (linkUp) {
+        _linkBackoff.reset();
+        enter(BROKER_WAIT, now);
+      } else if (now - _stateSince >= LINK_CONNECT_TIMEOUT) {
+        _linkFailures++;
+        _linkBackoff.failed(now);
+        Serial.print(F("Network link failed, retrying in "));
+        Serial.print(_linkBackoff.nextAttempt() - now);
+        Serial.println(F(" ms"));
+        enter(LINK_DOWN, now);
+      }
+      break;
+
+    case BROKER_WAIT:
+      if (!linkUp) {
+        enter(LINK_DOWN, now);
+      } else if (_brokerBackoff.ready(now)) {
+        if (_hooks.connectBroker()) {
+          _brokerBackoff.reset();
+          enter(ONLINE, now);
+        } else if (_hooks.brokerConnecting && _hooks.brokerConnecting()) {
+          enter(BROKER_CONNECTING, now);
+        } else {
+          brokerFailed(now);
+        }
+      }
+      break;
+
+    case BROKER_CONNECTING:
+      if (!linkUp) {
+        enter(LINK_DOWN, now);
+      } else if (_hooks.brokerConnected()) {
+        if (_hooks.connectBroker()) {
+          _brokerBackoff.reset();
+          enter(ONLINE, now);
+        } else {
+          brokerFailed(now);
+          enter(BROKER_WAIT, now);
+        }
+      } else if (!_hooks.brokerConnecting()) {
+        brokerFailed(now);
+        enter(BROKER_WAIT, now);
+      }
+      break;
+
+    case ONLINE:
+      if (!linkUp) {
+        enter(LINK_DOWN, now);
+      } else if (!_hooks.brokerConnected()) {
+        enter(BROKER_WAIT, now);
+      }
+      break;
+  }
+}
+
+void ConnectionManager::suspend(unsigned long now) {
+  _state = LINK_DOWN;
+  _stateSince = now;
+  _offlineSince = 0;
+  _linkBackoff.start(now, 0);
+}
+
+void ConnectionManager::enter(State state, unsigned long now) {
+  if (_state == ONLINE && state != ONLINE) {
+    _offlineSince = now;
+  }
+
+  if (state == BROKER_WAIT && _state != BROKER_WAIT && _state != BROKER_CONNECTING) {
+    Serial.println(F("Network link up"));
+    // The first connect after boot goes out immediately; after an outage
+    // every device waits a random slice of the start window.
+    _brokerBackoff.start(now, _offlineSince ? BROKER_START_WINDOW : 0);
+  }
+
+  if (state == ONLINE && _offlineSince) {
+    _reconnects++;
+    _lastOutageMs = now - _offlineSince;
+    HA_RECORD_LATENCY(Reconnect, _lastOutageMs);
+  }
+
+  _state = state;
+  _stateSince = now;
+}
+
+void ConnectionManager::brokerFailed(unsigned long now) {
+  _brokerFailures++;
+  _brokerBackoff.failed(now);
+  Serial.print(F("MQTT retry in "));
+  Serial.print(_brokerBackoff.nextAttempt() - now);
+  Serial.println(F(" ms"));
+}
+
+const char* ConnectionManager::stateName() const {
+  switch (_state) {
+    case LINK_DOWN: return "link_down";
+    case LINK_CONNECTING: return "link_connecting";
+    case BROKER_WAIT: return "broker_wait";
+    case BROKER_CONNECTING: return "broker_connecting";
+    case ONLINE: return "online";
+  }
+  return "unknown";
+}
+
+void ConnectionManager::reportStats(JsonObject obj) const {
+  obj["state"] = stateName();
+  obj["reconnects"] = _reconnects;
+  obj["link_failures"] = _linkFailures;
+  obj["broker_failures"] = _brokerFailures;
+  obj["last_outage_ms"] = _lastOutageMs;
+}
+
+}  // namespace ha
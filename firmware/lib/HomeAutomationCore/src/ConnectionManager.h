@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Exponential backoff with per-device jitter. Each device seeds its own
+// PRNG (from its MAC) so a floor of devices coming back after an AP or
+// broker outage spreads its retries out instead of reconnecting in step.
+class Backoff {
+ public:
+  Backoff(unsigned long baseMs, unsigned long maxMs) : _baseMs(baseMs), _maxMs(maxMs) {}
+
+  void seed(uint32_t seed) { _rng = seed ? seed : 0x9E3779B9UL; }
+
+  // Schedules the first attempt somewhere within the next windowMs.
+  void start(unsigned long now, unsigned long windowMs);
+  // Schedules the next attempt after a failure, doubling the window.
+  void failed(unsigned long now);
+  void reset() { _attempts = 0; }
+
+  bool ready(unsigned long now) const { return (long)(now - _nextAttempt) >= 0; }
+  uint8_t attempts() const { return _attempts; }
+  unsigned long nextAttempt() const { return _nextAttempt; }
+
+ private:
+  uint32_t random();
+
+  unsigned long _baseMs;
+  unsigned long _maxMs;
+  unsigned long _nextAttempt = 0;
+  uint8_t _attempts = 0;
+  uint32_t _rng = 0x9E3779B9UL;
+};
+
+// Board-specific operations the connection state machine drives. All of
+// them must return promptly; beginLink may be null when the link layer
+// (e.g. wired Ethernet) does not need to be restarted.
+//
+// brokerConnecting may be null too. An async client's connectBroker only
+// starts the connect and returns false; brokerConnecting stays true until
+// the broker answers (or the attempt times out), and connectBroker is
+// called again once brokerConnected, to subscribe and announce.
+struct ConnectionHooks {
+  bool (*linkUp)();
+  void (*beginLink)();
+  bool (*connectBroker)();
+  bool (*brokerConnected)();
+  bool (*brokerConnecting)();
+};
+
+// Non-blocking WiFi/Ethernet + MQTT reconnect loop. service() is called on
+// every loop() pass and performs at most one connection step, so local
+// control keeps running while the network is down.
+class ConnectionManager {
+ public:
+  enum State : uint8_t { LINK_DOWN, LINK_CONNECTING, BROKER_WAIT, BROKER_CONNECTING, ONLINE };
+
+  explicit ConnectionManager(const ConnectionHooks& hooks);
+
+  void seed(uint32_t seed);
+  void service(unsigned long now);
+  // Drops to LINK_DOWN for a deliberate radio shutdown (e.g. sleep); the
+  // next connect is not treated as an outage, so it skips the start window.
+  void suspend(unsigned long now);
+
+  bool online() const { return _state == ONLINE; }
+  State state() const { return _state; }
+  const char* stateName() const;
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  void enter(State state, unsigned long now);
+  void brokerFailed(unsigned long now);
+
+  const ConnectionHooks& _hooks;
+  State _state = LINK_DOWN;
+  unsigned long _stateSince = 0;
+  Backoff _linkBackoff;
+  Backoff _brokerBackoff;
+  uint32_t _linkFailures = 0;
+  uint32_t _brokerFailures = 0;
+  uint32_t _reconnects = 0;
+  unsigned long _lastOutageMs = 0;
+  unsigned long _offlineSince = 0;
+};
+
+}  // namespace ha
@@ -0,0 +1,34 @@
+#include "DeviceCore.h"
+
+namespace ha {
+
+namespace {
+// Kept in flash on AVR, like the format strings below
+const char TOPIC_PREFIX[] PROGMEM = "homeautomation/devices/";
+}
+
+bool DeviceTopics::begin(const char* deviceId) {
+  size_t prefixLength = sizeof(TOPIC_PREFIX) - 1;
+  size_t idLength = strlen(deviceId);
+  if (prefixLength + idLength >= sizeof(_base)) {
+    _base[0] = '\0';
+    _prefixLength = 0;
+    return false;
+  }
+  memcpy_P(_base, TOPIC_PREFIX, prefixLength);
+  memcpy(_base + prefixLength, deviceId, idLength + 1);
+  _prefixLength = prefixLength;
+  return true;
+}
+
+const char* formatAddress(const IPAddress& address, char out[16]) {
+  snprintf_P(out, 16, PSTR("%u.%u.%u.%u"), address[0], address[1], address[2], address[3]);
+  return out;
+}
+
+bool DeviceTopics::format(char* out, size_t size, const char* suffix) const {
+  size_t length = snprintf_P(out, size, PSTR("%s%s"), _base, suffix);
+  return length < size;
+}
+
+}  // namespace ha
@@ -0,0 +1,462 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <IPAddress.h>
+
+#if defined(ESP32)
+#include <WiFi.h>
+#elif defined(ESP8266)
+#include <ESP8266WiFi.h>
+#endif
+
+#include "HeapProbe.h"
+#include "Metrics.h"
+
+#if defined(ESP32) || defined(ESP8266)
+#include "OtaUpdate.h"
+#endif
+
+#if defined(HA_ASYNC_MQTT)
+#include "AsyncMqtt.h"
+#else
+#include <PubSubClient.h>
+#endif
+
+// Longest base topic. The Uno's lean profile lowers it, since every
+// composed topic is a stack buffer of this plus a suffix.
+#ifndef HA_MAX_BASE_TOPIC
+#define HA_MAX_BASE_TOPIC 64
+#endif
+
+namespace ha {
+
+// The MQTT transport: PubSubClient, or with HA_ASYNC_MQTT the
+// non-blocking AsyncMqtt, which has the same calls.
+#if defined(HA_ASYNC_MQTT)
+typedef AsyncMqtt MqttClient;
+#else
+typedef PubSubClient MqttClient;
+#endif
+
+// Suffixes of the device base topic, homeautomation/devices/<id>. Route
+// tables hash these (fnv1a(topic::COMMAND)) and full topics are composed
+// from them when needed.
+namespace topic {
+constexpr const char* STATUS = "/status";
+constexpr const char* STATE = "/state";
+constexpr const char* STATE_BIN = "/state/bin";
+constexpr const char* SAMPLES = "/samples";
+constexpr const char* SAMPLES_BIN = "/samples/bin";
+constexpr const char* ONLINE = "/online";
+constexpr const char* COMMAND = "/command";
+constexpr const char* OTA = "/ota";
+constexpr const char* REPLAY = "/replay";
+constexpr const char* CHILDREN = "/children";
+constexpr const char* EVENT = "/event";
+constexpr const char* METRICS = "/metrics";
+}  // namespace topic
+
+// The device's base topic, built once at boot. Only the base is kept;
+// full topics are composed on the stack for each publish or subscribe
+// (see Topic), so a device holds no String per topic.
+class DeviceTopics {
+ public:
+  static const size_t MAX_BASE = HA_MAX_BASE_TOPIC;
+  static const size_t MAX_TOPIC = MAX_BASE + 16;
+
+  // False if the id does not fit.
+  bool begin(const char* deviceId);
+
+  const char* base() const { return _base; }
+  // The id is the tail of the base topic.
+  const char* deviceId() const { return _base + _prefixLength; }
+
+  // Writes base + suffix to out; false if it had to be truncated.
+  bool format(char* out, size_t size, const char* suffix) const;
+
+ private:
+  char _base[MAX_BASE] = "";
+  uint8_t _prefixLength = 0;
+};
+
+// Dotted quad into out, without the String IPAddress::toString() builds.
+const char* formatAddress(const IPAddress& address, char out[16]);
+
+// One composed topic, alive for the statement that uses it:
+//   mqttClient.publish(ha::Topic(device.topics(), ha::topic::STATE), payload);
+class Topic {
+ public:
+  Topic(const DeviceTopics& topics, const char* suffix) { topics.format(_topic, sizeof(_topic), suffix); }
+
+  const char* c_str() const { return _topic; }
+  operator const char*() const { return _topic; }
+
+ private:
+  char _topic[DeviceTopics::MAX_TOPIC];
+};
+
+// The connect, online and status plumbing every device shares. Traits
+// supplies the per-device parts as static members:
+//
+//   struct LightTraits {
+//     static const size_t STATUS_CAPACITY = 1024;    // status document and publish buffer size
+//     static const char* type();                     // "Smart Light"
+//     static const char* firmwareVersion();
+//     static void reportStatus(JsonDocument& status); // device-specific fields
+//   };
+//
+// On AVR type() and firmwareVersion() may return F() strings instead;
+// they are copied into the status document, so STATUS_CAPACITY has to
+// leave room for them.
+template <typename Traits>
+class DeviceCore {
+ public:
+  // The largest document any method here keeps on the stack, for the
+  // sketches' stack budget checks. The ESP status document is a member.
+  static const size_t MAX_STACK_DOCUMENT = 320;
+
+  explicit DeviceCore(MqttClient& client) : _client(client) {}
+
+  // False if the id is too long for a topic.
+  bool begin(const char* deviceId) { return _topics.begin(deviceId); }
+
+  const DeviceTopics& topics() const { return _topics; }
+  const char* deviceId() const { return _topics.deviceId(); }
+  bool online() const { return _online; }
+
+  // Connects with a retained {"online":false} will on <base>/online. The
+  // device counts as offline until publishOnline(true). The session is
+  // persistent, under the device id as client id, so the broker keeps the
+  // subscriptions and queues QoS1 commands while the device is away.
+  bool connect(const char* user, const char* password) {
+    _online = false;
+    Topic will(_topics, topic::ONLINE);
+    return _client.connect(deviceId(), user, password, will, 1, true, "{\"online\":false}", false);
+  }
+
+  // The broker resumed the session with every subscription in place, so
+  // the reconnect can skip subscribing. Only the async transport can
+  // tell (PubSubClient does not report it), so this is always false with
+  // PubSubClient, which then subscribes again each time.
+  bool resumed() const {
+#if defined(HA_ASYNC_MQTT)
+    return _client.sessionPresent();
+#else
+    return false;
+#endif
+  }
+
+  // An async connect() answered by the broker later; registered as the
+  // ConnectionManager's brokerConnecting hook. Never with PubSubClient.
+  bool connecting() const {
+#if defined(HA_ASYNC_MQTT)
+    return _client.connecting();
+#else
+    return false;
+#endif
+  }
+
+  // Everything published has gone out (and QoS1 been acknowledged), e.g.
+  // before the radio is switched off. PubSubClient writes synchronously.
+  bool flushed() const {
+#if defined(HA_ASYNC_MQTT)
+    return _client.flushed();
+#else
+    return true;
+#endif
+  }
+
+  // At QoS1, so commands sent while the device is offline are queued
+  bool subscribe(const char* suffix) { return _client.subscribe(Topic(_topics, suffix), 1); }
+
+  bool publish(const char* suffix, const char* payload, bool retained = false) {
+    HA_ASSERT_NO_ALLOC("DeviceCore::publish");
+    HA_TIME_SCOPE(Publish);
+    return _client.connected() && sent(_client.publish(Topic(_topics, suffix), payload, retained));
+  }
+
+  // Publishes without a String or the client buffer bounding the size. On
+  // ESP the document is serialized into one reusable buffer and written
+  // in one go; anything larger, and every document on AVR, is streamed.
+  bool publishJson(const char* suffix, const JsonDocument& doc, bool retained = false) {
+    HA_ASSERT_NO_ALLOC("DeviceCore::publishJson");
+    HA_TIME_SCOPE(Publish);
+    if (!_client.connected()) {
+      return false;
+    }
+    size_t length = measureJson(doc);
+    if (!sent(_client.beginPublish(Topic(_topics, suffix), length, retained))) {
+      return false;
+    }
+#if defined(ESP32) || defined(ESP8266)
+    if (length < sizeof(_payload)) {
+      serializeJson(doc, _payload, sizeof(_payload));
+      _client.write(reinterpret_cast<const uint8_t*>(_payload), length);
+      return sent(_client.endPublish());
+    }
+    Chunked chunked(_client, _payload, sizeof(_payload));
+#else
+    // Unbuffered, every byte would be its own SPI transaction on the
+    // Ethernet chip and possibly its own TCP segment
+    Chunked chunked(_client, _chunk, sizeof(_chunk));
+#endif
+    serializeJson(doc, chunked);
+    chunked.drain();
+    return sent(_client.endPublish());
+  }
+
+  void publishOnline(bool online) {
+    HA_ASSERT_NO_ALLOC("DeviceCore::publishOnline");
+    char message[48];
+    snprintf_P(message, sizeof(message), PSTR("{\"online\":%s,\"timestamp\":%lu}"), online ? "true" : "false",
+               (unsigned long)millis());
+    publish(topic::ONLINE, message, true);
+    _online = online;
+  }
+
+  // Identity and link fields, then whatever the device adds; retained.
+  void publishStatus() {
+    HA_ASSERT_NO_ALLOC("DeviceCore::publishStatus");
+    HA_TIME_SCOPE(Publish);
+#if defined(ESP32) || defined(ESP8266)
+    // The constant fields are serialized once, on the first status (the
+    // MAC is only certain once WiFi is up); each publish rebuilds the rest
+    // and sends both parts as one document.
+    if (!_statusPrefixLength) {
+      buildStatusPrefix();
+    }
+    JsonDocument& doc = _status;
+    doc.clear();
+    char ip[16];
+    doc["ip_address"] = (const char*)formatAddress(WiFi.localIP(), ip);
+    doc["wifi_rssi"] = WiFi.RSSI();
+    doc["free_heap"] = ESP.getFreeHeap();
+    doc["online"] = _online;
+    doc["uptime"] = millis();
+    reportHeap(doc.createNestedObject("heap"));
+#if defined(HA_COUNT_ALLOCATIONS)
+    reportAllocations(doc.createNestedObject("allocations"));
+#endif
+    Traits::reportStatus(doc);
+
+    // Both parts are objects: "{<prefix>" + "," + the rest minus its "{"
+    if (!_client.connected()) {
+      return;
+    }
+    size_t length = measureJson(doc);
+    if (!sent(_client.beginPublish(Topic(_topics, topic::STATUS), _statusPrefixLength + length, true))) {
+      return;
+    }
+    _client.write(reinterpret_cast<const uint8_t*>(_statusPrefix), _statusPrefixLength);
+    _client.write(',');
+    if (length < sizeof(_payload)) {
+      serializeJson(doc, _payload, sizeof(_payload));
+      _client.write(reinterpret_cast<const uint8_t*>(_payload) + 1, length - 1);
+    } else {
+      SkipFirst rest(_client);
+      serializeJson(doc, rest);
+    }
+    if (sent(_client.endPublish())) {
+      _statusAddress = WiFi.localIP();
+    }
+#else
+    StaticJsonDocument<Traits::STATUS_CAPACITY> doc;
+    doc["device_id"] = deviceId();
+    doc["device_type"] = Traits::type();
+    doc["firmware_version"] = Traits::firmwareVersion();
+    doc["online"] = _online;
+    doc["uptime"] = millis();
+    Traits::reportStatus(doc);
+    publishJson(topic::STATUS, doc, true);
+#endif
+  }
+
+#if defined(ESP32) || defined(ESP8266)
+  // The hot-path metrics (see Metrics.h) in the Prometheus text format on
+  // <base>/metrics. The text is longer than the payload buffer, so it is
+  // rendered twice from one snapshot: once to measure, once to send in
+  // buffer-sized pieces.
+  bool publishMetrics() {
+    HA_ASSERT_NO_ALLOC("DeviceCore::publishMetrics");
+    if (!_client.connected()) {
+      return false;
+    }
+    MetricsSnapshot snapshot;
+    snapshotMetrics(snapshot);
+    Discard discard;
+    size_t length = writeMetrics(discard, snapshot);
+    if (!sent(_client.beginPublish(Topic(_topics, topic::METRICS), length, false))) {
+      return false;
+    }
+    Chunked chunked(_client, _payload, sizeof(_payload));
+    writeMetrics(chunked, snapshot);
+    chunked.drain();
+    return sent(_client.endPublish());
+  }
+
+  // The retained status went out with the current address, so after a
+  // resumed session it can stand.
+  bool statusCurrent() const { return _statusAddress && _statusAddress == (uint32_t)WiFi.localIP(); }
+
+  // Answers an OTA "check" on <base>/status with the running version and
+  // image and the artifact formats this device decodes, so the OTA
+  // service can send the smallest one.
+  void publishOtaCheck() {
+    StaticJsonDocument<MAX_STACK_DOCUMENT> response;
+    response["device_id"] = deviceId();
+    response["current_version"] = Traits::firmwareVersion();
+    response["status"] = "ready_for_update";
+    OtaStream::reportCapabilities(response.as<JsonObject>());
+    publishJson(topic::STATUS, response);
+  }
+
+  // Publishes slot requests, throttled progress and then the result of
+  // ota on <base>/status. Once a verified image is in place,
+  // beforeRestart (optional, e.g. to flush saved state) runs and the
+  // device reboots.
+  void reportOta(OtaStream& ota, void (*beforeRestart)() = nullptr) {
+    if (ota.grantRequestDue(millis())) {
+      // Answered on <base>/ota with "grant" or "retry_after"
+      StaticJsonDocument<96> request;
+      request["device_id"] = deviceId();
+      request["status"] = "waiting_for_slot";
+      publishJson(topic::STATUS, request);
+      return;
+    }
+
+    OtaStream::State state = ota.state();
+    bool finished = state == OtaStream::State::Verified || state == OtaStream::State::Failed;
+    if (!finished && !ota.progressDue(millis())) {
+      return;
+    }
+
+    StaticJsonDocument<192> status;
+    status["device_id"] = deviceId();
+    status["status"] = otaStateName(state);
+    status["progress"] = ota.progress();
+    if (state == OtaStream::State::Failed) {
+      Serial.print("OTA Update failed: ");
+      Serial.println(ota.error());
+      status["error"] = ota.error();
+    }
+    publishJson(topic::STATUS, status);
+    if (!finished) {
+      return;
+    }
+
+    ota.clear();
+    if (state == OtaStream::State::Verified) {
+      Serial.println("OTA Update successful, restarting...");
+      if (beforeRestart) {
+        beforeRestart();
+      }
+      delay(1000);
+      ESP.restart();
+    }
+  }
+#endif
+
+ private:
+  // A publish the client refused while connected is lost, not queued
+  static bool sent(bool ok) {
+    if (!ok) {
+      HA_COUNT_EVENT(DroppedPublishes, 1);
+    }
+    return ok;
+  }
+
+  // Print that hands writes on in pieces of the buffer's size
+  class Chunked : public Print {
+   public:
+    Chunked(Print& out, char* buffer, size_t size) : _out(out), _buffer(buffer), _size(size) {}
+    size_t write(uint8_t c) override {
+      if (_used == _size) {
+        drain();
+      }
+      _buffer[_used++] = c;
+      return 1;
+    }
+    void drain() {
+      _out.write(reinterpret_cast<const uint8_t*>(_buffer), _used);
+      _used = 0;
+    }
+
+   private:
+    Print& _out;
+    char* _buffer;
+    size_t _size;
+    size_t _used = 0;
+  };
+
+  // Small enough for the Uno's SRAM, large enough to batch the writes
+  static const size_t PUBLISH_CHUNK = 32;
+
+#if defined(ESP32) || defined(ESP8266)
+  static const size_t MAX_STATUS_PREFIX = 192;
+
+  // Print that writes nowhere, for measuring
+  class Discard : public Print {
+   public:
+    size_t write(uint8_t) override { return 1; }
+    size_t write(const uint8_t*, size_t size) override { return size; }
+  };
+
+  // Print that drops the first byte, for streaming the dynamic part
+  class SkipFirst : public Print {
+   public:
+    explicit SkipFirst(Print& out) : _out(out) {}
+    size_t write(uint8_t c) override {
+      if (!_skipped) {
+        _skipped = true;
+        return 1;
+      }
+      return _out.write(c);
+    }
+
+   private:
+    Print& _out;
+    bool _skipped = false;
+  };
+
+  void buildStatusPrefix() {
+    uint8_t mac[6];
+    char macAddress[18];
+    WiFi.macAddress(mac);
+    snprintf(macAddress, sizeof(macAddress), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3],
+             mac[4], mac[5]);
+
+    StaticJsonDocument<192> doc;
+    doc["device_id"] = deviceId();
+    doc["device_type"] = Traits::type();
+    doc["firmware_version"] = Traits::firmwareVersion();
+    doc["mac_address"] = macAddress;
+    // Kept without the closing brace, ready for the dynamic fields
+    size_t length = serializeJson(doc, _statusPrefix, sizeof(_statusPrefix));
+    _statusPrefixLength = length > 1 && length < sizeof(_statusPrefix) - 1 ? length - 1 : 0;
+    if (!_statusPrefixLength) {
+      strcpy(_statusPrefix, "{\"device_id\":null");
+      _statusPrefixLength = strlen(_statusPrefix);
+    }
+  }
+#endif
+
+  MqttClient& _client;
+  DeviceTopics _topics;
+  bool _online = false;
+#if defined(ESP32) || defined(ESP8266)
+  char _statusPrefix[MAX_STATUS_PREFIX];
+  size_t _statusPrefixLength = 0;
+  uint32_t _statusAddress = 0;
+  // Serialized documents on their way to the client
+  char _payload[Traits::STATUS_CAPACITY];
+  // Not on the stack: status is published from the MQTT callback, on top
+  // of the command document, and the ESP8266 loop has a 4 KB stack
+  StaticJsonDocument<Traits::STATUS_CAPACITY> _status;
+#else
+  // Serialized documents on their way to the client, a piece at a time
+  char _chunk[PUBLISH_CHUNK];
+#endif
+};
+
+}  // namespace ha
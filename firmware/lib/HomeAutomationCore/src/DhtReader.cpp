@@ -0,0 +1,164 @@
+#include "DhtReader.h"
+
+#if defined(ESP32)
+
+namespace ha {
+
+namespace {
+// 1 us RMT ticks off the 80 MHz APB clock
+const uint8_t RMT_CLOCK_DIVIDER = 80;
+// The line stays high after the last bit; this much high ends a capture
+const uint16_t IDLE_THRESHOLD_US = 200;
+const uint8_t GLITCH_FILTER_TICKS = 100;   // APB cycles, ~1.25 us
+// A bit is a 50 us low and then a 26-28 us (0) or 70 us (1) high
+const uint16_t ONE_THRESHOLD_US = 48;
+const uint8_t FRAME_BITS = 40;
+// Start pulse, capture limit and read spacing
+const unsigned long DHT22_START_MS = 2;
+const unsigned long DHT11_START_MS = 20;
+const unsigned long CAPTURE_TIMEOUT_MS = 20;
+const unsigned long DHT22_MIN_INTERVAL_MS = 2000;
+const unsigned long DHT11_MIN_INTERVAL_MS = 1000;
+}  // namespace
+
+DhtReader::DhtReader(uint8_t pin, Model model, rmt_channel_t channel)
+    : _pin(pin), _model(model), _channel(channel) {}
+
+bool DhtReader::begin() {
+  rmt_config_t config = RMT_DEFAULT_CONFIG_RX((gpio_num_t)_pin, _channel);
+  config.clk_div = RMT_CLOCK_DIVIDER;
+  config.mem_block_num = 1;   // 64 items; a frame is 42
+  config.rx_config.idle_threshold = IDLE_THRESHOLD_US;
+  config.rx_config.filter_en = true;
+  config.rx_config.filter_ticks_thresh = GLITCH_FILTER_TICKS;
+  if (rmt_config(&config) != ESP_OK || rmt_driver_install(_channel, 512, 0) != ESP_OK ||
+      rmt_get_ringbuf_handle(_channel, &_ring) != ESP_OK) {
+    return false;
+  }
+  // rmt_config() made the pin an input; it also has to pull the line low
+  // for the start pulse, open-drain so the sensor can answer on it
+  gpio_set_pull_mode((gpio_num_t)_pin, GPIO_PULLUP_ONLY);
+  gpio_set_direction((gpio_num_t)_pin, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_level((gpio_num_t)_pin, 1);
+  return true;
+}
+
+bool DhtReader::start(unsigned long now) {
+  unsigned long spacing = _model == Model::Dht22 ? DHT22_MIN_INTERVAL_MS : DHT11_MIN_INTERVAL_MS;
+  if (!_ring || busy() || (_started && now - _lastStart < spacing)) {
+    return false;
+  }
+  gpio_set_level((gpio_num_t)_pin, 0);
+  _phase = Phase::StartPulse;
+  _phaseStarted = now;
+  _lastStart = now;
+  _started = true;
+  return true;
+}
+
+DhtReader::Result DhtReader::service(unsigned long now) {
+  switch (_phase) {
+    case Phase::Idle:
+      return Result::Idle;
+
+    case Phase::StartPulse: {
+      // One millisecond longer than needed, as the first millis() tick may
+      // come right away. The capture starts before the release, so the
+      // answer cannot be missed.
+      unsigned long pulse = _model == Model::Dht22 ? DHT22_START_MS : DHT11_START_MS;
+      if (now - _phaseStarted < pulse) {
+        return Result::Busy;
+      }
+      rmt_rx_start(_channel, true);
+      gpio_set_level((gpio_num_t)_pin, 1);
+      _phase = Phase::Capturing;
+      _phaseStarted = now;
+      return Result::Busy;
+    }
+
+    case Phase::Capturing: {
+      size_t size = 0;
+      rmt_item32_t* items = static_cast<rmt_item32_t*>(xRingbufferReceive(_ring, &size, 0));
+      if (!items) {
+        if (now - _phaseStarted < CAPTURE_TIMEOUT_MS) {
+          return Result::Busy;
+        }
+        stopCapture();
+        _timeouts++;
+        return Result::Failed;
+      }
+      bool good = decode(items, size / sizeof(rmt_item32_t));
+      vRingbufferReturnItem(_ring, items);
+      stopCapture();
+      if (!good) {
+        _badFrames++;
+        return Result::Failed;
+      }
+      _reads++;
+      return Result::Ready;
+    }
+  }
+  return Result::Idle;
+}
+
+bool DhtReader::decode(const rmt_item32_t* items, size_t count) {
+  // The highs in order: maybe the tail of the release, the 80 us answer,
+  // then one per bit. The last 40 are the bits.
+  uint8_t highs[FRAME_BITS];
+  uint8_t seen = 0;
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t halves[2][2] = { { items[i].level0, items[i].duration0 }, { items[i].level1, items[i].duration1 } };
+    for (const auto& half : halves) {
+      if (half[1] == 0) {
+        break;
+      }
+      if (half[0]) {
+        highs[seen % FRAME_BITS] = half[1] > ONE_THRESHOLD_US ? 1 : 0;
+        seen++;
+      }
+    }
+  }
+  if (seen < FRAME_BITS) {
+    return false;
+  }
+
+  uint8_t data[5] = {};
+  for (uint8_t bit = 0; bit < FRAME_BITS; bit++) {
+    uint8_t value = highs[(seen + bit) % FRAME_BITS];
+    data[bit / 8] = data[bit / 8] << 1 | value;
+  }
+  if ((uint8_t)(data[0] + data[1] + data[2] + data[3]) != data[4]) {
+    return false;
+  }
+
+  if (_model == Model::Dht22) {
+    _humidity = (data[0] << 8 | data[1]) / 10.0f;
+    float temperature = ((data[2] & 0x7F) << 8 | data[3]) / 10.0f;
+    _temperature = data[2] & 0x80 ? -temperature : temperature;
+  } else {
+    _humidity = data[0] + data[1] / 10.0f;
+    float temperature = data[2] + (data[3] & 0x7F) / 10.0f;
+    _temperature = data[3] & 0x80 ? -temperature : temperature;
+  }
+  return true;
+}
+
+void DhtReader::stopCapture() {
+  rmt_rx_stop(_channel);
+  // Drop anything the channel still queued, so the next read starts clean
+  size_t size = 0;
+  while (void* item = xRingbufferReceive(_ring, &size, 0)) {
+    vRingbufferReturnItem(_ring, item);
+  }
+  _phase = Phase::Idle;
+}
+
+void DhtReader::reportStats(JsonObject obj) const {
+  obj["reads"] = _reads;
+  obj["timeouts"] = _timeouts;
+  obj["bad_frames"] = _badFrames;
+}
+
+}  // namespace ha
+
+#endif
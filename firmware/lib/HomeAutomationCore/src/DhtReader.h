@@ -0,0 +1,70 @@
+#pragma once
+
+#if defined(ESP32)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <driver/rmt.h>
+
+namespace ha {
+
+// DHT11/DHT22 reads without bit-banging. The start pulse is timed across
+// service() calls and the sensor's answer is captured by an RMT receive
+// channel, so no one waits with interrupts masked. The 40 bits are
+// decoded from the captured pulse widths once the line goes idle.
+//
+//   reader.start(now);
+//   ... each pass: if (reader.service(now) == DhtReader::Result::Ready) ...
+//
+// service() has to come round within a couple of milliseconds while a
+// read is running (the start pulse is 1 ms for a DHT22); the whole read
+// takes about 10 ms.
+class DhtReader {
+ public:
+  enum class Model : uint8_t { Dht11, Dht22 };
+  enum class Result : uint8_t { Idle, Busy, Ready, Failed };
+
+  DhtReader(uint8_t pin, Model model, rmt_channel_t channel = RMT_CHANNEL_2);
+
+  bool begin();
+
+  // False while a read runs, or sooner after the last one than the
+  // sensor allows (2 s for a DHT22); the last values then stand.
+  bool start(unsigned long now);
+  // Ready or Failed once, when a read ends; Busy before that.
+  Result service(unsigned long now);
+  bool busy() const { return _phase != Phase::Idle; }
+
+  // Of the last good read; NAN before the first.
+  float temperature() const { return _temperature; }
+  float humidity() const { return _humidity; }
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  enum class Phase : uint8_t { Idle, StartPulse, Capturing };
+
+  bool decode(const rmt_item32_t* items, size_t count);
+  void stopCapture();
+
+  uint8_t _pin;
+  Model _model;
+  rmt_channel_t _channel;
+  RingbufHandle_t _ring = nullptr;
+
+  Phase _phase = Phase::Idle;
+  unsigned long _phaseStarted = 0;
+  unsigned long _lastStart = 0;
+  bool _started = false;
+
+  float _temperature = NAN;
+  float _humidity = NAN;
+
+  uint32_t _reads = 0;
+  uint32_t _timeouts = 0;
+  uint32_t _badFrames = 0;
+};
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,81 @@
+#include "EdgeCapture.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+namespace ha {
+
+EdgeCapture::EdgeCapture(uint8_t pin, unsigned long debounceMs) : _pin(pin), _debounceMs(debounceMs) {}
+
+void EdgeCapture::begin() {
+  _reported = _level = digitalRead(_pin);
+  // No lockout for the first change
+  _reportedAt = _levelAt = millis() - _debounceMs;
+  attachInterruptArg(digitalPinToInterrupt(_pin), onEdge, this, CHANGE);
+}
+
+void IRAM_ATTR EdgeCapture::onEdge(void* arg) {
+  EdgeCapture& self = *static_cast<EdgeCapture*>(arg);
+  uint8_t head = self._head;
+  uint8_t next = (head + 1) % RING_SIZE;
+  if (next == self._tail) {
+    self._overruns++;
+    return;
+  }
+  self._edgeAt[head] = millis();
+  self._edgeLevel[head] = digitalRead(self._pin);
+  self._head = next;
+}
+
+bool EdgeCapture::poll(Event& event, unsigned long now) {
+  while (_tail != _head) {
+    uint8_t tail = _tail;
+    bool level = _edgeLevel[tail];
+    uint32_t at = _edgeAt[tail];
+    _tail = (tail + 1) % RING_SIZE;
+    _edges++;
+    _level = level;
+    _levelAt = at;
+    if (level == _reported) {
+      continue;
+    }
+    if (at - _reportedAt >= _debounceMs) {
+      return report(level, at, event);
+    }
+    _chatter++;
+  }
+
+  // An edge nobody saw: the line is not where the last one left it
+  bool pin = digitalRead(_pin);
+  if (pin != _level) {
+    _level = pin;
+    _levelAt = now;
+    _resyncs++;
+  }
+
+  // Lockout over with the line at the other level
+  if (_level != _reported && now - _reportedAt >= _debounceMs) {
+    return report(_level, _levelAt, event);
+  }
+  return false;
+}
+
+bool EdgeCapture::report(bool level, uint32_t at, Event& event) {
+  _reported = level;
+  // The lockout counts from the edge, not from when poll() got to it
+  _reportedAt = at;
+  _events++;
+  event = { level, at };
+  return true;
+}
+
+void EdgeCapture::reportStats(JsonObject obj) const {
+  obj["edges"] = _edges;
+  obj["events"] = _events;
+  obj["chatter"] = _chatter;
+  obj["resyncs"] = _resyncs;
+  obj["overruns"] = _overruns;
+}
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Both edges of one input, timestamped in its interrupt and handed to the
+// loop through a small ring (the interrupt is the only writer, poll() the
+// only reader). poll() debounces with a lockout rather than a settle
+// time: a change is reported on its first edge, and edges within the
+// debounce time after a report are chatter. If the line ends the lockout
+// at the other level, that is reported too, with the time of the edge
+// that left it there. A PIR trigger therefore goes out at once, and a
+// pulse shorter than the debounce still shows up as two events.
+class EdgeCapture {
+ public:
+  static const uint8_t RING_SIZE = 16;
+
+  struct Event {
+    bool level;
+    uint32_t at;   // millis() of the edge
+  };
+
+  EdgeCapture(uint8_t pin, unsigned long debounceMs);
+
+  // Takes the current level as the reported one and attaches the
+  // interrupt; the pin mode is the caller's.
+  void begin();
+
+  // The next debounced change, if any. Also levels with the pin itself,
+  // for edges the interrupt could not see (light sleep, a full ring).
+  bool poll(Event& event, unsigned long now);
+  bool level() const { return _reported; }
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  static void IRAM_ATTR onEdge(void* arg);
+  bool report(bool level, uint32_t at, Event& event);
+
+  uint8_t _pin;
+  unsigned long _debounceMs;
+
+  // Written by onEdge() only
+  volatile uint8_t _head = 0;
+  uint32_t _edgeAt[RING_SIZE];
+  bool _edgeLevel[RING_SIZE];
+  volatile uint32_t _overruns = 0;
+  // Written by poll() only
+  volatile uint8_t _tail = 0;
+
+  bool _reported = false;
+  uint32_t _reportedAt = 0;
+  bool _level = false;
+  uint32_t _levelAt = 0;
+
+  uint32_t _edges = 0;
+  uint32_t _events = 0;
+  uint32_t _chatter = 0;
+  uint32_t _resyncs = 0;
+};
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,137 @@
+#include "FastBoot.h"
+
+#if defined(ESP32)
+#include <WiFi.h>
+#include <esp_wifi.h>
+#elif defined(ESP8266)
+#include <ESP8266WiFi.h>
+#endif
+
+namespace ha {
+
+namespace {
+const char* const PHASE_KEYS[FastBoot::PHASE_COUNT] = {
+  "outputs_ms", "storage_ms", "setup_ms", "link_ms", "broker_ms", "first_state_ms",
+};
+}  // namespace
+
+#if defined(ESP32) || defined(ESP8266)
+
+bool FastBoot::beginJoin() {
+  if (!_store.load(&_record) || _record.channel == 0) {
+    _record = NetworkRecord();
+    return false;
+  }
+
+  // The credentials WiFiManager stored on the first boot
+  WiFi.mode(WIFI_STA);
+#if defined(ESP32)
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK || !conf.sta.ssid[0]) {
+    return false;
+  }
+  memcpy(_ssid, conf.sta.ssid, sizeof(_ssid) - 1);
+  memcpy(_password, conf.sta.password, sizeof(_password) - 1);
+#else
+  if (WiFi.SSID().length() == 0) {
+    return false;
+  }
+  strncpy(_ssid, WiFi.SSID().c_str(), sizeof(_ssid) - 1);
+  strncpy(_password, WiFi.psk().c_str(), sizeof(_password) - 1);
+#endif
+
+  // Pinned for this join only: the stored config is left for a scan
+  WiFi.persistent(false);
+#if defined(HA_FAST_BOOT_STATIC_IP)
+  // The last lease, so the join needs no DHCP exchange either. Only safe
+  // where the router reserves the address for this MAC.
+  if (_record.ip) {
+    _staticIp = WiFi.config(IPAddress(_record.ip), IPAddress(_record.gateway), IPAddress(_record.subnet),
+                            IPAddress(_record.dns));
+  }
+#endif
+  WiFi.begin(_ssid, _password, _record.channel, _record.bssid);
+  _join = JOIN_STARTED;
+  Serial.print(F("Fast join on channel "));
+  Serial.println(_record.channel);
+  return true;
+}
+
+bool FastBoot::join() {
+  switch (_join) {
+    case JOIN_FULL:
+      return false;
+
+    case JOIN_STARTED:
+      // beginJoin()'s join is still running; let it finish
+      _join = JOIN_WAITING;
+      return true;
+
+    case JOIN_WAITING:
+      // The cached AP did not answer in time: drop it and scan
+      Serial.println(F("Cached AP not answering, scanning"));
+      forget();
+      if (_staticIp) {
+        WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+        _staticIp = false;
+      }
+      _join = JOIN_FALLBACK;
+      WiFi.begin(_ssid, _password);
+      return true;
+
+    case JOIN_CACHED:
+    case JOIN_FALLBACK:
+      // Later outages: a plain join, not pinned to the AP of the boot
+      WiFi.begin(_ssid, _password);
+      return true;
+  }
+  return false;
+}
+
+void FastBoot::linkUp() {
+  mark(LINK);
+  if (_join == JOIN_STARTED || _join == JOIN_WAITING) {
+    _join = JOIN_CACHED;
+  }
+
+  const uint8_t* bssid = WiFi.BSSID();
+  if (!bssid) {
+    return;
+  }
+  NetworkRecord seen = NetworkRecord();
+  memcpy(seen.bssid, bssid, sizeof(seen.bssid));
+  seen.channel = WiFi.channel();
+  seen.ip = (uint32_t)WiFi.localIP();
+  seen.gateway = (uint32_t)WiFi.gatewayIP();
+  seen.subnet = (uint32_t)WiFi.subnetMask();
+  seen.dns = (uint32_t)WiFi.dnsIP(0);
+  if (memcmp(&seen, &_record, sizeof(seen)) != 0 && _store.save(&seen)) {
+    _record = seen;
+  }
+}
+
+#endif
+
+void FastBoot::forget() {
+  if (_record.channel == 0) {
+    return;
+  }
+  _record = NetworkRecord();
+  _store.save(&_record);
+}
+
+void FastBoot::reportStats(JsonObject obj) const {
+  switch (_join) {
+    case JOIN_FULL: obj["join"] = "full"; break;
+    case JOIN_FALLBACK: obj["join"] = "fallback"; break;
+    default: obj["join"] = "cached"; break;
+  }
+  obj["static_ip"] = _staticIp;
+  for (uint8_t i = 0; i < PHASE_COUNT; i++) {
+    if (_at[i]) {
+      obj[PHASE_KEYS[i]] = _at[i];
+    }
+  }
+}
+
+}  // namespace ha
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "StateStore.h"
+
+namespace ha {
+
+// The access point and address of the last good join, kept across power
+// cycles. Plain bytes, no padding, so it stores and compares as-is.
+struct NetworkRecord {
+  uint8_t bssid[6];
+  uint8_t channel;   // 0 when nothing is cached
+  uint8_t reserved;
+  uint32_t ip;       // the last DHCP lease, for HA_FAST_BOOT_STATIC_IP
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+// Boot from power-on to the first state publish without the slow parts
+// of a cold join. The AP of the last boot is joined directly on its
+// channel and BSSID, with the stored credentials and no scan (and, built
+// with HA_FAST_BOOT_STATIC_IP, on the last lease without DHCP). The join
+// runs while the sketch mounts storage and starts its servers. If the
+// cached AP does not answer within the link timeout, the cache is
+// dropped and the retry scans, so a replaced router costs one slow boot.
+//
+//   setup():         setupOutputs(); loadState(); fastBoot.mark(FastBoot::OUTPUTS);
+//                    if (!fastBoot.beginJoin()) { wifiManager.autoConnect(...); }
+//   connectToWiFi(): if (!fastBoot.join()) { WiFi.begin(); }
+//   connectToMQTT(): fastBoot.linkUp(); ... fastBoot.mark(FastBoot::BROKER);
+//
+// Each phase is marked once, by whichever task gets there, in millis()
+// since the core started; reportStats() puts them in the status.
+class FastBoot {
+ public:
+  enum Phase : uint8_t {
+    OUTPUTS,       // saved relay/PWM state back on the outputs
+    STORAGE,       // filesystem, offline queue, groups and rules loaded
+    SETUP,         // setup() done
+    LINK,          // WiFi up with an address
+    BROKER,        // MQTT session up, commands accepted
+    FIRST_STATE,   // first state publish out
+    PHASE_COUNT
+  };
+
+  // The record uses an EEPROM region on boards without NVS; keep it clear
+  // of the sketch's other RecordStores.
+  FastBoot(uint16_t base = 16, uint16_t length = 496) : _store("netcache", sizeof(NetworkRecord), base, length) {}
+
+  void mark(Phase phase) {
+    if (!_at[phase]) {
+      _at[phase] = millis();
+    }
+  }
+  bool marked(Phase phase) const { return _at[phase] != 0; }
+
+#if defined(ESP32) || defined(ESP8266)
+  // Starts the join to the cached AP and returns at once; false without a
+  // cached AP or stored credentials, for the sketch's usual join.
+  bool beginJoin();
+  // The connection manager's beginLink: true if this took care of it.
+  // The first call finds beginJoin()'s join under way; the next means it
+  // timed out, and starts a scanning join instead.
+  bool join();
+  // Link up: marks LINK and remembers the AP, written only if it moved.
+  void linkUp();
+#endif
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  enum JoinPath : uint8_t {
+    JOIN_FULL,       // nothing cached: the sketch joins (and scans) itself
+    JOIN_STARTED,    // cached join started in setup()
+    JOIN_WAITING,    // ... and the connection manager is timing it
+    JOIN_CACHED,     // the cached AP answered
+    JOIN_FALLBACK    // it did not; scanned instead
+  };
+
+  void forget();
+
+  RecordStore _store;
+  NetworkRecord _record = {};
+  JoinPath _join = JOIN_FULL;
+  bool _staticIp = false;
+  // 0 until marked; millis() is well past 0 by setup(). One word per
+  // phase, so the tasks marking them never write the same one.
+  uint32_t _at[PHASE_COUNT] = {};
+#if defined(ESP32) || defined(ESP8266)
+  char _ssid[33] = "";
+  char _password[65] = "";
+#endif
+};
+
+}  // namespace ha
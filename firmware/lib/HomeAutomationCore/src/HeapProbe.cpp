@@ -0,0 +1,146 @@
+#include "HeapProbe.h"
+
+namespace ha {
+
+namespace {
+// Low-water mark for targets whose SDK does not keep one
+uint32_t lowestFree = UINT32_MAX;
+
+uint32_t sampleFree(uint32_t free) {
+  if (free < lowestFree) {
+    lowestFree = free;
+  }
+  return free;
+}
+}  // namespace
+
+uint32_t freeHeapBytes() {
+#if defined(ESP32) || defined(ESP8266)
+  return sampleFree(ESP.getFreeHeap());
+#elif defined(__AVR__)
+  extern int __heap_start, *__brkval;
+  int v;
+  return sampleFree((int)&v - (__brkval == 0 ? (int)&__heap_start : (int)__brkval));
+#else
+  return 0;
+#endif
+}
+
+void reportHeap(JsonObject obj) {
+  uint32_t free = freeHeapBytes();
+  obj["free"] = free;
+#if defined(ESP32)
+  uint32_t largest = ESP.getMaxAllocHeap();
+  obj["largest_block"] = largest;
+  obj["fragmentation"] = free ? 100 - (uint8_t)((uint64_t)largest * 100 / free) : 0;
+  obj["min_free"] = ESP.getMinFreeHeap();
+#elif defined(ESP8266)
+  obj["largest_block"] = ESP.getMaxFreeBlockSize();
+  obj["fragmentation"] = ESP.getHeapFragmentation();
+  obj["min_free"] = lowestFree;
+#else
+  obj["min_free"] = lowestFree;
+#endif
+}
+
+#if defined(HA_COUNT_ALLOCATIONS)
+namespace {
+volatile uint32_t allocations = 0;
+uint32_t checked = 0;
+uint32_t violations = 0;
+const char* lastViolation = "";
+
+// Only allocations by the task inside the outermost guard count, so the
+// other core's work does not trip it
+#if defined(ESP32)
+volatile TaskHandle_t guardedTask = nullptr;
+
+bool counting() {
+  return guardedTask && xTaskGetCurrentTaskHandle() == guardedTask;
+}
+#else
+volatile bool guarded = false;
+
+bool counting() {
+  return guarded;
+}
+#endif
+}  // namespace
+
+AllocationGuard::AllocationGuard(const char* where) : _where(where) {
+#if defined(ESP32)
+  if (guardedTask) {
+    return;
+  }
+  guardedTask = xTaskGetCurrentTaskHandle();
+#else
+  if (guarded) {
+    return;
+  }
+  guarded = true;
+#endif
+  _owner = true;
+  _start = allocations;
+}
+
+AllocationGuard::~AllocationGuard() {
+  if (!_owner) {
+    return;
+  }
+  uint32_t made = allocations - _start;
+#if defined(ESP32)
+  guardedTask = nullptr;
+#else
+  guarded = false;
+#endif
+  checked++;
+  if (made) {
+    violations++;
+    lastViolation = _where;
+    Serial.print("Heap allocation in ");
+    Serial.print(_where);
+    Serial.print(": ");
+    Serial.println(made);
+  }
+}
+
+void reportAllocations(JsonObject obj) {
+  obj["checked"] = checked;
+  obj["violations"] = violations;
+  if (violations) {
+    obj["last"] = lastViolation;
+  }
+}
+#endif
+
+}  // namespace ha
+
+#if defined(HA_COUNT_ALLOCATIONS)
+// Linker-wrapped allocator entry points (see HeapProbe.h)
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  if (ha::counting()) {
+    ha::allocations++;
+  }
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  if (ha::counting()) {
+    ha::allocations++;
+  }
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+  if (ha::counting()) {
+    ha::allocations++;
+  }
+  return __real_realloc(pointer, size);
+}
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Free heap in bytes on the running target (ESP heap, or the AVR
+// heap/stack gap). Cheap enough to call on every MQTT message; each call
+// also feeds the low-water mark on targets without one of their own.
+uint32_t freeHeapBytes();
+
+// Free heap, largest allocatable block, fragmentation (percent) and the
+// minimum free heap since boot. Free heap alone hides fragmentation.
+void reportHeap(JsonObject obj);
+
+#if defined(HA_COUNT_ALLOCATIONS)
+// Debug builds count heap allocations: -DHA_COUNT_ALLOCATIONS plus
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (the *-alloccheck
+// environments). Code that must not allocate declares
+//
+//   HA_ASSERT_NO_ALLOC("publishStatus");
+//
+// and any allocation made before the end of the scope, directly or by a
+// callee, on the same task, is logged and counted as a violation. Guards
+// nest; only the outermost one counts.
+class AllocationGuard {
+ public:
+  explicit AllocationGuard(const char* where);
+  ~AllocationGuard();
+
+ private:
+  const char* _where;
+  uint32_t _start = 0;
+  bool _owner = false;
+};
+
+// checked, violations and where the last one was.
+void reportAllocations(JsonObject obj);
+
+#define HA_ASSERT_NO_ALLOC(where) ::ha::AllocationGuard haAllocationGuard_(where)
+#else
+#define HA_ASSERT_NO_ALLOC(where) \
+  do {                            \
+  } while (0)
+#endif
+
+}  // namespace ha
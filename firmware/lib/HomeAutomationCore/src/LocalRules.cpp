@@ -0,0 +1,299 @@
+#include "LocalRules.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include "DeviceCore.h"
+#include "MqttDispatch.h"
+#include "StateEncoding.h"
+
+namespace ha {
+
+namespace {
+const char* const RULES_PATH = "/rules.bin";
+const char* const TOPIC_PREFIX = "homeautomation/devices/";
+const char* const PEER_SUFFIXES[] = { topic::STATE, topic::STATE_BIN, topic::EVENT };
+const size_t TOPIC_SIZE = 72;
+
+bool parseOp(const char* name, uint8_t& out) {
+  const char* const names[] = { "eq", "ne", "gt", "lt" };
+  for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i]) == 0) {
+      out = i;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace
+
+LocalRules::LocalRules(fs::FS& fs, const LocalRuleHooks& hooks) : _fs(fs), _hooks(hooks) {}
+
+void LocalRules::begin() {
+  _table = {};
+  fs::File file = _fs.open(RULES_PATH, "r");
+  if (!file) {
+    return;
+  }
+  Table loaded;
+  bool complete = file.read(reinterpret_cast<uint8_t*>(&loaded), sizeof(loaded)) == sizeof(loaded);
+  file.close();
+  // A table from another layout is dropped; the backend sends rules again
+  if (complete && loaded.magic == MAGIC && loaded.version == VERSION && loaded.peerCount <= MAX_PEERS &&
+      loaded.ruleCount <= MAX_RULES) {
+    _table = loaded;
+  }
+  hashTopics();
+}
+
+bool LocalRules::stage(JsonObjectConst parameters) {
+  _next = {};
+  _next.magic = MAGIC;
+  _next.version = VERSION;
+  _staged = false;
+  for (JsonVariantConst rule : parameters["rules"].as<JsonArrayConst>()) {
+    if (!compile(_next, rule.as<JsonObjectConst>())) {
+      _rejected++;
+      return false;
+    }
+  }
+  _staged = true;
+  return true;
+}
+
+void LocalRules::commit() {
+  if (!_staged) {
+    return;
+  }
+  _staged = false;
+  forEachTopic(_hooks.unsubscribe);
+  _table = _next;
+  hashTopics();
+  _active = 0;
+  _pending = 0;
+  memset(_fired, 0, sizeof(_fired));
+  subscribeAll();
+  save();
+}
+
+void LocalRules::subscribeAll() {
+  forEachTopic(_hooks.subscribe);
+}
+
+bool LocalRules::matches(const char* topic) {
+  _matchedPeer = -1;
+  if (_table.peerCount == 0) {
+    return false;
+  }
+  uint32_t hash = fnv1aBuffer(topic, strlen(topic));
+  for (uint8_t i = 0; i < _table.peerCount; i++) {
+    for (uint8_t t = 0; t < TOPIC_COUNT; t++) {
+      if (_topicHashes[i][t] == hash && hash != 0) {
+        _matchedPeer = i;
+        _matchedSource = t == TOPIC_EVENT ? Source::Event : Source::State;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void LocalRules::evaluate(JsonDocument& doc) {
+  if (_matchedPeer < 0) {
+    return;
+  }
+  _evaluated++;
+
+  // One pass over the message: each key is hashed once and checked
+  // against the rules of this peer and source
+  for (JsonPairConst entry : doc.as<JsonObjectConst>()) {
+    const char* key = entry.key().c_str();
+    uint32_t hash = fnv1aBuffer(key, strlen(key));
+    JsonVariantConst value = entry.value();
+    if (!value.is<float>() && !value.is<bool>()) {
+      continue;
+    }
+    float number = value.is<bool>() ? (value.as<bool>() ? 1.0f : 0.0f) : value.as<float>();
+
+    for (uint8_t i = 0; i < _table.ruleCount; i++) {
+      const Rule& rule = _table.rules[i];
+      if (rule.peer != _matchedPeer || rule.source != _matchedSource ||
+          (rule.jsonHash != hash && rule.compactHash != hash)) {
+        continue;
+      }
+      bool holds = false;
+      switch (rule.op) {
+        case Op::Eq: holds = number == rule.value; break;
+        case Op::Ne: holds = number != rule.value; break;
+        case Op::Gt: holds = number > rule.value; break;
+        case Op::Lt: holds = number < rule.value; break;
+      }
+      uint8_t bit = 1 << i;
+      if (holds && !(_active & bit)) {
+        _pending |= bit;
+        _fired[i]++;
+      }
+      _active = holds ? (_active | bit) : (_active & ~bit);
+    }
+  }
+}
+
+void LocalRules::service() {
+  while (_pending) {
+    uint8_t i = 0;
+    while (!(_pending & (1 << i))) {
+      i++;
+    }
+    _pending &= ~(1 << i);
+
+    // Parsed from a const copy, so the stored action stays intact
+    StaticJsonDocument<256> action;
+    if (deserializeJson(action, static_cast<const char*>(_table.rules[i].action))) {
+      _actionErrors++;
+      continue;
+    }
+    _hooks.actuate(action);
+  }
+}
+
+bool LocalRules::compile(Table& table, JsonObjectConst rule) {
+  if (table.ruleCount >= MAX_RULES) {
+    return false;
+  }
+  Rule& out = table.rules[table.ruleCount];
+
+  const char* source = rule["source"] | "state";
+  if (strcmp(source, "state") == 0) {
+    out.source = Source::State;
+  } else if (strcmp(source, "event") == 0) {
+    out.source = Source::Event;
+  } else {
+    return false;
+  }
+
+  const char* field = rule["field"];
+  size_t fieldLength = field ? strlen(field) : 0;
+  if (fieldLength == 0 || fieldLength > MAX_FIELD_LENGTH) {
+    return false;
+  }
+  memcpy(out.field, field, fieldLength + 1);
+  out.jsonHash = fnv1aBuffer(field, fieldLength);
+  // State from a MsgPack peer carries the compact name instead
+  const char* compact = out.source == Source::State ? compactStateKey(field) : nullptr;
+  out.compactHash = compact ? fnv1aBuffer(compact, strlen(compact)) : out.jsonHash;
+
+  uint8_t op = 0;
+  if (!parseOp(rule["op"] | "eq", op)) {
+    return false;
+  }
+  out.op = static_cast<Op>(op);
+
+  JsonVariantConst value = rule["value"];
+  if (value.is<bool>()) {
+    out.value = value.as<bool>() ? 1.0f : 0.0f;
+  } else if (value.is<float>()) {
+    out.value = value.as<float>();
+  } else {
+    return false;
+  }
+
+  JsonObjectConst action = rule["action"];
+  if (action.isNull() || measureJson(action) > MAX_ACTION_LENGTH) {
+    return false;
+  }
+  serializeJson(action, out.action, sizeof(out.action));
+
+  int8_t peer = addPeer(table, rule["device"], out.source);
+  if (peer < 0) {
+    return false;
+  }
+  out.peer = peer;
+  table.ruleCount++;
+  return true;
+}
+
+int8_t LocalRules::addPeer(Table& table, const char* id, Source source) {
+  size_t length = id ? strlen(id) : 0;
+  if (length == 0 || length > MAX_ID_LENGTH || strpbrk(id, "/+#")) {
+    return -1;
+  }
+  uint8_t i = 0;
+  while (i < table.peerCount && strcmp(table.peers[i].id, id) != 0) {
+    i++;
+  }
+  if (i == table.peerCount) {
+    if (table.peerCount >= MAX_PEERS) {
+      return -1;
+    }
+    memcpy(table.peers[i].id, id, length + 1);
+    table.peers[i].sources = 0;
+    table.peerCount++;
+  }
+  table.peers[i].sources |= 1 << static_cast<uint8_t>(source);
+  return i;
+}
+
+void LocalRules::hashTopics() {
+  memset(_topicHashes, 0, sizeof(_topicHashes));
+  for (uint8_t i = 0; i < _table.peerCount; i++) {
+    for (uint8_t t = 0; t < TOPIC_COUNT; t++) {
+      char topic[TOPIC_SIZE];
+      size_t length = formatTopic(topic, sizeof(topic), _table.peers[i], t);
+      if (length) {
+        _topicHashes[i][t] = fnv1aBuffer(topic, length);
+      }
+    }
+  }
+}
+
+size_t LocalRules::formatTopic(char* out, size_t capacity, const Peer& peer, uint8_t topic) const {
+  // 0 for a topic this peer is not followed on
+  Source source = topic == TOPIC_EVENT ? Source::Event : Source::State;
+  if (!(peer.sources & (1 << static_cast<uint8_t>(source)))) {
+    return 0;
+  }
+  int written = snprintf(out, capacity, "%s%s%s", TOPIC_PREFIX, peer.id, PEER_SUFFIXES[topic]);
+  return written > 0 && (size_t)written < capacity ? written : 0;
+}
+
+void LocalRules::forEachTopic(bool (*operation)(const char* topic)) {
+  for (uint8_t i = 0; i < _table.peerCount; i++) {
+    for (uint8_t t = 0; t < TOPIC_COUNT; t++) {
+      char topic[TOPIC_SIZE];
+      if (formatTopic(topic, sizeof(topic), _table.peers[i], t)) {
+        operation(topic);
+      }
+    }
+  }
+}
+
+void LocalRules::save() {
+  if (_table.ruleCount == 0) {
+    _fs.remove(RULES_PATH);
+    return;
+  }
+  fs::File file = _fs.open(RULES_PATH, "w");
+  if (!file) {
+    return;
+  }
+  file.write(reinterpret_cast<const uint8_t*>(&_table), sizeof(_table));
+  file.close();
+}
+
+void LocalRules::reportStats(JsonObject obj) const {
+  obj["evaluated"] = _evaluated;
+  obj["rejected"] = _rejected;
+  obj["action_errors"] = _actionErrors;
+  JsonArray rules = obj.createNestedArray("rules");
+  for (uint8_t i = 0; i < _table.ruleCount; i++) {
+    const Rule& rule = _table.rules[i];
+    JsonObject entry = rules.createNestedObject();
+    entry["device"] = _table.peers[rule.peer].id;
+    entry["field"] = rule.field;
+    entry["active"] = (_active & (1 << i)) != 0;
+    entry["fired"] = _fired[i];
+  }
+}
+
+}  // namespace ha
+
+#endif
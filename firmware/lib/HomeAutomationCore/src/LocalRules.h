@@ -0,0 +1,134 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+namespace ha {
+
+// Subscription operations the rules drive, and the local command runner.
+struct LocalRuleHooks {
+  bool (*subscribe)(const char* topic);
+  bool (*unsubscribe)(const char* topic);
+  // Runs a rule's action, {"command": ..., "parameters": {...}} or a
+  // {"commands": [...]} batch, as if it had arrived on <base>/command.
+  void (*actuate)(JsonDocument& action);
+};
+
+// Automation that runs on the device it actuates, so a trigger does not
+// round-trip through the backend. Rules are set with
+//   {"rules": [{"device": "<peer id>", "source": "state" | "event",
+//               "field": "motion_detected", "op": "eq", "value": true,
+//               "action": {"command": "set_power", "parameters": {"power": true}}}]}
+// and compiled into a fixed table kept on the filesystem: the peer's
+// topics and the field (under its JSON and its compact MsgPack name) are
+// reduced to hashes, so a peer message is evaluated in one pass over its
+// keys. "state" follows <peer>/state and <peer>/state/bin, "event" follows
+// <peer>/event. ops are eq, ne, gt and lt on numbers and booleans.
+//
+// A rule fires when its condition becomes true, not on every message
+// that satisfies it, so keepalive copies of a peer's state do not undo a
+// manual change. Actions run from service(), outside the MQTT callback,
+// because the message being evaluated aliases the receive buffer.
+class LocalRules {
+ public:
+  static const uint8_t MAX_RULES = 8;
+  static const uint8_t MAX_PEERS = 4;
+  static const size_t MAX_ID_LENGTH = 31;
+  static const size_t MAX_FIELD_LENGTH = 15;
+  static const size_t MAX_ACTION_LENGTH = 95;
+
+  LocalRules(fs::FS& fs, const LocalRuleHooks& hooks);
+
+  // Loads the saved rules; call once the filesystem is mounted.
+  void begin();
+
+  // Compiles new rules out of the parameters. Nothing is sent yet: the
+  // parameters may alias the MQTT receive buffer, which subscribing
+  // would overwrite. Returns false (and stages nothing) on a bad rule.
+  bool stage(JsonObjectConst parameters);
+  // Moves the subscriptions over to the staged rules and saves them.
+  void commit();
+  bool staged() const { return _staged; }
+
+  // Subscribes every peer topic, after each broker (re)connect.
+  void subscribeAll();
+
+  // Whether a topic is one the rules follow; it is remembered for the
+  // evaluate() of the same message.
+  bool matches(const char* topic);
+  bool matched() const { return _matchedPeer >= 0; }
+  // Checks the rules of the last matched topic against its message.
+  void evaluate(JsonDocument& doc);
+
+  // Runs the actions of rules that fired.
+  void service();
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  static const uint32_t MAGIC = 0x48415255;   // "HARU"
+  static const uint8_t VERSION = 1;
+
+  enum class Source : uint8_t { State, Event };
+  enum class Op : uint8_t { Eq, Ne, Gt, Lt };
+
+  // A followed peer's topics, indexing _topicHashes
+  enum PeerTopic : uint8_t { TOPIC_STATE, TOPIC_STATE_BIN, TOPIC_EVENT, TOPIC_COUNT };
+
+  struct Peer {
+    char id[MAX_ID_LENGTH + 1];
+    uint8_t sources;   // 1 << Source
+  };
+
+  struct Rule {
+    uint8_t peer;
+    Source source;
+    Op op;
+    char field[MAX_FIELD_LENGTH + 1];
+    uint32_t jsonHash;
+    uint32_t compactHash;
+    float value;
+    char action[MAX_ACTION_LENGTH + 1];
+  };
+
+  // Compiled rules, saved as is
+  struct Table {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t peerCount;
+    uint8_t ruleCount;
+    Peer peers[MAX_PEERS];
+    Rule rules[MAX_RULES];
+  };
+
+  bool compile(Table& table, JsonObjectConst rule);
+  int8_t addPeer(Table& table, const char* id, Source source);
+  void hashTopics();
+  size_t formatTopic(char* out, size_t capacity, const Peer& peer, uint8_t topic) const;
+  void forEachTopic(bool (*operation)(const char* topic));
+  void save();
+
+  fs::FS& _fs;
+  const LocalRuleHooks& _hooks;
+  Table _table = {};
+  Table _next = {};
+  bool _staged = false;
+
+  // Runtime state, not saved
+  uint32_t _topicHashes[MAX_PEERS][TOPIC_COUNT] = {};
+  int8_t _matchedPeer = -1;
+  Source _matchedSource = Source::State;
+  uint8_t _active = 0;    // rules whose condition held on the last message
+  uint8_t _pending = 0;   // rules that fired and still have to act
+  uint32_t _fired[MAX_RULES] = {};
+  uint32_t _evaluated = 0;
+  uint32_t _rejected = 0;
+  uint32_t _actionErrors = 0;
+};
+
+}  // namespace ha
+
+#endif
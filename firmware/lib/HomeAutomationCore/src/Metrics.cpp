@@ -0,0 +1,166 @@
+#include "Metrics.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include "HeapProbe.h"
+
+namespace ha {
+
+namespace {
+// Upper bounds of the finite buckets; one more bucket catches the rest
+const uint32_t MICROS_BOUNDS[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 250000 };
+const uint32_t MILLIS_BOUNDS[] = { 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 300000 };
+
+struct LatencySpec {
+  const char* name;
+  const char* help;
+  const uint32_t* bounds;
+  uint8_t boundCount;
+  uint32_t perSecond;   // recorded units per second
+};
+
+#define HA_BOUNDS(bounds) bounds, sizeof(bounds) / sizeof(bounds[0])
+const LatencySpec LATENCY_SPECS[] = {
+  { "ha_mqtt_callback_seconds", "MQTT message parse and dispatch time", HA_BOUNDS(MICROS_BOUNDS), 1000000 },
+  { "ha_publish_seconds", "Publish duration", HA_BOUNDS(MICROS_BOUNDS), 1000000 },
+  { "ha_loop_seconds", "Main loop pass duration, waits excluded", HA_BOUNDS(MICROS_BOUNDS), 1000000 },
+  { "ha_reconnect_seconds", "Broker outage until back online", HA_BOUNDS(MILLIS_BOUNDS), 1000 },
+};
+#undef HA_BOUNDS
+
+struct EventSpec {
+  const char* name;
+  const char* help;
+};
+
+const EventSpec EVENT_SPECS[] = {
+  { "ha_eeprom_commits_total", "Saved-state writes to EEPROM (NVS on ESP32)" },
+  { "ha_dropped_publishes_total", "Publishes given up on" },
+  { "ha_dropped_commands_total", "Control commands dropped on a full control queue" },
+};
+
+static_assert(sizeof(LATENCY_SPECS) / sizeof(LATENCY_SPECS[0]) == static_cast<uint8_t>(Latency::Count),
+              "one spec per latency metric");
+static_assert(sizeof(EVENT_SPECS) / sizeof(EVENT_SPECS[0]) == static_cast<uint8_t>(Event::Count),
+              "one spec per event counter");
+static_assert(sizeof(MICROS_BOUNDS) / sizeof(MICROS_BOUNDS[0]) < MetricsSnapshot::MAX_BUCKETS, "buckets");
+static_assert(sizeof(MILLIS_BOUNDS) / sizeof(MILLIS_BOUNDS[0]) < MetricsSnapshot::MAX_BUCKETS, "buckets");
+
+MetricsSnapshot::Histogram latencies[static_cast<uint8_t>(Latency::Count)];
+uint32_t events[static_cast<uint8_t>(Event::Count)];
+
+// value / perSecond in decimal, exactly and without trailing zeros
+size_t printScaled(Print& out, uint64_t value, uint32_t perSecond) {
+  size_t written = out.print((uint32_t)(value / perSecond));
+  uint32_t fraction = value % perSecond;
+  if (!fraction) {
+    return written;
+  }
+  char digits[12];
+  uint8_t length = 0;
+  for (uint32_t unit = perSecond / 10; unit; unit /= 10) {
+    digits[length++] = '0' + fraction / unit % 10;
+  }
+  while (length && digits[length - 1] == '0') {
+    length--;
+  }
+  written += out.print('.');
+  written += out.write(reinterpret_cast<const uint8_t*>(digits), length);
+  return written;
+}
+
+size_t printHeader(Print& out, const char* name, const char* help, const char* type) {
+  size_t written = out.print(F("# HELP "));
+  written += out.print(name);
+  written += out.print(' ');
+  written += out.print(help);
+  written += out.print('\n');
+  written += out.print(F("# TYPE "));
+  written += out.print(name);
+  written += out.print(' ');
+  written += out.print(type);
+  written += out.print('\n');
+  return written;
+}
+
+size_t printSample(Print& out, const char* name, const char* suffix, uint32_t value) {
+  size_t written = out.print(name);
+  written += out.print(suffix);
+  written += out.print(' ');
+  written += out.print(value);
+  written += out.print('\n');
+  return written;
+}
+}  // namespace
+
+void recordLatency(Latency metric, uint32_t value) {
+  uint8_t index = static_cast<uint8_t>(metric);
+  const LatencySpec& spec = LATENCY_SPECS[index];
+  MetricsSnapshot::Histogram& histogram = latencies[index];
+  uint8_t bucket = 0;
+  while (bucket < spec.boundCount && value > spec.bounds[bucket]) {
+    bucket++;
+  }
+  histogram.buckets[bucket]++;
+  histogram.count++;
+  histogram.sum += value;
+}
+
+void countEvent(Event event, uint32_t n) {
+  events[static_cast<uint8_t>(event)] += n;
+}
+
+void snapshotMetrics(MetricsSnapshot& out) {
+  memcpy(out.latency, latencies, sizeof(out.latency));
+  memcpy(out.events, events, sizeof(out.events));
+  out.uptimeMs = millis();
+  out.freeHeap = freeHeapBytes();
+}
+
+size_t writeMetrics(Print& out, const MetricsSnapshot& snapshot) {
+  size_t written = 0;
+  for (uint8_t i = 0; i < static_cast<uint8_t>(Latency::Count); i++) {
+    const LatencySpec& spec = LATENCY_SPECS[i];
+    const MetricsSnapshot::Histogram& histogram = snapshot.latency[i];
+    written += printHeader(out, spec.name, spec.help, "histogram");
+
+    // Prometheus buckets are cumulative
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < spec.boundCount; b++) {
+      cumulative += histogram.buckets[b];
+      written += out.print(spec.name);
+      written += out.print(F("_bucket{le=\""));
+      written += printScaled(out, spec.bounds[b], spec.perSecond);
+      written += out.print(F("\"} "));
+      written += out.print(cumulative);
+      written += out.print('\n');
+    }
+    written += out.print(spec.name);
+    written += out.print(F("_bucket{le=\"+Inf\"} "));
+    written += out.print(histogram.count);
+    written += out.print('\n');
+
+    written += out.print(spec.name);
+    written += out.print(F("_sum "));
+    written += printScaled(out, histogram.sum, spec.perSecond);
+    written += out.print('\n');
+    written += printSample(out, spec.name, "_count", histogram.count);
+  }
+
+  for (uint8_t i = 0; i < static_cast<uint8_t>(Event::Count); i++) {
+    written += printHeader(out, EVENT_SPECS[i].name, EVENT_SPECS[i].help, "counter");
+    written += printSample(out, EVENT_SPECS[i].name, "", snapshot.events[i]);
+  }
+
+  written += printHeader(out, "ha_uptime_seconds", "Time since boot", "gauge");
+  written += out.print(F("ha_uptime_seconds "));
+  written += printScaled(out, snapshot.uptimeMs, 1000);
+  written += out.print('\n');
+  written += printHeader(out, "ha_free_heap_bytes", "Free heap", "gauge");
+  written += printSample(out, "ha_free_heap_bytes", "", snapshot.freeHeap);
+  return written;
+}
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace ha {
+
+// Fixed-bucket latency histograms and event counters for the hot paths,
+// cheap enough to stay on in production: a sample is two cycle-counter
+// reads, a divide and a scan over a dozen bucket bounds. Exported in the
+// Prometheus text format, on /metrics and on <base>/metrics.
+enum class Latency : uint8_t {
+  MqttCallback,   // parse and dispatch of one received message, us
+  Publish,        // one DeviceCore or offline-queue publish, us
+  Loop,           // one pass of the main loop, waits excluded, us
+  Reconnect,      // outage from losing the broker to being back online, ms
+  Count
+};
+
+enum class Event : uint8_t {
+  EepromCommits,      // saved-state writes (NVS on ESP32)
+  DroppedPublishes,   // messages given up on, not queued for later
+  DroppedCommands,    // control commands that found the control queue full
+  Count
+};
+
+#if defined(ESP32) || defined(ESP8266)
+
+inline uint32_t cycleCount() { return ESP.getCycleCount(); }
+
+// For spans under 2^32 cycles (17.9 s at 240 MHz, 53 s at 80 MHz).
+inline uint32_t cyclesToMicros(uint32_t cycles) { return cycles / ESP.getCpuFreqMHz(); }
+
+// Each metric is written by one task; readers on another task (the web
+// server) may see a sample half applied, which a scrape shrugs off.
+void recordLatency(Latency metric, uint32_t value);
+void countEvent(Event event, uint32_t n);
+
+// Times the enclosing scope.
+class LatencyTimer {
+ public:
+  explicit LatencyTimer(Latency metric) : _metric(metric), _start(cycleCount()) {}
+  ~LatencyTimer() { recordLatency(_metric, cyclesToMicros(cycleCount() - _start)); }
+
+ private:
+  Latency _metric;
+  uint32_t _start;
+};
+
+// A loop pass that blocks somewhere in the middle (a queue wait, a
+// delay): pause() before the wait and resume() after, so only the work
+// is timed.
+class LoopTimer {
+ public:
+  void start() {
+    _elapsed = 0;
+    _since = cycleCount();
+  }
+  void pause() { _elapsed += cycleCount() - _since; }
+  void resume() { _since = cycleCount(); }
+  void stop() {
+    pause();
+    recordLatency(Latency::Loop, cyclesToMicros(_elapsed));
+  }
+
+ private:
+  uint32_t _elapsed = 0;
+  uint32_t _since = 0;
+};
+
+// A consistent copy to render from, so the length measured for an MQTT
+// publish matches the bytes then written.
+struct MetricsSnapshot {
+  static const uint8_t MAX_BUCKETS = 11;
+  struct Histogram {
+    uint32_t buckets[MAX_BUCKETS];
+    uint32_t count;
+    uint64_t sum;
+  };
+  Histogram latency[static_cast<uint8_t>(Latency::Count)];
+  uint32_t events[static_cast<uint8_t>(Event::Count)];
+  uint32_t uptimeMs;
+  uint32_t freeHeap;
+};
+
+constexpr const char* METRICS_CONTENT_TYPE = "text/plain; version=0.0.4";
+
+void snapshotMetrics(MetricsSnapshot& out);
+// Prometheus text exposition; returns the number of bytes written.
+size_t writeMetrics(Print& out, const MetricsSnapshot& snapshot);
+
+#define HA_TIME_SCOPE(metric) ::ha::LatencyTimer haLatencyTimer_(::ha::Latency::metric)
+#define HA_RECORD_LATENCY(metric, value) ::ha::recordLatency(::ha::Latency::metric, value)
+#define HA_COUNT_EVENT(event, n) ::ha::countEvent(::ha::Event::event, n)
+#else
+// Elsewhere (AVR) the instrumented library code compiles to nothing
+#define HA_TIME_SCOPE(metric) \
+  do {                        \
+  } while (0)
+#define HA_RECORD_LATENCY(metric, value) \
+  do {                                   \
+  } while (0)
+#define HA_COUNT_EVENT(event, n) \
+  do {                           \
+  } while (0)
+#endif
+
+}  // namespace ha
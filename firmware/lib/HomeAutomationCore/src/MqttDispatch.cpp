@@ -0,0 +1,13 @@
+#include "MqttDispatch.h"
+
+namespace ha {
+
+uint32_t fnv1aBuffer(const char* s, size_t len) {
+  uint32_t h = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i]) * 16777619UL;
+  }
+  return h;
+}
+
+}  // namespace ha
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "HeapProbe.h"
+
+namespace ha {
+
+// FNV-1a over a NUL-terminated string. constexpr so route tables are
+// hashed at compile time and live in flash.
+constexpr uint32_t fnv1a(const char* s, uint32_t h = 2166136261UL) {
+  return *s ? fnv1a(s + 1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+
+// Same hash over a runtime buffer of known length.
+uint32_t fnv1aBuffer(const char* s, size_t len);
+
+typedef void (*TopicHandler)(JsonDocument& doc);
+typedef bool (*TopicMatcher)(const char* topic);
+
+// One entry per subscribed topic, keyed by the hash of the suffix that
+// follows the device base topic (e.g. fnv1a("/command")).
+struct TopicRoute {
+  uint32_t suffixHash;
+  TopicHandler handler;
+};
+
+// One entry per command (or OTA action) a device accepts, keyed by
+// fnv1a(name). Tables are constexpr arrays, so they are hashed at compile
+// time and adding a command is one line. Handlers get the command's
+// parameters plus a per-message context the device collects effects in.
+template <typename Context>
+struct CommandRoute {
+  uint32_t nameHash;
+  void (*handler)(JsonObject parameters, Context& context);
+};
+
+// Runs the handler registered for name; false for an unknown or missing
+// name. This is a scan over 32-bit keys, which for a dozen commands beats
+// any hashed lookup and needs no RAM.
+template <typename Context, size_t N>
+bool dispatchCommand(const CommandRoute<Context> (&routes)[N], const char* name, JsonObject parameters,
+                     Context& context) {
+  if (!name) {
+    return false;
+  }
+  uint32_t hash = fnv1aBuffer(name, strlen(name));
+  for (size_t i = 0; i < N; i++) {
+    if (routes[i].nameHash == hash) {
+      routes[i].handler(parameters, context);
+      return true;
+    }
+  }
+  return false;
+}
+
+// For static_assert on a command table: names that hash alike would
+// shadow one another.
+template <typename Context, size_t N>
+constexpr bool uniqueCommandHashes(const CommandRoute<Context> (&routes)[N], size_t i = 0, size_t j = 1) {
+  return i + 1 >= N ? true
+         : j >= N   ? uniqueCommandHashes(routes, i + 1, i + 2)
+                    : routes[i].nameHash != routes[j].nameHash && uniqueCommandHashes(routes, i, j + 1);
+}
+
+struct DispatchStats {
+  uint32_t messages = 0;
+  uint32_t parseErrors = 0;
+  uint32_t unrouted = 0;
+  uint32_t shared = 0;
+  int32_t lastHeapDelta = 0;
+  int32_t maxHeapDelta = 0;
+};
+
+// Routes MQTT messages to handlers without building a String for the
+// topic or the payload. The payload is parsed in place (ArduinoJson
+// zero-copy mode), so strings in the document alias the client's receive
+// buffer: handlers must read everything they need from the document
+// before publishing anything. Topics ending in /bin (a peer's compact
+// state, see StateEncoding.h) are parsed as MessagePack.
+template <size_t DocCapacity>
+class MqttDispatcher {
+ public:
+  template <size_t N>
+  explicit MqttDispatcher(const TopicRoute (&routes)[N])
+      : _routes(routes), _routeCount(N) {}
+
+  // base must stay valid for the lifetime of the dispatcher.
+  void setBaseTopic(const char* base) {
+    _base = base;
+    _baseLen = strlen(base);
+  }
+
+  // Topics outside the base (e.g. group command topics) that match go
+  // to handler.
+  void setSharedRoute(TopicMatcher matcher, TopicHandler handler) {
+    _sharedMatcher = matcher;
+    _sharedHandler = handler;
+  }
+
+  void dispatch(char* topic, byte* payload, unsigned int length) {
+    uint32_t heapBefore = freeHeapBytes();
+    _stats.messages++;
+
+    Serial.print(F("Received ["));
+    Serial.print(topic);
+    Serial.print(F("]: "));
+    Serial.write(payload, length);
+    Serial.println();
+
+    TopicHandler handler = route(topic);
+    if (!handler) {
+      _stats.unrouted++;
+    } else {
+      StaticJsonDocument<DocCapacity> doc;
+      DeserializationError error = binaryTopic(topic)
+                                       ? deserializeMsgPack(doc, reinterpret_cast<char*>(payload), length)
+                                       : deserializeJson(doc, reinterpret_cast<char*>(payload), length);
+      if (error) {
+        Serial.print(F("Failed to parse payload: "));
+        Serial.println(error.c_str());
+        _stats.parseErrors++;
+      } else {
+        handler(doc);
+      }
+    }
+
+    // Positive delta means the message left allocations behind.
+    _stats.lastHeapDelta = (int32_t)heapBefore - (int32_t)freeHeapBytes();
+    if (abs(_stats.lastHeapDelta) > abs(_stats.maxHeapDelta)) {
+      _stats.maxHeapDelta = _stats.lastHeapDelta;
+    }
+  }
+
+  const DispatchStats& stats() const { return _stats; }
+
+  void reportStats(JsonObject obj) const {
+    obj["messages"] = _stats.messages;
+    obj["parse_errors"] = _stats.parseErrors;
+    obj["unrouted"] = _stats.unrouted;
+    obj["shared"] = _stats.shared;
+    obj["heap_delta"] = _stats.lastHeapDelta;
+    obj["heap_delta_max"] = _stats.maxHeapDelta;
+  }
+
+ private:
+  static bool binaryTopic(const char* topic) {
+    size_t length = strlen(topic);
+    return length >= 4 && memcmp(topic + length - 4, "/bin", 4) == 0;
+  }
+
+  TopicHandler route(const char* topic) {
+    if (!_base || strncmp(topic, _base, _baseLen) != 0) {
+      if (_sharedMatcher && _sharedMatcher(topic)) {
+        _stats.shared++;
+        return _sharedHandler;
+      }
+      return nullptr;
+    }
+    const char* suffix = topic + _baseLen;
+    uint32_t hash = fnv1aBuffer(suffix, strlen(suffix));
+    for (uint8_t i = 0; i < _routeCount; i++) {
+      if (_routes[i].suffixHash == hash) {
+        return _routes[i].handler;
+      }
+    }
+    return nullptr;
+  }
+
+  const TopicRoute* _routes;
+  uint8_t _routeCount;
+  const char* _base = nullptr;
+  size_t _baseLen = 0;
+  TopicMatcher _sharedMatcher = nullptr;
+  TopicHandler _sharedHandler = nullptr;
+  DispatchStats _stats;
+};
+
+}  // namespace ha
@@ -0,0 +1,412 @@
+#include "OfflineQueue.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include "Metrics.h"
+
+namespace ha {
+
+namespace {
+const uint32_t SEGMENT_MAGIC = 0x3151464FUL;   // "OFQ1"
+const uint32_t SEGMENT_HEADER = 8;             // magic, sequence
+const uint8_t RECORD_MAGIC = 0xA5;
+const uint32_t RECORD_HEADER = 7;              // magic, flags, topic len, payload len, crc16
+const uint8_t FLAG_RETAINED = 1 << 0;
+const uint8_t FLAG_RELATIVE = 1 << 1;          // topic is stored without the base
+
+const unsigned long REPLAY_INTERVAL = 50;
+const unsigned long ACK_TIMEOUT = 5000;
+const uint32_t REPLAY_WINDOW = 8;
+const uint8_t MAX_ATTEMPTS = 3;
+
+uint16_t crc16(const uint8_t* data, size_t length, uint16_t crc = 0xFFFF) {
+  // CRC-16/CCITT-FALSE
+  while (length--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+void putU32(uint8_t* out, uint32_t value) {
+  for (uint8_t i = 0; i < 4; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+uint32_t getU32(const uint8_t* in) {
+  return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+}  // namespace
+
+OfflineQueue::OfflineQueue(fs::FS& fs, const OfflineQueueHooks& hooks) : _fs(fs), _hooks(hooks) {}
+
+void OfflineQueue::begin() {
+  bool found = false;
+  uint32_t oldest = 0;
+  uint32_t newest = 0;
+  uint32_t sequences[MAX_SEGMENTS];
+  bool present[MAX_SEGMENTS] = {};
+  char path[16];
+
+  for (uint8_t slot = 0; slot < MAX_SEGMENTS; slot++) {
+    segmentPath(slot, path, sizeof(path));
+    if (!_fs.exists(path)) {
+      continue;
+    }
+    fs::File file = _fs.open(path, "r");
+    uint8_t header[SEGMENT_HEADER];
+    bool valid = file && file.read(header, sizeof(header)) == sizeof(header) &&
+                 getU32(header) == SEGMENT_MAGIC && getU32(header + 4) % MAX_SEGMENTS == slot;
+    file.close();
+    if (!valid) {
+      _fs.remove(path);
+      continue;
+    }
+    uint32_t sequence = getU32(header + 4);
+    sequences[slot] = sequence;
+    present[slot] = true;
+    if (!found || sequence < oldest) {
+      oldest = sequence;
+    }
+    if (!found || sequence > newest) {
+      newest = sequence;
+    }
+    found = true;
+  }
+
+  // More than a ring's worth of sequence numbers means stale leftovers
+  // (a failed remove, or a reset mid-rotation). Their records belong to
+  // no segment in the ring, so they go rather than replay under a newer
+  // sequence.
+  if (found && newest - oldest >= MAX_SEGMENTS) {
+    oldest = newest - MAX_SEGMENTS + 1;
+    for (uint8_t slot = 0; slot < MAX_SEGMENTS; slot++) {
+      if (present[slot] && sequences[slot] < oldest) {
+        segmentPath(slot, path, sizeof(path));
+        _fs.remove(path);
+      }
+    }
+  }
+  _head = found ? oldest : 0;
+  _segments = found ? newest - oldest + 1 : 0;
+  _acked = {_head, SEGMENT_HEADER};
+  _sent = _acked;
+  _pending = 0;
+  for (uint32_t segment = _head; segment < _head + _segments; segment++) {
+    _pending += countRecords(segment, SEGMENT_HEADER);
+  }
+  // New records always go to a fresh segment, never after a tail that may
+  // have been torn by a reset.
+}
+
+void OfflineQueue::setBaseTopic(const char* base) {
+  strncpy(_base, base, sizeof(_base) - 1);
+  _base[sizeof(_base) - 1] = '\0';
+  _baseLength = strlen(_base);
+}
+
+bool OfflineQueue::publish(const char* topic, const uint8_t* payload, size_t length, bool retained) {
+  HA_TIME_SCOPE(Publish);
+  if (_pending == 0 && _hooks.connected() && _hooks.publish(topic, payload, length, retained)) {
+    return true;
+  }
+  return enqueue(topic, payload, length, retained);
+}
+
+bool OfflineQueue::enqueue(const char* topic, const uint8_t* payload, size_t length, bool retained) {
+  uint8_t flags = retained ? FLAG_RETAINED : 0;
+  if (_baseLength && strncmp(topic, _base, _baseLength) == 0) {
+    topic += _baseLength;
+    flags |= FLAG_RELATIVE;
+  }
+  size_t topicLength = strlen(topic);
+  if (length > MAX_PAYLOAD || topicLength + _baseLength >= sizeof(_topic)) {
+    return false;
+  }
+
+  size_t recordSize = RECORD_HEADER + topicLength + length;
+  if ((!_writer || _writer.size() + recordSize > SEGMENT_SIZE) && !rotate()) {
+    return false;
+  }
+
+  uint16_t crc = crc16(payload, length, crc16(reinterpret_cast<const uint8_t*>(topic), topicLength));
+  uint8_t header[RECORD_HEADER] = {
+    RECORD_MAGIC, flags, (uint8_t)topicLength,
+    (uint8_t)length, (uint8_t)(length >> 8),
+    (uint8_t)crc, (uint8_t)(crc >> 8),
+  };
+  // Append-only: a reset mid-write leaves a torn tail record that the CRC
+  // rejects, and nothing is ever written after it
+  bool written = _writer.write(header, sizeof(header)) == sizeof(header) &&
+                 _writer.write(reinterpret_cast<const uint8_t*>(topic), topicLength) == topicLength &&
+                 _writer.write(payload, length) == length;
+  _writer.flush();
+  if (!written) {
+    _writer.close();
+    return false;
+  }
+
+  _pending++;
+  _queued++;
+  return true;
+}
+
+void OfflineQueue::service(unsigned long now) {
+  if (!_hooks.connected()) {
+    if (_inFlight || _windowRecords) {
+      rewind();
+    }
+    return;
+  }
+
+  if (_inFlight) {
+    if (now - _windowSentAt >= ACK_TIMEOUT) {
+      _retries++;
+      rewind();
+    }
+    return;
+  }
+
+  if (_pending == _windowRecords || now - _lastSend < REPLAY_INTERVAL) {
+    return;
+  }
+  _lastSend = now;
+
+  uint8_t flags;
+  size_t length;
+  uint32_t next;
+  for (;;) {
+    // Only sealed segments are read; close the open one if replay caught up
+    if (_writer && _sent.segment == lastSegment()) {
+      _writer.close();
+    }
+    if (readRecord(_sent, flags, length, next)) {
+      break;
+    }
+    if (_sent.segment >= lastSegment()) {
+      // The remaining records were unreadable
+      _dropped += _pending - _windowRecords;
+      HA_COUNT_EVENT(DroppedPublishes, _pending - _windowRecords);
+      _pending = _windowRecords;
+      if (_windowRecords) {
+        sendMarker(now);
+      } else {
+        compact();
+      }
+      return;
+    }
+    _sent = {_sent.segment + 1, SEGMENT_HEADER};
+  }
+
+  if (_hooks.publish(_topic, _payload, length, flags & FLAG_RETAINED)) {
+    _replayed++;
+    _attempts = 0;
+  } else if (++_attempts < MAX_ATTEMPTS) {
+    rewind();
+    return;
+  } else {
+    // Skip a record the broker keeps refusing (e.g. too big for the client)
+    _dropped++;
+    HA_COUNT_EVENT(DroppedPublishes, 1);
+    _attempts = 0;
+  }
+  _sent.offset = next;
+  _windowRecords++;
+
+  if (_windowRecords >= REPLAY_WINDOW || _windowRecords == _pending) {
+    sendMarker(now);
+  }
+}
+
+void OfflineQueue::acknowledge(uint32_t seq) {
+  if (!_inFlight || seq != _windowSeq) {
+    return;
+  }
+
+  while (_head < _sent.segment) {
+    removeSegment(_head);
+  }
+  _acked = _sent;
+  _pending -= _windowRecords;
+  _windowRecords = 0;
+  _inFlight = false;
+  compact();
+}
+
+void OfflineQueue::compact() {
+  // Fully drained: start over with an empty ring
+  if (_pending == 0 && !_writer) {
+    while (_segments) {
+      removeSegment(_head);
+    }
+    _acked = {_head, SEGMENT_HEADER};
+    _sent = _acked;
+  }
+}
+
+bool OfflineQueue::rotate() {
+  _writer.close();
+  if (_segments == MAX_SEGMENTS) {
+    dropOldest();
+  }
+
+  uint32_t segment = _head + _segments;
+  char path[16];
+  segmentPath(segment, path, sizeof(path));
+  _writer = _fs.open(path, "w");
+  if (!_writer) {
+    return false;
+  }
+
+  uint8_t header[SEGMENT_HEADER];
+  putU32(header, SEGMENT_MAGIC);
+  putU32(header + 4, segment);
+  if (_writer.write(header, sizeof(header)) != sizeof(header)) {
+    _writer.close();
+    _fs.remove(path);
+    return false;
+  }
+  _writer.flush();
+
+  if (_segments == 0) {
+    _head = segment;
+    _acked = {segment, SEGMENT_HEADER};
+    _sent = _acked;
+  }
+  _segments++;
+  return true;
+}
+
+void OfflineQueue::dropOldest() {
+  // Bounded: the oldest undelivered records make room for new ones
+  rewind();
+  uint32_t lost = countRecords(_head, _acked.segment == _head ? _acked.offset : SEGMENT_HEADER);
+  _dropped += lost;
+  HA_COUNT_EVENT(DroppedPublishes, lost);
+  _pending -= lost < _pending ? lost : _pending;
+  removeSegment(_head);
+  if (_acked.segment < _head) {
+    _acked = {_head, SEGMENT_HEADER};
+    _sent = _acked;
+  }
+}
+
+void OfflineQueue::removeSegment(uint32_t segment) {
+  if (_reader && _readerSegment == segment) {
+    _reader.close();
+  }
+  char path[16];
+  segmentPath(segment, path, sizeof(path));
+  _fs.remove(path);
+  if (segment == _head && _segments) {
+    _head++;
+    _segments--;
+  }
+}
+
+void OfflineQueue::rewind() {
+  _sent = _acked;
+  _windowRecords = 0;
+  _inFlight = false;
+}
+
+bool OfflineQueue::sendMarker(unsigned long now) {
+  char topic[sizeof(_base) + 8];
+  snprintf(topic, sizeof(topic), "%s/replay", _base);
+  char marker[24];
+  int length = snprintf(marker, sizeof(marker), "{\"seq\":%lu}", (unsigned long)(_windowSeq + 1));
+
+  if (!_hooks.publish(topic, reinterpret_cast<const uint8_t*>(marker), length, false)) {
+    rewind();
+    return false;
+  }
+  _windowSeq++;
+  _inFlight = true;
+  _windowSentAt = now;
+  return true;
+}
+
+bool OfflineQueue::openReader(uint32_t segment) {
+  if (_reader && _readerSegment == segment) {
+    return true;
+  }
+  _reader.close();
+  char path[16];
+  segmentPath(segment, path, sizeof(path));
+  if (!_fs.exists(path)) {
+    return false;
+  }
+  _reader = _fs.open(path, "r");
+  _readerSegment = segment;
+
+  // The slot is shared by every segment ringing round to it; only read
+  // the one this sequence wrote
+  uint8_t header[SEGMENT_HEADER];
+  if (!_reader || _reader.read(header, sizeof(header)) != sizeof(header) || getU32(header) != SEGMENT_MAGIC ||
+      getU32(header + 4) != segment) {
+    _reader.close();
+    return false;
+  }
+  return true;
+}
+
+bool OfflineQueue::readRecord(const Cursor& at, uint8_t& flags, size_t& length, uint32_t& next) {
+  if (!openReader(at.segment) || !_reader.seek(at.offset)) {
+    return false;
+  }
+
+  uint8_t header[RECORD_HEADER];
+  if (_reader.read(header, sizeof(header)) != sizeof(header) || header[0] != RECORD_MAGIC) {
+    return false;
+  }
+  flags = header[1];
+  size_t topicLength = header[2];
+  length = header[3] | (size_t)header[4] << 8;
+  uint16_t crc = header[5] | (uint16_t)header[6] << 8;
+
+  size_t prefix = flags & FLAG_RELATIVE ? _baseLength : 0;
+  if (length > MAX_PAYLOAD || prefix + topicLength >= sizeof(_topic)) {
+    return false;
+  }
+  memcpy(_topic, _base, prefix);
+  uint8_t* topic = reinterpret_cast<uint8_t*>(_topic + prefix);
+  if (_reader.read(topic, topicLength) != topicLength || _reader.read(_payload, length) != length ||
+      crc16(_payload, length, crc16(topic, topicLength)) != crc) {
+    return false;
+  }
+  _topic[prefix + topicLength] = '\0';
+
+  next = at.offset + RECORD_HEADER + topicLength + length;
+  return true;
+}
+
+uint32_t OfflineQueue::countRecords(uint32_t segment, uint32_t offset) {
+  uint32_t count = 0;
+  uint8_t flags;
+  size_t length;
+  Cursor at = {segment, offset};
+  while (readRecord(at, flags, length, at.offset)) {
+    count++;
+  }
+  return count;
+}
+
+void OfflineQueue::segmentPath(uint32_t segment, char* out, size_t size) const {
+  snprintf(out, size, "/oq%u.log", (unsigned)(segment % MAX_SEGMENTS));
+}
+
+void OfflineQueue::reportStats(JsonObject obj) const {
+  obj["pending"] = _pending;
+  obj["queued"] = _queued;
+  obj["replayed"] = _replayed;
+  obj["dropped"] = _dropped;
+  obj["retries"] = _retries;
+  obj["segments"] = _segments;
+}
+
+}  // namespace ha
+
+#endif
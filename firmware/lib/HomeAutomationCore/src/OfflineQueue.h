@@ -0,0 +1,110 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+namespace ha {
+
+// MQTT operations the offline queue drives.
+struct OfflineQueueHooks {
+  bool (*connected)();
+  bool (*publish)(const char* topic, const uint8_t* payload, size_t length, bool retained);
+};
+
+// Store-and-forward queue for messages published while the broker is out
+// of reach. Records are appended to a small ring of segment files; a
+// segment is never rewritten, only deleted once every record in it has
+// been acknowledged. After reconnect the records are replayed in order at
+// a throttled rate.
+//
+// PubSubClient publishes at QoS0 only and never surfaces PUBACKs, so each
+// replay window is closed with a marker on <base>/replay, which the device
+// subscribes to itself. The broker handles a connection's packets in
+// order, so the marker coming back means all records before it were
+// accepted. Unacknowledged windows are resent (at-least-once, as QoS1).
+class OfflineQueue {
+ public:
+  static const size_t MAX_PAYLOAD = 512;
+  static const uint8_t MAX_SEGMENTS = 8;
+  static const size_t SEGMENT_SIZE = 4096;
+
+  OfflineQueue(fs::FS& fs, const OfflineQueueHooks& hooks);
+
+  // Scans the segments left by a previous boot; call once the filesystem
+  // is mounted.
+  void begin();
+  void setBaseTopic(const char* base);
+
+  // Publishes straight away when connected and nothing older is waiting;
+  // otherwise appends to flash so ordering is kept.
+  bool publish(const char* topic, const uint8_t* payload, size_t length, bool retained = false);
+  bool enqueue(const char* topic, const uint8_t* payload, size_t length, bool retained = false);
+
+  // Replays queued records; call on every loop pass.
+  void service(unsigned long now);
+  // Feed the sequence number of a marker echoed back on <base>/replay.
+  void acknowledge(uint32_t seq);
+
+  bool empty() const { return _pending == 0; }
+  uint32_t pending() const { return _pending; }
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  struct Cursor {
+    uint32_t segment;
+    uint32_t offset;
+  };
+
+  bool rotate();
+  void dropOldest();
+  void removeSegment(uint32_t segment);
+  void rewind();
+  void compact();
+  bool sendMarker(unsigned long now);
+  bool openReader(uint32_t segment);
+  // Reads the record at cursor into _topic/_payload; false at the end of
+  // the segment or on a torn/corrupt record.
+  bool readRecord(const Cursor& at, uint8_t& flags, size_t& length, uint32_t& next);
+  uint32_t countRecords(uint32_t segment, uint32_t offset);
+  void segmentPath(uint32_t segment, char* out, size_t size) const;
+  uint32_t lastSegment() const { return _head + _segments - 1; }
+
+  fs::FS& _fs;
+  const OfflineQueueHooks& _hooks;
+  char _base[96] = "";
+  size_t _baseLength = 0;
+
+  // Segments _head .. _head + _segments - 1 exist; the newest one is
+  // open for appends while _writer is.
+  uint32_t _head = 0;
+  uint8_t _segments = 0;
+  fs::File _writer;
+  fs::File _reader;
+  uint32_t _readerSegment = 0;
+
+  Cursor _acked = {0, 0};   // everything before this is acknowledged
+  Cursor _sent = {0, 0};    // next record to replay
+  bool _inFlight = false;
+  uint32_t _windowSeq = 0;
+  uint32_t _windowRecords = 0;
+  uint8_t _attempts = 0;
+  unsigned long _windowSentAt = 0;
+  unsigned long _lastSend = 0;
+
+  uint32_t _pending = 0;
+  uint32_t _queued = 0;
+  uint32_t _replayed = 0;
+  uint32_t _dropped = 0;
+  uint32_t _retries = 0;
+
+  char _topic[160];
+  uint8_t _payload[MAX_PAYLOAD];
+};
+
+}  // namespace ha
+
+#endif
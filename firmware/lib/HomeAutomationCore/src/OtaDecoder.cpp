@@ -0,0 +1,324 @@
+#include "OtaDecoder.h"
+
+#if defined(ESP32)
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#endif
+
+namespace ha {
+
+namespace {
+const uint8_t OP_DATA = 0x00;
+const uint8_t OP_COPY = 0x01;
+
+enum : uint8_t { HS_TAG, HS_LITERAL, HS_INDEX, HS_COUNT };
+
+uint32_t le32(const uint8_t* bytes) {
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+#if defined(ESP32) || defined(ESP8266)
+bool runningImageMatches(uint32_t size, const uint8_t* md5) {
+  // A patch only applies to the exact image it was made against
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  char digest[33];
+  for (uint8_t i = 0; i < 16; i++) {
+    digest[2 * i] = HEX_DIGITS[md5[i] >> 4];
+    digest[2 * i + 1] = HEX_DIGITS[md5[i] & 0x0F];
+  }
+  digest[32] = '\0';
+  return size == ESP.getSketchSize() && ESP.getSketchMD5().equalsIgnoreCase(digest);
+}
+
+bool readRunningImage(uint32_t offset, uint8_t* out, size_t length) {
+#if defined(ESP32)
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  return running && esp_partition_read(running, offset, out, length) == ESP_OK;
+#else
+  // The running sketch is mapped from flash offset 0
+  return ESP.flashRead(offset, out, length);
+#endif
+}
+#endif
+}  // namespace
+
+#if defined(ESP32) || defined(ESP8266)
+// Only the ESP8266 bootloader unpacks gzip images
+#if defined(ESP8266)
+const ImagePlatform RUNNING_IMAGE = { true, runningImageMatches, readRunningImage };
+#else
+const ImagePlatform RUNNING_IMAGE = { false, runningImageMatches, readRunningImage };
+#endif
+#endif
+
+void ImageDecoder::reset() {
+  _stage = Stage::Header;
+  _error = "";
+  _in = nullptr;
+  _inLength = 0;
+  _inPos = 0;
+  _headerLength = 0;
+  _flags = 0;
+  _imageSize = 0;
+  _baseSize = 0;
+  _produced = 0;
+  _bitBuffer = 0;
+  _bitCount = 0;
+  _hsState = HS_TAG;
+  _backrefIndex = 0;
+  _backref = 0;
+  _windowHead = 0;
+  memset(_window, 0, sizeof(_window));
+  _op = Op::Opcode;
+  _fieldLength = 0;
+  _dataRemaining = 0;
+  _copyRemaining = 0;
+}
+
+void ImageDecoder::input(const uint8_t* data, size_t length) {
+  _in = data;
+  _inLength = length;
+  _inPos = 0;
+}
+
+int ImageDecoder::read(uint8_t* out, size_t size) {
+  if (_stage == Stage::Failed) {
+    return -1;
+  }
+  if (_stage == Stage::Header && !parseHeader()) {
+    return _stage == Stage::Failed ? -1 : 0;
+  }
+
+  size_t produced = 0;
+  if (_flags & DELTA) {
+    int length = readPatch(out, size);
+    if (length < 0) {
+      return -1;
+    }
+    produced = length;
+  } else if (_flags & HEATSHRINK) {
+    uint8_t byte;
+    while (produced < size && nextPayloadByte(byte)) {
+      out[produced++] = byte;
+    }
+  } else {
+    produced = _inLength - _inPos < size ? _inLength - _inPos : size;
+    memcpy(out, _in + _inPos, produced);
+    _inPos += produced;
+  }
+
+  _produced += produced;
+  if (_imageSize && _produced > _imageSize) {
+    return failWith("image overrun");
+  }
+  return produced;
+}
+
+bool ImageDecoder::complete() const {
+  return _stage == Stage::Body && !pending() && (!(_flags & DELTA) || _op == Op::Opcode) &&
+         (!_imageSize || _produced == _imageSize);
+}
+
+const char* ImageDecoder::formatName() const {
+  if (_stage != Stage::Body) {
+    return "unknown";
+  }
+  switch (_flags) {
+    case HEATSHRINK:
+      return "heatshrink";
+    case DELTA:
+      return "delta";
+    case DELTA | HEATSHRINK:
+      return "delta+heatshrink";
+    default:
+      return "full";
+  }
+}
+
+bool ImageDecoder::parseHeader() {
+  // Plain images start 0xE9 (gzip 0x1F 0x8B), never 'H'
+  if (_headerLength == 0 && _inPos < _inLength && _in[_inPos] != 'H') {
+    if (_in[_inPos] == 0x1F && !_platform.gzip) {
+      failWith("gzip images not supported");
+      return false;
+    }
+    _stage = Stage::Body;
+    return true;
+  }
+  while (_headerLength < HEADER_SIZE && _inPos < _inLength) {
+    _header[_headerLength++] = _in[_inPos++];
+  }
+  if (_headerLength < HEADER_SIZE) {
+    return false;
+  }
+
+  _flags = _header[4];
+  _windowBits = _header[5];
+  _lookaheadBits = _header[6];
+  _imageSize = le32(_header + 8);
+  _baseSize = le32(_header + 12);
+  if (memcmp(_header, "HAOT", 4) != 0 || !_imageSize) {
+    failWith("bad container header");
+    return false;
+  }
+  if (_flags & ~(HEATSHRINK | DELTA)) {
+    failWith("unsupported image format");
+    return false;
+  }
+  if ((_flags & HEATSHRINK) &&
+      (_windowBits < 4 || _windowBits > MAX_WINDOW_BITS || _lookaheadBits < 3 || _lookaheadBits >= _windowBits)) {
+    failWith("unsupported heatshrink window");
+    return false;
+  }
+  if ((_flags & DELTA) && !_platform.baseMatches(_baseSize, _header + 16)) {
+    failWith("delta base mismatch");
+    return false;
+  }
+  _stage = Stage::Body;
+  return true;
+}
+
+bool ImageDecoder::nextByte(uint8_t& out) {
+  if (_inPos >= _inLength) {
+    return false;
+  }
+  out = _in[_inPos++];
+  return true;
+}
+
+int ImageDecoder::bits(uint8_t count) {
+  while (_bitCount < count) {
+    if (_inPos >= _inLength) {
+      return -1;
+    }
+    _bitBuffer = (_bitBuffer << 8) | _in[_inPos++];
+    _bitCount += 8;
+  }
+  _bitCount -= count;
+  int value = (_bitBuffer >> _bitCount) & ((1UL << count) - 1);
+  _bitBuffer &= (1UL << _bitCount) - 1;
+  return value;
+}
+
+bool ImageDecoder::nextPayloadByte(uint8_t& out) {
+  if (!(_flags & HEATSHRINK)) {
+    return nextByte(out);
+  }
+
+  // Heatshrink, MSB first: 1 <8-bit literal>, or 0 <index - 1> <count - 1>
+  // naming a run already in the window
+  const uint16_t mask = (1U << _windowBits) - 1;
+  for (;;) {
+    if (_backref > 0) {
+      out = _window[(uint16_t)(_windowHead - _backrefIndex) & mask];
+      _window[_windowHead++ & mask] = out;
+      _backref--;
+      return true;
+    }
+    int value;
+    switch (_hsState) {
+      case HS_TAG:
+        if ((value = bits(1)) < 0) {
+          return false;
+        }
+        _hsState = value ? HS_LITERAL : HS_INDEX;
+        break;
+      case HS_LITERAL:
+        if ((value = bits(8)) < 0) {
+          return false;
+        }
+        out = value;
+        _window[_windowHead++ & mask] = out;
+        _hsState = HS_TAG;
+        return true;
+      case HS_INDEX:
+        if ((value = bits(_windowBits)) < 0) {
+          return false;
+        }
+        _backrefIndex = value + 1;
+        _hsState = HS_COUNT;
+        break;
+      default:
+        if ((value = bits(_lookaheadBits)) < 0) {
+          return false;
+        }
+        _backref = value + 1;
+        _hsState = HS_TAG;
+        break;
+    }
+  }
+}
+
+int ImageDecoder::readPatch(uint8_t* out, size_t size) {
+  size_t produced = 0;
+  uint8_t byte;
+  while (produced < size) {
+    switch (_op) {
+      case Op::Opcode:
+        if (!nextPayloadByte(byte)) {
+          return produced;
+        }
+        if (byte != OP_DATA && byte != OP_COPY) {
+          return failWith("bad delta op");
+        }
+        _opcode = byte;
+        _fieldLength = 0;
+        _op = Op::Fields;
+        break;
+      case Op::Fields: {
+        uint8_t need = _opcode == OP_COPY ? 8 : 4;
+        while (_fieldLength < need && nextPayloadByte(byte)) {
+          _fields[_fieldLength++] = byte;
+        }
+        if (_fieldLength < need) {
+          return produced;
+        }
+        if (_opcode == OP_COPY) {
+          _copyOffset = le32(_fields);
+          _copyRemaining = le32(_fields + 4);
+          if (_copyOffset > _baseSize || _copyRemaining > _baseSize - _copyOffset) {
+            return failWith("delta copy out of range");
+          }
+          _op = Op::Copy;
+        } else {
+          _dataRemaining = le32(_fields);
+          _op = Op::Data;
+        }
+        break;
+      }
+      case Op::Data:
+        while (_dataRemaining > 0 && produced < size && nextPayloadByte(byte)) {
+          out[produced++] = byte;
+          _dataRemaining--;
+        }
+        if (_dataRemaining > 0) {
+          return produced;
+        }
+        _op = Op::Opcode;
+        break;
+      case Op::Copy: {
+        // Copies are the bulk of a patch; bounded by the output buffer
+        size_t length = _copyRemaining < size - produced ? _copyRemaining : size - produced;
+        if (!_platform.readBase(_copyOffset, out + produced, length)) {
+          return failWith("base image read failed");
+        }
+        produced += length;
+        _copyOffset += length;
+        _copyRemaining -= length;
+        if (_copyRemaining == 0) {
+          _op = Op::Opcode;
+        }
+        break;
+      }
+    }
+  }
+  return produced;
+}
+
+int ImageDecoder::failWith(const char* why) {
+  _error = why;
+  _stage = Stage::Failed;
+  return -1;
+}
+
+}  // namespace ha
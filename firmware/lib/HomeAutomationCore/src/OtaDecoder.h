@@ -0,0 +1,117 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace ha {
+
+// What the decoder needs from the board: whether its bootloader unpacks
+// gzip images, and the running image a patch applies to.
+struct ImagePlatform {
+  bool gzip;
+  bool (*baseMatches)(uint32_t size, const uint8_t* md5);
+  bool (*readBase)(uint32_t offset, uint8_t* out, size_t length);
+};
+
+#if defined(ESP32) || defined(ESP8266)
+// The running sketch
+extern const ImagePlatform RUNNING_IMAGE;
+#endif
+
+// Turns a downloaded OTA artifact back into the image to flash. A plain
+// image (or, on ESP8266, a gzip one, which the bootloader unpacks) passes
+// straight through. Anything else the OTA service sends is wrapped in a
+// 32-byte little-endian container header:
+//
+//   0  "HAOT"
+//   4  flags: HEATSHRINK (payload is heatshrink-compressed) and/or
+//      DELTA (payload is a patch against the running image)
+//   5  heatshrink window bits, 6 lookahead bits
+//   8  image size, 12 base image size, 16 base image MD5
+//
+// A patch is a run of ops: 0x00 <u32 length> <bytes> copies new bytes,
+// 0x01 <u32 offset> <u32 length> copies from the running image.
+//
+// The decoder is resumable at any byte boundary: input() hands it one
+// downloaded chunk, read() produces up to one output buffer, and all
+// state (bit buffer, backref window, current op) survives a dropped
+// connection, so the download resumes by artifact offset.
+class ImageDecoder {
+ public:
+  static const uint8_t HEADER_SIZE = 32;
+  static const uint8_t MAX_WINDOW_BITS = 10;
+  static const uint8_t HEATSHRINK = 0x01;
+  static const uint8_t DELTA = 0x02;
+
+#if defined(ESP32) || defined(ESP8266)
+  ImageDecoder() : ImageDecoder(RUNNING_IMAGE) {}
+#endif
+  // Host tests bring their own platform
+  explicit ImageDecoder(const ImagePlatform& platform) : _platform(platform) {}
+
+  void reset();
+
+  // The chunk must stay untouched until pending() turns false.
+  void input(const uint8_t* data, size_t length);
+  // Decodes into out; the byte count, or -1 with error() set.
+  int read(uint8_t* out, size_t size);
+
+  // More output can be read without new input.
+  bool pending() const { return _inPos < _inLength || _backref > 0 || _copyRemaining > 0; }
+  // Header resolved, so imageSize() is known.
+  bool ready() const { return _stage == Stage::Body; }
+  // Expected image size, 0 for a pass-through artifact.
+  uint32_t imageSize() const { return _imageSize; }
+  // At a clean end: whole header, no op half read, full image produced.
+  bool complete() const;
+
+  const char* formatName() const;
+  const char* error() const { return _error; }
+
+ private:
+  enum class Stage : uint8_t { Header, Body, Failed };
+  enum class Op : uint8_t { Opcode, Fields, Data, Copy };
+
+  bool parseHeader();
+  bool nextByte(uint8_t& out);
+  bool nextPayloadByte(uint8_t& out);
+  int bits(uint8_t count);
+  int readPatch(uint8_t* out, size_t size);
+  int failWith(const char* why);
+
+  const ImagePlatform& _platform;
+  Stage _stage = Stage::Header;
+  const char* _error = "";
+
+  const uint8_t* _in = nullptr;
+  size_t _inLength = 0;
+  size_t _inPos = 0;
+
+  uint8_t _header[HEADER_SIZE];
+  uint8_t _headerLength = 0;
+  uint8_t _flags = 0;
+  uint32_t _imageSize = 0;
+  uint32_t _baseSize = 0;
+  uint32_t _produced = 0;
+
+  // Heatshrink: bit buffer, sliding window and the backref being copied
+  uint8_t _windowBits = 0;
+  uint8_t _lookaheadBits = 0;
+  uint32_t _bitBuffer = 0;
+  uint8_t _bitCount = 0;
+  uint8_t _hsState = 0;
+  uint16_t _backrefIndex = 0;
+  uint16_t _backref = 0;
+  uint16_t _windowHead = 0;
+  uint8_t _window[1 << MAX_WINDOW_BITS];
+
+  // Patch: current op and how much of it is left
+  Op _op = Op::Opcode;
+  uint8_t _opcode = 0;
+  uint8_t _fields[8];
+  uint8_t _fieldLength = 0;
+  uint32_t _dataRemaining = 0;
+  uint32_t _copyOffset = 0;
+  uint32_t _copyRemaining = 0;
+};
+
+}  // namespace ha
@@ -0,0 +1,496 @@
+#include "OtaUpdate.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+#if defined(ESP32)
+#include <Update.h>
+#include <esp_task_wdt.h>
+#else
+#include <Updater.h>
+#endif
+
+namespace ha {
+
+namespace {
+int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool parseDigest(const char* hex, uint8_t out[32]) {
+  if (strlen(hex) != 64) {
+    return false;
+  }
+  for (uint8_t i = 0; i < 32; i++) {
+    int high = hexDigit(hex[2 * i]);
+    int low = hexDigit(hex[2 * i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    out[i] = (high << 4) | low;
+  }
+  return true;
+}
+
+void abortImage() {
+#if defined(ESP32)
+  Update.abort();
+#else
+  // ESP8266 Updater has no abort(); ending early discards the image
+  Update.end(false);
+#endif
+}
+
+// One download at a time, so the buffers are static rather than on the
+// stack of whichever task runs service(): chunk holds downloaded bytes
+// until the decoder has used them all, image the decoded bytes to flash
+uint8_t chunk[OtaStream::CHUNK_SIZE];
+uint8_t image[OtaStream::CHUNK_SIZE];
+}  // namespace
+
+bool OtaStream::start(const char* url, const char* sha256, uint32_t size, uint32_t startWindow, bool needsGrant) {
+  if (busy()) {
+    _error = "update already running";
+    return false;
+  }
+  _error = "";
+  if (sha256 && strncmp(sha256, "sha256:", 7) == 0) {
+    sha256 += 7;
+  }
+  if (!url || !*url || strlen(url) >= sizeof(_url)) {
+    _error = "bad url";
+  } else if (sha256 && *sha256 && !parseDigest(sha256, _expected)) {
+    _error = "bad checksum";
+  }
+  if (*_error) {
+    _failed++;
+    _state = State::Failed;
+    return false;
+  }
+
+  strcpy(_url, url);
+  _verify = sha256 && *sha256;
+  _total = size;
+  _received = 0;
+  _written = 0;
+  _decoder.reset();
+  _resumes = 0;
+  _retryAt = 0;
+  _connected = false;
+  _imageStarted = false;
+  _reportedProgress = 0xFF;
+  hashStart();
+
+  // Devices sent the same command spread their start over the window
+  _needsGrant = needsGrant;
+  _granted = false;
+  _token[0] = '\0';
+  _postedRetryAfter = 0;
+  _grantRequested = false;
+  _scheduledAt = millis();
+  _startAt = _scheduledAt + (startWindow ? (unsigned long)random(startWindow * 1000UL) : 0);
+  _state = State::Scheduled;
+  return true;
+}
+
+bool OtaStream::grant(const char* token) {
+  if (_state != State::Scheduled || !_needsGrant || _granted || !token || strlen(token) >= sizeof(_token)) {
+    return false;
+  }
+  strcpy(_token, token);
+  _granted = true;
+  return true;
+}
+
+void OtaStream::retryAfter(uint32_t seconds) {
+  if (!seconds) {
+    seconds = DEFAULT_RETRY_AFTER;
+  }
+  if (busy()) {
+    _postedRetryAfter = seconds;
+  }
+}
+
+void OtaStream::service(unsigned long now) {
+  if (_state == State::Scheduled) {
+    serviceAdmission(now);
+    return;
+  }
+  if (_state != State::Downloading) {
+    return;
+  }
+  uint32_t retryAfter = _postedRetryAfter;
+  if (retryAfter) {
+    _postedRetryAfter = 0;
+    defer(now, retryAfter);
+    return;
+  }
+  // Finish decoding what was downloaded before reading more
+  if (!_decoder.pending()) {
+    if (_total && _received >= _total) {
+      finish();
+      return;
+    }
+    if (!_connected) {
+      if ((long)(now - _retryAt) >= 0) {
+        connect(now);
+      }
+      return;
+    }
+
+    WiFiClient* stream = _http.getStreamPtr();
+    size_t available = stream ? stream->available() : 0;
+    if (available == 0) {
+      if (!_http.connected()) {
+        drop(now, "connection lost");
+      } else if (now - _lastData > STALL_TIMEOUT) {
+        drop(now, "download stalled");
+      }
+      return;
+    }
+
+    size_t want = available < CHUNK_SIZE ? available : CHUNK_SIZE;
+    if (want > _total - _received) {
+      want = _total - _received;
+    }
+    int length = stream->read(chunk, want);
+    if (length <= 0) {
+      return;
+    }
+    _lastData = now;
+    hashUpdate(chunk, length);
+    _received += length;
+    _decoder.input(chunk, length);
+  }
+
+  int length = _decoder.read(image, sizeof(image));
+  if (length < 0) {
+    fail(_decoder.error());
+    return;
+  }
+  if (length > 0) {
+    if (!_imageStarted && !beginImage()) {
+      return;
+    }
+    if (Update.write(image, length) != (size_t)length) {
+      fail("flash write failed");
+      return;
+    }
+    _written += length;
+  }
+  if (_total && _received >= _total && !_decoder.pending()) {
+    finish();
+  }
+}
+
+void OtaStream::serviceAdmission(unsigned long now) {
+  uint32_t retryAfter = _postedRetryAfter;
+  if (retryAfter) {
+    _postedRetryAfter = 0;
+    defer(now, retryAfter);
+    return;
+  }
+  if ((long)(now - _startAt) < 0) {
+    return;
+  }
+  if (_needsGrant && !_granted) {
+    if (now - _scheduledAt > MAX_ADMISSION_WAIT) {
+      fail("no download slot");
+    }
+    return;
+  }
+  _retryAt = now;
+  _state = State::Downloading;
+}
+
+bool OtaStream::connect(unsigned long now) {
+  static const char* HEADERS[] = { "Content-Range", "Retry-After" };
+
+  _http.setReuse(false);
+  _http.setTimeout(STALL_TIMEOUT);
+  if (!_http.begin(_client, _url)) {
+    fail("bad url");
+    return false;
+  }
+  _http.collectHeaders(HEADERS, 2);
+  if (*_token) {
+    _http.addHeader("X-OTA-Token", _token);
+  }
+  if (_received > 0) {
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)_received);
+    _http.addHeader("Range", range);
+  }
+
+  int code = _http.GET();
+  if (code == HTTP_CODE_PARTIAL_CONTENT && _received > 0) {
+    // Content-Range: bytes <first>-<last>/<total>
+    unsigned long first = 0, last = 0, total = 0;
+    if (sscanf(_http.header("Content-Range").c_str(), "bytes %lu-%lu/%lu", &first, &last, &total) != 3 ||
+        first != _received || total != _total) {
+      restartImage();
+      drop(now, "bad range response");
+      return false;
+    }
+    _resumed++;
+  } else if (code == HTTP_CODE_OK) {
+    // Whole file: a fresh start, or a server that ignores Range
+    if (_received > 0) {
+      restartImage();
+    }
+    int length = _http.getSize();
+    if (length > 0 && _total && (uint32_t)length != _total) {
+      fail("size mismatch");
+      return false;
+    }
+    if (length > 0) {
+      _total = length;
+    }
+    if (!_total) {
+      fail("unknown image size");
+      return false;
+    }
+  } else if (code == HTTP_CODE_TOO_MANY_REQUESTS || code == HTTP_CODE_SERVICE_UNAVAILABLE) {
+    // Busy, not broken: an HTTP-date Retry-After gets the default
+    uint32_t seconds = _http.header("Retry-After").toInt();
+    if (!seconds) {
+      seconds = DEFAULT_RETRY_AFTER;
+    }
+    _error = "server busy";
+    defer(now, seconds);
+    return false;
+  } else if (code > 0 && code < 500) {
+    fail("http request refused");
+    return false;
+  } else {
+    drop(now, "http request failed");
+    return false;
+  }
+
+  _connected = true;
+  _lastData = now;
+  return true;
+}
+
+void OtaStream::drop(unsigned long now, const char* why) {
+  _http.end();
+  _connected = false;
+  _error = why;
+  if (++_resumes > MAX_RESUMES) {
+    fail(why);
+    return;
+  }
+  _retryAt = now + RESUME_BACKOFF * _resumes;
+}
+
+void OtaStream::defer(unsigned long now, uint32_t seconds) {
+  // Downloaded bytes are kept; a granted slot is not, so ask again
+  _http.end();
+  _connected = false;
+  if (seconds > MAX_RETRY_AFTER) {
+    seconds = MAX_RETRY_AFTER;
+  }
+  _startAt = now + seconds * 1000UL + (unsigned long)random(RETRY_JITTER);
+  _granted = false;
+  _token[0] = '\0';
+  _grantRequested = false;
+  _deferred++;
+  _state = State::Scheduled;
+}
+
+void OtaStream::fail(const char* why) {
+  _http.end();
+  _connected = false;
+  if (_imageStarted) {
+    abortImage();
+    _imageStarted = false;
+  }
+  _error = why;
+  _failed++;
+  _state = State::Failed;
+}
+
+void OtaStream::finish() {
+  _http.end();
+  _connected = false;
+
+  if (!_decoder.complete()) {
+    fail("truncated image");
+    return;
+  }
+  uint8_t digest[32];
+  hashFinish(digest);
+  if (_verify && memcmp(digest, _expected, sizeof(digest)) != 0) {
+    fail("sha256 mismatch");
+    return;
+  }
+  _imageStarted = false;
+  if (!Update.end()) {
+    fail("image rejected");
+    return;
+  }
+  _error = "";
+  _completed++;
+  _state = State::Verified;
+}
+
+void OtaStream::restartImage() {
+  if (_imageStarted) {
+    abortImage();
+    _imageStarted = false;
+  }
+  _received = 0;
+  _written = 0;
+  _decoder.reset();
+  hashStart();
+  _restarted++;
+}
+
+bool OtaStream::beginImage() {
+  // The first decoded bytes; a container header has named the image size
+  uint32_t size = _decoder.imageSize() ? _decoder.imageSize() : _total;
+  if (!Update.begin(size)) {
+    fail("no room for image");
+    return false;
+  }
+  _imageStarted = true;
+  return true;
+}
+
+uint8_t OtaStream::progress() const {
+  return _total ? (uint8_t)((uint64_t)_received * 100 / _total) : 0;
+}
+
+bool OtaStream::grantRequestDue(unsigned long now) {
+  if (_state != State::Scheduled || !_needsGrant || _granted || (long)(now - _startAt) < 0) {
+    return false;
+  }
+  if (_grantRequested && now - _grantRequestedAt < GRANT_REQUEST_INTERVAL) {
+    return false;
+  }
+  _grantRequested = true;
+  _grantRequestedAt = now;
+  return true;
+}
+
+bool OtaStream::progressDue(unsigned long now) {
+  if (_state != State::Downloading) {
+    return false;
+  }
+  uint8_t percent = progress();
+  if (_reportedProgress != 0xFF &&
+      (percent < _reportedProgress + PROGRESS_STEP || now - _reportedAt < PROGRESS_INTERVAL)) {
+    return false;
+  }
+  _reportedProgress = percent;
+  _reportedAt = now;
+  return true;
+}
+
+void OtaStream::clear() {
+  if (!busy()) {
+    _state = State::Idle;
+  }
+}
+
+void OtaStream::reportStats(JsonObject obj) const {
+  obj["state"] = otaStateName(_state);
+  obj["progress"] = progress();
+  obj["format"] = _decoder.formatName();
+  obj["received"] = _received;
+  obj["total"] = _total;
+  obj["written"] = _written;
+  obj["completed"] = _completed;
+  obj["failed"] = _failed;
+  obj["resumed"] = _resumed;
+  obj["restarted"] = _restarted;
+  obj["deferred"] = _deferred;
+  if (*_error) {
+    obj["error"] = _error;
+  }
+}
+
+void OtaStream::reportCapabilities(JsonObject obj) {
+  JsonArray formats = obj.createNestedArray("formats");
+  formats.add("full");
+#if defined(ESP8266)
+  // Unpacked by the bootloader rather than in flight
+  formats.add("gzip");
+#endif
+  formats.add("heatshrink");
+  formats.add("delta");
+  obj["heatshrink_window"] = ImageDecoder::MAX_WINDOW_BITS;
+  obj["image_size"] = ESP.getSketchSize();
+  obj["image_md5"] = ESP.getSketchMD5();
+}
+
+#if defined(ESP32)
+bool OtaStream::startTask(uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+  return xTaskCreatePinnedToCore(
+             [](void* parameter) {
+               OtaStream* ota = static_cast<OtaStream*>(parameter);
+               esp_task_wdt_add(NULL);
+               while (ota->busy()) {
+                 esp_task_wdt_reset();
+                 ota->service(millis());
+                 vTaskDelay(ota->active() ? 1 : pdMS_TO_TICKS(100));
+               }
+               esp_task_wdt_delete(NULL);
+               vTaskDelete(NULL);
+             },
+             "ota", stackSize, this, priority, NULL, core) == pdPASS;
+}
+
+void OtaStream::hashStart() {
+  // A context may hold the SHA peripheral until it is freed
+  if (_hashing) {
+    mbedtls_sha256_free(&_sha);
+  }
+  mbedtls_sha256_init(&_sha);
+  mbedtls_sha256_starts(&_sha, 0);
+  _hashing = true;
+}
+
+void OtaStream::hashUpdate(const uint8_t* data, size_t length) {
+  mbedtls_sha256_update(&_sha, data, length);
+}
+
+void OtaStream::hashFinish(uint8_t out[32]) {
+  mbedtls_sha256_finish(&_sha, out);
+  mbedtls_sha256_free(&_sha);
+  _hashing = false;
+}
+#else
+void OtaStream::hashStart() {
+  br_sha256_init(&_sha);
+}
+
+void OtaStream::hashUpdate(const uint8_t* data, size_t length) {
+  br_sha256_update(&_sha, data, length);
+}
+
+void OtaStream::hashFinish(uint8_t out[32]) {
+  br_sha256_out(&_sha, out);
+}
+#endif
+
+const char* otaStateName(OtaStream::State state) {
+  switch (state) {
+    case OtaStream::State::Scheduled:
+      return "scheduled";
+    case OtaStream::State::Downloading:
+      return "updating";
+    case OtaStream::State::Verified:
+      return "success";
+    case OtaStream::State::Failed:
+      return "failed";
+    default:
+      return "idle";
+  }
+}
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,174 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFiClient.h>
+
+#include "OtaDecoder.h"
+
+#if defined(ESP32)
+#include <HTTPClient.h>
+#include <mbedtls/sha256.h>
+#else
+#include <ESP8266HTTPClient.h>
+#include <bearssl/bearssl_hash.h>
+#endif
+
+namespace ha {
+
+// Firmware download streamed into the OTA partition through the Update
+// API, one chunk per service() call, so the caller's loop (and watchdog)
+// keeps running. A dropped connection is resumed from the bytes already
+// written with an HTTP Range request; a server that answers the range
+// with the whole file gets the download restarted from zero. The image is
+// hashed as it streams and only marked bootable if the SHA-256 matches.
+//
+// The artifact may be compressed or a delta against the running image
+// (see ImageDecoder); offsets, progress and the SHA-256 are always those
+// of the artifact as downloaded, and the decoded image goes to flash.
+//
+// A fleet rollout adds admission: the download starts at a random point
+// of the start window, may have to wait for a download slot (a token
+// granted over <base>/ota, sent back as X-OTA-Token), and backs off when
+// the server answers 429/503 or sends retry_after, keeping what was
+// already downloaded.
+//
+// service() may run on its own task; progressDue(), grantRequestDue(),
+// state() and clear() are for the side that reports, and grant() and
+// retryAfter() for the side that receives commands. They only post
+// values for service() to act on.
+class OtaStream {
+ public:
+  enum class State : uint8_t { Idle, Scheduled, Downloading, Verified, Failed };
+
+  static const size_t CHUNK_SIZE = 1024;
+  static const size_t MAX_URL = 200;
+  static const uint8_t MAX_RESUMES = 8;
+  static const unsigned long STALL_TIMEOUT = 15000;
+  static const unsigned long RESUME_BACKOFF = 2000;
+  static const size_t MAX_TOKEN = 40;
+  // Slot requests are repeated until granted, for at most
+  // MAX_ADMISSION_WAIT; retry-after delays are capped and jittered.
+  static const unsigned long GRANT_REQUEST_INTERVAL = 30000;
+  static const unsigned long MAX_ADMISSION_WAIT = 4UL * 3600 * 1000;
+  static const uint32_t DEFAULT_RETRY_AFTER = 60;
+  static const uint32_t MAX_RETRY_AFTER = 3600;
+  static const unsigned long RETRY_JITTER = 10000;
+  // Progress is reported every PROGRESS_STEP percent, at most once per
+  // PROGRESS_INTERVAL.
+  static const uint8_t PROGRESS_STEP = 5;
+  static const unsigned long PROGRESS_INTERVAL = 2000;
+
+  // sha256 is the expected digest of the artifact as 64 hex digits
+  // (optionally prefixed "sha256:"), or null to skip the check; size is
+  // the expected artifact size, 0 to take it from the server. The
+  // download starts within startWindow seconds, and only once granted if
+  // needsGrant. False (with error() set) if the request is unusable or an
+  // update is already under way.
+  bool start(const char* url, const char* sha256, uint32_t size = 0, uint32_t startWindow = 0,
+             bool needsGrant = false);
+  // A download slot from the OTA service; false if none was asked for.
+  bool grant(const char* token);
+  // The OTA service is busy: try again after this many seconds (0 for
+  // DEFAULT_RETRY_AFTER).
+  void retryAfter(uint32_t seconds);
+
+  // Moves the download on by at most one chunk.
+  void service(unsigned long now);
+#if defined(ESP32)
+  // Calls service() from a task of its own until the update ends. The
+  // task is on the task watchdog and yields between chunks.
+  bool startTask(uint32_t stackSize = 4096, UBaseType_t priority = 1, BaseType_t core = 0);
+#endif
+
+  State state() const { return _state; }
+  bool active() const { return _state == State::Downloading; }
+  // Scheduled or downloading.
+  bool busy() const { return _state == State::Scheduled || _state == State::Downloading; }
+  // Idle once any result has been reported, too.
+  bool idle() const { return _state == State::Idle; }
+  uint8_t progress() const;
+  const char* error() const { return _error; }
+
+  // True once per progress step while downloading.
+  bool progressDue(unsigned long now);
+  // True when a slot request should be published.
+  bool grantRequestDue(unsigned long now);
+  // Back to Idle once the result has been reported.
+  void clear();
+
+  void reportStats(JsonObject obj) const;
+
+  // What the OTA service needs to pick an artifact: the formats this
+  // device decodes and the size and MD5 a delta must be made against.
+  static void reportCapabilities(JsonObject obj);
+
+ private:
+  void serviceAdmission(unsigned long now);
+  bool connect(unsigned long now);
+  void defer(unsigned long now, uint32_t seconds);
+  void drop(unsigned long now, const char* why);
+  void fail(const char* why);
+  void finish();
+  void restartImage();
+  bool beginImage();
+
+  void hashStart();
+  void hashUpdate(const uint8_t* data, size_t length);
+  void hashFinish(uint8_t out[32]);
+
+  volatile State _state = State::Idle;
+  char _url[MAX_URL] = "";
+  uint8_t _expected[32];
+  bool _verify = false;
+  const char* _error = "";
+
+  bool _needsGrant = false;
+  volatile bool _granted = false;
+  char _token[MAX_TOKEN] = "";
+  volatile uint32_t _postedRetryAfter = 0;
+  unsigned long _scheduledAt = 0;
+  unsigned long _startAt = 0;
+  bool _grantRequested = false;
+  unsigned long _grantRequestedAt = 0;
+
+  HTTPClient _http;
+  WiFiClient _client;
+  bool _connected = false;
+  bool _imageStarted = false;
+  bool _hashing = false;
+#if defined(ESP32)
+  mbedtls_sha256_context _sha;
+#else
+  br_sha256_context _sha;
+#endif
+
+  ImageDecoder _decoder;
+
+  // Artifact bytes: total and downloaded; image bytes flashed
+  volatile uint32_t _total = 0;
+  volatile uint32_t _received = 0;
+  uint32_t _written = 0;
+  uint8_t _resumes = 0;
+  unsigned long _retryAt = 0;
+  unsigned long _lastData = 0;
+
+  uint8_t _reportedProgress = 0xFF;
+  unsigned long _reportedAt = 0;
+
+  uint32_t _completed = 0;
+  uint32_t _failed = 0;
+  uint32_t _resumed = 0;
+  uint32_t _restarted = 0;
+  uint32_t _deferred = 0;
+};
+
+// "scheduled", "updating", "success" or "failed", as reported on the
+// status topic.
+const char* otaStateName(OtaStream::State state);
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace ha {
+
+// Lightness (0..255, perceptually even steps) to PWM duty, from the CIE
+// 1931 lightness formula. Everything here is constexpr, so a table
+// declared constexpr is computed by the compiler and lives in flash.
+constexpr double cieLuminance(double lightness) {
+  return lightness <= 8.0 ? lightness / 903.3
+                          : ((lightness + 16.0) / 116.0) * ((lightness + 16.0) / 116.0) * ((lightness + 16.0) / 116.0);
+}
+
+constexpr uint16_t perceptualDuty(unsigned level, uint16_t maxDuty) {
+  return (uint16_t)(cieLuminance(level * 100.0 / 255.0) * maxDuty + 0.5);
+}
+
+template <size_t N>
+struct DutyTable {
+  uint16_t duty[N];
+
+  // Linear between entries, for levels in 8.8 fixed point
+  uint16_t interpolate(uint16_t level) const {
+    size_t index = level >> 8;
+    if (index >= N - 1) {
+      return duty[N - 1];
+    }
+    uint32_t low = duty[index];
+    uint32_t high = duty[index + 1];
+    return low + (((high - low) * (level & 0xFF)) >> 8);
+  }
+};
+
+namespace detail {
+template <unsigned... I>
+struct Indices {};
+
+template <unsigned N, unsigned... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+template <unsigned... I>
+struct MakeIndices<0, I...> {
+  typedef Indices<I...> type;
+};
+
+template <unsigned... I>
+constexpr DutyTable<sizeof...(I)> perceptualCurve(uint16_t maxDuty, Indices<I...>) {
+  return {{ perceptualDuty(I, maxDuty)... }};
+}
+}  // namespace detail
+
+// 256-entry table for PWM with the given full-scale duty.
+constexpr DutyTable<256> perceptualCurve(uint16_t maxDuty) {
+  return detail::perceptualCurve(maxDuty, detail::MakeIndices<256>::type());
+}
+
+}  // namespace ha
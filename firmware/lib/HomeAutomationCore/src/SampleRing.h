@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace ha {
+
+// Fixed-capacity FIFO of samples over caller-provided storage (a static
+// array, or PSRAM taken once at boot). It never allocates; when full,
+// push() overwrites the oldest sample and counts it as dropped.
+template <typename T>
+class SampleRing {
+ public:
+  void begin(T* storage, size_t capacity) {
+    _items = storage;
+    _capacity = capacity;
+    _head = 0;
+    _count = 0;
+  }
+
+  void push(const T& item) {
+    if (_capacity == 0) {
+      return;
+    }
+    _items[(_head + _count) % _capacity] = item;
+    if (_count < _capacity) {
+      _count++;
+    } else {
+      _head = (_head + 1) % _capacity;
+      _dropped++;
+    }
+  }
+
+  // The i-th oldest sample, for 0 <= i < size().
+  const T& at(size_t i) const { return _items[(_head + i) % _capacity]; }
+
+  // Removes the n oldest samples once they have been delivered.
+  void consume(size_t n) {
+    if (n > _count) {
+      n = _count;
+    }
+    _head = (_head + n) % _capacity;
+    _count -= n;
+  }
+
+  size_t size() const { return _count; }
+  size_t capacity() const { return _capacity; }
+  bool empty() const { return _count == 0; }
+  uint32_t dropped() const { return _dropped; }
+
+  void reportStats(JsonObject obj) const {
+    obj["buffered"] = _count;
+    obj["capacity"] = _capacity;
+    obj["dropped"] = _dropped;
+  }
+
+ private:
+  T* _items = nullptr;
+  size_t _capacity = 0;
+  size_t _head = 0;
+  size_t _count = 0;
+  uint32_t _dropped = 0;
+};
+
+}  // namespace ha
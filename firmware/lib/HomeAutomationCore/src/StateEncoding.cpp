@@ -0,0 +1,90 @@
+#include "StateEncoding.h"
+
+namespace ha {
+
+const char* stateEncodingName(StateEncoding encoding) {
+  return encoding == StateEncoding::MsgPack ? "msgpack" : "json";
+}
+
+bool parseStateEncoding(const char* name, StateEncoding& out) {
+  if (!name) {
+    return false;
+  }
+  if (strcmp(name, "json") == 0) {
+    out = StateEncoding::Json;
+    return true;
+  }
+  if (strcmp(name, "msgpack") == 0) {
+    out = StateEncoding::MsgPack;
+    return true;
+  }
+  return false;
+}
+
+const char* compactStateKey(const char* json) {
+  static const StateKey* const ALL[] = {
+    &keys::TIMESTAMP, &keys::DEVICE_ID, &keys::POWER, &keys::BRIGHTNESS, &keys::COLOR_R,
+    &keys::COLOR_G, &keys::COLOR_B, &keys::TEMPERATURE, &keys::HUMIDITY, &keys::PRESSURE,
+    &keys::LIGHT_LEVEL, &keys::MOTION_DETECTED, &keys::ANALOG_VALUE, &keys::WINDOW,
+  };
+  if (!json) {
+    return nullptr;
+  }
+  for (const StateKey* key : ALL) {
+    if (strcmp(json, key->json) == 0) {
+      return key->compact;
+    }
+  }
+  return nullptr;
+}
+
+void reportStateEncodings(JsonDocument& doc, StateEncoding current) {
+  doc["state_encoding"] = stateEncodingName(current);
+  JsonArray supported = doc.createNestedArray("state_encodings");
+  supported.add("json");
+  supported.add("msgpack");
+}
+
+StateEncoder::StateEncoder(JsonDocument& doc, StateEncoding encoding)
+    : _doc(doc), _encoding(encoding) {
+  if (_encoding == StateEncoding::MsgPack) {
+    _doc["v"] = BINARY_STATE_VERSION;
+  }
+}
+
+void StateEncoder::setDeviceId(const char* id) {
+  if (_encoding == StateEncoding::Json) {
+    _doc[keys::DEVICE_ID.json] = id;
+  }
+}
+
+void StateEncoder::setWindow(const StateKey& key, const WindowStats& stats) {
+  if (stats.count() == 0) {
+    return;
+  }
+  JsonObject window = _doc[name(keys::WINDOW)];
+  if (window.isNull()) {
+    window = _doc.createNestedObject(name(keys::WINDOW));
+  }
+  if (_encoding == StateEncoding::MsgPack) {
+    stats.serialize(window.createNestedArray(key.compact));
+  } else {
+    stats.serialize(window.createNestedObject(key.json));
+  }
+}
+
+size_t StateEncoder::serialize(uint8_t* out, size_t capacity) const {
+  if (_encoding == StateEncoding::MsgPack) {
+    if (measureMsgPack(_doc) > capacity) {
+      return 0;
+    }
+    return serializeMsgPack(_doc, out, capacity);
+  }
+  // serializeJson NUL-terminates, so it needs one byte of headroom.
+  if (measureJson(_doc) >= capacity) {
+    return 0;
+  }
+  return serializeJson(_doc, reinterpret_cast<char*>(out), capacity);
+}
+
+}  // namespace ha
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "WindowStats.h"
+
+namespace ha {
+
+// Wire format for state/telemetry publishes. Json goes to <base>/state as
+// before; MsgPack goes to <base>/state/bin with the compact keys below.
+// Devices always boot in Json; the backend opts a device in with a
+// "set_encoding" command after seeing "state_encodings" in its status.
+enum class StateEncoding : uint8_t { Json, MsgPack };
+
+// Bumped whenever a compact key changes meaning. Sent as "v" in every
+// MsgPack payload; the decoder lives in backend/device-service/mqtt_client.py.
+constexpr uint8_t BINARY_STATE_VERSION = 1;
+
+const char* stateEncodingName(StateEncoding encoding);
+bool parseStateEncoding(const char* name, StateEncoding& out);
+
+// Adds the encodings this firmware can publish to a status document.
+void reportStateEncodings(JsonDocument& doc, StateEncoding current);
+
+// A state field under its JSON name and its compact MsgPack name.
+struct StateKey {
+  const char* json;
+  const char* compact;
+};
+
+namespace keys {
+constexpr StateKey TIMESTAMP = { "timestamp", "t" };
+constexpr StateKey DEVICE_ID = { "device_id", "id" };
+constexpr StateKey POWER = { "power", "p" };
+constexpr StateKey BRIGHTNESS = { "brightness", "br" };
+constexpr StateKey COLOR_R = { "color_r", "cr" };
+constexpr StateKey COLOR_G = { "color_g", "cg" };
+constexpr StateKey COLOR_B = { "color_b", "cb" };
+constexpr StateKey TEMPERATURE = { "temperature", "tc" };
+constexpr StateKey HUMIDITY = { "humidity", "rh" };
+constexpr StateKey PRESSURE = { "pressure", "pa" };
+constexpr StateKey LIGHT_LEVEL = { "light_level", "lx" };
+constexpr StateKey MOTION_DETECTED = { "motion_detected", "mo" };
+constexpr StateKey ANALOG_VALUE = { "analog_value", "av" };
+// Per-field window statistics, keyed by the field's own name
+constexpr StateKey WINDOW = { "window", "w" };
+}  // namespace keys
+
+// The compact name of a state field given its JSON name, or nullptr.
+const char* compactStateKey(const char* json);
+
+// Fills a document with the key set of the chosen encoding and
+// serializes it into a caller-owned buffer.
+class StateEncoder {
+ public:
+  StateEncoder(JsonDocument& doc, StateEncoding encoding);
+
+  template <typename T>
+  void set(const StateKey& key, T value) {
+    _doc[name(key)] = value;
+  }
+
+  // The device id is implied by the topic, so the compact form skips it.
+  void setDeviceId(const char* id);
+
+  // Min/max/mean/count of a field's publish window under WINDOW: an
+  // object per field in JSON, a [min, max, mean, samples] array in the
+  // compact form. An empty window is left out.
+  void setWindow(const StateKey& key, const WindowStats& stats);
+
+  // Returns the number of bytes written, 0 if the buffer is too small.
+  size_t serialize(uint8_t* out, size_t capacity) const;
+
+  const char* topic(const char* jsonTopic, const char* binaryTopic) const {
+    return _encoding == StateEncoding::MsgPack ? binaryTopic : jsonTopic;
+  }
+
+ private:
+  const char* name(const StateKey& key) const {
+    return _encoding == StateEncoding::MsgPack ? key.compact : key.json;
+  }
+
+  JsonDocument& _doc;
+  StateEncoding _encoding;
+};
+
+}  // namespace ha
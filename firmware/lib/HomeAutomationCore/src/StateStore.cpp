@@ -0,0 +1,128 @@
+#include "StateStore.h"
+
+#include "Metrics.h"
+
+#if !defined(ESP32)
+#include <EEPROM.h>
+#endif
+
+namespace ha {
+
+#if defined(ESP32)
+
+RecordStore::RecordStore(const char* name, uint8_t size, uint16_t, uint16_t) : _name(name), _size(size) {}
+
+bool RecordStore::load(void* out) {
+  if (!_open) {
+    _open = _prefs.begin(_name, false);
+  }
+  return _open && _prefs.getBytes("record", out, _size) == _size;
+}
+
+bool RecordStore::save(const void* data) {
+  if (!_open) {
+    _open = _prefs.begin(_name, false);
+  }
+  if (!_open || _prefs.putBytes("record", data, _size) != _size) {
+    return false;
+  }
+  HA_COUNT_EVENT(EepromCommits, 1);
+  return true;
+}
+
+#else
+
+namespace {
+uint8_t crc8(uint8_t seq, const uint8_t* data, uint8_t length) {
+  // CRC-8/MAXIM over the sequence number and the record
+  uint8_t crc = 0;
+  for (int16_t i = -1; i < length; i++) {
+    uint8_t byte = i < 0 ? seq : data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      uint8_t mix = (crc ^ byte) & 1;
+      crc >>= 1;
+      if (mix) {
+        crc ^= 0x8C;
+      }
+      byte >>= 1;
+    }
+  }
+  return crc;
+}
+}  // namespace
+
+RecordStore::RecordStore(const char* name, uint8_t size, uint16_t base, uint16_t length)
+    : _base(base), _slots(length / (size + 2)), _name(name), _size(size) {
+  // The newest slot is found by a break in the sequence, which needs fewer
+  // slots than sequence numbers
+  if (_slots > 255) {
+    _slots = 255;
+  }
+}
+
+bool RecordStore::readSlot(uint16_t slot, uint8_t& seq, void* out) const {
+  uint16_t address = slotAddress(slot);
+  uint8_t* bytes = static_cast<uint8_t*>(out);
+  bool erased = true;
+  seq = EEPROM.read(address);
+  for (uint8_t i = 0; i < _size; i++) {
+    bytes[i] = EEPROM.read(address + 1 + i);
+    erased = erased && bytes[i] == 0xFF;
+  }
+  uint8_t crc = EEPROM.read(address + 1 + _size);
+  return !(erased && seq == 0xFF && crc == 0xFF) && crc == crc8(seq, bytes, _size);
+}
+
+bool RecordStore::load(void* out) {
+  // Writes go round the slots in order, so the newest record is the valid
+  // slot whose successor does not hold the next sequence number (a torn
+  // write leaves its slot invalid and the one before it newest)
+  _newest = -1;
+  uint8_t seq;
+  uint8_t nextSeq;
+  for (uint16_t slot = 0; slot < _slots && _newest < 0; slot++) {
+    if (!readSlot(slot, seq, out)) {
+      continue;
+    }
+    uint16_t next = (slot + 1) % _slots;
+    if (!readSlot(next, nextSeq, out) || nextSeq != (uint8_t)(seq + 1)) {
+      _newest = slot;
+      _seq = seq;
+    }
+  }
+  return _newest >= 0 && readSlot(_newest, seq, out);
+}
+
+bool RecordStore::save(const void* data) {
+  uint16_t slot = _newest < 0 ? 0 : (_newest + 1) % _slots;
+  uint8_t seq = _newest < 0 ? 0 : _seq + 1;
+  uint16_t address = slotAddress(slot);
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+#if defined(__AVR__)
+  // Real EEPROM: update() skips cells that already hold the value
+  EEPROM.update(address, seq);
+  for (uint8_t i = 0; i < _size; i++) {
+    EEPROM.update(address + 1 + i, bytes[i]);
+  }
+  EEPROM.update(address + 1 + _size, crc8(seq, bytes, _size));
+#else
+  EEPROM.write(address, seq);
+  for (uint8_t i = 0; i < _size; i++) {
+    EEPROM.write(address + 1 + i, bytes[i]);
+  }
+  EEPROM.write(address + 1 + _size, crc8(seq, bytes, _size));
+  if (!EEPROM.commit()) {
+    return false;
+  }
+#endif
+  HA_COUNT_EVENT(EepromCommits, 1);
+
+  _newest = slot;
+  _seq = seq;
+  return true;
+}
+
+#endif
+
+}  // namespace ha
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#if defined(ESP32)
+#include <Preferences.h>
+#endif
+
+namespace ha {
+
+// Storage for one small fixed-size record. On ESP32 it lives in NVS,
+// which is log-structured and wear-levels by itself. Elsewhere every save
+// goes to the next slot of an EEPROM region, tagged with a sequence number
+// and CRC-8, so writes spread over the region instead of one address. The
+// default region starts at 16 to leave the old single-record layout at
+// address 0 readable for migration.
+class RecordStore {
+ public:
+  RecordStore(const char* name, uint8_t size, uint16_t base = 16, uint16_t length = 496);
+
+  // Newest valid record; false when none has been saved yet.
+  bool load(void* out);
+  bool save(const void* data);
+
+ private:
+#if defined(ESP32)
+  Preferences _prefs;
+  bool _open = false;
+#else
+  bool readSlot(uint16_t slot, uint8_t& seq, void* out) const;
+  uint16_t slotAddress(uint16_t slot) const { return _base + slot * (_size + 2); }
+
+  uint16_t _base;
+  uint16_t _slots;
+  int16_t _newest = -1;
+  uint8_t _seq = 0;
+#endif
+  const char* _name;
+  uint8_t _size;
+};
+
+// A PersistedState's counters, copied out so another task can report them
+struct PersistenceStats {
+  uint32_t updates = 0;
+  uint32_t writes = 0;
+
+  void report(JsonObject obj) const {
+    obj["updates"] = updates;
+    obj["writes"] = writes;
+    obj["writes_avoided"] = updates - writes;
+  }
+};
+
+// Coalesced persistence of a plain-data value (no padding; it is compared
+// bytewise). update() is cheap and can be called on every command: a value
+// equal to what is already stored costs nothing, and a change is written
+// once it has been stable for settleMs, or at the latest after maxDelayMs,
+// so a dimmer slider sending dozens of commands costs a single write.
+template <typename T>
+class PersistedState {
+ public:
+  PersistedState(const char* name, unsigned long settleMs, unsigned long maxDelayMs)
+      : _store(name, sizeof(T)), _settleMs(settleMs), _maxDelayMs(maxDelayMs) {}
+
+  bool load(T& out) {
+    if (!_store.load(&_persisted)) {
+      return false;
+    }
+    out = _persisted;
+    return true;
+  }
+
+  void update(const T& value, unsigned long now) {
+    _updates++;
+    _pending = value;
+    if (memcmp(&_pending, &_persisted, sizeof(T)) == 0) {
+      _dirty = false;
+      return;
+    }
+    if (!_dirty) {
+      _dirty = true;
+      _firstChange = now;
+    }
+    _lastChange = now;
+  }
+
+  void service(unsigned long now) {
+    if (_dirty && (now - _lastChange >= _settleMs || now - _firstChange >= _maxDelayMs)) {
+      flush();
+    }
+  }
+
+  // Writes a pending change right away (e.g. before a restart).
+  void flush() {
+    if (!_dirty) {
+      return;
+    }
+    if (_store.save(&_pending)) {
+      _persisted = _pending;
+      _writes++;
+      _dirty = false;
+    }
+  }
+
+  bool dirty() const { return _dirty; }
+
+  PersistenceStats stats() const {
+    PersistenceStats stats;
+    stats.updates = _updates;
+    stats.writes = _writes;
+    return stats;
+  }
+
+  void reportStats(JsonObject obj) const { stats().report(obj); }
+
+ private:
+  RecordStore _store;
+  unsigned long _settleMs;
+  unsigned long _maxDelayMs;
+  T _persisted = T();
+  T _pending = T();
+  bool _dirty = false;
+  unsigned long _firstChange = 0;
+  unsigned long _lastChange = 0;
+  uint32_t _updates = 0;
+  uint32_t _writes = 0;
+};
+
+}  // namespace ha
@@ -0,0 +1,123 @@
+#include "TopicGroups.h"
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include "MqttDispatch.h"
+
+namespace ha {
+
+namespace {
+const char* const GROUPS_PATH = "/groups.txt";
+const char* const TOPIC_PREFIX = "homeautomation/";
+const char* const TOPIC_SUFFIX = "/command";
+}  // namespace
+
+TopicGroups::TopicGroups(fs::FS& fs, const TopicGroupHooks& hooks) : _fs(fs), _hooks(hooks) {}
+
+void TopicGroups::begin() {
+  _members.count = 0;
+  fs::File file = _fs.open(GROUPS_PATH, "r");
+  if (!file) {
+    return;
+  }
+
+  // One topic per line, as written by save()
+  char line[TOPIC_SIZE];
+  while (_members.count < MAX_TOPICS && file.available()) {
+    size_t length = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = '\0';
+    if (length == 0 || strncmp(line, TOPIC_PREFIX, strlen(TOPIC_PREFIX)) != 0) {
+      continue;
+    }
+    memcpy(_members.topics[_members.count], line, length + 1);
+    _members.hashes[_members.count] = fnv1aBuffer(line, length);
+    _members.count++;
+  }
+  file.close();
+}
+
+bool TopicGroups::stage(JsonObjectConst parameters) {
+  _next.count = 0;
+  _staged = false;
+  const char* const kinds[] = { "groups", "scenes" };
+  for (const char* kind : kinds) {
+    for (JsonVariantConst id : parameters[kind].as<JsonArrayConst>()) {
+      if (!add(_next, kind, id.as<const char*>())) {
+        return false;
+      }
+    }
+  }
+  _staged = true;
+  return true;
+}
+
+void TopicGroups::commit() {
+  if (!_staged) {
+    return;
+  }
+  _staged = false;
+  for (uint8_t i = 0; i < _members.count; i++) {
+    _hooks.unsubscribe(_members.topics[i]);
+  }
+  _members = _next;
+  subscribeAll();
+  save();
+}
+
+void TopicGroups::subscribeAll() {
+  for (uint8_t i = 0; i < _members.count; i++) {
+    _hooks.subscribe(_members.topics[i]);
+  }
+}
+
+bool TopicGroups::contains(const char* topic) const {
+  uint32_t hash = fnv1aBuffer(topic, strlen(topic));
+  for (uint8_t i = 0; i < _members.count; i++) {
+    if (_members.hashes[i] == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TopicGroups::add(Members& members, const char* kind, const char* id) {
+  size_t length = id ? strlen(id) : 0;
+  if (length == 0 || length > MAX_ID_LENGTH || strpbrk(id, "/+#") || members.count >= MAX_TOPICS) {
+    return false;
+  }
+  char* topic = members.topics[members.count];
+  int written = snprintf(topic, TOPIC_SIZE, "%s%s/%s%s", TOPIC_PREFIX, kind, id, TOPIC_SUFFIX);
+  members.hashes[members.count] = fnv1aBuffer(topic, written);
+  members.count++;
+  return true;
+}
+
+void TopicGroups::save() {
+  fs::File file = _fs.open(GROUPS_PATH, "w");
+  if (!file) {
+    return;
+  }
+  for (uint8_t i = 0; i < _members.count; i++) {
+    file.print(_members.topics[i]);
+    file.print('\n');
+  }
+  file.close();
+}
+
+void TopicGroups::reportStats(JsonObject obj) const {
+  // Members as "groups/<id>" / "scenes/<id>"
+  JsonArray members = obj.createNestedArray("members");
+  size_t prefix = strlen(TOPIC_PREFIX);
+  size_t suffix = strlen(TOPIC_SUFFIX);
+  for (uint8_t i = 0; i < _members.count; i++) {
+    char name[TOPIC_SIZE];
+    size_t length = strlen(_members.topics[i]) - prefix - suffix;
+    memcpy(name, _members.topics[i] + prefix, length);
+    name[length] = '\0';
+    members.add(name);
+  }
+}
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#if defined(ESP32) || defined(ESP8266)
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+namespace ha {
+
+// Subscription operations the group membership drives.
+struct TopicGroupHooks {
+  bool (*subscribe)(const char* topic);
+  bool (*unsubscribe)(const char* topic);
+};
+
+// Shared command topics a device listens on besides its own, so one
+// publish reaches every member: homeautomation/groups/<id>/command and
+// homeautomation/scenes/<id>/command. Membership is set with
+// {"groups": [...], "scenes": [...]} and kept on the filesystem.
+class TopicGroups {
+ public:
+  static const uint8_t MAX_TOPICS = 8;
+  static const size_t MAX_ID_LENGTH = 31;
+
+  TopicGroups(fs::FS& fs, const TopicGroupHooks& hooks);
+
+  // Loads the saved membership; call once the filesystem is mounted.
+  void begin();
+
+  // Copies a new membership out of the parameters. Nothing is sent yet:
+  // the parameters may alias the MQTT receive buffer, which subscribing
+  // would overwrite. Returns false (and stages nothing) on a bad id.
+  bool stage(JsonObjectConst parameters);
+  // Moves the subscriptions over to the staged membership and saves it.
+  void commit();
+  bool staged() const { return _staged; }
+
+  // Subscribes every member topic, after each broker (re)connect.
+  void subscribeAll();
+  bool contains(const char* topic) const;
+
+  void reportStats(JsonObject obj) const;
+
+ private:
+  static const size_t TOPIC_SIZE = 64;
+
+  struct Members {
+    uint8_t count;
+    char topics[MAX_TOPICS][TOPIC_SIZE];
+    uint32_t hashes[MAX_TOPICS];
+  };
+
+  bool add(Members& members, const char* kind, const char* id);
+  void save();
+
+  fs::FS& _fs;
+  const TopicGroupHooks& _hooks;
+  Members _members = {};
+  Members _next = {};
+  bool _staged = false;
+};
+
+}  // namespace ha
+
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <math.h>
+
+namespace ha {
+
+// Streaming statistics of one reading over a publish window, in fixed
+// memory: sample count, min, max and mean since the last reset(), plus an
+// EWMA that carries across windows and serves as the smoothed value.
+// NaN readings (a failed sensor read) are counted and otherwise ignored.
+class WindowStats {
+ public:
+  // alpha is the weight of each new sample, 0 < alpha <= 1
+  explicit WindowStats(float alpha) : _alpha(alpha) {}
+
+  // The weight that gives an EWMA time constant of tauMs at one sample
+  // every intervalMs.
+  static constexpr float alphaFor(unsigned long intervalMs, unsigned long tauMs) {
+    return (float)intervalMs / (float)(intervalMs + tauMs);
+  }
+
+  void add(float value) {
+    if (isnan(value)) {
+      _rejected++;
+      return;
+    }
+    _count++;
+    if (_count == 1) {
+      _min = value;
+      _max = value;
+      _mean = value;
+    } else {
+      _min = value < _min ? value : _min;
+      _max = value > _max ? value : _max;
+      // Running mean, so a long window cannot lose precision to a big sum
+      _mean += (value - _mean) / _count;
+    }
+    _ewma = _seeded ? _ewma + _alpha * (value - _ewma) : value;
+    _seeded = true;
+  }
+
+  // Starts the next window; the EWMA carries on.
+  void reset() { _count = 0; }
+
+  uint32_t count() const { return _count; }
+  // Not min()/max(): Arduino cores may define those as macros
+  float minimum() const { return _min; }
+  float maximum() const { return _max; }
+  float mean() const { return _mean; }
+  // The smoothed value; NaN until the first sample.
+  float ewma() const { return _seeded ? _ewma : NAN; }
+  bool seeded() const { return _seeded; }
+
+  void setAlpha(float alpha) { _alpha = alpha; }
+  float alpha() const { return _alpha; }
+
+  // The window as {"min","max","mean","samples"}, or as the compact
+  // [min, max, mean, samples].
+  void serialize(JsonObject obj) const {
+    obj["min"] = _min;
+    obj["max"] = _max;
+    obj["mean"] = _mean;
+    obj["samples"] = _count;
+  }
+
+  void serialize(JsonArray arr) const {
+    arr.add(_min);
+    arr.add(_max);
+    arr.add(_mean);
+    arr.add(_count);
+  }
+
+  void reportStats(JsonObject obj) const {
+    obj["alpha"] = _alpha;
+    obj["window_samples"] = _count;
+    obj["rejected"] = _rejected;
+  }
+
+ private:
+  float _alpha;
+  uint32_t _count = 0;
+  float _min = 0;
+  float _max = 0;
+  float _mean = 0;
+  float _ewma = 0;
+  bool _seeded = false;
+  uint32_t _rejected = 0;
+};
+
+}  // namespace ha